@@ -3,27 +3,50 @@
 #include <nan.h>
 #include <uv.h>
 #include <list>
+#include <map>
+#include <climits>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <memory>
 
 #if defined(_WIN32)
 #include <io.h>
-#include <memory>
 #else
 #include <libgen.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #endif
 
+#include <openssl/evp.h>
+
 #include "genaro.h"
 
+// set by binding.gyp when libgenaro and libcurl are linked in statically
+#ifndef GENARO_CURL_SHARE
+#define GENARO_CURL_SHARE 0
+#endif
+
+#if GENARO_CURL_SHARE
+#include <curl/curl.h>
+#endif
+
 class free_env_proxy
 {
 public:
 	Nan::Persistent<v8::Object> persistent;
 };
 
-typedef struct
-{
-	Nan::Callback *progress_callback;
-	Nan::Callback *finished_callback;
-} transfer_callbacks_t;
 
 typedef struct uploading_task
 {
@@ -33,9 +56,6 @@ typedef struct uploading_task
 
 typedef std::list<uploading_task_t> uploading_task_list_t;
 
-// the current uploading tasks.
-static uploading_task_list_t uploading_task_list;
-
 typedef struct downloading_task
 {
 	const char *full_path;
@@ -43,1233 +63,1956 @@ typedef struct downloading_task
 
 typedef std::list<downloading_task_t> downloading_task_list_t;
 
-// the current downloading tasks.
-static downloading_task_list_t downloading_task_list;
+// state of one instance of the addon, every worker thread that loads
+// it gets its own. The task lists may be touched from any thread.
+typedef struct addon_data
+{
+	uv_mutex_t mutex;
+	// the current uploading tasks.
+	uploading_task_list_t uploading_task_list;
+	// the current downloading tasks.
+	downloading_task_list_t downloading_task_list;
+	// contexts of the environments created by this instance that are not
+	// destroyed yet, only touched on its js thread
+	std::list<struct env_context *> contexts;
+} addon_data_t;
+
+// log lines longer than this are truncated.
+#define LOG_MESSAGE_MAX 1024
+
+// must be a power of two.
+#define LOG_RING_SIZE 4096
+
+typedef struct
+{
+	std::atomic<size_t> sequence;
+	uint64_t sink_id;
+	int level;
+	uint64_t timestamp;
+	char message[LOG_MESSAGE_MAX];
+} log_slot_t;
 
-extern "C" void JsonLogger(const char *message, int level, void *handle)
+typedef struct
+{
+	uint64_t sink_id;
+	std::string message;
+	int level;
+	uint64_t timestamp;
+} log_entry_t;
+
+// an Environment created with a `logger` option, log lines are delivered
+// to its callback in batches on the loop that created it.
+typedef struct log_sink
 {
-	printf("{\"message\": \"%s\", \"level\": %i, \"timestamp\": %" PRIu64 "}\n",
-		message, level, genaro_util_timestamp());
+	uv_async_t async;
+	uv_mutex_t mutex;
+	// what the lines of the environment are marked with in the ring
+	uint64_t id;
+	Nan::Callback *callback;
+	std::vector<log_entry_t> pending;
+	uint64_t dropped_reported;
+} log_sink_t;
+
+typedef std::list<log_sink_t *> log_sink_list_t;
+
+// bounded multi-producer/multi-consumer queue, any thread libgenaro logs
+// from appends to it without taking a lock.
+static log_slot_t log_ring[LOG_RING_SIZE];
+static std::atomic<size_t> log_ring_head(0);
+static std::atomic<size_t> log_ring_tail(0);
+static std::atomic<uint64_t> log_written(0);
+static std::atomic<uint64_t> log_dropped(0);
+static std::atomic<bool> log_wakeup_pending(false);
+
+static uv_once_t log_once = UV_ONCE_INIT;
+static uv_mutex_t log_sinks_mutex;
+static log_sink_list_t log_sinks;
+static std::atomic<int> log_sink_count(0);
+static uint64_t log_sink_next_id = 1;
+// the sink of every request and transfer of an environment with a
+// logger, by the handle libgenaro passes to the logger with its lines
+static std::map<void *, uint64_t> log_handles;
+
+void InitLogRing()
+{
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+	{
+		log_ring[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	uv_mutex_init(&log_sinks_mutex);
 }
 
-char *str_concat_many(int count, ...)
+bool LogRingPush(uint64_t sink_id, const char *message, int level, uint64_t timestamp)
 {
-	int length = 1;
+	size_t pos = log_ring_head.load(std::memory_order_relaxed);
+	log_slot_t *slot;
 
-	va_list args;
-	va_start(args, count);
-	for (int i = 0; i < count; i++) {
-		char *item = va_arg(args, char *);
-		length += strlen(item);
+	for (;;)
+	{
+		slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0)
+		{
+			if (log_ring_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			// the ring is full
+			log_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		else
+		{
+			pos = log_ring_head.load(std::memory_order_relaxed);
+		}
 	}
-	va_end(args);
 
-	char *combined = (char *)calloc(length, sizeof(char));
-	if (!combined) {
-		return NULL;
+	slot->sink_id = sink_id;
+	slot->level = level;
+	slot->timestamp = timestamp;
+	strncpy(slot->message, message, LOG_MESSAGE_MAX - 1);
+	slot->message[LOG_MESSAGE_MAX - 1] = '\0';
+
+	slot->sequence.store(pos + 1, std::memory_order_release);
+	log_written.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+bool LogRingPop(log_entry_t *entry)
+{
+	size_t pos = log_ring_tail.load(std::memory_order_relaxed);
+	log_slot_t *slot;
+
+	for (;;)
+	{
+		slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0)
+		{
+			if (log_ring_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			// the ring is empty
+			return false;
+		}
+		else
+		{
+			pos = log_ring_tail.load(std::memory_order_relaxed);
+		}
 	}
 
-	va_start(args, count);
-	for (int i = 0; i < count; i++) {
-		char *item = va_arg(args, char *);
-		strcat(combined, item);
+	entry->sink_id = slot->sink_id;
+	entry->message = slot->message;
+	entry->level = slot->level;
+	entry->timestamp = slot->timestamp;
+
+	slot->sequence.store(pos + LOG_RING_SIZE, std::memory_order_release);
+
+	return true;
+}
+
+std::string JsonEscape(const char *str)
+{
+	std::string escaped;
+
+	for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+	{
+		switch (*p)
+		{
+		case '"':
+			escaped += "\\\"";
+			break;
+		case '\\':
+			escaped += "\\\\";
+			break;
+		case '\b':
+			escaped += "\\b";
+			break;
+		case '\f':
+			escaped += "\\f";
+			break;
+		case '\n':
+			escaped += "\\n";
+			break;
+		case '\r':
+			escaped += "\\r";
+			break;
+		case '\t':
+			escaped += "\\t";
+			break;
+		default:
+			if (*p < 0x20)
+			{
+				char unicode[7];
+				snprintf(unicode, sizeof(unicode), "\\u%04x", *p);
+				escaped += unicode;
+			}
+			else
+			{
+				escaped += (char)*p;
+			}
+		}
 	}
-	va_end(args);
 
-	return combined;
+	return escaped;
 }
 
-char *RetrieveNewName(const char *fileName, const char *extra)
+// move everything queued in the ring to the pending batch of the sink it
+// was written for, lines of a sink that is gone meanwhile are dropped.
+void DrainLogRing(log_sink_t *current)
 {
-	if (fileName == NULL || strlen(fileName) == 0)
+	log_wakeup_pending.store(false, std::memory_order_release);
+
+	std::vector<log_entry_t> batch;
+	log_entry_t entry;
+	while (LogRingPop(&entry))
 	{
-		return NULL;
+		batch.push_back(entry);
 	}
 
-	int len = strlen(fileName);
-	char *retName = NULL;
+	if (batch.empty())
+	{
+		return;
+	}
 
-	int dotIndex = len;
-	bool flag = false;
-	for (int i = 0; i < len; i++)
+	uv_mutex_lock(&log_sinks_mutex);
+	for (log_sink_list_t::iterator iter = log_sinks.begin(); iter != log_sinks.end(); ++iter)
 	{
-		if (!flag)
+		log_sink_t *sink = *iter;
+
+		std::vector<log_entry_t> lines;
+		for (const log_entry_t &line : batch)
 		{
-			if (fileName[i] != '.')
+			if (line.sink_id == sink->id)
 			{
-				flag = true;
+				lines.push_back(line);
 			}
 		}
-
-		if (flag && fileName[i] == '.')
+		if (lines.empty())
 		{
-			dotIndex = i;
-			break;
+			continue;
 		}
-	}
 
-	char *left_name = (char *)malloc((dotIndex + 1) * sizeof(char));
-	strncpy(left_name, fileName, dotIndex);
-	left_name[dotIndex] = '\0';
+		uv_mutex_lock(&sink->mutex);
+		sink->pending.insert(sink->pending.end(), lines.begin(), lines.end());
+		uv_mutex_unlock(&sink->mutex);
 
-	char *right_name = NULL;
-	if (dotIndex != len)
-	{
-		right_name = (char *)malloc((len - dotIndex + 2) * sizeof(char));
-		right_name[0] = '.';
-		for (int i = dotIndex + 2; i < len + 1; i++)
+		if (sink != current)
 		{
-			right_name[i - dotIndex - 1] = fileName[i - 1];
+			uv_async_send(&sink->async);
 		}
-		right_name[len - dotIndex] = '\0';
 	}
+	uv_mutex_unlock(&log_sinks_mutex);
+}
 
-	if (right_name)
+void LogSinkAsyncCallback(uv_async_t *handle)
+{
+	Nan::HandleScope scope;
+
+	log_sink_t *sink = (log_sink_t *)handle->data;
+
+	DrainLogRing(sink);
+
+	std::vector<log_entry_t> batch;
+	uv_mutex_lock(&sink->mutex);
+	batch.swap(sink->pending);
+	uv_mutex_unlock(&sink->mutex);
+
+	uint64_t dropped = log_dropped.load(std::memory_order_relaxed);
+	if (batch.empty() && dropped == sink->dropped_reported)
 	{
-		retName = str_concat_many(3, left_name, extra, right_name);
+		return;
 	}
-	else
+
+	v8::Local<v8::Array> entries = Nan::New<v8::Array>(batch.size());
+	for (uint32_t i = 0; i < batch.size(); i++)
 	{
-		retName = str_concat_many(2, left_name, extra);
+		v8::Local<v8::Object> entry = Nan::New<v8::Object>();
+		entry->Set(Nan::New("message").ToLocalChecked(), Nan::New(batch[i].message).ToLocalChecked());
+		entry->Set(Nan::New("level").ToLocalChecked(), Nan::New(batch[i].level));
+		entry->Set(Nan::New("timestamp").ToLocalChecked(), Nan::New((double)batch[i].timestamp));
+		entries->Set(i, entry);
 	}
 
-	free(left_name);
-	free(right_name);
+	v8::Local<v8::Value> argv[] = {
+		entries,
+		Nan::New((double)(dropped - sink->dropped_reported)) };
 
-	return retName;
+	sink->dropped_reported = dropped;
+
+	Nan::Call(*(sink->callback), 2, argv);
 }
 
-#ifdef _WIN32
-const char *ConvertToWindowsPath(const char *path)
+log_sink_t *CreateLogSink(uv_loop_t *loop, v8::Local<v8::Function> callback)
 {
-	if (path == NULL)
+	uv_once(&log_once, InitLogRing);
+
+	log_sink_t *sink = new log_sink_t();
+	sink->callback = new Nan::Callback(callback);
+	sink->dropped_reported = log_dropped.load(std::memory_order_relaxed);
+	uv_mutex_init(&sink->mutex);
+	uv_async_init(loop, &sink->async, LogSinkAsyncCallback);
+	sink->async.data = sink;
+
+	// the sink must not keep the process alive on its own
+	uv_unref((uv_handle_t *)&sink->async);
+
+	uv_mutex_lock(&log_sinks_mutex);
+	sink->id = log_sink_next_id++;
+	log_sinks.push_back(sink);
+	log_sink_count++;
+	// the wakeup of lines queued for a sink destroyed before it came
+	if (log_wakeup_pending.load(std::memory_order_acquire))
 	{
-		return NULL;
+		uv_async_send(&sink->async);
 	}
+	uv_mutex_unlock(&log_sinks_mutex);
 
-	int len = strlen(path);
-	char *retPath = (char *)malloc((len + 1) * sizeof(char));
+	return sink;
+}
 
-	for (int i = 0; i < len; i++)
+void LogSinkCloseCallback(uv_handle_t *handle)
+{
+	log_sink_t *sink = (log_sink_t *)handle->data;
+
+	uv_mutex_destroy(&sink->mutex);
+	delete sink->callback;
+	delete sink;
+}
+
+void DestroyLogSink(log_sink_t *sink)
+{
+	uv_mutex_lock(&log_sinks_mutex);
+	log_sinks.remove(sink);
+	log_sink_count--;
+	std::map<void *, uint64_t>::iterator iter = log_handles.begin();
+	while (iter != log_handles.end())
 	{
-		if (path[i] != '/')
+		if (iter->second == sink->id)
 		{
-			retPath[i] = path[i];
+			log_handles.erase(iter++);
 		}
 		else
 		{
-			retPath[i] = '\\';
+			++iter;
 		}
 	}
-	retPath[len] = '\0';
+	uv_mutex_unlock(&log_sinks_mutex);
 
-	return retPath;
+	uv_close((uv_handle_t *)&sink->async, LogSinkCloseCallback);
 }
-#endif
 
-v8::Local<v8::Value> IntToGenaroError(int error_code)
+// lines libgenaro logs with handle go to sink from now on
+void AttachLogHandle(log_sink_t *sink, void *handle)
 {
-	if (!error_code)
-	{
-		return Nan::Null();
-	}
-
-	const char *error_msg = genaro_strerror(error_code);
-	v8::Local<v8::String> msg = Nan::New(error_msg).ToLocalChecked();
-	v8::Local<v8::Value> error = Nan::Error(msg);
-
-	return error;
+	uv_mutex_lock(&log_sinks_mutex);
+	log_handles[handle] = sink->id;
+	uv_mutex_unlock(&log_sinks_mutex);
 }
 
-v8::Local<v8::Value> IntToCurlError(int error_code)
+void DetachLogHandle(void *handle)
 {
-	const char *error_msg = curl_easy_strerror((CURLcode)error_code);
-	v8::Local<v8::String> msg = Nan::New(error_msg).ToLocalChecked();
-	return Nan::Error(msg);
+	uv_mutex_lock(&log_sinks_mutex);
+	log_handles.erase(handle);
+	uv_mutex_unlock(&log_sinks_mutex);
 }
 
-v8::Local<v8::Value> IntToStatusError(int status_code)
+// the sink lines logged with handle go to, 0 if there is none
+uint64_t FindLogSink(void *handle)
 {
-	v8::Local<v8::String> error_message;
-	switch (status_code)
+	uint64_t sink_id = 0;
+
+	uv_mutex_lock(&log_sinks_mutex);
+	std::map<void *, uint64_t>::iterator iter = log_handles.find(handle);
+	if (iter != log_handles.end())
 	{
-	case 400:
-		error_message = Nan::New("Bad request").ToLocalChecked();
-		break;
-	case 401:
-		error_message = Nan::New("Not authorized").ToLocalChecked();
-		break;
-	case 404:
-		error_message = Nan::New("Resource not found").ToLocalChecked();
-		break;
-	case 420:
-		error_message = Nan::New("Transfer rate limit").ToLocalChecked();
-		break;
-	case 429:
-		error_message = Nan::New("Request rate limited").ToLocalChecked();
-		break;
-	case 499:
-		error_message = Nan::New("No Payment Wallet").ToLocalChecked();
-		break;
-	case 500:
-		error_message = Nan::New("Internal error").ToLocalChecked();
-		break;
-	case 501:
-		error_message = Nan::New("Not implemented").ToLocalChecked();
-		break;
-	case 503:
-		error_message = Nan::New("Service unavailable").ToLocalChecked();
-		break;
-	default:
-		error_message = Nan::New("Unknown status error").ToLocalChecked();
+		sink_id = iter->second;
 	}
-	v8::Local<v8::Value> error = Nan::Error(error_message);
-	return error;
+	uv_mutex_unlock(&log_sinks_mutex);
+
+	return sink_id;
 }
 
-template <typename ReqType>
-bool error_and_status_check(ReqType *req, v8::Local<v8::Value> *error)
+void WakeLogSinks()
 {
-	if (req->error_code)
-	{
-		*error = IntToCurlError(req->error_code);
-	}
-	else if (req->status_code > 399)
-	{
-		*error = IntToStatusError(req->status_code);
-	}
-	else
+	uv_mutex_lock(&log_sinks_mutex);
+	for (log_sink_list_t::iterator iter = log_sinks.begin(); iter != log_sinks.end(); ++iter)
 	{
-		return true;
+		uv_async_send(&(*iter)->async);
 	}
-
-	return false;
+	uv_mutex_unlock(&log_sinks_mutex);
 }
 
-void Timestamp(const v8::FunctionCallbackInfo<v8::Value> &args)
+// what an upload of a plaintext to a bucket resulted in
+typedef struct
 {
-	v8::Isolate *isolate = args.GetIsolate();
-
-	uint64_t timestamp = genaro_util_timestamp();
-	v8::Local<v8::Number> timestamp_local = v8::Number::New(isolate, (double)timestamp);
-
-	args.GetReturnValue().Set(timestamp_local);
-}
+	std::string file_id;
+	uint64_t file_bytes;
+	std::string sha256_of_encrypted;
+} dedupe_entry_t;
 
-void GetInfoCallback(uv_work_t *work_req, int status)
+// local index of uploads by bucket and sha256 of the plaintext, kept in
+// an append only file which is compacted when it is opened.
+typedef struct
 {
-	Nan::HandleScope scope;
+	std::string path;
+	FILE *log;
+	std::map<std::string, dedupe_entry_t> entries;
+} dedupe_index_t;
 
-	json_request_t *req = (json_request_t *)work_req->data;
+#define DEDUPE_LINE_MAX 1024
 
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
+std::string DedupeKey(const std::string &bucket_id, const std::string &hash)
+{
+	return bucket_id + " " + hash;
+}
 
-	v8::Local<v8::Value> error = Nan::Null();
-	v8::Local<v8::Value> result = Nan::Null();
+void ForgetDedupeFile(dedupe_index_t *index, const char *bucket_id, const char *file_id)
+{
+	std::string prefix = std::string(bucket_id) + " ";
 
-	if (error_and_status_check<json_request_t>(req, &error))
+	std::map<std::string, dedupe_entry_t>::iterator iter = index->entries.lower_bound(prefix);
+	while (iter != index->entries.end() && !iter->first.compare(0, prefix.size(), prefix))
 	{
-		const char *result_str = json_object_to_json_string(req->response);
-		v8::Local<v8::String> result_json_string = Nan::New(result_str).ToLocalChecked();
-		Nan::JSON NanJSON;
-		Nan::MaybeLocal<v8::Value> res = NanJSON.Parse(result_json_string);
-		if (!res.IsEmpty())
+		if (iter->second.file_id == file_id)
 		{
-			result = res.ToLocalChecked();
+			index->entries.erase(iter++);
+		}
+		else
+		{
+			++iter;
 		}
 	}
+}
 
-	v8::Local<v8::Value> argv[] = {
-		error,
-		result };
+// returns NULL if the file can be neither read nor written
+dedupe_index_t *OpenDedupeIndex(const char *path)
+{
+	dedupe_index_t *index = new dedupe_index_t();
+	index->path = path;
 
-	Nan::Call(*callback, 2, argv);
+	FILE *fp = fopen(path, "r");
+	if (fp)
+	{
+		char line[DEDUPE_LINE_MAX];
+		char bucket_id[256];
+		char hash[256];
+		char file_id[256];
+		char sha256_of_encrypted[256];
+		unsigned long long file_bytes;
+
+		while (fgets(line, sizeof(line), fp))
+		{
+			if (sscanf(line, "+ %255s %255s %255s %llu %255s",
+				bucket_id, hash, file_id, &file_bytes, sha256_of_encrypted) == 5)
+			{
+				dedupe_entry_t &entry = index->entries[DedupeKey(bucket_id, hash)];
+				entry.file_id = file_id;
+				entry.file_bytes = file_bytes;
+				entry.sha256_of_encrypted = sha256_of_encrypted;
+			}
+			else if (sscanf(line, "- %255s %255s", bucket_id, file_id) == 2)
+			{
+				ForgetDedupeFile(index, bucket_id, file_id);
+			}
+		}
+		fclose(fp);
+	}
 
-	free(req);
-	free(work_req);
-}
+	// write the live entries out again so removed ones do not pile up
+	std::string temp_path = index->path + ".tmp";
+	fp = fopen(temp_path.c_str(), "w");
+	if (!fp)
+	{
+		delete index;
+		return NULL;
+	}
 
-void GetInfo(const Nan::FunctionCallbackInfo<v8::Value> &args)
-{
-	if (args.Length() != 1 || !args[0]->IsFunction())
+	std::map<std::string, dedupe_entry_t>::iterator iter = index->entries.begin();
+	for (; iter != index->entries.end(); ++iter)
 	{
-		return Nan::ThrowError("First argument is expected to be a function");
+		fprintf(fp, "+ %s %s %" PRIu64 " %s\n", iter->first.c_str(), iter->second.file_id.c_str(),
+			iter->second.file_bytes, iter->second.sha256_of_encrypted.c_str());
 	}
-	if (args.This()->InternalFieldCount() != 1)
+
+	if (fclose(fp) || rename(temp_path.c_str(), path))
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		unlink(temp_path.c_str());
+		delete index;
+		return NULL;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	index->log = fopen(path, "a");
+	if (!index->log)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		delete index;
+		return NULL;
 	}
 
-	Nan::Callback *callback = new Nan::Callback(args[0].As<v8::Function>());
+	return index;
+}
 
-	genaro_bridge_get_info(env, (void *)callback, GetInfoCallback);
+void CloseDedupeIndex(dedupe_index_t *index)
+{
+	fclose(index->log);
+	delete index;
 }
 
-v8::Local<v8::Date> StrToDate(const char *dateStr)
+dedupe_entry_t *LookupDedupeEntry(dedupe_index_t *index, const std::string &bucket_id, const std::string &hash)
 {
-	v8::Local<v8::Date> tmp = Nan::New<v8::Date>(0).ToLocalChecked();
-	v8::Local<v8::Function> cons = v8::Local<v8::Function>::Cast(
-		Nan::Get(tmp, Nan::New("constructor").ToLocalChecked()).ToLocalChecked());
-	const int argc = 1;
-	v8::Local<v8::Value> argv[argc] = { Nan::New(dateStr).ToLocalChecked() };
-	v8::Local<v8::Date> date = v8::Local<v8::Date>::Cast(
-		Nan::NewInstance(cons, argc, argv).ToLocalChecked());
-	return date;
+	std::map<std::string, dedupe_entry_t>::iterator iter = index->entries.find(DedupeKey(bucket_id, hash));
+	return iter == index->entries.end() ? NULL : &iter->second;
 }
 
-void GetBucketsCallback(uv_work_t *work_req, int status)
+void RecordDedupeEntry(dedupe_index_t *index, const std::string &bucket_id, const std::string &hash,
+	const char *file_id, uint64_t file_bytes, const char *sha256_of_encrypted)
 {
-	Nan::HandleScope scope;
+	dedupe_entry_t &entry = index->entries[DedupeKey(bucket_id, hash)];
+	entry.file_id = file_id;
+	entry.file_bytes = file_bytes;
+	entry.sha256_of_encrypted = sha256_of_encrypted;
+
+	fprintf(index->log, "+ %s %s %s %" PRIu64 " %s\n", bucket_id.c_str(), hash.c_str(),
+		file_id, file_bytes, sha256_of_encrypted);
+	fflush(index->log);
+}
 
-	get_buckets_request_t *req = (get_buckets_request_t *)work_req->data;
+void RemoveDedupeFile(dedupe_index_t *index, const char *bucket_id, const char *file_id)
+{
+	ForgetDedupeFile(index, bucket_id, file_id);
 
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
-	v8::Local<v8::Value> buckets_value = Nan::Null();
-	v8::Local<v8::Value> error = Nan::Null();
+	fprintf(index->log, "- %s %s\n", bucket_id, file_id);
+	fflush(index->log);
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+// incremental sha256 through EVP, the SHA256_* functions are deprecated
+// since OpenSSL 3
+struct sha256_digest
+{
+	EVP_MD_CTX *ctx;
 
-	if (error_and_status_check<get_buckets_request_t>(req, &error))
+	sha256_digest() : ctx(EVP_MD_CTX_new())
 	{
-		v8::Local<v8::Array> buckets_array = Nan::New<v8::Array>();
-		for (uint32_t i = 0; i < req->total_buckets; i++)
-		{
-			v8::Local<v8::Object> bucket = Nan::New<v8::Object>();
-			bucket->Set(Nan::New("name").ToLocalChecked(), Nan::New(req->buckets[i].name).ToLocalChecked());
-			bucket->Set(Nan::New("created").ToLocalChecked(), StrToDate(req->buckets[i].created));
-			bucket->Set(Nan::New("id").ToLocalChecked(), Nan::New(req->buckets[i].id).ToLocalChecked());
-			bucket->Set(Nan::New("bucketId").ToLocalChecked(), Nan::New(req->buckets[i].bucketId).ToLocalChecked());
-			bucket->Set(Nan::New("type").ToLocalChecked(), Nan::New(req->buckets[i].type));
-			bucket->Set(Nan::New("decrypted").ToLocalChecked(), Nan::New<v8::Boolean>(req->buckets[i].decrypted));
-			bucket->Set(Nan::New("limitStorage").ToLocalChecked(), Nan::New((double)req->buckets[i].limitStorage));
-			bucket->Set(Nan::New("usedStorage").ToLocalChecked(), Nan::New((double)req->buckets[i].usedStorage));
-			bucket->Set(Nan::New("timeStart").ToLocalChecked(), Nan::New((double)req->buckets[i].timeStart));
-			bucket->Set(Nan::New("timeEnd").ToLocalChecked(), Nan::New((double)req->buckets[i].timeEnd));
-			buckets_array->Set(i, bucket);
-		}
-		buckets_value = buckets_array;
+		Reset();
 	}
 
-	v8::Local<v8::Value> argv[] = {
-		error,
-		buckets_value };
-
-	Nan::Call(*callback, 2, argv);
+	~sha256_digest()
+	{
+		EVP_MD_CTX_free(ctx);
+	}
 
-	free(req);
-	free(work_req);
-}
+	sha256_digest(const sha256_digest &) = delete;
+	sha256_digest &operator=(const sha256_digest &) = delete;
 
-void GetBuckets(const Nan::FunctionCallbackInfo<v8::Value> &args)
-{
-	if (args.Length() != 1 || !args[0]->IsFunction())
+	void Reset()
 	{
-		return Nan::ThrowError("First argument is expected to be a function");
+		EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
 	}
-	if (args.This()->InternalFieldCount() != 1)
+
+	void Update(const void *data, size_t length)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		EVP_DigestUpdate(ctx, data, length);
 	}
+};
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+// lowercase hex of a digest
+std::string DigestHex(const unsigned char *digest, unsigned int length)
+{
+	static const char hex[] = "0123456789abcdef";
+	std::string hash;
+	for (unsigned int i = 0; i < length; i++)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		hash += hex[digest[i] >> 4];
+		hash += hex[digest[i] & 0x0f];
 	}
 
-	Nan::Callback *callback = new Nan::Callback(args[0].As<v8::Function>());
-
-	genaro_bridge_get_buckets(env, (void *)callback, GetBucketsCallback);
+	return hash;
 }
 
-void ListFilesCallback(uv_work_t *work_req, int status)
+// finishes sha as lowercase hex, Reset starts the next one
+std::string Sha256Hex(sha256_digest *sha)
 {
-	Nan::HandleScope scope;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	EVP_DigestFinal_ex(sha->ctx, digest, &length);
 
-	list_files_request_t *req = (list_files_request_t *)work_req->data;
+	return DigestHex(digest, length);
+}
 
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
-	v8::Local<v8::Value> files_value = Nan::Null();
-	v8::Local<v8::Value> error = Nan::Null();
+// tells the kernel a file is read once from start to end, so it reads
+// ahead further and drops what has been read sooner
+void AdviseSequentialRead(FILE *fp)
+{
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
 
-	if (error_and_status_check<list_files_request_t>(req, &error))
+// reserves the blocks of a file about to be written front to back, so
+// it ends up in one piece. The size of the file is left as it is.
+void PreallocateFile(FILE *fp, uint64_t size)
+{
+#if defined(__linux__)
+	if (size)
 	{
-		v8::Local<v8::Array> files_array = Nan::New<v8::Array>();
-		for (uint32_t i = 0; i < req->total_files; i++)
-		{
-			v8::Local<v8::Object> file = Nan::New<v8::Object>();
-			file->Set(Nan::New("filename").ToLocalChecked(), Nan::New(req->files[i].filename).ToLocalChecked());
-			file->Set(Nan::New("mimetype").ToLocalChecked(), Nan::New(req->files[i].mimetype).ToLocalChecked());
-			file->Set(Nan::New("id").ToLocalChecked(), Nan::New(req->files[i].id).ToLocalChecked());
-			file->Set(Nan::New("size").ToLocalChecked(), Nan::New((double)(req->files[i].size)));
-			file->Set(Nan::New("created").ToLocalChecked(), StrToDate(req->files[i].created));
-
-			if (req->files[i].rsaKey && req->files[i].rsaCtr)
-			{
-				file->Set(Nan::New("rsaKey").ToLocalChecked(), Nan::New(req->files[i].rsaKey).ToLocalChecked());
-				file->Set(Nan::New("rsaCtr").ToLocalChecked(), Nan::New(req->files[i].rsaCtr).ToLocalChecked());
-			}
-			files_array->Set(i, file);
-		}
-		files_value = files_array;
+		// not every filesystem supports it, the writes work either way
+		(void)fallocate(fileno(fp), FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
 	}
+#endif
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
 
-	v8::Local<v8::Value> argv[] = {
-		error,
-		files_value };
-
-	Nan::Call(*callback, 2, argv);
-
-	free(req);
-	free(work_req);
+// drops the whole page cache of a file that has been written, once it
+// is on disk. Blocks until then, so only for the threadpool.
+void DropFileCache(FILE *fp)
+{
+#if defined(POSIX_FADV_DONTNEED)
+	if (fflush(fp))
+	{
+		return;
+	}
+#if defined(__linux__)
+	fdatasync(fileno(fp));
+#endif
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+#endif
 }
 
-void ListFiles(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// sha256 of a file as lowercase hex, empty if it could not be read
+std::string HashFile(const char *path)
 {
-	if (args.Length() != 2 || !args[1]->IsFunction())
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		return std::string();
 	}
-	if (args.This()->InternalFieldCount() != 1)
+	AdviseSequentialRead(fp);
+
+	sha256_digest sha;
+
+	std::vector<unsigned char> buffer(65536);
+	size_t read_bytes;
+	while ((read_bytes = fread(&buffer[0], 1, buffer.size(), fp)) > 0)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		sha.Update(&buffer[0], read_bytes);
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	int error = ferror(fp);
+	fclose(fp);
+	if (error)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		return std::string();
 	}
 
-	Nan::Utf8String str(args[0]);
-	const char *bucket_id = *str;
-	const char *bucket_id_dup = strdup(bucket_id);
+	return Sha256Hex(&sha);
+}
 
-	Nan::Callback *callback = new Nan::Callback(args[1].As<v8::Function>());
+// binding state kept next to the genaro_env_t of every Environment,
+// stored in the second internal field of the instance.
+typedef std::list<std::function<void()> > task_queue_t;
 
-	genaro_bridge_list_files(env, bucket_id_dup, (void *)callback, ListFilesCallback);
-}
+typedef struct
+{
+	std::string index;
+	std::string key;
+	std::string ctr;
+} encryption_info_entry_t;
 
-void CreateBucketCallback(uv_work_t *work_req, int status)
+// ready encryption info of a bucket, refilled on the threadpool
+typedef struct
 {
-	Nan::HandleScope scope;
+	std::list<encryption_info_entry_t> entries;
+	bool refilling;
+	// refills queued so far
+	uint64_t refills;
+} encryption_info_pool_t;
 
-	create_bucket_request_t *req = (create_bucket_request_t *)work_req->data;
+typedef struct env_context
+{
+	// NULL once the addon instance is gone before the context
+	addon_data_t *addon;
+	// of the Environment until it is destroyed
+	free_env_proxy *proxy;
+	genaro_log_options_t log_options;
+	log_sink_t *log_sink;
+
+	// only with the `ioThread` option, libgenaro then runs on a loop of
+	// its own and only the results are handed back to the js thread.
+	uv_loop_t *io_loop;
+	uv_thread_t io_thread;
+	uv_async_t io_async;
+	uv_thread_t js_thread;
+	uv_async_t js_async;
+	// js_async is closed along with the context, it outlives the io loop
+	bool js_async_open;
+	uv_mutex_t queue_mutex;
+	task_queue_t io_queue;
+	task_queue_t js_queue;
+	// requests on the io thread the js loop has to stay alive for
+	int io_pending;
+
+	// estimated native memory of the running transfers, reported to V8,
+	// and the ceiling above which new transfers wait in transfer_queue
+	uint64_t max_memory;
+	uint64_t inflight_memory;
+	std::list<struct transfer_callbacks *> transfer_queue;
+
+	// transfers handed to libgenaro that did not finish yet
+	std::list<struct transfer_callbacks *> transfers;
+
+	// jobs on the libuv threadpool using the env, destroying the env waits
+	// for the last of them to return, and for its transfers and requests
+	int pool_jobs;
+	genaro_env_t *destroyed_env;
+
+	// with the `encryptionInfoPool` option
+	int encryption_info_pool_size;
+	std::map<std::string, encryption_info_pool_t> encryption_info_pools;
+
+	// with the `dedupeIndex` option
+	dedupe_index_t *dedupe_index;
+
+	// reads in flight by what they read, identical reads started
+	// meanwhile wait for their result instead of asking the bridge again
+	std::map<std::string, struct request_callbacks *> inflight_reads;
+	uint64_t coalesced_reads;
+} env_context_t;
+
+struct free_deleter
+{
+	void operator()(const void *ptr) const
+	{
+		free((void *)ptr);
+	}
+};
 
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
+// malloc'd strings and structs handed to libgenaro, which keeps pointing
+// at them until the request finishes, freed along with the request.
+struct owned_allocations
+{
+	std::vector<std::unique_ptr<const void, free_deleter> > allocations;
 
-	v8::Local<v8::Value> bucket_value = Nan::Null();
-	v8::Local<v8::Value> error = Nan::Null();
+	template <typename T>
+	T *Own(T *ptr)
+	{
+		allocations.emplace_back((const void *)ptr);
+		return ptr;
+	}
+};
 
-	if (error_and_status_check<create_bucket_request_t>(req, &error))
+typedef struct request_callbacks : owned_allocations
+{
+	Nan::Callback *callback;
+	env_context_t *ctx;
+	// run on the js thread before the callback if the request succeeded
+	std::function<void()> succeeded;
+	// a read identical ones were coalesced into, and their callbacks
+	std::string read_key;
+	std::vector<Nan::Callback *> coalesced;
+	// reads a write makes stale, see ForgetRead
+	std::vector<std::string> invalidates;
+	// the lines libgenaro logs for it go to the logger of the env
+	bool log_handle;
+
+	~request_callbacks()
 	{
-		v8::Local<v8::Object> bucket_object = Nan::To<v8::Object>(Nan::New<v8::Object>()).ToLocalChecked();
-		bucket_object->Set(Nan::New("name").ToLocalChecked(), Nan::New(req->bucket->name).ToLocalChecked());
-		bucket_object->Set(Nan::New("id").ToLocalChecked(), Nan::New(req->bucket->id).ToLocalChecked());
-		bucket_object->Set(Nan::New("decrypted").ToLocalChecked(), Nan::New<v8::Boolean>(req->bucket->decrypted));
-		bucket_value = bucket_object;
+		if (log_handle)
+		{
+			DetachLogHandle(this);
+		}
+		delete callback;
+		for (Nan::Callback *waiting : coalesced)
+		{
+			delete waiting;
+		}
 	}
+} request_callbacks_t;
 
-	v8::Local<v8::Value> argv[] = {
-		error,
-		bucket_value };
+typedef struct transfer_callbacks : owned_allocations
+{
+	Nan::Callback *progress_callback;
+	Nan::Callback *finished_callback;
+	int finished_argc;
+	env_context_t *ctx;
+	// one reference for the transfer until its result is delivered and
+	// one for the state object handed to js, only touched on the js thread
+	int refs;
+	Nan::Persistent<v8::Object> state_object;
+	// the libgenaro state while the transfer is running, only to be
+	// touched on the thread running the env loop
+	void *state;
+	bool finished;
+	int error_status;
+	// latest progress not yet delivered to the js thread
+	bool progress_pending;
+	double progress;
+	uint64_t progress_bytes;
+	// estimated native memory of the transfer and the part of it that is
+	// currently accounted for
+	uint64_t memory;
+	uint64_t reserved_memory;
+	bool size_known;
+	// hands the transfer to libgenaro, returns an error message on failure
+	std::function<const char *()> start;
+	// releases what start would have taken over, for a transfer that
+	// failed to start or was canceled while queued
+	std::function<void()> discard;
+	// cancels the running transfer, where libgenaro runs
+	std::function<void()> cancel;
+	// canceled because the env was destroyed, which is what it reports
+	bool destroyed;
+	// waiting for memory in transfer_queue or for its dedupe lookup
+	bool queued;
+	// bucket and sha256 of the plaintext of a dedupe upload
+	std::string dedupe_bucket_id;
+	std::string dedupe_hash;
+	// file written by the binding itself, removed with the transfer
+	std::string temp_file_path;
+	// the read an upload makes stale, see ForgetRead
+	std::string invalidates;
+	// a download is synced to disk before it is reported finished
+	bool durable;
+	// the dontneed io mode, the page cache of the file is dropped behind
+	// the transfer. cache_flushed is where writeback has been started
+	// up to, cache_dropped where the cache has been dropped up to.
+	bool drop_cache;
+	int cache_fd;
+	uint64_t cache_size;
+	uint64_t cache_flushed;
+	uint64_t cache_dropped;
+	// the lines libgenaro logs for it go to the logger of the env
+	bool log_handle;
+
+	~transfer_callbacks()
+	{
+		if (log_handle)
+		{
+			DetachLogHandle(this);
+		}
+		if (!temp_file_path.empty())
+		{
+			unlink(temp_file_path.c_str());
+		}
+		delete progress_callback;
+		delete finished_callback;
+	}
+} transfer_callbacks_t;
 
-	Nan::Call(*callback, 2, argv);
+request_callbacks_t *NewRequestCallbacks(env_context_t *ctx, v8::Local<v8::Function> callback)
+{
+	request_callbacks_t *callbacks = new request_callbacks_t();
+	callbacks->callback = new Nan::Callback(callback);
+	callbacks->ctx = ctx;
+	if (ctx->log_sink)
+	{
+		callbacks->log_handle = true;
+		AttachLogHandle(ctx->log_sink, callbacks);
+	}
 
-	free(req);
-	free(work_req);
+	return callbacks;
 }
 
-void CreateBucket(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// joins a read of key that is already in flight, false if there is none
+bool CoalesceRead(env_context_t *ctx, const std::string &key, v8::Local<v8::Function> callback)
 {
-	if (args.Length() != 2 || !args[1]->IsFunction())
+	auto it = ctx->inflight_reads.find(key);
+	if (it == ctx->inflight_reads.end())
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		return false;
 	}
-	if (args.This()->InternalFieldCount() != 1)
+
+	it->second->coalesced.push_back(new Nan::Callback(callback));
+	ctx->coalesced_reads++;
+	return true;
+}
+
+void StartRead(request_callbacks_t *callbacks, const std::string &key)
+{
+	callbacks->read_key = key;
+	callbacks->ctx->inflight_reads[key] = callbacks;
+}
+
+// a read in flight may have been answered before a write that finished
+// now, reads started from here on go to the bridge again
+void ForgetRead(env_context_t *ctx, const std::string &key)
+{
+	ctx->inflight_reads.erase(key);
+}
+
+void ForgetReads(request_callbacks_t *callbacks)
+{
+	for (const std::string &key : callbacks->invalidates)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		ForgetRead(callbacks->ctx, key);
 	}
+}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+// calls back everyone waiting for a read, argv builds the arguments anew
+// for every one of them, as they may change what they get. Reads started
+// from the callbacks go to the bridge again.
+void FinishRead(request_callbacks_t *callbacks, std::function<void(v8::Local<v8::Value> *)> argv)
+{
+	auto it = callbacks->ctx->inflight_reads.find(callbacks->read_key);
+	if (it != callbacks->ctx->inflight_reads.end() && it->second == callbacks)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		callbacks->ctx->inflight_reads.erase(it);
 	}
 
-	Nan::Utf8String str(args[0]);
-	const char *name = *str;
-	const char *name_dup = strdup(name);
-
-	Nan::Callback *callback = new Nan::Callback(args[1].As<v8::Function>());
+	{
+		Nan::HandleScope scope;
+		v8::Local<v8::Value> args[2];
+		argv(args);
+		Nan::Call(*callbacks->callback, 2, args);
+	}
 
-	genaro_bridge_create_bucket(env, name_dup, (void *)callback, CreateBucketCallback);
+	for (Nan::Callback *waiting : callbacks->coalesced)
+	{
+		Nan::HandleScope scope;
+		v8::Local<v8::Value> args[2];
+		argv(args);
+		Nan::Call(*waiting, 2, args);
+	}
 }
 
-void DeleteBucketCallback(uv_work_t *work_req, int status)
+transfer_callbacks_t *NewTransferCallbacks(env_context_t *ctx, v8::Local<v8::Object> options)
 {
-	Nan::HandleScope scope;
+	transfer_callbacks_t *callbacks = new transfer_callbacks_t();
+	callbacks->progress_callback = new Nan::Callback(options->Get(Nan::New("progressCallback").ToLocalChecked()).As<v8::Function>());
+	callbacks->finished_callback = new Nan::Callback(options->Get(Nan::New("finishedCallback").ToLocalChecked()).As<v8::Function>());
+	callbacks->ctx = ctx;
+	callbacks->refs = 1;
+	if (ctx->log_sink)
+	{
+		callbacks->log_handle = true;
+		AttachLogHandle(ctx->log_sink, callbacks);
+	}
 
-	json_request_t *req = (json_request_t *)work_req->data;
+	return callbacks;
+}
 
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
-	v8::Local<v8::Value> error = Nan::Null();
+void ReleaseTransfer(transfer_callbacks_t *callbacks)
+{
+	if (--callbacks->refs == 0)
+	{
+		delete callbacks;
+	}
+}
 
-	error_and_status_check<json_request_t>(req, &error);
+// reads the ioMode option of a transfer, false if it is not a known one
+bool ParseIoMode(v8::Local<v8::Object> options, transfer_callbacks_t *callbacks)
+{
+	Nan::MaybeLocal<v8::Value> ioModeOption = options->Get(Nan::New("ioMode").ToLocalChecked());
+	if (ioModeOption.IsEmpty() || ioModeOption.ToLocalChecked()->IsUndefined())
+	{
+		return true;
+	}
 
-	v8::Local<v8::Value> argv[] = {
-		error };
+	Nan::Utf8String io_mode(ioModeOption.ToLocalChecked());
 
-	Nan::Call(*callback, 1, argv);
+	// there is no 'direct', O_DIRECT needs aligned buffers and the stdio
+	// libgenaro writes and reads through does not have them
+	if (!strcmp(*io_mode, "dontneed"))
+	{
+		callbacks->drop_cache = true;
+		return true;
+	}
 
-	free(req);
-	free(work_req);
+	return !strcmp(*io_mode, "buffered");
 }
 
-void DeleteBucket(const Nan::FunctionCallbackInfo<v8::Value> &args)
+#define DROP_CACHE_WINDOW (8 * 1024 * 1024)
+
+// called with the progress of a transfer in the dontneed io mode. Drops
+// the cache a window behind the position, writeback of written data is
+// started one window before, so the drop does not wait for it.
+void DropTransferCache(transfer_callbacks_t *callbacks, double progress, uint64_t file_bytes, bool written)
 {
-	if (args.Length() != 2 || !args[1]->IsFunction())
+#if defined(POSIX_FADV_DONTNEED)
+	if (!callbacks->drop_cache || callbacks->finished)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		return;
 	}
-	if (args.This()->InternalFieldCount() != 1)
+
+	uint64_t size = callbacks->cache_size ? callbacks->cache_size : file_bytes;
+	uint64_t position = (uint64_t)(progress * size);
+	if (position < callbacks->cache_flushed + DROP_CACHE_WINDOW)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		return;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+#if defined(__linux__)
+	if (written)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		sync_file_range(callbacks->cache_fd, callbacks->cache_flushed,
+			position - callbacks->cache_flushed, SYNC_FILE_RANGE_WRITE);
 	}
+#endif
 
-	Nan::Utf8String str(args[0]);
-	const char *id = *str;
-	const char *id_dup = strdup(id);
-
-	Nan::Callback *callback = new Nan::Callback(args[1].As<v8::Function>());
+	if (callbacks->cache_flushed > callbacks->cache_dropped)
+	{
+		posix_fadvise(callbacks->cache_fd, callbacks->cache_dropped,
+			callbacks->cache_flushed - callbacks->cache_dropped, POSIX_FADV_DONTNEED);
+	}
 
-	genaro_bridge_delete_bucket(env, id_dup, (void *)callback, DeleteBucketCallback);
+	callbacks->cache_dropped = callbacks->cache_flushed;
+	callbacks->cache_flushed = position;
+#endif
 }
 
-void RenameBucketCallback(uv_work_t *work_req, int status)
+void StateObjectWeakCallback(const Nan::WeakCallbackInfo<transfer_callbacks_t> &data)
 {
-	Nan::HandleScope scope;
-
-	rename_bucket_request_t *req = (rename_bucket_request_t *)work_req->data;
-
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
-
-	v8::Local<v8::Value> error = Nan::Null();
+	ReleaseTransfer(data.GetParameter());
+}
 
-	error_and_status_check<rename_bucket_request_t>(req, &error);
+// the state object keeps the transfer alive for cancel and error_status
+// until it is collected
+v8::Local<v8::Object> NewStateObject(transfer_callbacks_t *callbacks, Nan::GetterCallback error_status_getter)
+{
+	v8::Isolate *isolate = v8::Isolate::GetCurrent();
+	v8::Local<v8::ObjectTemplate> state_template = v8::ObjectTemplate::New(isolate);
+	state_template->SetInternalFieldCount(1);
 
-	v8::Local<v8::Value> argv[] = {
-		error };
+	v8::Local<v8::Object> state_local = state_template->NewInstance();
+	state_local->SetAlignedPointerInInternalField(0, callbacks);
+	Nan::SetAccessor(state_local, Nan::New("error_status").ToLocalChecked(), error_status_getter);
 
-	Nan::Call(*callback, 1, argv);
+	callbacks->refs++;
+	callbacks->state_object.Reset(state_local);
+	callbacks->state_object.SetWeak(callbacks, StateObjectWeakCallback, Nan::WeakCallbackType::kParameter);
 
-	free(req);
-	free(work_req);
+	return state_local;
 }
 
-void RenameBucket(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// libgenaro picks shards of MIN_SHARD_SIZE doubled until the file fits,
+// then steps SHARD_MULTIPLES_BACK doublings back.
+#define MIN_SHARD_SIZE 2097152ULL
+#define MAX_SHARD_SIZE 4294967296ULL
+#define SHARD_MULTIPLES_BACK 4
+
+// what a transfer holds besides shard data: its state, curl handles and
+// their buffers, hashes and strings.
+#define TRANSFER_BASE_MEMORY (256 * 1024)
+// buffered per shard being pushed to a farmer
+#define PUSH_SHARD_MEMORY (64 * 1024)
+// shards pulled at once by a download, each held in memory until written
+#define DOWNLOAD_CONCURRENCY 24
+
+uint64_t EstimateShardSize(uint64_t file_size)
 {
-	if (args.Length() != 3 || !args[2]->IsFunction())
+	int accumulator = 0;
+	while ((MIN_SHARD_SIZE << accumulator) < file_size && accumulator < 41)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		accumulator++;
 	}
-	if (args.This()->InternalFieldCount() != 1)
+
+	int hops = accumulator - SHARD_MULTIPLES_BACK;
+	uint64_t shard_size = MIN_SHARD_SIZE << (hops > 0 ? hops : 0);
+	while (shard_size > MAX_SHARD_SIZE)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		shard_size >>= 1;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	return shard_size;
+}
+
+uint64_t EstimateUploadMemory(uint64_t file_size, genaro_upload_opts_t *upload_opts)
+{
+	uint64_t prepared = upload_opts->prepare_frame_limit * EstimateShardSize(file_size);
+	if (prepared > file_size)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		prepared = file_size;
 	}
 
-	Nan::Utf8String id_str(args[0]);
-	const char *id = *id_str;
-	const char *id_dup = strdup(id);
+	return TRANSFER_BASE_MEMORY + prepared + upload_opts->push_shard_limit * PUSH_SHARD_MEMORY;
+}
 
-	Nan::Utf8String name_str(args[1]);
-	const char *name = *name_str;
-	const char *name_dup = strdup(name);
+// file_size is 0 until libgenaro reported it with the first progress
+uint64_t EstimateDownloadMemory(uint64_t file_size)
+{
+	if (!file_size)
+	{
+		return TRANSFER_BASE_MEMORY + DOWNLOAD_CONCURRENCY * MIN_SHARD_SIZE;
+	}
 
-	Nan::Callback *callback = new Nan::Callback(args[2].As<v8::Function>());
+	uint64_t pulled = DOWNLOAD_CONCURRENCY * EstimateShardSize(file_size);
+	if (pulled > file_size)
+	{
+		pulled = file_size;
+	}
 
-	genaro_bridge_rename_bucket(env, id_dup, name_dup, (void *)callback, RenameBucketCallback);
+	return TRANSFER_BASE_MEMORY + pulled;
 }
 
-void RemoveUploadingTask(const char *bucket_id, const char *file_name)
+void AdjustExternalMemory(int64_t change)
 {
-	uploading_task_list_t::iterator iter = uploading_task_list.begin();
-
-	while (iter != uploading_task_list.end())
+	// V8 takes an int
+	while (change > INT_MAX)
 	{
-		if (!strcmp(iter->file_name, file_name) &&
-			!strcmp(iter->bucket_id, bucket_id))
-		{
-			free((void *)iter->bucket_id);
-			free((void *)iter->file_name);
-			uploading_task_list.erase(iter);
-			return;
-		}
-
-		++iter;
+		Nan::AdjustExternalMemory(INT_MAX);
+		change -= INT_MAX;
+	}
+	while (change < -INT_MAX)
+	{
+		Nan::AdjustExternalMemory(-INT_MAX);
+		change += INT_MAX;
 	}
+	Nan::AdjustExternalMemory((int)change);
 }
 
-bool IsUploading(const char *bucket_id, const char *file_name)
+bool ReserveTransferMemory(env_context_t *ctx, transfer_callbacks_t *callbacks)
 {
-	uploading_task_list_t::iterator iter = uploading_task_list.begin();
-
-	while (iter != uploading_task_list.end())
+	// a lone transfer always runs, however large
+	if (ctx->max_memory && ctx->inflight_memory &&
+		ctx->inflight_memory + callbacks->memory > ctx->max_memory)
 	{
-		if (!strcmp(iter->bucket_id, bucket_id) &&
-			!strcmp(iter->file_name, file_name))
-		{
-			return true;
-		}
+		return false;
+	}
 
-		++iter;
+	callbacks->reserved_memory = callbacks->memory;
+	ctx->inflight_memory += callbacks->memory;
+	AdjustExternalMemory((int64_t)callbacks->memory);
+
+	return true;
+}
+
+// a download only learns its size with the first progress
+void UpdateTransferMemory(env_context_t *ctx, transfer_callbacks_t *callbacks, uint64_t memory)
+{
+	callbacks->memory = memory;
+	if (!callbacks->reserved_memory)
+	{
+		return;
 	}
 
-	return false;
+	int64_t change = (int64_t)memory - (int64_t)callbacks->reserved_memory;
+	callbacks->reserved_memory = memory;
+	ctx->inflight_memory += change;
+	AdjustExternalMemory(change);
 }
 
-void RemoveDownloadingTask(const char *full_path)
+void ReleaseTransferMemory(env_context_t *ctx, transfer_callbacks_t *callbacks)
 {
-	downloading_task_list_t::iterator iter = downloading_task_list.begin();
+	ctx->inflight_memory -= callbacks->reserved_memory;
+	AdjustExternalMemory(-(int64_t)callbacks->reserved_memory);
+	callbacks->reserved_memory = 0;
+}
 
-	while (iter != downloading_task_list.end())
-	{
-	#ifdef _WIN32
-		const char *converted_full_path = ConvertToWindowsPath(full_path);
-		if (!_stricmp(iter->full_path, converted_full_path))
-	#else
-		if (!strcmp(iter->full_path, full_path))
-	#endif
-		{
-		#ifdef _WIN32
-			free((void *)converted_full_path);
-		#endif
+void FailTransfer(transfer_callbacks_t *callbacks, const char *message)
+{
+	Nan::HandleScope scope;
 
-			free((void *)iter->full_path);
-			downloading_task_list.erase(iter);
+	v8::Local<v8::Value> argv[] = {
+		Nan::Error(Nan::New(message).ToLocalChecked()),
+		Nan::Null(),
+		Nan::Null(),
+		Nan::Null() };
 
-			return;
-		}
+	Nan::Call(*(callbacks->finished_callback), callbacks->finished_argc, argv);
+}
 
-	#ifdef _WIN32
-		free((void *)converted_full_path);
-	#endif
+// start the transfer if the memory ceiling allows it, otherwise queue it
+// until enough of the running transfers have finished. Returns the error
+// message of a failed start.
+const char *StartOrQueueTransfer(env_context_t *ctx, transfer_callbacks_t *callbacks)
+{
+	if (!ReserveTransferMemory(ctx, callbacks))
+	{
+		callbacks->queued = true;
+		ctx->transfer_queue.push_back(callbacks);
+		return NULL;
+	}
 
-		++iter;
+	const char *error = callbacks->start();
+	if (error)
+	{
+		ReleaseTransferMemory(ctx, callbacks);
+		callbacks->discard();
+	}
+	else
+	{
+		ctx->transfers.push_back(callbacks);
 	}
+
+	return error;
 }
 
-bool IsDownloading(const char *full_path)
+void DrainTransferQueue(env_context_t *ctx)
 {
-	downloading_task_list_t::iterator iter = downloading_task_list.begin();
-
-	while (iter != downloading_task_list.end())
+	while (!ctx->transfer_queue.empty())
 	{
-	#ifdef _WIN32
-		const char *converted_full_path = ConvertToWindowsPath(full_path);
-		if (!_stricmp(iter->full_path, converted_full_path))
-	#else
-		if (!strcmp(iter->full_path, full_path))
-	#endif
+		transfer_callbacks_t *callbacks = ctx->transfer_queue.front();
+		if (!ReserveTransferMemory(ctx, callbacks))
 		{
-		#ifdef _WIN32
-			free((void *)converted_full_path);
-		#endif
-
-			return true;
+			break;
 		}
 
-	#ifdef _WIN32
-		free((void *)converted_full_path);
-	#endif
+		ctx->transfer_queue.pop_front();
+		callbacks->queued = false;
 
-		++iter;
+		const char *error = callbacks->start();
+		if (error)
+		{
+			ReleaseTransferMemory(ctx, callbacks);
+			callbacks->discard();
+			FailTransfer(callbacks, error);
+			ReleaseTransfer(callbacks);
+		}
+		else
+		{
+			ctx->transfers.push_back(callbacks);
+		}
 	}
-
-	return false;
 }
 
-void StoreFileFinishedCallback(const char *bucket_id, const char *file_name, int status, char *file_id, uint64_t file_bytes, char *sha256_of_encrypted, void *handle)
+// remove a transfer that has not started yet, returns false if it has
+bool UnqueueTransfer(env_context_t *ctx, transfer_callbacks_t *callbacks)
 {
-	Nan::HandleScope scope;
+	if (!callbacks->queued)
+	{
+		return false;
+	}
 
-	RemoveUploadingTask(bucket_id, file_name);
+	ctx->transfer_queue.remove(callbacks);
+	callbacks->queued = false;
+	callbacks->discard();
 
-	transfer_callbacks_t *upload_callbacks = (transfer_callbacks_t *)handle;
-	Nan::Callback *callback = upload_callbacks->finished_callback;
+	return true;
+}
 
-	v8::Local<v8::Value> file_id_local = Nan::Null();
-	v8::Local<v8::Value> file_bytes_local = Nan::Null();
-	v8::Local<v8::Value> sha256_of_encrypted_local = Nan::Null();
-	if (status == 0)
+bool OnIoThread(env_context_t *ctx)
+{
+	if (!ctx->io_loop)
 	{
-		file_id_local = Nan::New(file_id).ToLocalChecked();
-		file_bytes_local = Nan::New((double)file_bytes);
-		sha256_of_encrypted_local = Nan::New(sha256_of_encrypted).ToLocalChecked();
+		return false;
 	}
 
-	v8::Local<v8::Value> error = IntToGenaroError(status);
+	uv_thread_t self = uv_thread_self();
+	return !uv_thread_equal(&self, &ctx->js_thread);
+}
 
-	v8::Local<v8::Value> argv[] = {
-		error,
-		file_id_local,
-		file_bytes_local,
-		sha256_of_encrypted_local };
+void IoAsyncCallback(uv_async_t *handle)
+{
+	env_context_t *ctx = (env_context_t *)handle->data;
 
-	Nan::Call(*callback, 4, argv);
+	task_queue_t tasks;
+	uv_mutex_lock(&ctx->queue_mutex);
+	tasks.swap(ctx->io_queue);
+	uv_mutex_unlock(&ctx->queue_mutex);
 
-	free(file_id);
-	free(sha256_of_encrypted);
+	for (task_queue_t::iterator iter = tasks.begin(); iter != tasks.end(); ++iter)
+	{
+		(*iter)();
+	}
 }
 
-void StoreFileProgressCallback(double progress, uint64_t file_bytes, void *handle)
+void JsAsyncCallback(uv_async_t *handle)
 {
 	Nan::HandleScope scope;
 
-	transfer_callbacks_t *upload_callbacks = (transfer_callbacks_t *)handle;
-	Nan::Callback *callback = upload_callbacks->progress_callback;
-
-	v8::Local<v8::Number> progress_local = Nan::New(progress);
-	v8::Local<v8::Number> file_bytes_local = Nan::New((double)file_bytes);
+	env_context_t *ctx = (env_context_t *)handle->data;
 
-	v8::Local<v8::Value> argv[] = {
-		progress_local,
-		file_bytes_local };
+	task_queue_t tasks;
+	uv_mutex_lock(&ctx->queue_mutex);
+	tasks.swap(ctx->js_queue);
+	uv_mutex_unlock(&ctx->queue_mutex);
 
-	Nan::Call(*callback, 2, argv);
+	for (task_queue_t::iterator iter = tasks.begin(); iter != tasks.end(); ++iter)
+	{
+		(*iter)();
+	}
 }
 
-template <class StateType>
-void StateStatusErrorGetter(v8::Local<v8::String> property, const Nan::PropertyCallbackInfo<v8::Value> &info)
+void IoThreadMain(void *arg)
 {
-	v8::Local<v8::Object> self = info.Holder();
-	StateType *state = (StateType *)self->GetAlignedPointerFromInternalField(0);
-	v8::Local<v8::Value> error = IntToGenaroError(state->error_status);
-	info.GetReturnValue().Set(error);
+	env_context_t *ctx = (env_context_t *)arg;
+	uv_run(ctx->io_loop, UV_RUN_DEFAULT);
 }
 
-//add on 2018.5.9
-#if defined(_WIN32)
-std::unique_ptr<char[]> EncodingConvert(const char* strIn, int sourceCodepage, int targetCodepage)
+// run fn where libgenaro may be called, which is right here unless the
+// env has an io thread. The js thread waits for it, so fn may capture
+// locals by reference.
+void RunOnIoThread(env_context_t *ctx, const std::function<void()> &fn)
 {
-	int unicodeLen = MultiByteToWideChar(sourceCodepage, 0, strIn, -1, nullptr, 0);
-
-	wchar_t * pUnicode = new wchar_t[unicodeLen + 1];
-	memset(pUnicode, 0, (unicodeLen + 1) * sizeof(wchar_t));
+	if (!ctx->io_loop)
+	{
+		fn();
+		return;
+	}
 
-	MultiByteToWideChar(sourceCodepage, 0, strIn, -1, pUnicode, unicodeLen);
+	uv_sem_t done;
+	uv_sem_init(&done, 0);
 
-	char * pTargetData = nullptr;
-	int targetLen = WideCharToMultiByte(targetCodepage, 0, pUnicode, -1, pTargetData, 0, nullptr, nullptr);
+	uv_mutex_lock(&ctx->queue_mutex);
+	ctx->io_queue.push_back([&fn, &done]() {
+		fn();
+		uv_sem_post(&done);
+	});
+	uv_mutex_unlock(&ctx->queue_mutex);
+	uv_async_send(&ctx->io_async);
 
-	pTargetData = new char[targetLen + 1];
-	memset(pTargetData, 0, targetLen + 1);
+	uv_sem_wait(&done);
+	uv_sem_destroy(&done);
+}
 
-	WideCharToMultiByte(targetCodepage, 0, pUnicode, -1, pTargetData, targetLen, nullptr, nullptr);
+bool DestroyEnvIfIdle(env_context_t *ctx);
 
-	delete[] pUnicode;
-	return std::unique_ptr<char[]>(pTargetData);
+void IoRequestStarted(env_context_t *ctx)
+{
+	if (ctx->io_loop && ctx->io_pending++ == 0)
+	{
+		uv_ref((uv_handle_t *)&ctx->js_async);
+	}
 }
-#endif
 
-void GenerateEncryptionInfo(const Nan::FunctionCallbackInfo<v8::Value> &args)
+void IoRequestFinished(env_context_t *ctx)
 {
-	if (args.Length() != 1)
+	if (ctx->io_loop && --ctx->io_pending == 0)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		uv_unref((uv_handle_t *)&ctx->js_async);
+		DestroyEnvIfIdle(ctx);
 	}
-	if (args.This()->InternalFieldCount() != 1)
+}
+
+// callbacks of libgenaro call this first, on the io thread it queues fn
+// for the js thread and returns true. `last` marks the final callback
+// of a request.
+bool DeferToJsThread(env_context_t *ctx, const std::function<void()> &fn, bool last)
+{
+	if (!OnIoThread(ctx))
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		return false;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	uv_mutex_lock(&ctx->queue_mutex);
+	if (last)
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		ctx->js_queue.push_back([ctx, fn]() {
+			fn();
+			IoRequestFinished(ctx);
+		});
 	}
+	else
+	{
+		ctx->js_queue.push_back(fn);
+	}
+	uv_mutex_unlock(&ctx->queue_mutex);
+	uv_async_send(&ctx->js_async);
 
-	Nan::Utf8String bucket_id_str(args[0]);
-	const char *bucket_id = *bucket_id_str;
-
-	genaro_encryption_info_t *encryption_info = genaro_generate_encryption_info(env, NULL, bucket_id);
+	return true;
+}
 
-	if (encryption_info)
+// on the io thread only the latest progress of a transfer is kept until
+// the js thread gets to it.
+bool DeferProgress(transfer_callbacks_t *callbacks, double progress, uint64_t file_bytes,
+	void (*progress_cb)(double progress, uint64_t file_bytes, void *handle))
+{
+	env_context_t *ctx = callbacks->ctx;
+	if (!OnIoThread(ctx))
 	{
-		v8::Local<v8::Object> encryption = Nan::New<v8::Object>();
-		encryption->Set(Nan::New("index").ToLocalChecked(), Nan::New(encryption_info->index).ToLocalChecked());
-		free(encryption_info->index);
-		encryption->Set(Nan::New("key").ToLocalChecked(), Nan::New(encryption_info->key_ctr_as_str->key_as_str).ToLocalChecked());
-		free((void *)encryption_info->key_ctr_as_str->key_as_str);
-		encryption->Set(Nan::New("ctr").ToLocalChecked(), Nan::New(encryption_info->key_ctr_as_str->ctr_as_str).ToLocalChecked());
-		free((void *)encryption_info->key_ctr_as_str->ctr_as_str);
-		free(encryption_info->key_ctr_as_str);
-		free(encryption_info);
+		return false;
+	}
+
+	uv_mutex_lock(&ctx->queue_mutex);
+	bool pending = callbacks->progress_pending;
+	callbacks->progress_pending = true;
+	callbacks->progress = progress;
+	callbacks->progress_bytes = file_bytes;
+	uv_mutex_unlock(&ctx->queue_mutex);
 
-		args.GetReturnValue().Set(encryption);
+	if (!pending)
+	{
+		DeferToJsThread(ctx, [ctx, callbacks, progress_cb]() {
+			uv_mutex_lock(&ctx->queue_mutex);
+			callbacks->progress_pending = false;
+			double latest_progress = callbacks->progress;
+			uint64_t latest_bytes = callbacks->progress_bytes;
+			uv_mutex_unlock(&ctx->queue_mutex);
+
+			progress_cb(latest_progress, latest_bytes, callbacks);
+		}, false);
 	}
+
+	return true;
 }
 
-// void EncryptData(const Nan::FunctionCallbackInfo<v8::Value> &args)
-// {
-// 	if (args.Length() != 1)
-// 	{
-// 		return Nan::ThrowError("Unexpected arguments");
-// 	}
-// 	if (args.This()->InternalFieldCount() != 1)
-// 	{
-// 		return Nan::ThrowError("Environment not available for instance");
-// 	}
+int StartIoThread(env_context_t *ctx)
+{
+	ctx->io_loop = (uv_loop_t *)malloc(sizeof(uv_loop_t));
+	if (uv_loop_init(ctx->io_loop))
+	{
+		free(ctx->io_loop);
+		ctx->io_loop = NULL;
+		return 1;
+	}
 
-// 	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-// 	if (!env)
-// 	{
-// 		return Nan::ThrowError("Environment is not initialized");
-// 	}
+	uv_mutex_init(&ctx->queue_mutex);
+	ctx->io_pending = 0;
 
-// 	Nan::Utf8String bucket_id_str(args[0]);
-// 	const char *bucket_id = *bucket_id_str;
+	uv_async_init(ctx->io_loop, &ctx->io_async, IoAsyncCallback);
+	ctx->io_async.data = ctx;
 
-// 	genaro_encryption_info_t *encryption_info = genaro_generate_encryption_info(env, NULL, bucket_id);
+	if (uv_thread_create(&ctx->io_thread, IoThreadMain, ctx))
+	{
+		uv_close((uv_handle_t *)&ctx->io_async, NULL);
+		uv_run(ctx->io_loop, UV_RUN_NOWAIT);
+		uv_loop_close(ctx->io_loop);
+		free(ctx->io_loop);
+		ctx->io_loop = NULL;
+		uv_mutex_destroy(&ctx->queue_mutex);
+		return 1;
+	}
 
-// 	if (encryption_info)
-// 	{
-// 		v8::Local<v8::Object> encryption = Nan::New<v8::Object>();
-// 		encryption->Set(Nan::New("index").ToLocalChecked(), Nan::New(encryption_info->index).ToLocalChecked());
-// 		free(encryption_info->index);
-// 		encryption->Set(Nan::New("key").ToLocalChecked(), Nan::New(encryption_info->key_ctr_as_str->key_as_str).ToLocalChecked());
-// 		free((void *)encryption_info->key_ctr_as_str->key_as_str);
-// 		encryption->Set(Nan::New("ctr").ToLocalChecked(), Nan::New(encryption_info->key_ctr_as_str->ctr_as_str).ToLocalChecked());
-// 		free((void *)encryption_info->key_ctr_as_str->ctr_as_str);
-// 		free(encryption_info->key_ctr_as_str);
-// 		free(encryption_info);
+	uv_async_init(Nan::GetCurrentEventLoop(), &ctx->js_async, JsAsyncCallback);
+	ctx->js_async.data = ctx;
+	ctx->js_async_open = true;
+	uv_unref((uv_handle_t *)&ctx->js_async);
 
-// 		args.GetReturnValue().Set(encryption);
-// 	}
-// }
+	return 0;
+}
 
-void StoreFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+void JsAsyncCloseCallback(uv_handle_t *handle)
 {
-	if (args.Length() != 4)
+	env_context_t *ctx = (env_context_t *)handle->data;
+
+	uv_mutex_destroy(&ctx->queue_mutex);
+	delete ctx;
+}
+
+void CloseIoHandle(uv_handle_t *handle, void *arg)
+{
+	if (!uv_is_closing(handle))
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		uv_close(handle, NULL);
 	}
-	if (args.This()->InternalFieldCount() != 1)
+}
+
+// stop the io thread, which is idle unless the addon instance is going
+// away. From here on libgenaro runs on the js thread, if at all.
+void StopIoThread(env_context_t *ctx)
+{
+	if (!ctx->io_loop)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		return;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	RunOnIoThread(ctx, [ctx]() {
+		uv_close((uv_handle_t *)&ctx->io_async, NULL);
+		uv_stop(ctx->io_loop);
+	});
+	uv_thread_join(&ctx->io_thread);
+
+	// the close of io_async, and anything libgenaro left open, only
+	// completes on another run of the loop
+	if (uv_loop_close(ctx->io_loop))
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		uv_walk(ctx->io_loop, CloseIoHandle, NULL);
+		uv_run(ctx->io_loop, UV_RUN_DEFAULT);
 	}
 
-	Nan::Utf8String bucket_id_str(args[0]);
-	const char *bucket_id = *bucket_id_str;
-	const char *bucket_id_dup = strdup(bucket_id);
-
-	Nan::Utf8String file_or_data_str(args[1]);
-	const char *file_or_data = *file_or_data_str;
+	// a loop that still can not be closed is leaked, its handles point
+	// into it
+	if (!uv_loop_close(ctx->io_loop))
+	{
+		free(ctx->io_loop);
+	}
+	ctx->io_loop = NULL;
+}
 
- 	v8::Local<v8::Boolean> is_file_path_local = v8::Local<v8::Boolean>::Cast(args[2]); 
-    bool is_file_path = is_file_path_local->BooleanValue();
+void WipeEncryptionInfo(encryption_info_entry_t *entry)
+{
+	std::fill(entry->key.begin(), entry->key.end(), '\0');
+	std::fill(entry->ctr.begin(), entry->ctr.end(), '\0');
+}
 
-	v8::Local<v8::Object> options = args[3].As<v8::Object>();
-
-	transfer_callbacks_t *upload_callbacks = static_cast<transfer_callbacks_t *>(malloc(sizeof(transfer_callbacks_t)));
-
-	upload_callbacks->progress_callback = new Nan::Callback(options->Get(Nan::New("progressCallback").ToLocalChecked()).As<v8::Function>());
-	upload_callbacks->finished_callback = new Nan::Callback(options->Get(Nan::New("finishedCallback").ToLocalChecked()).As<v8::Function>());
+void DestroyEnvContext(env_context_t *ctx)
+{
+	if (ctx->addon)
+	{
+		ctx->addon->contexts.remove(ctx);
+	}
 
-	Nan::Utf8String file_name_str(options->Get(Nan::New("filename").ToLocalChecked()).As<v8::String>());
-	const char *file_name = *file_name_str;
-	const char *file_name_dup = strdup(file_name);
+	// transfers still waiting for memory will never start
+	while (!ctx->transfer_queue.empty())
+	{
+		transfer_callbacks_t *callbacks = ctx->transfer_queue.front();
+		UnqueueTransfer(ctx, callbacks);
+		ReleaseTransfer(callbacks);
+	}
 
-	if (IsUploading(bucket_id_dup, file_name_dup))
+	if (ctx->log_sink)
 	{
-		v8::Local<v8::String> msg = Nan::New("File is already uploading").ToLocalChecked();
-		v8::Local<v8::Value> error = Nan::Error(msg);
+		DestroyLogSink(ctx->log_sink);
+		ctx->log_sink = NULL;
+	}
 
-		v8::Local<v8::Value> argv[] = {
-			error,
-			Nan::Null(),
-			Nan::Null(),
-			Nan::Null() };
+	if (ctx->dedupe_index)
+	{
+		CloseDedupeIndex(ctx->dedupe_index);
+	}
 
-		Nan::Call(*(upload_callbacks->finished_callback), 4, argv);
+	std::map<std::string, encryption_info_pool_t>::iterator pool = ctx->encryption_info_pools.begin();
+	for (; pool != ctx->encryption_info_pools.end(); ++pool)
+	{
+		std::list<encryption_info_entry_t>::iterator entry = pool->second.entries.begin();
+		for (; entry != pool->second.entries.end(); ++entry)
+		{
+			WipeEncryptionInfo(&*entry);
+		}
+	}
 
+	if (ctx->js_async_open)
+	{
+		// only the addon instance going away leaves results queued
+		uv_close((uv_handle_t *)&ctx->js_async, JsAsyncCloseCallback);
 		return;
 	}
 
-	const char *file_path = NULL;
+	delete ctx;
+}
 
-	if (is_file_path)
+// cancel what the env is still doing when it is destroyed. Transfers
+// waiting for memory fail right away, running ones once libgenaro has
+// canceled them, all of them with "Environment destroyed".
+void CancelTransfers(env_context_t *ctx)
+{
+	while (!ctx->transfer_queue.empty())
 	{
-		file_path = file_or_data;
-
-		//convert to ANSI encoding on Windows
-		#if defined(_WIN32)
-			std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
-			file_path = u_p.get();
-		#endif
+		transfer_callbacks_t *callbacks = ctx->transfer_queue.front();
+		UnqueueTransfer(ctx, callbacks);
+		FailTransfer(callbacks, "Environment destroyed");
+		ReleaseTransfer(callbacks);
 	}
-	else
-	{
-		const char *tmp_path = NULL;
-		if (getenv("GENARO_TEMP") && !access(getenv("GENARO_TEMP"), F_OK)) {
-			tmp_path = getenv("GENARO_TEMP");
-		#ifdef _WIN32
-		} else if (getenv("TEMP") && !access(getenv("TEMP"), F_OK)) {
-			tmp_path = getenv("TEMP");
-		#else
-		} else if ("/tmp" && !access("/tmp", F_OK)) {
-			tmp_path = "/tmp";
-		#endif
-		} else {
-			return Nan::ThrowError("Get temp path failed");
-		}
-
-	#ifdef _WIN32
-		const char *path_slash = "\\";
-	#else
-		const char *path_slash = "/";
-	#endif
-		char *temp_file_path = str_concat_many(3, tmp_path, path_slash, "tmp-XXXXXX");
-
-		int fd = -1;
-	#ifdef _WIN32
-		int err = _mktemp_s(temp_file_path, strlen(temp_file_path) + 1);
-		if (!err)
-		{
-			fd = open(temp_file_path, O_WRONLY | O_CREAT);
-		}
-	#else
-		fd = mkstemp(temp_file_path);
-	#endif
 
-		if (fd == -1)
+	// a transfer is canceled once, destroying twice does not repeat it
+	std::list<transfer_callbacks_t *> running;
+	for (transfer_callbacks_t *callbacks : ctx->transfers)
+	{
+		if (!callbacks->destroyed)
 		{
-			return Nan::ThrowError("Create temp file failed");
+			callbacks->destroyed = true;
+			running.push_back(callbacks);
 		}
+	}
 
-		size_t len = strlen(file_or_data);
-		if (write(fd, file_or_data, len) != 
-		#ifdef _WIN32
-			(int)len
-		#else
-			(ssize_t)len
-		#endif
-		)
+	RunOnIoThread(ctx, [&running]() {
+		for (transfer_callbacks_t *callbacks : running)
 		{
-			close(fd);
-			return Nan::ThrowError("Write data to file failed");
+			if (callbacks->state)
+			{
+				callbacks->cancel();
+			}
 		}
-		close(fd);
-		file_path = temp_file_path;
-	}
+	});
+}
 
-	FILE *fd = fopen(file_path, "rb");
+bool EnvInUse(env_context_t *ctx)
+{
+	return ctx->pool_jobs || ctx->io_pending || !ctx->transfers.empty();
+}
 
-	if (!fd)
+// the context outlives the env, it owns the log options
+int DestroyEnvAndContext(genaro_env_t *env, env_context_t *ctx)
+{
+	if (ctx)
 	{
-		v8::Local<v8::String> msg = Nan::New("Unable to open file").ToLocalChecked();
-		v8::Local<v8::Value> error = Nan::Error(msg);
-
-		v8::Local<v8::Value> argv[] = {
-			error,
-			Nan::Null(),
-			Nan::Null(),
-			Nan::Null() };
-
-		Nan::Call(*(upload_callbacks->finished_callback), 4, argv);
-
-		return;
+		StopIoThread(ctx);
 	}
 
-	genaro_upload_opts_t upload_opts = {};
-	upload_opts.prepare_frame_limit = 1,
-	upload_opts.push_frame_limit = 64;
-	upload_opts.push_shard_limit = 64;
-	upload_opts.rs = true;
-	upload_opts.bucket_id = bucket_id_dup;
-	upload_opts.file_name = file_name_dup;
-	upload_opts.fd = fd;
-
-	Nan::Utf8String index_str(options->Get(Nan::New("index").ToLocalChecked()));
-	const char *index = *index_str;
-	const char *index_dup = strdup(index);
-
-	Nan::Utf8String key_str(options->Get(Nan::New("key").ToLocalChecked()));
-	const char *key = *key_str;
-	const char *key_dup = strdup(key);
-
-	Nan::Utf8String ctr_str(options->Get(Nan::New("ctr").ToLocalChecked()));
-	const char *ctr = *ctr_str;
-	const char *ctr_dup = strdup(ctr);
-
-	genaro_key_ctr_as_str_t *key_ctr = (genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t));
-	key_ctr->key_as_str = key_dup;
-	key_ctr->ctr_as_str = ctr_dup;
-
-	Nan::Utf8String rsa_key_str(options->Get(Nan::New("rsaKey").ToLocalChecked()));
-	const char *rsa_key = *rsa_key_str;
-	const char *rsa_key_dup = strdup(rsa_key);
-
-	Nan::Utf8String rsa_ctr_str(options->Get(Nan::New("rsaCtr").ToLocalChecked()));
-	const char *rsa_ctr = *rsa_ctr_str;
-	const char *rsa_ctr_dup = strdup(rsa_ctr);
+	int status = env ? genaro_destroy_env(env) : 0;
 
-	genaro_key_ctr_as_str_t *rsa_key_ctr_as_str = (genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t));
-	rsa_key_ctr_as_str->key_as_str = rsa_key_dup;
-	rsa_key_ctr_as_str->ctr_as_str = rsa_ctr_dup;
+	if (ctx)
+	{
+		DestroyEnvContext(ctx);
+	}
 
-	genaro_upload_state_t *state;
+	return status;
+}
 
-	state = genaro_bridge_store_file(env, &upload_opts,
-		index_dup,
-		key_ctr,
-		rsa_key_ctr_as_str,
-		(void *)upload_callbacks,
-		StoreFileProgressCallback,
-		StoreFileFinishedCallback);
+// destroy the env and its context, or leave that to the last threadpool
+// job, transfer or io thread request still using the env. Returns
+// nonzero if libgenaro failed.
+int DestroyEnvWhenIdle(genaro_env_t *env, env_context_t *ctx)
+{
+	// the env no longer counts from here, neither does what its running
+	// transfers reserved, so their finishing releases nothing again
+	Nan::AdjustExternalMemory(-(int)sizeof(genaro_env_t));
 
-	if (!state)
+	if (ctx)
 	{
-		return Nan::ThrowError("Unable to create upload state");
+		for (transfer_callbacks_t *callbacks : ctx->transfers)
+		{
+			ReleaseTransferMemory(ctx, callbacks);
+		}
+		CancelTransfers(ctx);
 	}
 
-	if (state->error_status)
+	if (ctx && EnvInUse(ctx))
 	{
-		return Nan::ThrowError("Unable to queue file upload");
+		ctx->destroyed_env = env;
+		return 0;
 	}
 
-	uploading_task_t task;
-	task.bucket_id = strdup(state->bucket_id);
-	task.file_name = strdup(state->file_name);
-
-	uploading_task_list.push_back(task);
-
-	v8::Isolate *isolate = args.GetIsolate();
-	v8::Local<v8::ObjectTemplate> state_template = v8::ObjectTemplate::New(isolate);
-	state_template->SetInternalFieldCount(1);
-
-	v8::Local<v8::Object> state_local = state_template->NewInstance();
-	state_local->SetAlignedPointerInInternalField(0, state);
-	Nan::SetAccessor(state_local, Nan::New("error_status").ToLocalChecked(),
-		StateStatusErrorGetter<genaro_upload_state_t>);
-
-	args.GetReturnValue().Set(state_local);
+	return DestroyEnvAndContext(env, ctx);
 }
 
-void StoreFileCancel(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// call when a job, transfer or request of a destroyed env is done,
+// returns true if the env was idle now and is gone
+bool DestroyEnvIfIdle(env_context_t *ctx)
 {
-	if (args.Length() != 1)
+	if (!ctx->destroyed_env || EnvInUse(ctx))
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		return false;
 	}
 
-	v8::Local<v8::Object> state_local = args[0].As<v8::Object>();
-	if (state_local->IsNullOrUndefined())
-	{
-		return Nan::ThrowError("Unexpected arguments");
-	}
+	genaro_env_t *env = ctx->destroyed_env;
+	ctx->destroyed_env = NULL;
+	DestroyEnvAndContext(env, ctx);
 
-	genaro_upload_state_t *state = (genaro_upload_state_t *)state_local->GetAlignedPointerFromInternalField(0);
-	genaro_bridge_store_file_cancel(state);
+	return true;
 }
 
-void ResolveFileCancel(const Nan::FunctionCallbackInfo<v8::Value> &args)
+void QueuePoolJob(env_context_t *ctx, uv_work_t *req, uv_work_cb work_cb, uv_after_work_cb after_work_cb)
 {
-	if (args.Length() != 1)
+	ctx->pool_jobs++;
+	uv_queue_work(Nan::GetCurrentEventLoop(), req, work_cb, after_work_cb);
+}
+
+// call at the end of the after work callback, returns true if the env
+// has been destroyed meanwhile and is now gone
+bool PoolJobFinished(env_context_t *ctx)
+{
+	ctx->pool_jobs--;
+	return DestroyEnvIfIdle(ctx);
+}
+
+// handle is the one the binding passed along with the request or transfer
+// that logs, which tells the environment and so its logger
+extern "C" void JsonLogger(const char *message, int level, void *handle)
+{
+	uint64_t timestamp = genaro_util_timestamp();
+
+	uint64_t sink_id = 0;
+	if (log_sink_count.load(std::memory_order_acquire) > 0)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		sink_id = FindLogSink(handle);
 	}
 
-	v8::Local<v8::Object> state_local = args[0].As<v8::Object>();
-	if (state_local->IsNullOrUndefined())
+	if (!sink_id)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		// the environment has no logger, keep the old behaviour of stdout
+		std::string escaped = JsonEscape(message);
+		printf("{\"message\": \"%s\", \"level\": %i, \"timestamp\": %" PRIu64 "}\n",
+			escaped.c_str(), level, timestamp);
+		return;
 	}
 
-	genaro_download_state_t *state = (genaro_download_state_t *)state_local->GetAlignedPointerFromInternalField(0);
-	genaro_bridge_resolve_file_cancel(state);
+	LogRingPush(sink_id, message, level, timestamp);
+
+	// only the first line of a batch pays for the wakeup
+	if (!log_wakeup_pending.exchange(true, std::memory_order_acq_rel))
+	{
+		WakeLogSinks();
+	}
 }
 
-void ResolveFileFinishedCallback(int status, const char *file_name, const char *temp_file_name, FILE *fd, uint64_t file_bytes, char *sha256, void *handle)
+char *str_concat_many(int count, ...)
 {
-	Nan::HandleScope scope;
+	int length = 1;
+
+	va_list args;
+	va_start(args, count);
+	for (int i = 0; i < count; i++) {
+		char *item = va_arg(args, char *);
+		length += strlen(item);
+	}
+	va_end(args);
 
-	RemoveDownloadingTask(file_name);
+	char *combined = (char *)calloc(length, sizeof(char));
+	if (!combined) {
+		return NULL;
+	}
 
-	if (fd) {
-		fclose(fd);
+	va_start(args, count);
+	for (int i = 0; i < count; i++) {
+		char *item = va_arg(args, char *);
+		strcat(combined, item);
 	}
+	va_end(args);
 
-	int rename_failed = 0;
+	return combined;
+}
 
-	// download success, remove the original file, and rename
-	// the downloaded file to the same file name.
-	if (status == 0)
+char *RetrieveNewName(const char *fileName, const char *extra)
+{
+	if (fileName == NULL || strlen(fileName) == 0)
 	{
-		const char *final_file_name = strdup(file_name);
+		return NULL;
+	}
 
-		bool getname_failed = true;
+	int len = strlen(fileName);
+	char *retName = NULL;
 
-		// original file exists
-		if (access(final_file_name, F_OK) != -1)
+	int dotIndex = len;
+	bool flag = false;
+	for (int i = 0; i < len; i++)
+	{
+		if (!flag)
 		{
-			// delete it
-			int ret = unlink(final_file_name);
-
-			// failed to delete
-			if (ret != 0)
-			{
-			#ifndef _WIN32
-				char *path_name = dirname((char *)final_file_name);
-				char *file_name = basename((char *)final_file_name);
-			#else
-				char drive[_MAX_DRIVE];
-				char dir[_MAX_DIR];
-				char fname[_MAX_FNAME];
-				char ext[_MAX_EXT];
-
-				_splitpath(final_file_name, drive, dir, fname, ext);
-				char *path_name = str_concat_many(2, drive, dir);
-				char *file_name = str_concat_many(2, fname, ext);
-			#endif
-
-				int index = 1;
-				char temp_str[5];
-
-				do
-				{
-					sprintf(temp_str, " (%d)", index);
-					char *temp_file_name = RetrieveNewName(file_name, temp_str);
-					if (temp_file_name == NULL)
-					{
-						break;
-					}
-
-					free((void *)final_file_name);
-					final_file_name = str_concat_many(2, path_name, temp_file_name);
-
-					free(temp_file_name);
-
-					if (access(final_file_name, F_OK) == -1)
-					{
-						getname_failed = false;
-						break;
-					}
-				} while (++index < 10);
-			}
-			else
+			if (fileName[i] != '.')
 			{
-				getname_failed = false;
+				flag = true;
 			}
 		}
-		else
-		{
-			getname_failed = false;
-		}
 
-		if (!getname_failed)
-		{
-			rename_failed = rename(temp_file_name, final_file_name);
-			if (rename_failed)
-			{
-				unlink(temp_file_name);
-			}
-		}
-		else
+		if (flag && fileName[i] == '.')
 		{
-			rename_failed = 1;
-			unlink(temp_file_name);
+			dotIndex = i;
+			break;
 		}
-
-		free((void *)final_file_name);
 	}
-	else
-	{
-		// download failed, delete the temp file.
-		unlink(temp_file_name);
-	}
-
-	free((void *)file_name);
-	free((void *)temp_file_name);
 
-	transfer_callbacks_t *download_callbacks = (transfer_callbacks_t *)handle;
-	Nan::Callback *callback = download_callbacks->finished_callback;
+	char *left_name = (char *)malloc((dotIndex + 1) * sizeof(char));
+	strncpy(left_name, fileName, dotIndex);
+	left_name[dotIndex] = '\0';
 
-	v8::Local<v8::Value> file_bytes_local = Nan::Null();
-	v8::Local<v8::Value> sha256_local = Nan::Null();
-	if (status == 0)
+	char *right_name = NULL;
+	if (dotIndex != len)
 	{
-		file_bytes_local = Nan::New((double)file_bytes);
-		sha256_local = Nan::New(sha256).ToLocalChecked();
+		right_name = (char *)malloc((len - dotIndex + 2) * sizeof(char));
+		right_name[0] = '.';
+		for (int i = dotIndex + 2; i < len + 1; i++)
+		{
+			right_name[i - dotIndex - 1] = fileName[i - 1];
+		}
+		right_name[len - dotIndex] = '\0';
 	}
 
-	v8::Local<v8::Value> error = Nan::Null();
-	if (rename_failed)
+	if (right_name)
 	{
-		v8::Local<v8::String> msg = Nan::New("File rename error").ToLocalChecked();
-		error = Nan::Error(msg);
+		retName = str_concat_many(3, left_name, extra, right_name);
 	}
 	else
 	{
-		error = IntToGenaroError(status);
+		retName = str_concat_many(2, left_name, extra);
 	}
 
-	v8::Local<v8::Value> argv[] = {
-		error,
-		file_bytes_local,
-		sha256_local };
-
-	Nan::Call(*callback, 3, argv);
+	free(left_name);
+	free(right_name);
 
-	free(sha256);
+	return retName;
 }
 
-void ResolveFileProgressCallback(double progress, uint64_t file_bytes, void *handle)
-{
+#ifdef _WIN32
+const char *ConvertToWindowsPath(const char *path)
+{
+	if (path == NULL)
+	{
+		return NULL;
+	}
+
+	int len = strlen(path);
+	char *retPath = (char *)malloc((len + 1) * sizeof(char));
+
+	for (int i = 0; i < len; i++)
+	{
+		if (path[i] != '/')
+		{
+			retPath[i] = path[i];
+		}
+		else
+		{
+			retPath[i] = '\\';
+		}
+	}
+	retPath[len] = '\0';
+
+	return retPath;
+}
+#endif
+
+v8::Local<v8::Value> IntToGenaroError(int error_code)
+{
+	if (!error_code)
+	{
+		return Nan::Null();
+	}
+
+	const char *error_msg = genaro_strerror(error_code);
+	v8::Local<v8::String> msg = Nan::New(error_msg).ToLocalChecked();
+	v8::Local<v8::Value> error = Nan::Error(msg);
+	Nan::Set(error.As<v8::Object>(), Nan::New("code").ToLocalChecked(), Nan::New(error_code));
+#ifdef GENARO_BRIDGE_RATE_ERROR
+	if (error_code == GENARO_BRIDGE_RATE_ERROR)
+	{
+		Nan::Set(error.As<v8::Object>(), Nan::New("rateLimited").ToLocalChecked(), Nan::True());
+	}
+#endif
+
+	return error;
+}
+
+// what a finished transfer reports for the status libgenaro gave it
+v8::Local<v8::Value> TransferError(transfer_callbacks_t *callbacks, int status)
+{
+	if (status && callbacks->destroyed)
+	{
+		return Nan::Error("Environment destroyed");
+	}
+
+	return IntToGenaroError(status);
+}
+
+v8::Local<v8::Value> IntToCurlError(int error_code)
+{
+	const char *error_msg = curl_easy_strerror((CURLcode)error_code);
+	v8::Local<v8::String> msg = Nan::New(error_msg).ToLocalChecked();
+	v8::Local<v8::Value> error = Nan::Error(msg);
+	// the bridge was not reached at all
+	Nan::Set(error.As<v8::Object>(), Nan::New("curlCode").ToLocalChecked(), Nan::New(error_code));
+	return error;
+}
+
+v8::Local<v8::Value> IntToStatusError(int status_code)
+{
+	v8::Local<v8::String> error_message;
+	switch (status_code)
+	{
+	case 400:
+		error_message = Nan::New("Bad request").ToLocalChecked();
+		break;
+	case 401:
+		error_message = Nan::New("Not authorized").ToLocalChecked();
+		break;
+	case 404:
+		error_message = Nan::New("Resource not found").ToLocalChecked();
+		break;
+	case 420:
+		error_message = Nan::New("Transfer rate limit").ToLocalChecked();
+		break;
+	case 429:
+		error_message = Nan::New("Request rate limited").ToLocalChecked();
+		break;
+	case 499:
+		error_message = Nan::New("No Payment Wallet").ToLocalChecked();
+		break;
+	case 500:
+		error_message = Nan::New("Internal error").ToLocalChecked();
+		break;
+	case 501:
+		error_message = Nan::New("Not implemented").ToLocalChecked();
+		break;
+	case 503:
+		error_message = Nan::New("Service unavailable").ToLocalChecked();
+		break;
+	default:
+		error_message = Nan::New("Unknown status error").ToLocalChecked();
+	}
+	v8::Local<v8::Value> error = Nan::Error(error_message);
+	Nan::Set(error.As<v8::Object>(), Nan::New("statusCode").ToLocalChecked(), Nan::New(status_code));
+	// the request was turned away before it was processed, so it can be
+	// sent again later
+	if (status_code == 420 || status_code == 429 || status_code == 503)
+	{
+		Nan::Set(error.As<v8::Object>(), Nan::New("rateLimited").ToLocalChecked(), Nan::True());
+	}
+	return error;
+}
+
+template <typename ReqType>
+bool error_and_status_check(ReqType *req, v8::Local<v8::Value> *error)
+{
+	if (req->error_code)
+	{
+		*error = IntToCurlError(req->error_code);
+	}
+	else if (req->status_code > 399)
+	{
+		*error = IntToStatusError(req->status_code);
+	}
+	else
+	{
+		return true;
+	}
+
+	return false;
+}
+
+void Timestamp(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+	v8::Isolate *isolate = args.GetIsolate();
+
+	uint64_t timestamp = genaro_util_timestamp();
+	v8::Local<v8::Number> timestamp_local = v8::Number::New(isolate, (double)timestamp);
+
+	args.GetReturnValue().Set(timestamp_local);
+}
+
+void GetInfoCallback(uv_work_t *work_req, int status)
+{
+	json_request_t *req = (json_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(GetInfoCallback, work_req, status), true))
+	{
+		return;
+	}
+
 	Nan::HandleScope scope;
 
-	transfer_callbacks_t *download_callbacks = (transfer_callbacks_t *)handle;
-	Nan::Callback *callback = download_callbacks->progress_callback;
+	Nan::Callback *callback = callbacks->callback;
 
-	v8::Local<v8::Number> progress_local = Nan::New(progress);
-	v8::Local<v8::Number> file_bytes_local = Nan::New((double)file_bytes);
+	v8::Local<v8::Value> error = Nan::Null();
+	v8::Local<v8::Value> result = Nan::Null();
+
+	if (error_and_status_check<json_request_t>(req, &error))
+	{
+		const char *result_str = json_object_to_json_string(req->response);
+		v8::Local<v8::String> result_json_string = Nan::New(result_str).ToLocalChecked();
+		Nan::JSON NanJSON;
+		Nan::MaybeLocal<v8::Value> res = NanJSON.Parse(result_json_string);
+		if (!res.IsEmpty())
+		{
+			result = res.ToLocalChecked();
+		}
+	}
 
 	v8::Local<v8::Value> argv[] = {
-		progress_local,
-		file_bytes_local };
+		error,
+		result };
 
 	Nan::Call(*callback, 2, argv);
+
+	free(req);
+	free(work_req);
+	delete callbacks;
 }
 
-void ResolveFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+void GetInfo(const Nan::FunctionCallbackInfo<v8::Value> &args)
 {
-	if (args.Length() != 4)
+	if (args.Length() != 1 || !args[0]->IsFunction())
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		return Nan::ThrowError("First argument is expected to be a function");
 	}
-	if (args.This()->InternalFieldCount() != 1)
+	if (args.This()->InternalFieldCount() != 2)
 	{
 		return Nan::ThrowError("Environment not available for instance");
 	}
@@ -1280,670 +2023,3964 @@ void ResolveFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
 		return Nan::ThrowError("Environment is not initialized");
 	}
 
-	Nan::Utf8String bucket_id_str(args[0]);
-	const char *bucket_id = *bucket_id_str;
-	const char *bucket_id_dup = strdup(bucket_id);
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[0].As<v8::Function>());
 
-	Nan::Utf8String file_id_str(args[1]);
-	const char *file_id = *file_id_str;
-	const char *file_id_dup = strdup(file_id);
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_get_info(env, (void *)callbacks, GetInfoCallback);
+	});
+}
 
-	Nan::Utf8String file_path_str(args[2]);
-	const char *file_path = *file_path_str;
+v8::Local<v8::Date> StrToDate(const char *dateStr)
+{
+	v8::Local<v8::Date> tmp = Nan::New<v8::Date>(0).ToLocalChecked();
+	v8::Local<v8::Function> cons = v8::Local<v8::Function>::Cast(
+		Nan::Get(tmp, Nan::New("constructor").ToLocalChecked()).ToLocalChecked());
+	const int argc = 1;
+	v8::Local<v8::Value> argv[argc] = { Nan::New(dateStr).ToLocalChecked() };
+	v8::Local<v8::Date> date = v8::Local<v8::Date>::Cast(
+		Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+	return date;
+}
 
-	//convert to ANSI encoding on Win32, add on 2018.5.9
-#if defined(_WIN32)
-	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
-	const char *file_path_dup = strdup(u_p.get());
-#else
-	const char *file_path_dup = strdup(file_path);
-#endif
+void GetBucketsCallback(uv_work_t *work_req, int status)
+{
+	get_buckets_request_t *req = (get_buckets_request_t *)work_req->data;
 
-	v8::Local<v8::Object> options = args[3].As<v8::Object>();
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(GetBucketsCallback, work_req, status), true))
+	{
+		return;
+	}
 
-	bool hasKey = Nan::HasOwnProperty(options, Nan::New("key").ToLocalChecked()).FromJust();
-	bool hasCtr = Nan::HasOwnProperty(options, Nan::New("ctr").ToLocalChecked()).FromJust();
+	FinishRead(callbacks, [&](v8::Local<v8::Value> *argv) {
+		v8::Local<v8::Value> buckets_value = Nan::Null();
+		v8::Local<v8::Value> error = Nan::Null();
 
-	const char *key = NULL;
-	const char *ctr = NULL;
-	const char *key_dup = NULL;
-	const char *ctr_dup = NULL;
-	if (hasKey && hasCtr)
+		if (error_and_status_check<get_buckets_request_t>(req, &error))
+		{
+			v8::Local<v8::Array> buckets_array = Nan::New<v8::Array>();
+			for (uint32_t i = 0; i < req->total_buckets; i++)
+			{
+				v8::Local<v8::Object> bucket = Nan::New<v8::Object>();
+				bucket->Set(Nan::New("name").ToLocalChecked(), Nan::New(req->buckets[i].name).ToLocalChecked());
+				bucket->Set(Nan::New("created").ToLocalChecked(), StrToDate(req->buckets[i].created));
+				bucket->Set(Nan::New("id").ToLocalChecked(), Nan::New(req->buckets[i].id).ToLocalChecked());
+				bucket->Set(Nan::New("bucketId").ToLocalChecked(), Nan::New(req->buckets[i].bucketId).ToLocalChecked());
+				bucket->Set(Nan::New("type").ToLocalChecked(), Nan::New(req->buckets[i].type));
+				bucket->Set(Nan::New("decrypted").ToLocalChecked(), Nan::New<v8::Boolean>(req->buckets[i].decrypted));
+				bucket->Set(Nan::New("limitStorage").ToLocalChecked(), Nan::New((double)req->buckets[i].limitStorage));
+				bucket->Set(Nan::New("usedStorage").ToLocalChecked(), Nan::New((double)req->buckets[i].usedStorage));
+				bucket->Set(Nan::New("timeStart").ToLocalChecked(), Nan::New((double)req->buckets[i].timeStart));
+				bucket->Set(Nan::New("timeEnd").ToLocalChecked(), Nan::New((double)req->buckets[i].timeEnd));
+				buckets_array->Set(i, bucket);
+			}
+			buckets_value = buckets_array;
+		}
+
+		argv[0] = error;
+		argv[1] = buckets_value;
+	});
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void GetBuckets(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1 || !args[0]->IsFunction())
 	{
-		Nan::Utf8String key_str(options->Get(Nan::New("key").ToLocalChecked()));
-		key = *key_str;
+		return Nan::ThrowError("First argument is expected to be a function");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
 
-		if (key && key[0] != '\0')
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	if (CoalesceRead(ctx, "getBuckets", args[0].As<v8::Function>()))
+	{
+		return;
+	}
+
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[0].As<v8::Function>());
+	StartRead(callbacks, "getBuckets");
+
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_get_buckets(env, (void *)callbacks, GetBucketsCallback);
+	});
+}
+
+void ListFilesCallback(uv_work_t *work_req, int status)
+{
+	list_files_request_t *req = (list_files_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(ListFilesCallback, work_req, status), true))
+	{
+		return;
+	}
+
+	FinishRead(callbacks, [&](v8::Local<v8::Value> *argv) {
+		v8::Local<v8::Value> files_value = Nan::Null();
+		v8::Local<v8::Value> error = Nan::Null();
+
+		if (error_and_status_check<list_files_request_t>(req, &error))
 		{
-			key_dup = strdup(key);
+			v8::Local<v8::Array> files_array = Nan::New<v8::Array>();
+			for (uint32_t i = 0; i < req->total_files; i++)
+			{
+				v8::Local<v8::Object> file = Nan::New<v8::Object>();
+				file->Set(Nan::New("filename").ToLocalChecked(), Nan::New(req->files[i].filename).ToLocalChecked());
+				file->Set(Nan::New("mimetype").ToLocalChecked(), Nan::New(req->files[i].mimetype).ToLocalChecked());
+				file->Set(Nan::New("id").ToLocalChecked(), Nan::New(req->files[i].id).ToLocalChecked());
+				file->Set(Nan::New("size").ToLocalChecked(), Nan::New((double)(req->files[i].size)));
+				file->Set(Nan::New("created").ToLocalChecked(), StrToDate(req->files[i].created));
+
+				if (req->files[i].rsaKey && req->files[i].rsaCtr)
+				{
+					file->Set(Nan::New("rsaKey").ToLocalChecked(), Nan::New(req->files[i].rsaKey).ToLocalChecked());
+					file->Set(Nan::New("rsaCtr").ToLocalChecked(), Nan::New(req->files[i].rsaCtr).ToLocalChecked());
+				}
+				files_array->Set(i, file);
+			}
+			files_value = files_array;
 		}
 
-		Nan::Utf8String ctr_str(options->Get(Nan::New("ctr").ToLocalChecked()));
-		ctr = *ctr_str;
+		argv[0] = error;
+		argv[1] = files_value;
+	});
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void ListFiles(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 2 || !args[1]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String str(args[0]);
+	const char *bucket_id = *str;
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	std::string read_key = std::string("listFiles/") + bucket_id;
+	if (CoalesceRead(ctx, read_key, args[1].As<v8::Function>()))
+	{
+		return;
+	}
+
+	const char *bucket_id_dup = strdup(bucket_id);
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[1].As<v8::Function>());
+	callbacks->Own(bucket_id_dup);
+	StartRead(callbacks, read_key);
+
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_list_files(env, bucket_id_dup, (void *)callbacks, ListFilesCallback);
+	});
+}
+
+void CreateBucketCallback(uv_work_t *work_req, int status)
+{
+	create_bucket_request_t *req = (create_bucket_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(CreateBucketCallback, work_req, status), true))
+	{
+		return;
+	}
+
+	ForgetReads(callbacks);
+
+	Nan::HandleScope scope;
+
+	Nan::Callback *callback = callbacks->callback;
+
+	v8::Local<v8::Value> bucket_value = Nan::Null();
+	v8::Local<v8::Value> error = Nan::Null();
+
+	if (error_and_status_check<create_bucket_request_t>(req, &error))
+	{
+		v8::Local<v8::Object> bucket_object = Nan::To<v8::Object>(Nan::New<v8::Object>()).ToLocalChecked();
+		bucket_object->Set(Nan::New("name").ToLocalChecked(), Nan::New(req->bucket->name).ToLocalChecked());
+		bucket_object->Set(Nan::New("id").ToLocalChecked(), Nan::New(req->bucket->id).ToLocalChecked());
+		bucket_object->Set(Nan::New("decrypted").ToLocalChecked(), Nan::New<v8::Boolean>(req->bucket->decrypted));
+		bucket_value = bucket_object;
+	}
+
+	v8::Local<v8::Value> argv[] = {
+		error,
+		bucket_value };
+
+	Nan::Call(*callback, 2, argv);
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void CreateBucket(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 2 || !args[1]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String str(args[0]);
+	const char *name = *str;
+	const char *name_dup = strdup(name);
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[1].As<v8::Function>());
+	callbacks->Own(name_dup);
+	callbacks->invalidates.push_back("getBuckets");
+
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_create_bucket(env, name_dup, (void *)callbacks, CreateBucketCallback);
+	});
+}
+
+void DeleteBucketCallback(uv_work_t *work_req, int status)
+{
+	json_request_t *req = (json_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(DeleteBucketCallback, work_req, status), true))
+	{
+		return;
+	}
+
+	ForgetReads(callbacks);
+
+	Nan::HandleScope scope;
+
+	Nan::Callback *callback = callbacks->callback;
+	v8::Local<v8::Value> error = Nan::Null();
+
+	error_and_status_check<json_request_t>(req, &error);
+
+	v8::Local<v8::Value> argv[] = {
+		error };
+
+	Nan::Call(*callback, 1, argv);
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void DeleteBucket(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 2 || !args[1]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String str(args[0]);
+	const char *id = *str;
+	const char *id_dup = strdup(id);
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[1].As<v8::Function>());
+	callbacks->Own(id_dup);
+	callbacks->invalidates.push_back("getBuckets");
+	callbacks->invalidates.push_back(std::string("listFiles/") + id);
+
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_delete_bucket(env, id_dup, (void *)callbacks, DeleteBucketCallback);
+	});
+}
+
+void RenameBucketCallback(uv_work_t *work_req, int status)
+{
+	rename_bucket_request_t *req = (rename_bucket_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(RenameBucketCallback, work_req, status), true))
+	{
+		return;
+	}
+
+	ForgetReads(callbacks);
+
+	Nan::HandleScope scope;
+
+	Nan::Callback *callback = callbacks->callback;
+
+	v8::Local<v8::Value> error = Nan::Null();
+
+	error_and_status_check<rename_bucket_request_t>(req, &error);
+
+	v8::Local<v8::Value> argv[] = {
+		error };
+
+	Nan::Call(*callback, 1, argv);
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void RenameBucket(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 3 || !args[2]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String id_str(args[0]);
+	const char *id = *id_str;
+	const char *id_dup = strdup(id);
+
+	Nan::Utf8String name_str(args[1]);
+	const char *name = *name_str;
+	const char *name_dup = strdup(name);
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[2].As<v8::Function>());
+	callbacks->Own(id_dup);
+	callbacks->Own(name_dup);
+	callbacks->invalidates.push_back("getBuckets");
+
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_rename_bucket(env, id_dup, name_dup, (void *)callbacks, RenameBucketCallback);
+	});
+}
+
+void AddUploadingTask(addon_data_t *addon, const char *bucket_id, const char *file_name)
+{
+	uploading_task_t task;
+	task.bucket_id = strdup(bucket_id);
+	task.file_name = strdup(file_name);
+
+	uv_mutex_lock(&addon->mutex);
+	addon->uploading_task_list.push_back(task);
+	uv_mutex_unlock(&addon->mutex);
+}
+
+void RemoveUploadingTask(addon_data_t *addon, const char *bucket_id, const char *file_name)
+{
+	if (!addon)
+	{
+		return;
+	}
+
+	uv_mutex_lock(&addon->mutex);
+
+	uploading_task_list_t::iterator iter = addon->uploading_task_list.begin();
+
+	while (iter != addon->uploading_task_list.end())
+	{
+		if (!strcmp(iter->file_name, file_name) &&
+			!strcmp(iter->bucket_id, bucket_id))
+		{
+			free((void *)iter->bucket_id);
+			free((void *)iter->file_name);
+			addon->uploading_task_list.erase(iter);
+			break;
+		}
+
+		++iter;
+	}
+
+	uv_mutex_unlock(&addon->mutex);
+}
+
+bool IsUploading(addon_data_t *addon, const char *bucket_id, const char *file_name)
+{
+	bool uploading = false;
+
+	uv_mutex_lock(&addon->mutex);
+
+	uploading_task_list_t::iterator iter = addon->uploading_task_list.begin();
+
+	while (iter != addon->uploading_task_list.end())
+	{
+		if (!strcmp(iter->bucket_id, bucket_id) &&
+			!strcmp(iter->file_name, file_name))
+		{
+			uploading = true;
+			break;
+		}
+
+		++iter;
+	}
+
+	uv_mutex_unlock(&addon->mutex);
+
+	return uploading;
+}
+
+void AddDownloadingTask(addon_data_t *addon, const char *full_path)
+{
+	downloading_task_t task;
+#ifdef _WIN32
+	task.full_path = ConvertToWindowsPath(full_path);
+#else
+	task.full_path = strdup(full_path);
+#endif
+
+	uv_mutex_lock(&addon->mutex);
+	addon->downloading_task_list.push_back(task);
+	uv_mutex_unlock(&addon->mutex);
+}
+
+void RemoveDownloadingTask(addon_data_t *addon, const char *full_path)
+{
+	if (!addon)
+	{
+		return;
+	}
+
+	uv_mutex_lock(&addon->mutex);
+
+	downloading_task_list_t::iterator iter = addon->downloading_task_list.begin();
+
+	while (iter != addon->downloading_task_list.end())
+	{
+	#ifdef _WIN32
+		const char *converted_full_path = ConvertToWindowsPath(full_path);
+		if (!_stricmp(iter->full_path, converted_full_path))
+	#else
+		if (!strcmp(iter->full_path, full_path))
+	#endif
+		{
+		#ifdef _WIN32
+			free((void *)converted_full_path);
+		#endif
+
+			free((void *)iter->full_path);
+			addon->downloading_task_list.erase(iter);
+
+			break;
+		}
+
+	#ifdef _WIN32
+		free((void *)converted_full_path);
+	#endif
+
+		++iter;
+	}
+
+	uv_mutex_unlock(&addon->mutex);
+}
+
+bool IsDownloading(addon_data_t *addon, const char *full_path)
+{
+	bool downloading = false;
+
+	uv_mutex_lock(&addon->mutex);
+
+	downloading_task_list_t::iterator iter = addon->downloading_task_list.begin();
+
+	while (iter != addon->downloading_task_list.end())
+	{
+	#ifdef _WIN32
+		const char *converted_full_path = ConvertToWindowsPath(full_path);
+		if (!_stricmp(iter->full_path, converted_full_path))
+	#else
+		if (!strcmp(iter->full_path, full_path))
+	#endif
+		{
+		#ifdef _WIN32
+			free((void *)converted_full_path);
+		#endif
+
+			downloading = true;
+			break;
+		}
+
+	#ifdef _WIN32
+		free((void *)converted_full_path);
+	#endif
+
+		++iter;
+	}
+
+	uv_mutex_unlock(&addon->mutex);
+
+	return downloading;
+}
+
+void DeliverStoreFileFinished(int status, char *file_id, uint64_t file_bytes, char *sha256_of_encrypted, void *handle)
+{
+	Nan::HandleScope scope;
+
+	transfer_callbacks_t *upload_callbacks = (transfer_callbacks_t *)handle;
+	Nan::Callback *callback = upload_callbacks->finished_callback;
+
+	upload_callbacks->ctx->transfers.remove(upload_callbacks);
+	ReleaseTransferMemory(upload_callbacks->ctx, upload_callbacks);
+	DrainTransferQueue(upload_callbacks->ctx);
+	ForgetRead(upload_callbacks->ctx, upload_callbacks->invalidates);
+
+	dedupe_index_t *dedupe_index = upload_callbacks->ctx->dedupe_index;
+	if (status == 0 && dedupe_index && !upload_callbacks->dedupe_hash.empty())
+	{
+		RecordDedupeEntry(dedupe_index, upload_callbacks->dedupe_bucket_id, upload_callbacks->dedupe_hash,
+			file_id, file_bytes, sha256_of_encrypted);
+	}
+
+	v8::Local<v8::Value> file_id_local = Nan::Null();
+	v8::Local<v8::Value> file_bytes_local = Nan::Null();
+	v8::Local<v8::Value> sha256_of_encrypted_local = Nan::Null();
+	if (status == 0)
+	{
+		file_id_local = Nan::New(file_id).ToLocalChecked();
+		file_bytes_local = Nan::New((double)file_bytes);
+		sha256_of_encrypted_local = Nan::New(sha256_of_encrypted).ToLocalChecked();
+	}
+
+	v8::Local<v8::Value> error = TransferError(upload_callbacks, status);
+
+	v8::Local<v8::Value> argv[] = {
+		error,
+		file_id_local,
+		file_bytes_local,
+		sha256_of_encrypted_local };
+
+	Nan::Call(*callback, 4, argv);
+
+	free(file_id);
+	free(sha256_of_encrypted);
+	ReleaseTransfer(upload_callbacks);
+}
+
+void StoreFileFinishedCallback(const char *bucket_id, const char *file_name, int status, char *file_id, uint64_t file_bytes, char *sha256_of_encrypted, void *handle)
+{
+	transfer_callbacks_t *upload_callbacks = (transfer_callbacks_t *)handle;
+
+	// the state is freed by libgenaro once this returns
+	upload_callbacks->state = NULL;
+	upload_callbacks->finished = true;
+	upload_callbacks->error_status = status;
+
+	RemoveUploadingTask(upload_callbacks->ctx->addon, bucket_id, file_name);
+
+	if (DeferToJsThread(upload_callbacks->ctx,
+		std::bind(DeliverStoreFileFinished, status, file_id, file_bytes, sha256_of_encrypted, handle), true))
+	{
+		return;
+	}
+
+	env_context_t *ctx = upload_callbacks->ctx;
+	DeliverStoreFileFinished(status, file_id, file_bytes, sha256_of_encrypted, handle);
+	DestroyEnvIfIdle(ctx);
+}
+
+void StoreFileProgressCallback(double progress, uint64_t file_bytes, void *handle)
+{
+	transfer_callbacks_t *upload_callbacks = (transfer_callbacks_t *)handle;
+	if (DeferProgress(upload_callbacks, progress, file_bytes, StoreFileProgressCallback))
+	{
+		return;
+	}
+
+	DropTransferCache(upload_callbacks, progress, file_bytes, false);
+
+	Nan::HandleScope scope;
+
+	Nan::Callback *callback = upload_callbacks->progress_callback;
+
+	v8::Local<v8::Number> progress_local = Nan::New(progress);
+	v8::Local<v8::Number> file_bytes_local = Nan::New((double)file_bytes);
+
+	v8::Local<v8::Value> argv[] = {
+		progress_local,
+		file_bytes_local };
+
+	Nan::Call(*callback, 2, argv);
+}
+
+template <class StateType>
+void StateStatusErrorGetter(v8::Local<v8::String> property, const Nan::PropertyCallbackInfo<v8::Value> &info)
+{
+	v8::Local<v8::Object> self = info.Holder();
+	transfer_callbacks_t *callbacks = (transfer_callbacks_t *)self->GetAlignedPointerFromInternalField(0);
+
+	int error_status = 0;
+	RunOnIoThread(callbacks->ctx, [&]() {
+		StateType *state = (StateType *)callbacks->state;
+		error_status = state ? state->error_status : callbacks->error_status;
+	});
+
+	v8::Local<v8::Value> error = IntToGenaroError(error_status);
+	info.GetReturnValue().Set(error);
+}
+
+//add on 2018.5.9
+#if defined(_WIN32)
+std::unique_ptr<char[]> EncodingConvert(const char* strIn, int sourceCodepage, int targetCodepage)
+{
+	int unicodeLen = MultiByteToWideChar(sourceCodepage, 0, strIn, -1, nullptr, 0);
+
+	wchar_t * pUnicode = new wchar_t[unicodeLen + 1];
+	memset(pUnicode, 0, (unicodeLen + 1) * sizeof(wchar_t));
+
+	MultiByteToWideChar(sourceCodepage, 0, strIn, -1, pUnicode, unicodeLen);
+
+	char * pTargetData = nullptr;
+	int targetLen = WideCharToMultiByte(targetCodepage, 0, pUnicode, -1, pTargetData, 0, nullptr, nullptr);
+
+	pTargetData = new char[targetLen + 1];
+	memset(pTargetData, 0, targetLen + 1);
+
+	WideCharToMultiByte(targetCodepage, 0, pUnicode, -1, pTargetData, targetLen, nullptr, nullptr);
+
+	delete[] pUnicode;
+	return std::unique_ptr<char[]>(pTargetData);
+}
+#endif
+
+bool NewEncryptionInfo(genaro_env_t *env, const char *bucket_id, encryption_info_entry_t *entry)
+{
+	genaro_encryption_info_t *encryption_info = genaro_generate_encryption_info(env, NULL, bucket_id);
+	if (!encryption_info)
+	{
+		return false;
+	}
+
+	entry->index = encryption_info->index;
+	free(encryption_info->index);
+	entry->key = encryption_info->key_ctr_as_str->key_as_str;
+	free((void *)encryption_info->key_ctr_as_str->key_as_str);
+	entry->ctr = encryption_info->key_ctr_as_str->ctr_as_str;
+	free((void *)encryption_info->key_ctr_as_str->ctr_as_str);
+	free(encryption_info->key_ctr_as_str);
+	free(encryption_info);
+
+	return true;
+}
+
+v8::Local<v8::Object> EncryptionInfoToObject(encryption_info_entry_t *entry)
+{
+	v8::Local<v8::Object> encryption = Nan::New<v8::Object>();
+	encryption->Set(Nan::New("index").ToLocalChecked(), Nan::New(entry->index).ToLocalChecked());
+	encryption->Set(Nan::New("key").ToLocalChecked(), Nan::New(entry->key).ToLocalChecked());
+	encryption->Set(Nan::New("ctr").ToLocalChecked(), Nan::New(entry->ctr).ToLocalChecked());
+
+	WipeEncryptionInfo(entry);
+
+	return encryption;
+}
+
+typedef struct
+{
+	uv_work_t req;
+	env_context_t *ctx;
+	genaro_env_t *env;
+	std::string bucket_id;
+	int count;
+	std::vector<encryption_info_entry_t> entries;
+	// NULL for a refill of the pool
+	Nan::Callback *callback;
+} encryption_info_work_t;
+
+void EncryptionInfoWork(uv_work_t *req)
+{
+	encryption_info_work_t *work = (encryption_info_work_t *)req->data;
+
+	work->entries.reserve(work->count);
+	for (int i = 0; i < work->count; i++)
+	{
+		encryption_info_entry_t entry;
+		if (!NewEncryptionInfo(work->env, work->bucket_id.c_str(), &entry))
+		{
+			break;
+		}
+		work->entries.push_back(entry);
+	}
+}
+
+void AfterEncryptionInfoWork(uv_work_t *req, int status)
+{
+	Nan::HandleScope scope;
+
+	encryption_info_work_t *work = (encryption_info_work_t *)req->data;
+	env_context_t *ctx = work->ctx;
+
+	if (work->callback)
+	{
+		v8::Local<v8::Value> error = Nan::Null();
+		v8::Local<v8::Value> infos = Nan::Null();
+		if ((int)work->entries.size() < work->count)
+		{
+			error = Nan::Error("Unable to generate encryption info");
+		}
+		else
+		{
+			v8::Local<v8::Array> infos_array = Nan::New<v8::Array>(work->count);
+			for (int i = 0; i < work->count; i++)
+			{
+				infos_array->Set(i, EncryptionInfoToObject(&work->entries[i]));
+			}
+			infos = infos_array;
+		}
+
+		v8::Local<v8::Value> argv[] = {
+			error,
+			infos };
+
+		Nan::Call(*(work->callback), 2, argv);
+	}
+	else if (!ctx->destroyed_env)
+	{
+		encryption_info_pool_t &pool = ctx->encryption_info_pools[work->bucket_id];
+		pool.refilling = false;
+		pool.entries.insert(pool.entries.end(), work->entries.begin(), work->entries.end());
+	}
+
+	for (size_t i = 0; i < work->entries.size(); i++)
+	{
+		WipeEncryptionInfo(&work->entries[i]);
+	}
+
+	PoolJobFinished(ctx);
+	delete work->callback;
+	delete work;
+}
+
+void QueueEncryptionInfoWork(env_context_t *ctx, genaro_env_t *env, const char *bucket_id, int count, Nan::Callback *callback)
+{
+	encryption_info_work_t *work = new encryption_info_work_t();
+	work->req.data = work;
+	work->ctx = ctx;
+	work->env = env;
+	work->bucket_id = bucket_id;
+	work->count = count;
+	work->callback = callback;
+
+	QueuePoolJob(ctx, &work->req, EncryptionInfoWork, AfterEncryptionInfoWork);
+}
+
+// top the pool of the bucket up to its size again in the background
+void RefillEncryptionInfoPool(env_context_t *ctx, genaro_env_t *env, const char *bucket_id)
+{
+	encryption_info_pool_t &pool = ctx->encryption_info_pools[bucket_id];
+	int missing = ctx->encryption_info_pool_size - (int)pool.entries.size();
+	if (pool.refilling || missing <= 0)
+	{
+		return;
+	}
+
+	pool.refilling = true;
+	pool.refills++;
+	QueueEncryptionInfoWork(ctx, env, bucket_id, missing, NULL);
+}
+
+void GenerateEncryptionInfo(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+
+	Nan::Utf8String bucket_id_str(args[0]);
+	const char *bucket_id = *bucket_id_str;
+
+	encryption_info_entry_t entry;
+	bool generated = false;
+
+	if (ctx->encryption_info_pool_size > 0)
+	{
+		encryption_info_pool_t &pool = ctx->encryption_info_pools[bucket_id];
+		if (!pool.entries.empty())
+		{
+			entry = pool.entries.front();
+			WipeEncryptionInfo(&pool.entries.front());
+			pool.entries.pop_front();
+			generated = true;
+		}
+		RefillEncryptionInfoPool(ctx, env, bucket_id);
+	}
+
+	if (!generated)
+	{
+		generated = NewEncryptionInfo(env, bucket_id, &entry);
+	}
+
+	if (generated)
+	{
+		args.GetReturnValue().Set(EncryptionInfoToObject(&entry));
+	}
+}
+
+// generate count entries on the threadpool, the callback gets them as an
+// array or an error if any of them failed
+void GenerateEncryptionInfoBatch(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 3 || !args[1]->IsNumber() || !args[2]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+
+	int count = Nan::To<int>(args[1]).FromJust();
+	if (count < 1)
+	{
+		return Nan::ThrowError("Count is expected to be positive");
+	}
+
+	Nan::Utf8String bucket_id_str(args[0]);
+	const char *bucket_id = *bucket_id_str;
+
+	QueueEncryptionInfoWork(ctx, env, bucket_id, count, new Nan::Callback(args[2].As<v8::Function>()));
+}
+
+// void EncryptData(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// {
+// 	if (args.Length() != 1)
+// 	{
+// 		return Nan::ThrowError("Unexpected arguments");
+// 	}
+// 	if (args.This()->InternalFieldCount() != 2)
+// 	{
+// 		return Nan::ThrowError("Environment not available for instance");
+// 	}
+
+// 	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+// 	if (!env)
+// 	{
+// 		return Nan::ThrowError("Environment is not initialized");
+// 	}
+
+// 	Nan::Utf8String bucket_id_str(args[0]);
+// 	const char *bucket_id = *bucket_id_str;
+
+// 	genaro_encryption_info_t *encryption_info = genaro_generate_encryption_info(env, NULL, bucket_id);
+
+// 	if (encryption_info)
+// 	{
+// 		v8::Local<v8::Object> encryption = Nan::New<v8::Object>();
+// 		encryption->Set(Nan::New("index").ToLocalChecked(), Nan::New(encryption_info->index).ToLocalChecked());
+// 		free(encryption_info->index);
+// 		encryption->Set(Nan::New("key").ToLocalChecked(), Nan::New(encryption_info->key_ctr_as_str->key_as_str).ToLocalChecked());
+// 		free((void *)encryption_info->key_ctr_as_str->key_as_str);
+// 		encryption->Set(Nan::New("ctr").ToLocalChecked(), Nan::New(encryption_info->key_ctr_as_str->ctr_as_str).ToLocalChecked());
+// 		free((void *)encryption_info->key_ctr_as_str->ctr_as_str);
+// 		free(encryption_info->key_ctr_as_str);
+// 		free(encryption_info);
+
+// 		args.GetReturnValue().Set(encryption);
+// 	}
+// }
+
+typedef struct
+{
+	uv_work_t req;
+	transfer_callbacks_t *callbacks;
+	std::string file_path;
+	std::string hash;
+} dedupe_hash_work_t;
+
+void DedupeHashWork(uv_work_t *req)
+{
+	dedupe_hash_work_t *work = (dedupe_hash_work_t *)req->data;
+	work->hash = HashFile(work->file_path.c_str());
+}
+
+// an upload already in the index finishes with its earlier result,
+// otherwise it goes on like any other upload
+void AfterDedupeHashWork(uv_work_t *req, int status)
+{
+	Nan::HandleScope scope;
+
+	dedupe_hash_work_t *work = (dedupe_hash_work_t *)req->data;
+	transfer_callbacks_t *callbacks = work->callbacks;
+	env_context_t *ctx = callbacks->ctx;
+
+	// not queued anymore if it was canceled meanwhile
+	if (callbacks->queued)
+	{
+		callbacks->queued = false;
+
+		dedupe_entry_t *entry = NULL;
+		if (!ctx->destroyed_env && !work->hash.empty())
+		{
+			entry = LookupDedupeEntry(ctx->dedupe_index, callbacks->dedupe_bucket_id, work->hash);
+		}
+
+		if (ctx->destroyed_env)
+		{
+			callbacks->discard();
+			FailTransfer(callbacks, "Environment destroyed");
+			ReleaseTransfer(callbacks);
+		}
+		else if (work->hash.empty())
+		{
+			callbacks->discard();
+			FailTransfer(callbacks, "Unable to hash file");
+			ReleaseTransfer(callbacks);
+		}
+		else if (entry)
+		{
+			callbacks->discard();
+			DeliverStoreFileFinished(0, strdup(entry->file_id.c_str()), entry->file_bytes,
+				strdup(entry->sha256_of_encrypted.c_str()), callbacks);
+		}
+		else
+		{
+			callbacks->dedupe_hash = work->hash;
+
+			const char *start_error = StartOrQueueTransfer(ctx, callbacks);
+			if (start_error)
+			{
+				FailTransfer(callbacks, start_error);
+				ReleaseTransfer(callbacks);
+			}
+		}
+	}
+
+	ReleaseTransfer(callbacks);
+	PoolJobFinished(ctx);
+	delete work;
+}
+
+void QueueDedupeHash(env_context_t *ctx, transfer_callbacks_t *callbacks, const char *file_path)
+{
+	dedupe_hash_work_t *work = new dedupe_hash_work_t();
+	work->req.data = work;
+	work->callbacks = callbacks;
+	work->file_path = file_path;
+
+	callbacks->refs++;
+	callbacks->queued = true;
+	QueuePoolJob(ctx, &work->req, DedupeHashWork, AfterDedupeHashWork);
+}
+
+// creates an empty temp file owned by the transfer, removed with it.
+// Returns the open descriptor, or -1 with error set.
+int CreateUploadTempFile(transfer_callbacks_t *callbacks, const char **error)
+{
+	const char *tmp_path = NULL;
+	if (getenv("GENARO_TEMP") && !access(getenv("GENARO_TEMP"), F_OK)) {
+		tmp_path = getenv("GENARO_TEMP");
+	#ifdef _WIN32
+	} else if (getenv("TEMP") && !access(getenv("TEMP"), F_OK)) {
+		tmp_path = getenv("TEMP");
+	#else
+	} else if ("/tmp" && !access("/tmp", F_OK)) {
+		tmp_path = "/tmp";
+	#endif
+	} else {
+		*error = "Get temp path failed";
+		return -1;
+	}
+
+#ifdef _WIN32
+	const char *path_slash = "\\";
+#else
+	const char *path_slash = "/";
+#endif
+	char *temp_file_path = str_concat_many(3, tmp_path, path_slash, "tmp-XXXXXX");
+
+	int fd = -1;
+#ifdef _WIN32
+	int err = _mktemp_s(temp_file_path, strlen(temp_file_path) + 1);
+	if (!err)
+	{
+		fd = open(temp_file_path, O_WRONLY | O_CREAT);
+	}
+#else
+	fd = mkstemp(temp_file_path);
+#endif
+
+	if (fd == -1)
+	{
+		free(temp_file_path);
+		*error = "Create temp file failed";
+		return -1;
+	}
+
+	callbacks->temp_file_path = temp_file_path;
+	free(temp_file_path);
+
+	return fd;
+}
+
+#define SEGMENT_COPY_BUFFER_SIZE (1024 * 1024)
+
+// copy_file_range has a glibc wrapper since 2.27
+#if defined(__linux__) && defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 27)
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+// fills target with length bytes at offset of source. libgenaro uploads
+// a whole file by its path, so a segment always becomes a temp file of
+// its own. Only a filesystem that shares blocks makes that copy free,
+// copy_file_range still writes all of it, just without passing it
+// through here, and only if neither works it is read and written here.
+bool CopySegment(int source, uint64_t offset, uint64_t length, int target)
+{
+	uint64_t copied = 0;
+
+#if defined(__linux__)
+#if defined(FICLONERANGE)
+	struct file_clone_range range;
+	range.src_fd = source;
+	range.src_offset = offset;
+	range.src_length = length;
+	range.dest_offset = 0;
+	// needs block aligned ranges, unless the range ends at the end of
+	// the source
+	if (length && ioctl(target, FICLONERANGE, &range) == 0)
+	{
+		return true;
+	}
+#endif
+#endif
+
+#if defined(HAVE_COPY_FILE_RANGE)
+	loff_t source_offset = (loff_t)offset;
+	loff_t target_offset = 0;
+	while (copied < length)
+	{
+		ssize_t bytes = copy_file_range(source, &source_offset, target, &target_offset,
+			(size_t)std::min(length - copied, (uint64_t)1 << 30), 0);
+		if (bytes <= 0)
+		{
+			break;
+		}
+		copied += bytes;
+	}
+	if (copied == length)
+	{
+		return true;
+	}
+#endif
+
+	std::vector<char> buffer(SEGMENT_COPY_BUFFER_SIZE);
+
+#if defined(_WIN32)
+	if (_lseeki64(source, offset + copied, SEEK_SET) == -1 || _lseeki64(target, copied, SEEK_SET) == -1)
+	{
+		return false;
+	}
+#else
+	if (lseek(target, (off_t)copied, SEEK_SET) == -1)
+	{
+		return false;
+	}
+#endif
+
+	while (copied < length)
+	{
+		size_t want = (size_t)std::min(length - copied, (uint64_t)buffer.size());
+	#if defined(_WIN32)
+		int bytes = _read(source, &buffer[0], (unsigned int)want);
+	#else
+		ssize_t bytes = pread(source, &buffer[0], want, (off_t)(offset + copied));
+	#endif
+		if (bytes <= 0)
+		{
+			// a segment past the end of the source is an error too
+			return false;
+		}
+
+		size_t written = 0;
+		while (written < (size_t)bytes)
+		{
+		#if defined(_WIN32)
+			int ret = _write(target, &buffer[written], (unsigned int)(bytes - written));
+		#else
+			ssize_t ret = write(target, &buffer[written], bytes - written);
+		#endif
+			if (ret <= 0)
+			{
+				return false;
+			}
+			written += ret;
+		}
+		copied += bytes;
+	}
+
+	return true;
+}
+
+typedef struct
+{
+	uv_work_t req;
+	transfer_callbacks_t *callbacks;
+	// the source is either a path or a descriptor of the caller
+	std::string source_path;
+	int source_fd;
+	uint64_t offset;
+	uint64_t length;
+	std::string target_path;
+	bool dedupe;
+	bool failed;
+} segment_copy_work_t;
+
+void SegmentCopyWork(uv_work_t *req)
+{
+	segment_copy_work_t *work = (segment_copy_work_t *)req->data;
+
+	int source = work->source_fd;
+	if (source == -1)
+	{
+	#if defined(_WIN32)
+		source = open(work->source_path.c_str(), O_RDONLY | O_BINARY);
+	#else
+		source = open(work->source_path.c_str(), O_RDONLY);
+	#endif
+	}
+
+	int target = -1;
+	if (source != -1)
+	{
+	#if defined(_WIN32)
+		target = open(work->target_path.c_str(), O_WRONLY | O_TRUNC | O_BINARY);
+	#else
+		target = open(work->target_path.c_str(), O_WRONLY | O_TRUNC);
+	#endif
+	}
+
+	work->failed = target == -1 || !CopySegment(source, work->offset, work->length, target);
+
+	if (target != -1 && close(target))
+	{
+		work->failed = true;
+	}
+	if (source != -1 && work->source_fd == -1)
+	{
+		close(source);
+	}
+}
+
+// a copied segment goes on like any other upload
+void AfterSegmentCopyWork(uv_work_t *req, int status)
+{
+	Nan::HandleScope scope;
+
+	segment_copy_work_t *work = (segment_copy_work_t *)req->data;
+	transfer_callbacks_t *callbacks = work->callbacks;
+	env_context_t *ctx = callbacks->ctx;
+
+	// not queued anymore if it was canceled meanwhile
+	if (callbacks->queued)
+	{
+		callbacks->queued = false;
+
+		if (ctx->destroyed_env)
+		{
+			callbacks->discard();
+			FailTransfer(callbacks, "Environment destroyed");
+			ReleaseTransfer(callbacks);
+		}
+		else if (work->failed)
+		{
+			callbacks->discard();
+			FailTransfer(callbacks, "Unable to read file segment");
+			ReleaseTransfer(callbacks);
+		}
+		else if (work->dedupe)
+		{
+			QueueDedupeHash(ctx, callbacks, work->target_path.c_str());
+		}
+		else
+		{
+			const char *start_error = StartOrQueueTransfer(ctx, callbacks);
+			if (start_error)
+			{
+				FailTransfer(callbacks, start_error);
+				ReleaseTransfer(callbacks);
+			}
+		}
+	}
+
+	ReleaseTransfer(callbacks);
+	PoolJobFinished(ctx);
+	delete work;
+}
+
+void QueueSegmentCopy(env_context_t *ctx, transfer_callbacks_t *callbacks, segment_copy_work_t *work)
+{
+	work->req.data = work;
+	work->callbacks = callbacks;
+
+	callbacks->refs++;
+	callbacks->queued = true;
+	QueuePoolJob(ctx, &work->req, SegmentCopyWork, AfterSegmentCopyWork);
+}
+
+void StoreFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 4)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+
+	Nan::Utf8String bucket_id_str(args[0]);
+	const char *bucket_id = *bucket_id_str;
+	const char *bucket_id_dup = strdup(bucket_id);
+
+	Nan::Utf8String file_or_data_str(args[1]);
+	const char *file_or_data = *file_or_data_str;
+
+ 	v8::Local<v8::Boolean> is_file_path_local = v8::Local<v8::Boolean>::Cast(args[2]); 
+    bool is_file_path = is_file_path_local->BooleanValue();
+
+	v8::Local<v8::Object> options = args[3].As<v8::Object>();
+
+	transfer_callbacks_t *upload_callbacks = NewTransferCallbacks(ctx, options);
+	upload_callbacks->Own(bucket_id_dup);
+	upload_callbacks->invalidates = std::string("listFiles/") + bucket_id;
+
+	Nan::MaybeLocal<v8::Value> dedupeOption = options->Get(Nan::New("dedupe").ToLocalChecked());
+
+	bool dedupe = false;
+	if (!dedupeOption.IsEmpty())
+	{
+		dedupe = Nan::To<bool>(dedupeOption.ToLocalChecked()).FromJust();
+	}
+
+	if (dedupe && !ctx->dedupe_index)
+	{
+		ReleaseTransfer(upload_callbacks);
+		return Nan::ThrowError("dedupe requires the dedupeIndex option of the environment");
+	}
+
+	if (!ParseIoMode(options, upload_callbacks))
+	{
+		ReleaseTransfer(upload_callbacks);
+		return Nan::ThrowError("Unknown ioMode");
+	}
+
+	// only a range of the file, or of a descriptor of the caller
+	std::unique_ptr<segment_copy_work_t> segment;
+	Nan::MaybeLocal<v8::Value> segmentOption = options->Get(Nan::New("segment").ToLocalChecked());
+	if (!segmentOption.IsEmpty() && segmentOption.ToLocalChecked()->IsObject())
+	{
+		v8::Local<v8::Object> segment_local = segmentOption.ToLocalChecked().As<v8::Object>();
+		v8::Local<v8::Value> offset_local = segment_local->Get(Nan::New("offset").ToLocalChecked());
+		v8::Local<v8::Value> length_local = segment_local->Get(Nan::New("length").ToLocalChecked());
+		v8::Local<v8::Value> fd_local = segment_local->Get(Nan::New("fd").ToLocalChecked());
+
+		double offset = offset_local->IsNumber() ? Nan::To<double>(offset_local).FromJust() : -1;
+		double length = length_local->IsNumber() ? Nan::To<double>(length_local).FromJust() : -1;
+		bool has_fd = fd_local->IsInt32() && Nan::To<int32_t>(fd_local).FromJust() >= 0;
+
+		if (offset < 0 || length < 0 || (!has_fd && !fd_local->IsUndefined()) || (!has_fd && !is_file_path))
+		{
+			ReleaseTransfer(upload_callbacks);
+			return Nan::ThrowError("segment needs an offset, a length and a file path or fd");
+		}
+
+		segment.reset(new segment_copy_work_t());
+		segment->offset = (uint64_t)offset;
+		segment->length = (uint64_t)length;
+		segment->source_fd = has_fd ? Nan::To<int32_t>(fd_local).FromJust() : -1;
+	}
+
+	Nan::Utf8String file_name_str(options->Get(Nan::New("filename").ToLocalChecked()).As<v8::String>());
+	const char *file_name = *file_name_str;
+	const char *file_name_dup = upload_callbacks->Own(strdup(file_name));
+
+	if (IsUploading(ctx->addon, bucket_id_dup, file_name_dup))
+	{
+		v8::Local<v8::String> msg = Nan::New("File is already uploading").ToLocalChecked();
+		v8::Local<v8::Value> error = Nan::Error(msg);
+
+		v8::Local<v8::Value> argv[] = {
+			error,
+			Nan::Null(),
+			Nan::Null(),
+			Nan::Null() };
+
+		Nan::Call(*(upload_callbacks->finished_callback), 4, argv);
+		ReleaseTransfer(upload_callbacks);
+
+		return;
+	}
+
+	const char *file_path = NULL;
+
+	if (segment)
+	{
+		if (segment->source_fd == -1)
+		{
+			segment->source_path = file_or_data;
+
+			//convert to ANSI encoding on Windows
+			#if defined(_WIN32)
+				std::unique_ptr<char[]> u_p = EncodingConvert(file_or_data, CP_UTF8, CP_ACP);
+				segment->source_path = u_p.get();
+			#endif
+		}
+
+		// filled on the threadpool before the upload starts
+		const char *temp_error = NULL;
+		int fd = CreateUploadTempFile(upload_callbacks, &temp_error);
+		if (fd == -1)
+		{
+			ReleaseTransfer(upload_callbacks);
+			return Nan::ThrowError(temp_error);
+		}
+		close(fd);
+
+		segment->target_path = upload_callbacks->temp_file_path;
+		file_path = upload_callbacks->temp_file_path.c_str();
+	}
+	else if (is_file_path)
+	{
+		file_path = file_or_data;
+
+		//convert to ANSI encoding on Windows
+		#if defined(_WIN32)
+			std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
+			file_path = u_p.get();
+		#endif
+	}
+	else
+	{
+		const char *temp_error = NULL;
+		int fd = CreateUploadTempFile(upload_callbacks, &temp_error);
+		if (fd == -1)
+		{
+			ReleaseTransfer(upload_callbacks);
+			return Nan::ThrowError(temp_error);
+		}
+
+		size_t len = strlen(file_or_data);
+		if (write(fd, file_or_data, len) != 
+		#ifdef _WIN32
+			(int)len
+		#else
+			(ssize_t)len
+		#endif
+		)
+		{
+			close(fd);
+			ReleaseTransfer(upload_callbacks);
+			return Nan::ThrowError("Write data to file failed");
+		}
+		close(fd);
+		file_path = upload_callbacks->temp_file_path.c_str();
+	}
+
+	FILE *fd = fopen(file_path, "rb");
+
+	if (!fd)
+	{
+		v8::Local<v8::String> msg = Nan::New("Unable to open file").ToLocalChecked();
+		v8::Local<v8::Value> error = Nan::Error(msg);
+
+		v8::Local<v8::Value> argv[] = {
+			error,
+			Nan::Null(),
+			Nan::Null(),
+			Nan::Null() };
+
+		Nan::Call(*(upload_callbacks->finished_callback), 4, argv);
+		ReleaseTransfer(upload_callbacks);
+
+		return;
+	}
+
+	AdviseSequentialRead(fd);
+
+	if (upload_callbacks->drop_cache)
+	{
+		struct stat st;
+		upload_callbacks->cache_fd = fileno(fd);
+		upload_callbacks->cache_size = fstat(fileno(fd), &st) ? 0 : (uint64_t)st.st_size;
+		if (segment)
+		{
+			upload_callbacks->cache_size = segment->length;
+		}
+	}
+
+	genaro_upload_opts_t upload_opts = {};
+	upload_opts.prepare_frame_limit = 1,
+	upload_opts.push_frame_limit = 64;
+	upload_opts.push_shard_limit = 64;
+	upload_opts.rs = true;
+	upload_opts.bucket_id = bucket_id_dup;
+	upload_opts.file_name = file_name_dup;
+	upload_opts.fd = fd;
+
+	Nan::Utf8String index_str(options->Get(Nan::New("index").ToLocalChecked()));
+	const char *index = *index_str;
+	const char *index_dup = upload_callbacks->Own(strdup(index));
+
+	Nan::Utf8String key_str(options->Get(Nan::New("key").ToLocalChecked()));
+	const char *key = *key_str;
+	const char *key_dup = upload_callbacks->Own(strdup(key));
+
+	Nan::Utf8String ctr_str(options->Get(Nan::New("ctr").ToLocalChecked()));
+	const char *ctr = *ctr_str;
+	const char *ctr_dup = upload_callbacks->Own(strdup(ctr));
+
+	genaro_key_ctr_as_str_t *key_ctr = upload_callbacks->Own((genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t)));
+	key_ctr->key_as_str = key_dup;
+	key_ctr->ctr_as_str = ctr_dup;
+
+	Nan::Utf8String rsa_key_str(options->Get(Nan::New("rsaKey").ToLocalChecked()));
+	const char *rsa_key = *rsa_key_str;
+	const char *rsa_key_dup = upload_callbacks->Own(strdup(rsa_key));
+
+	Nan::Utf8String rsa_ctr_str(options->Get(Nan::New("rsaCtr").ToLocalChecked()));
+	const char *rsa_ctr = *rsa_ctr_str;
+	const char *rsa_ctr_dup = upload_callbacks->Own(strdup(rsa_ctr));
+
+	genaro_key_ctr_as_str_t *rsa_key_ctr_as_str = upload_callbacks->Own((genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t)));
+	rsa_key_ctr_as_str->key_as_str = rsa_key_dup;
+	rsa_key_ctr_as_str->ctr_as_str = rsa_ctr_dup;
+
+	struct stat file_stat;
+	uint64_t file_size = fstat(fileno(fd), &file_stat) ? 0 : (uint64_t)file_stat.st_size;
+	if (segment)
+	{
+		file_size = segment->length;
+	}
+
+	upload_callbacks->finished_argc = 4;
+	upload_callbacks->memory = EstimateUploadMemory(file_size, &upload_opts);
+
+	upload_callbacks->start = [=]() -> const char * {
+		genaro_upload_opts_t opts = upload_opts;
+		genaro_upload_state_t *state = NULL;
+		int error_status = 0;
+
+		RunOnIoThread(ctx, [&]() {
+			state = genaro_bridge_store_file(env, &opts,
+				index_dup,
+				key_ctr,
+				rsa_key_ctr_as_str,
+				(void *)upload_callbacks,
+				StoreFileProgressCallback,
+				StoreFileFinishedCallback);
+
+			if (state && !(error_status = state->error_status))
+			{
+				upload_callbacks->state = state;
+			}
+		});
+
+		if (!state)
+		{
+			return "Unable to create upload state";
+		}
+
+		if (error_status)
+		{
+			return "Unable to queue file upload";
+		}
+
+		IoRequestStarted(ctx);
+		return NULL;
+	};
+
+	upload_callbacks->cancel = [upload_callbacks]() {
+		genaro_bridge_store_file_cancel((genaro_upload_state_t *)upload_callbacks->state);
+	};
+
+	upload_callbacks->discard = [=]() {
+		RemoveUploadingTask(ctx->addon, bucket_id_dup, file_name_dup);
+		fclose(fd);
+	};
+
+	AddUploadingTask(ctx->addon, bucket_id_dup, file_name_dup);
+
+	if (segment)
+	{
+		if (dedupe)
+		{
+			upload_callbacks->dedupe_bucket_id = bucket_id_dup;
+		}
+		segment->dedupe = dedupe;
+		QueueSegmentCopy(ctx, upload_callbacks, segment.release());
+	}
+	else if (dedupe)
+	{
+		upload_callbacks->dedupe_bucket_id = bucket_id_dup;
+		QueueDedupeHash(ctx, upload_callbacks, file_path);
+	}
+	else
+	{
+		const char *start_error = StartOrQueueTransfer(ctx, upload_callbacks);
+		if (start_error)
+		{
+			ReleaseTransfer(upload_callbacks);
+			return Nan::ThrowError(start_error);
+		}
+	}
+
+	args.GetReturnValue().Set(NewStateObject(upload_callbacks, StateStatusErrorGetter<genaro_upload_state_t>));
+}
+
+void StoreFileCancel(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+
+	v8::Local<v8::Object> state_local = args[0].As<v8::Object>();
+	if (state_local->IsNullOrUndefined())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+
+	transfer_callbacks_t *upload_callbacks = (transfer_callbacks_t *)state_local->GetAlignedPointerFromInternalField(0);
+	if (UnqueueTransfer(upload_callbacks->ctx, upload_callbacks))
+	{
+		upload_callbacks->error_status = GENARO_TRANSFER_CANCELED;
+		DeliverStoreFileFinished(GENARO_TRANSFER_CANCELED, NULL, 0, NULL, upload_callbacks);
+		return;
+	}
+
+	RunOnIoThread(upload_callbacks->ctx, [&]() {
+		if (upload_callbacks->state)
+		{
+			genaro_bridge_store_file_cancel((genaro_upload_state_t *)upload_callbacks->state);
+		}
+	});
+}
+
+// file_path is where the download ended up, which is next to the file
+// asked for if replacing that was refused
+void DeliverResolveFileFinished(int status, const char *finish_error, uint64_t file_bytes, char *sha256, const char *file_path, void *handle)
+{
+	Nan::HandleScope scope;
+
+	transfer_callbacks_t *download_callbacks = (transfer_callbacks_t *)handle;
+	Nan::Callback *callback = download_callbacks->finished_callback;
+
+	download_callbacks->ctx->transfers.remove(download_callbacks);
+	ReleaseTransferMemory(download_callbacks->ctx, download_callbacks);
+	DrainTransferQueue(download_callbacks->ctx);
+
+	v8::Local<v8::Value> file_bytes_local = Nan::Null();
+	v8::Local<v8::Value> sha256_local = Nan::Null();
+	v8::Local<v8::Value> file_path_local = Nan::Null();
+	if (status == 0 && !finish_error)
+	{
+		file_bytes_local = Nan::New((double)file_bytes);
+		sha256_local = Nan::New(sha256).ToLocalChecked();
+		file_path_local = Nan::New(file_path).ToLocalChecked();
+	}
+
+	v8::Local<v8::Value> error = Nan::Null();
+	if (finish_error)
+	{
+		v8::Local<v8::String> msg = Nan::New(finish_error).ToLocalChecked();
+		error = Nan::Error(msg);
+	}
+	else
+	{
+		error = TransferError(download_callbacks, status);
+	}
+
+	v8::Local<v8::Value> argv[] = {
+		error,
+		file_bytes_local,
+		sha256_local,
+		file_path_local };
+
+	Nan::Call(*callback, 4, argv);
+
+	free(sha256);
+	ReleaseTransfer(download_callbacks);
+}
+
+// what is left of a download once libgenaro is done with it, the
+// syscalls of which run on the threadpool
+typedef struct
+{
+	uv_work_t req;
+	transfer_callbacks_t *callbacks;
+	int status;
+	char *file_name;
+	char *temp_file_name;
+	// where the download was renamed to
+	std::string final_file_name;
+	FILE *fd;
+	uint64_t file_bytes;
+	char *sha256;
+	bool durable;
+	bool drop_cache;
+	const char *finish_error;
+} download_finish_work_t;
+
+int SyncFile(FILE *fd)
+{
+	if (fflush(fd))
+	{
+		return -1;
+	}
+#if defined(_WIN32)
+	return _commit(_fileno(fd));
+#else
+	return fsync(fileno(fd));
+#endif
+}
+
+// makes a rename into the directory of path durable, windows has no
+// such thing and MOVEFILE_WRITE_THROUGH covers it
+int SyncParentDirectory(const char *path)
+{
+#if defined(_WIN32)
+	return 0;
+#else
+	std::string dir(path);
+	size_t slash = dir.rfind('/');
+	dir = slash == std::string::npos ? "." : (slash ? dir.substr(0, slash) : "/");
+
+	int fd = open(dir.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	int ret = fsync(fd);
+	close(fd);
+
+	return ret;
+#endif
+}
+
+// moves from over to, replacing to in one step if it exists
+int ReplaceFile(const char *from, const char *to, bool durable)
+{
+#if defined(_WIN32)
+	DWORD flags = MOVEFILE_REPLACE_EXISTING | (durable ? MOVEFILE_WRITE_THROUGH : 0);
+	return MoveFileExA(from, to, flags) ? 0 : -1;
+#else
+	return rename(from, to);
+#endif
+}
+
+// "name (n).ext" next to file_name with n up to 9 that is not taken
+// yet, empty if there is none
+std::string FreeFileName(const char *file_name)
+{
+#ifndef _WIN32
+	std::string path(file_name);
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+	std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+#else
+	char drive[_MAX_DRIVE];
+	char dir_part[_MAX_DIR];
+	char fname[_MAX_FNAME];
+	char ext[_MAX_EXT];
+
+	_splitpath(file_name, drive, dir_part, fname, ext);
+	std::string dir = std::string(drive) + dir_part;
+	std::string base = std::string(fname) + ext;
+#endif
+
+	for (int index = 1; index < 10; index++)
+	{
+		char extra[8];
+		sprintf(extra, " (%d)", index);
+		char *new_name = RetrieveNewName(base.c_str(), extra);
+		if (new_name == NULL)
+		{
+			break;
+		}
+
+		std::string candidate = dir + new_name;
+		free(new_name);
+
+		if (access(candidate.c_str(), F_OK) == -1)
+		{
+			return candidate;
+		}
+	}
+
+	return "";
+}
+
+void FinishDownloadWork(uv_work_t *req)
+{
+	download_finish_work_t *work = (download_finish_work_t *)req->data;
+
+	bool synced = true;
+	if (work->fd)
+	{
+		if (work->status == 0 && work->durable && SyncFile(work->fd))
+		{
+			synced = false;
+		}
+		if (work->status == 0 && work->drop_cache)
+		{
+			DropFileCache(work->fd);
+		}
+		if (fclose(work->fd))
+		{
+			synced = false;
+		}
+	}
+
+	if (work->status != 0)
+	{
+		// download failed, delete the temp file.
+		unlink(work->temp_file_name);
+		return;
+	}
+
+	if (!synced)
+	{
+		work->finish_error = "File sync error";
+		unlink(work->temp_file_name);
+		return;
+	}
+
+	// an existing file is replaced by the rename itself, so there is no
+	// moment without either version. Only if that is refused the
+	// download goes next to it.
+	std::string final_file_name = work->file_name;
+	if (ReplaceFile(work->temp_file_name, final_file_name.c_str(), work->durable))
+	{
+		final_file_name = FreeFileName(work->file_name);
+		if (final_file_name.empty() || ReplaceFile(work->temp_file_name, final_file_name.c_str(), work->durable))
+		{
+			work->finish_error = "File rename error";
+			unlink(work->temp_file_name);
+			return;
+		}
+	}
+
+	work->final_file_name = final_file_name;
+	if (work->durable && SyncParentDirectory(final_file_name.c_str()))
+	{
+		work->finish_error = "File sync error";
+	}
+}
+
+void AfterFinishDownloadWork(uv_work_t *req, int status)
+{
+	download_finish_work_t *work = (download_finish_work_t *)req->data;
+	env_context_t *ctx = work->callbacks->ctx;
+
+	// only now may another download write to the same temp file
+	RemoveDownloadingTask(ctx->addon, work->file_name);
+	free(work->file_name);
+	free(work->temp_file_name);
+
+	DeliverResolveFileFinished(work->status, work->finish_error, work->file_bytes, work->sha256, work->final_file_name.c_str(), work->callbacks);
+
+	PoolJobFinished(ctx);
+	delete work;
+}
+
+void QueueFinishDownload(download_finish_work_t *work)
+{
+	QueuePoolJob(work->callbacks->ctx, &work->req, FinishDownloadWork, AfterFinishDownloadWork);
+}
+
+// runs where libgenaro runs, which is the io thread if there is one
+void ResolveFileFinishedCallback(int status, const char *file_name, const char *temp_file_name, FILE *fd, uint64_t file_bytes, char *sha256, void *handle)
+{
+	transfer_callbacks_t *download_callbacks = (transfer_callbacks_t *)handle;
+
+	// the state is freed by libgenaro once this returns
+	download_callbacks->state = NULL;
+	download_callbacks->finished = true;
+	download_callbacks->error_status = status;
+
+	download_finish_work_t *work = new download_finish_work_t();
+	work->req.data = work;
+	work->callbacks = download_callbacks;
+	work->status = status;
+	work->file_name = (char *)file_name;
+	work->temp_file_name = (char *)temp_file_name;
+	work->fd = fd;
+	work->file_bytes = file_bytes;
+	work->sha256 = sha256;
+	work->durable = download_callbacks->durable;
+	work->drop_cache = download_callbacks->drop_cache;
+	work->finish_error = NULL;
+
+	// the threadpool is queued to from the js thread
+	if (DeferToJsThread(download_callbacks->ctx, std::bind(QueueFinishDownload, work), true))
+	{
+		return;
+	}
+
+	QueueFinishDownload(work);
+}
+
+void ResolveFileCancel(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+
+	v8::Local<v8::Object> state_local = args[0].As<v8::Object>();
+	if (state_local->IsNullOrUndefined())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+
+	transfer_callbacks_t *download_callbacks = (transfer_callbacks_t *)state_local->GetAlignedPointerFromInternalField(0);
+	if (UnqueueTransfer(download_callbacks->ctx, download_callbacks))
+	{
+		download_callbacks->error_status = GENARO_TRANSFER_CANCELED;
+		DeliverResolveFileFinished(GENARO_TRANSFER_CANCELED, NULL, 0, NULL, NULL, download_callbacks);
+		return;
+	}
+
+	RunOnIoThread(download_callbacks->ctx, [&]() {
+		if (download_callbacks->state)
+		{
+			genaro_bridge_resolve_file_cancel((genaro_download_state_t *)download_callbacks->state);
+		}
+	});
+}
+
+void ResolveFileProgressCallback(double progress, uint64_t file_bytes, void *handle)
+{
+	transfer_callbacks_t *download_callbacks = (transfer_callbacks_t *)handle;
+	if (DeferProgress(download_callbacks, progress, file_bytes, ResolveFileProgressCallback))
+	{
+		return;
+	}
+
+	Nan::HandleScope scope;
+
+	if (!download_callbacks->size_known && file_bytes)
+	{
+		download_callbacks->size_known = true;
+		UpdateTransferMemory(download_callbacks->ctx, download_callbacks, EstimateDownloadMemory(file_bytes));
+	}
+
+	DropTransferCache(download_callbacks, progress, file_bytes, true);
+
+	Nan::Callback *callback = download_callbacks->progress_callback;
+
+	v8::Local<v8::Number> progress_local = Nan::New(progress);
+	v8::Local<v8::Number> file_bytes_local = Nan::New((double)file_bytes);
+
+	v8::Local<v8::Value> argv[] = {
+		progress_local,
+		file_bytes_local };
+
+	Nan::Call(*callback, 2, argv);
+}
+
+void ResolveFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 4)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+
+	Nan::Utf8String bucket_id_str(args[0]);
+	const char *bucket_id = *bucket_id_str;
+	const char *bucket_id_dup = strdup(bucket_id);
+
+	Nan::Utf8String file_id_str(args[1]);
+	const char *file_id = *file_id_str;
+	const char *file_id_dup = strdup(file_id);
+
+	Nan::Utf8String file_path_str(args[2]);
+	const char *file_path = *file_path_str;
+
+	//convert to ANSI encoding on Win32, add on 2018.5.9
+#if defined(_WIN32)
+	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
+	const char *file_path_dup = strdup(u_p.get());
+#else
+	const char *file_path_dup = strdup(file_path);
+#endif
+
+	v8::Local<v8::Object> options = args[3].As<v8::Object>();
+
+	bool hasKey = Nan::HasOwnProperty(options, Nan::New("key").ToLocalChecked()).FromJust();
+	bool hasCtr = Nan::HasOwnProperty(options, Nan::New("ctr").ToLocalChecked()).FromJust();
+
+	const char *key = NULL;
+	const char *ctr = NULL;
+	const char *key_dup = NULL;
+	const char *ctr_dup = NULL;
+	if (hasKey && hasCtr)
+	{
+		Nan::Utf8String key_str(options->Get(Nan::New("key").ToLocalChecked()));
+		key = *key_str;
+
+		if (key && key[0] != '\0')
+		{
+			key_dup = strdup(key);
+		}
+
+		Nan::Utf8String ctr_str(options->Get(Nan::New("ctr").ToLocalChecked()));
+		ctr = *ctr_str;
+
+		if (ctr && ctr[0] != '\0')
+		{
+			ctr_dup = strdup(ctr);
+		}
+	}
+
+	genaro_key_ctr_as_str_t *key_ctr_as_str = NULL;
+
+	if (key_dup && ctr_dup)
+	{
+		key_ctr_as_str = (genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t));
+		key_ctr_as_str->key_as_str = key_dup;
+		key_ctr_as_str->ctr_as_str = ctr_dup;
+	}
+
+	transfer_callbacks_t *download_callbacks = NewTransferCallbacks(ctx, options);
+	download_callbacks->Own(bucket_id_dup);
+	download_callbacks->Own(file_id_dup);
+	download_callbacks->Own(key_dup);
+	download_callbacks->Own(ctr_dup);
+	download_callbacks->Own(key_ctr_as_str);
+
+	if (!ParseIoMode(options, download_callbacks))
+	{
+		free((void *)file_path_dup);
+		ReleaseTransfer(download_callbacks);
+		return Nan::ThrowError("Unknown ioMode");
+	}
+
+	if (IsDownloading(ctx->addon, file_path_dup))
+	{
+		v8::Local<v8::String> msg = Nan::New("File is already downloading").ToLocalChecked();
+		v8::Local<v8::Value> error = Nan::Error(msg);
+
+		v8::Local<v8::Value> argv[] = {
+			error,
+			Nan::Null(),
+			Nan::Null() };
+
+		Nan::Call(*(download_callbacks->finished_callback), 3, argv);
+		free((void *)file_path_dup);
+		ReleaseTransfer(download_callbacks);
+
+		return;
+	}
+
+	Nan::MaybeLocal<v8::Value> overwriteOption = options->Get(Nan::New("overwrite").ToLocalChecked());
+
+	bool overwrite = false;
+	if (!overwriteOption.IsEmpty())
+	{
+		overwrite = Nan::To<bool>(overwriteOption.ToLocalChecked()).FromJust();
+	}
+
+	Nan::MaybeLocal<v8::Value> decryptOption = options->Get(Nan::New("decrypt").ToLocalChecked());
+
+	bool decrypt = true;
+	if (!decryptOption.IsEmpty())
+	{
+		decrypt = Nan::To<bool>(decryptOption.ToLocalChecked()).FromJust();
+	}
+
+	Nan::MaybeLocal<v8::Value> fsyncOption = options->Get(Nan::New("fsync").ToLocalChecked());
+	if (!fsyncOption.IsEmpty())
+	{
+		download_callbacks->durable = Nan::To<bool>(fsyncOption.ToLocalChecked()).FromJust();
+	}
+
+	FILE *fd = NULL;
+
+	if (access(file_path_dup, F_OK) != -1)
+	{
+		if (!overwrite)
+		{
+			v8::Local<v8::String> msg = Nan::New("File already exists").ToLocalChecked();
+			v8::Local<v8::Value> error = Nan::Error(msg);
+
+			v8::Local<v8::Value> argv[] = {
+				error,
+				Nan::Null(),
+				Nan::Null() };
+
+			Nan::Call(*(download_callbacks->finished_callback), 3, argv);
+			free((void *)file_path_dup);
+			ReleaseTransfer(download_callbacks);
+
+			return;
+		}
+	}
+
+	const char *temp_file_name = str_concat_many(2, file_path_dup, ".genarotmp");
+
+	fd = fopen(temp_file_name, "wb+");
+
+	if (fd == NULL)
+	{
+		v8::Local<v8::String> msg = Nan::New(strerror(errno)).ToLocalChecked();
+		v8::Local<v8::Value> error = Nan::Error(msg);
+
+		v8::Local<v8::Value> argv[] = {
+			error,
+			Nan::Null(),
+			Nan::Null() };
+
+		Nan::Call(*(download_callbacks->finished_callback), 3, argv);
+		free((void *)file_path_dup);
+		free((void *)temp_file_name);
+		ReleaseTransfer(download_callbacks);
+
+		return;
+	}
+
+	// the size from the bridge, if the caller has it, lets the whole
+	// file be reserved up front
+	Nan::MaybeLocal<v8::Value> sizeOption = options->Get(Nan::New("size").ToLocalChecked());
+	if (!sizeOption.IsEmpty() && sizeOption.ToLocalChecked()->IsNumber())
+	{
+		double size = Nan::To<double>(sizeOption.ToLocalChecked()).FromJust();
+		PreallocateFile(fd, size > 0 ? (uint64_t)size : 0);
+		download_callbacks->cache_size = size > 0 ? (uint64_t)size : 0;
+	}
+	download_callbacks->cache_fd = fileno(fd);
+
+	download_callbacks->finished_argc = 3;
+	download_callbacks->memory = EstimateDownloadMemory(0);
+
+	download_callbacks->start = [=]() -> const char * {
+		genaro_download_state_t *state = NULL;
+		int error_status = 0;
+
+		RunOnIoThread(ctx, [&]() {
+			state = genaro_bridge_resolve_file(env,
+											bucket_id_dup,
+											file_id_dup,
+											key_ctr_as_str,
+											file_path_dup,
+											temp_file_name,
+											fd,
+											decrypt,
+											(void *)download_callbacks,
+											ResolveFileProgressCallback,
+											ResolveFileFinishedCallback);
+
+			if (state && !(error_status = state->error_status))
+			{
+				download_callbacks->state = state;
+			}
+		});
+
+		if (!state)
+		{
+			return "Unable to create download state";
+		}
+
+		if (error_status)
+		{
+			return "Unable to queue file download";
+		}
+
+		IoRequestStarted(ctx);
+		return NULL;
+	};
+
+	download_callbacks->cancel = [download_callbacks]() {
+		genaro_bridge_resolve_file_cancel((genaro_download_state_t *)download_callbacks->state);
+	};
+
+	// the finished callback frees the paths once libgenaro has them
+	download_callbacks->discard = [=]() {
+		RemoveDownloadingTask(ctx->addon, file_path_dup);
+		fclose(fd);
+		unlink(temp_file_name);
+		free((void *)file_path_dup);
+		free((void *)temp_file_name);
+	};
+
+	AddDownloadingTask(ctx->addon, file_path_dup);
+
+	const char *start_error = StartOrQueueTransfer(ctx, download_callbacks);
+	if (start_error)
+	{
+		ReleaseTransfer(download_callbacks);
+		return Nan::ThrowError(start_error);
+	}
+
+	args.GetReturnValue().Set(NewStateObject(download_callbacks, StateStatusErrorGetter<genaro_download_state_t>));
+}
+
+// decrypt the downloaded but not decrypted file
+void DecryptFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 3)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String file_path_str(args[0]);
+	const char *file_path = *file_path_str;
+
+	//convert to ANSI encoding on Win32
+#if defined(_WIN32)
+	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
+	file_path = u_p.get();
+#endif
+
+	Nan::Utf8String key_str(args[1]);
+	const char *key = *key_str;
+	Nan::Utf8String ctr_str(args[2]);
+	const char *ctr = *ctr_str;
+
+	genaro_key_ctr_as_str_t *key_ctr_as_str = NULL;
+	key_ctr_as_str = (genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t));
+	key_ctr_as_str->key_as_str = key;
+	key_ctr_as_str->ctr_as_str = ctr;
+
+	char *decryptedMeta = genaro_decrypt_file(env, file_path, key_ctr_as_str);
+	free((void *)key_ctr_as_str);
+
+	if (!decryptedMeta) {
+		return;
+	}
+
+	// return the decrypted meta
+	args.GetReturnValue().Set(Nan::New(decryptedMeta).ToLocalChecked());
+	free(decryptedMeta);
+}
+
+// TODO: this is the same as DeleteBucketCallback; refactor
+void DeleteFileCallback(uv_work_t *work_req, int status)
+{
+	json_request_t *req = (json_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(DeleteFileCallback, work_req, status), true))
+	{
+		return;
+	}
+
+	ForgetReads(callbacks);
+
+	Nan::HandleScope scope;
+
+	Nan::Callback *callback = callbacks->callback;
+	v8::Local<v8::Value> error = Nan::Null();
+
+	if (error_and_status_check<json_request_t>(req, &error) && callbacks->succeeded)
+	{
+		callbacks->succeeded();
+	}
+
+	v8::Local<v8::Value> argv[] = {
+		error };
+
+	Nan::Call(*callback, 1, argv);
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void DeleteFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 3 || !args[2]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String bucket_id_str(args[0]);
+	const char *bucket_id = *bucket_id_str;
+	const char *bucket_id_dup = strdup(bucket_id);
+
+	Nan::Utf8String file_id_str(args[1]);
+	const char *file_id = *file_id_str;
+	const char *file_id_dup = strdup(file_id);
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	request_callbacks_t *callbacks = NewRequestCallbacks(ctx, args[2].As<v8::Function>());
+	callbacks->Own(bucket_id_dup);
+	callbacks->Own(file_id_dup);
+	callbacks->invalidates.push_back(std::string("listFiles/") + bucket_id);
+
+	if (ctx->dedupe_index)
+	{
+		callbacks->succeeded = [ctx, bucket_id_dup, file_id_dup]() {
+			RemoveDedupeFile(ctx->dedupe_index, bucket_id_dup, file_id_dup);
+		};
+	}
+
+	IoRequestStarted(ctx);
+	RunOnIoThread(ctx, [&]() {
+		genaro_bridge_delete_file(env, bucket_id_dup, file_id_dup, (void *)callbacks, DeleteFileCallback);
+	});
+}
+
+void EncryptMeta(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String meta_str(args[0]);
+	const char *meta = *meta_str;
+
+	char *encrypted_meta = genaro_encrypt_meta(env, meta);
+
+	if (encrypted_meta)
+	{
+		// return the encrypted meta.
+		args.GetReturnValue().Set(Nan::New(encrypted_meta).ToLocalChecked());
+		free(encrypted_meta);
+	}
+}
+
+// writes the encrypted meta to file_path, false if either step failed
+bool EncryptMetaToPath(genaro_env_t *env, const char *meta, const char *file_path)
+{
+	char *encrypted_meta = genaro_encrypt_meta(env, meta);
+	if (!encrypted_meta)
+	{
+		return false;
+	}
+
+	bool ret = false;
+	FILE *fd = fopen(file_path, "wb+");
+	if (fd)
+	{
+		size_t length = strlen(encrypted_meta);
+		ret = fwrite(encrypted_meta, sizeof(char), length, fd) == length;
+		ret = !fclose(fd) && ret;
+	}
+	free(encrypted_meta);
+
+	return ret;
+}
+
+// decrypts the contents of file_path, NULL if it can not be read or
+// decrypted. The file is mapped instead of read where possible.
+char *DecryptMetaFromPath(genaro_env_t *env, const char *file_path)
+{
+#if !defined(_WIN32)
+	int fd = open(file_path, O_RDONLY);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	size_t fsize = (size_t)st.st_size;
+	if (!fsize)
+	{
+		close(fd);
+		return genaro_decrypt_meta(env, "");
+	}
+
+	void *map = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	char *decrypted_meta = NULL;
+	static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	if (fsize % page_size)
+	{
+		// the rest of the last page reads as zeros, which ends the string
+		decrypted_meta = genaro_decrypt_meta(env, (const char *)map);
+	}
+	else
+	{
+		char *buffer = (char *)malloc(fsize + 1);
+		if (buffer)
+		{
+			memcpy(buffer, map, fsize);
+			buffer[fsize] = '\0';
+			decrypted_meta = genaro_decrypt_meta(env, buffer);
+			free(buffer);
+		}
+	}
+
+	munmap(map, fsize);
+
+	return decrypted_meta;
+#else
+	FILE *fp = fopen(file_path, "rb");
+	if (fp == NULL)
+	{
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size_t fsize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *buffer = (char *)calloc(fsize + 1, sizeof(char));
+	if (buffer == NULL)
+	{
+		fclose(fp);
+		return NULL;
+	}
+
+	size_t read_bytes = 0;
+	while (read_bytes < fsize && !feof(fp) && !ferror(fp))
+	{
+		size_t bytes = fread(buffer + read_bytes, 1, fsize - read_bytes, fp);
+		if (bytes == 0)
+		{
+			break;
+		}
+		read_bytes += bytes;
+	}
+
+	int error = ferror(fp);
+	fclose(fp);
+
+	if (error)
+	{
+		free(buffer);
+		return NULL;
+	}
+
+	char *decrypted_meta = genaro_decrypt_meta(env, buffer);
+	free(buffer);
+
+	return decrypted_meta;
+#endif
+}
+
+void EncryptMetaToFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 2)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String meta_str(args[0]);
+	const char *meta = *meta_str;
+
+	Nan::Utf8String file_path_str(args[1]);
+	const char *file_path = *file_path_str;
+
+	//convert to ANSI encoding on Win32
+#if defined(_WIN32)
+	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
+	file_path = u_p.get();
+#endif
+
+	args.GetReturnValue().Set(Nan::New(EncryptMetaToPath(env, meta, file_path)));
+}
+
+void DecryptMeta(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String encrypted_meta_str(args[0]);
+	const char *encrypted_meta = *encrypted_meta_str;
+
+	char *decrypted_meta = genaro_decrypt_meta(env, encrypted_meta);
+
+	if (decrypted_meta)
+	{
+		// return the decrypted meta.
+		args.GetReturnValue().Set(Nan::New(decrypted_meta).ToLocalChecked());
+		free(decrypted_meta);
+	}
+}
+
+void DecryptMetaFromFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String file_path_str(args[0]);
+	const char *file_path = *file_path_str;
+
+	//convert to ANSI encoding on Win32
+#if defined(_WIN32)
+	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
+	file_path = u_p.get();
+#endif
+
+	char *decrypted_meta = DecryptMetaFromPath(env, file_path);
+
+	if (decrypted_meta) {
+		args.GetReturnValue().Set(Nan::New(decrypted_meta).ToLocalChecked());
+		free(decrypted_meta);
+	}
+}
+
+typedef enum
+{
+	META_ENCRYPT,
+	META_DECRYPT,
+	META_ENCRYPT_TO_FILES,
+	META_DECRYPT_FROM_FILES
+} meta_batch_op_t;
+
+// the metas or files of one batch call, split into slices each handled
+// by a job of their own
+typedef struct
+{
+	env_context_t *ctx;
+	genaro_env_t *env;
+	meta_batch_op_t op;
+	std::vector<std::string> paths;
+	// the input metas, replaced with the results
+	std::vector<std::string> metas;
+	// not vector<bool>, the jobs write next to each other
+	std::vector<char> succeeded;
+	int pending_jobs;
+	Nan::Callback *callback;
+} meta_batch_t;
+
+typedef struct
+{
+	uv_work_t req;
+	meta_batch_t *batch;
+	size_t begin;
+	size_t end;
+} meta_batch_work_t;
+
+// as many jobs as the threadpool has threads, it is cpu bound work
+size_t ThreadpoolSize()
+{
+	const char *size = getenv("UV_THREADPOOL_SIZE");
+	int threads = size ? atoi(size) : 0;
+	return threads > 0 ? (size_t)threads : 4;
+}
+
+void MetaBatchWork(uv_work_t *req)
+{
+	meta_batch_work_t *work = (meta_batch_work_t *)req->data;
+	meta_batch_t *batch = work->batch;
+
+	for (size_t i = work->begin; i < work->end; i++)
+	{
+		char *result = NULL;
+		switch (batch->op)
+		{
+		case META_ENCRYPT:
+			result = genaro_encrypt_meta(batch->env, batch->metas[i].c_str());
+			break;
+		case META_DECRYPT:
+			result = genaro_decrypt_meta(batch->env, batch->metas[i].c_str());
+			break;
+		case META_ENCRYPT_TO_FILES:
+			batch->succeeded[i] = EncryptMetaToPath(batch->env, batch->metas[i].c_str(), batch->paths[i].c_str());
+			continue;
+		case META_DECRYPT_FROM_FILES:
+			result = DecryptMetaFromPath(batch->env, batch->paths[i].c_str());
+			break;
+		}
+
+		if (result)
+		{
+			batch->metas[i] = result;
+			batch->succeeded[i] = true;
+			free(result);
+		}
+	}
+}
+
+void AfterMetaBatchWork(uv_work_t *req, int status)
+{
+	meta_batch_work_t *work = (meta_batch_work_t *)req->data;
+	meta_batch_t *batch = work->batch;
+	env_context_t *ctx = batch->ctx;
+	delete work;
+
+	if (--batch->pending_jobs)
+	{
+		PoolJobFinished(ctx);
+		return;
+	}
+
+	Nan::HandleScope scope;
+
+	v8::Local<v8::Array> results = Nan::New<v8::Array>((int)batch->metas.size());
+	for (size_t i = 0; i < batch->metas.size(); i++)
+	{
+		if (batch->op == META_ENCRYPT_TO_FILES)
+		{
+			results->Set((uint32_t)i, Nan::New<v8::Boolean>(batch->succeeded[i] != 0));
+		}
+		else if (batch->succeeded[i])
+		{
+			results->Set((uint32_t)i, Nan::New(batch->metas[i]).ToLocalChecked());
+		}
+		else
+		{
+			results->Set((uint32_t)i, Nan::Null());
+		}
+	}
+
+	v8::Local<v8::Value> argv[] = {
+		Nan::Null(),
+		results };
+
+	Nan::Call(*(batch->callback), 2, argv);
+
+	// after the callback, which may have destroyed the env meanwhile
+	PoolJobFinished(ctx);
+	delete batch->callback;
+	delete batch;
+}
+
+void QueueMetaBatch(meta_batch_t *batch)
+{
+	// an empty batch still takes one job, so the callback never runs
+	// before the call returns
+	size_t jobs = std::max(std::min(batch->metas.size(), ThreadpoolSize()), (size_t)1);
+
+	batch->succeeded.resize(batch->metas.size(), 0);
+	batch->pending_jobs = (int)jobs;
+	size_t slice = (batch->metas.size() + jobs - 1) / jobs;
+	for (size_t i = 0; i < jobs; i++)
+	{
+		meta_batch_work_t *work = new meta_batch_work_t();
+		work->req.data = work;
+		work->batch = batch;
+		work->begin = i * slice;
+		work->end = std::min(work->begin + slice, batch->metas.size());
+		QueuePoolJob(batch->ctx, &work->req, MetaBatchWork, AfterMetaBatchWork);
+	}
+}
+
+std::string MetaFilePath(v8::Local<v8::Value> value)
+{
+	Nan::Utf8String file_path_str(value);
+
+	//convert to ANSI encoding on Win32
+#if defined(_WIN32)
+	std::unique_ptr<char[]> u_p = EncodingConvert(*file_path_str, CP_UTF8, CP_ACP);
+	return u_p.get();
+#else
+	return *file_path_str;
+#endif
+}
+
+// encryptMetaToFile for every pair of meta and path on the threadpool
+void EncryptMetaToFiles(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 3 || !args[0]->IsArray() || !args[1]->IsArray() || !args[2]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	v8::Local<v8::Array> metas = args[0].As<v8::Array>();
+	v8::Local<v8::Array> paths = args[1].As<v8::Array>();
+	if (metas->Length() != paths->Length())
+	{
+		return Nan::ThrowError("Expected a path for every meta");
+	}
+
+	meta_batch_t *batch = new meta_batch_t();
+	batch->ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	batch->env = env;
+	batch->op = META_ENCRYPT_TO_FILES;
+	for (uint32_t i = 0; i < paths->Length(); i++)
+	{
+		Nan::Utf8String meta_str(metas->Get(i));
+		batch->metas.push_back(*meta_str);
+		batch->paths.push_back(MetaFilePath(paths->Get(i)));
+	}
+	batch->callback = new Nan::Callback(args[2].As<v8::Function>());
+
+	QueueMetaBatch(batch);
+}
+
+// decryptMetaFromFile for every path on the threadpool
+void DecryptMetaFromFiles(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 2 || !args[0]->IsArray() || !args[1]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	v8::Local<v8::Array> paths = args[0].As<v8::Array>();
+
+	meta_batch_t *batch = new meta_batch_t();
+	batch->ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	batch->env = env;
+	batch->op = META_DECRYPT_FROM_FILES;
+	for (uint32_t i = 0; i < paths->Length(); i++)
+	{
+		batch->paths.push_back(MetaFilePath(paths->Get(i)));
+	}
+	batch->metas.resize(batch->paths.size());
+	batch->callback = new Nan::Callback(args[1].As<v8::Function>());
+
+	QueueMetaBatch(batch);
+}
+
+// a string, or the bytes of a Buffer
+std::string MetaString(v8::Local<v8::Value> value)
+{
+	if (node::Buffer::HasInstance(value))
+	{
+		return std::string(node::Buffer::Data(value), node::Buffer::Length(value));
+	}
+
+	Nan::Utf8String str(value);
+	return std::string(*str, str.length());
+}
+
+void QueueMetaStrings(const Nan::FunctionCallbackInfo<v8::Value> &args, meta_batch_op_t op)
+{
+	if (args.Length() != 2 || !args[0]->IsArray() || !args[1]->IsFunction())
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	v8::Local<v8::Array> metas = args[0].As<v8::Array>();
+
+	meta_batch_t *batch = new meta_batch_t();
+	batch->ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	batch->env = env;
+	batch->op = op;
+	batch->metas.reserve(metas->Length());
+	for (uint32_t i = 0; i < metas->Length(); i++)
+	{
+		batch->metas.push_back(MetaString(metas->Get(i)));
+	}
+	batch->callback = new Nan::Callback(args[1].As<v8::Function>());
+
+	QueueMetaBatch(batch);
+}
+
+// encryptMeta for every string or Buffer on the threadpool
+void EncryptMetaBatch(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	QueueMetaStrings(args, META_ENCRYPT);
+}
+
+// decryptMeta for every string or Buffer on the threadpool
+void DecryptMetaBatch(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	QueueMetaStrings(args, META_DECRYPT);
+}
+
+void RegisterCallback(uv_work_t *work_req, int status)
+{
+	json_request_t *req = (json_request_t *)work_req->data;
+
+	request_callbacks_t *callbacks = (request_callbacks_t *)req->handle;
+	if (DeferToJsThread(callbacks->ctx, std::bind(RegisterCallback, work_req, status), true))
+	{
+		return;
+	}
+
+	Nan::HandleScope scope;
+
+	Nan::Callback *callback = callbacks->callback;
+
+	v8::Local<v8::Value> error = Nan::Null();
+	v8::Local<v8::Value> result = Nan::Null();
+
+	if (error_and_status_check<json_request_t>(req, &error))
+	{
+		const char *result_str = json_object_to_json_string(req->response);
+		v8::Local<v8::String> result_json_string = Nan::New(result_str).ToLocalChecked();
+		Nan::JSON NanJSON;
+		Nan::MaybeLocal<v8::Value> res = NanJSON.Parse(result_json_string);
+		if (!res.IsEmpty())
+		{
+			result = res.ToLocalChecked();
+		}
+	}
+
+	v8::Local<v8::Value> argv[] = {
+		error,
+		result };
+
+	Nan::Call(*callback, 2, argv);
+
+	free(req);
+	free(work_req);
+	delete callbacks;
+}
+
+void MemoryStats(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	if (!ctx)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+	stats->Set(Nan::New("inflightBytes").ToLocalChecked(), Nan::New((double)ctx->inflight_memory));
+	stats->Set(Nan::New("maxMemory").ToLocalChecked(), Nan::New((double)ctx->max_memory));
+	stats->Set(Nan::New("queuedTransfers").ToLocalChecked(), Nan::New((double)ctx->transfer_queue.size()));
+
+	args.GetReturnValue().Set(stats);
+}
+
+void EncryptionInfoPoolStats(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.Length() != 1)
+	{
+		return Nan::ThrowError("Unexpected arguments");
+	}
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	if (!ctx)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	Nan::Utf8String bucket_id_str(args[0]);
+	encryption_info_pool_t empty = encryption_info_pool_t();
+	std::map<std::string, encryption_info_pool_t>::iterator found = ctx->encryption_info_pools.find(*bucket_id_str);
+	const encryption_info_pool_t &pool = found == ctx->encryption_info_pools.end() ? empty : found->second;
+
+	v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+	stats->Set(Nan::New("size").ToLocalChecked(), Nan::New(ctx->encryption_info_pool_size));
+	stats->Set(Nan::New("ready").ToLocalChecked(), Nan::New((double)pool.entries.size()));
+	stats->Set(Nan::New("refilling").ToLocalChecked(), Nan::New(pool.refilling));
+	stats->Set(Nan::New("refills").ToLocalChecked(), Nan::New((double)pool.refills));
+
+	args.GetReturnValue().Set(stats);
+}
+
+void RequestStats(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+	if (!ctx)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+	stats->Set(Nan::New("inflightReads").ToLocalChecked(), Nan::New((double)ctx->inflight_reads.size()));
+	stats->Set(Nan::New("coalescedReads").ToLocalChecked(), Nan::New((double)ctx->coalesced_reads));
+
+	args.GetReturnValue().Set(stats);
+}
+
+void DestroyEnvironment(const Nan::FunctionCallbackInfo<v8::Value> &args)
+{
+	if (args.This()->InternalFieldCount() != 2)
+	{
+		return Nan::ThrowError("Environment not available for instance");
+	}
+
+	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
+	if (!env)
+	{
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	env_context_t *ctx = (env_context_t *)args.This()->GetAlignedPointerFromInternalField(1);
+
+	if (ctx)
+	{
+		// the proxy stays with the instance until it is collected
+		ctx->proxy = NULL;
+	}
+
+	args.This()->SetAlignedPointerInInternalField(0, NULL);
+	args.This()->SetAlignedPointerInInternalField(1, NULL);
+
+	if (DestroyEnvWhenIdle(env, ctx))
+	{
+		Nan::ThrowError("Unable to destroy environment");
+	}
+}
+
+void FreeEnvironmentCallback(const Nan::WeakCallbackInfo<free_env_proxy> &data)
+{
+	free_env_proxy *proxy = data.GetParameter();
+	v8::Local<v8::Object> obj = Nan::New<v8::Object>(proxy->persistent);
+	genaro_env_t *env = (genaro_env_t *)obj->GetAlignedPointerFromInternalField(0);
+	env_context_t *ctx = (env_context_t *)obj->GetAlignedPointerFromInternalField(1);
+
+	if (ctx)
+	{
+		ctx->proxy = NULL;
+	}
+
+	if (DestroyEnvWhenIdle(env, ctx))
+	{
+		Nan::ThrowError("Unable to destroy environment");
+	}
+	delete proxy;
+}
+
+void Environment(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+	Nan::EscapableHandleScope scope;
+	if (args.Length() == 0)
+	{
+		return Nan::ThrowError("First argument is expected");
+	}
+
+	v8::Local<v8::Object> options = args[0].As<v8::Object>();
+
+	v8::Local<v8::String> bridgeUrl = options->Get(Nan::New("bridgeUrl").ToLocalChecked()).As<v8::String>();
+	v8::Local<v8::String> key_file = options->Get(Nan::New("keyFile").ToLocalChecked()).As<v8::String>();
+	v8::Local<v8::String> passphrase = options->Get(Nan::New("passphrase").ToLocalChecked()).As<v8::String>();
+	Nan::MaybeLocal<v8::Value> user_agent = options->Get(Nan::New("userAgent").ToLocalChecked());
+	Nan::MaybeLocal<v8::Value> logLevel = options->Get(Nan::New("logLevel").ToLocalChecked());
+	Nan::MaybeLocal<v8::Value> logger = options->Get(Nan::New("logger").ToLocalChecked());
+	Nan::MaybeLocal<v8::Value> ioThread = options->Get(Nan::New("ioThread").ToLocalChecked());
+	Nan::MaybeLocal<v8::Value> maxMemory = options->Get(Nan::New("maxMemory").ToLocalChecked());
+	Nan::MaybeLocal<v8::Value> encryptionInfoPool = options->Get(Nan::New("encryptionInfoPool").ToLocalChecked());
+	Nan::MaybeLocal<v8::Value> dedupeIndex = options->Get(Nan::New("dedupeIndex").ToLocalChecked());
+
+	v8::Local<v8::FunctionTemplate> constructor = Nan::New<v8::FunctionTemplate>();
+	constructor->SetClassName(Nan::New("Environment").ToLocalChecked());
+	constructor->InstanceTemplate()->SetInternalFieldCount(2);
+
+	Nan::SetPrototypeMethod(constructor, "getInfo", GetInfo);
+	Nan::SetPrototypeMethod(constructor, "getBuckets", GetBuckets);
+	Nan::SetPrototypeMethod(constructor, "createBucket", CreateBucket);
+	Nan::SetPrototypeMethod(constructor, "deleteBucket", DeleteBucket);
+	Nan::SetPrototypeMethod(constructor, "renameBucket", RenameBucket);
+	Nan::SetPrototypeMethod(constructor, "listFiles", ListFiles);
+	Nan::SetPrototypeMethod(constructor, "generateEncryptionInfo", GenerateEncryptionInfo);
+	Nan::SetPrototypeMethod(constructor, "generateEncryptionInfoBatch", GenerateEncryptionInfoBatch);
+	Nan::SetPrototypeMethod(constructor, "storeFile", StoreFile);
+	Nan::SetPrototypeMethod(constructor, "storeFileCancel", StoreFileCancel);
+	Nan::SetPrototypeMethod(constructor, "resolveFile", ResolveFile);
+	Nan::SetPrototypeMethod(constructor, "resolveFileCancel", ResolveFileCancel);
+	Nan::SetPrototypeMethod(constructor, "deleteFile", DeleteFile);
+	Nan::SetPrototypeMethod(constructor, "encryptMeta", EncryptMeta);
+	Nan::SetPrototypeMethod(constructor, "encryptMetaToFile", EncryptMetaToFile);
+	Nan::SetPrototypeMethod(constructor, "decryptMeta", DecryptMeta);
+	Nan::SetPrototypeMethod(constructor, "decryptMetaFromFile", DecryptMetaFromFile);
+	Nan::SetPrototypeMethod(constructor, "encryptMetaToFiles", EncryptMetaToFiles);
+	Nan::SetPrototypeMethod(constructor, "decryptMetaFromFiles", DecryptMetaFromFiles);
+	Nan::SetPrototypeMethod(constructor, "encryptMetaBatch", EncryptMetaBatch);
+	Nan::SetPrototypeMethod(constructor, "decryptMetaBatch", DecryptMetaBatch);
+	Nan::SetPrototypeMethod(constructor, "decryptFile", DecryptFile);
+	Nan::SetPrototypeMethod(constructor, "memoryStats", MemoryStats);
+	Nan::SetPrototypeMethod(constructor, "encryptionInfoPoolStats", EncryptionInfoPoolStats);
+	Nan::SetPrototypeMethod(constructor, "requestStats", RequestStats);
+	Nan::SetPrototypeMethod(constructor, "destroy", DestroyEnvironment);
+
+	Nan::MaybeLocal<v8::Object> maybeInstance;
+	v8::Local<v8::Object> instance;
+
+	v8::Local<v8::Value> *argv = 0;
+	maybeInstance = Nan::NewInstance(constructor->GetFunction(), 0, argv);
+
+	if (maybeInstance.IsEmpty())
+	{
+		return Nan::ThrowError("Could not create new Genaro instance");
+	}
+	else
+	{
+		instance = maybeInstance.ToLocalChecked();
+	}
+
+	// Bridge URL handling
+	Nan::Utf8String _bridgeUrl(bridgeUrl);
+	const char *url = *_bridgeUrl;
+	char proto[6];
+	char host[100];
+	int port = 0;
+	sscanf(url, "%5[^://]://%99[^:/]:%99d", proto, host, &port);
+	if (port == 0)
+	{
+		if (strcmp(proto, "http") == 0)
+		{
+			port = 80;
+		}
+		else
+		{
+			port = 443;
+		}
+	}
+
+	// V8 types to C types
+	Nan::Utf8String _keyFileObj(key_file);
+	const char *_key_file = *_keyFileObj;
+	Nan::Utf8String _passphraseObj(passphrase);
+	const char *_passphrase = *_passphraseObj;
+
+	// Setup option structs
+	genaro_bridge_options_t bridge_options = {};
+	bridge_options.proto = proto;
+	bridge_options.host = host;
+	bridge_options.port = port;
+
+	json_object *key_json_obj = json_tokener_parse(_key_file);
+	key_result_t *key_result = genaro_parse_key_file(key_json_obj, _passphrase);
+	if (key_result == NULL)
+	{
+		json_object_put(key_json_obj);
+		return Nan::ThrowError("Key file and passphrase mismatch.");
+	}
+	genaro_encrypt_options_t encrypt_options;
+	genaro_key_result_to_encrypt_options(key_result, &encrypt_options);
+	json_object_put(key_json_obj);
+
+	genaro_http_options_t http_options = {};
+	if (!user_agent.ToLocalChecked()->IsNullOrUndefined())
+	{
+		Nan::Utf8String str(user_agent.ToLocalChecked());
+		http_options.user_agent = strdup(*str);
+	}
+	else
+	{
+		http_options.user_agent = "genaro-test";
+	}
+	http_options.low_speed_limit = GENARO_LOW_SPEED_LIMIT;
+	http_options.low_speed_time = GENARO_LOW_SPEED_TIME;
+	http_options.timeout = GENARO_HTTP_TIMEOUT;
+	http_options.cainfo_path = NULL;
+
+	env_context_t *ctx = new env_context_t();
+	ctx->addon = (addon_data_t *)args.Data().As<v8::External>()->Value();
+	ctx->proxy = NULL;
+	ctx->log_sink = NULL;
+
+	// kept in the context, shared options would race between workers
+	ctx->log_options.logger = JsonLogger;
+	ctx->log_options.level = 0;
+	if (!logLevel.ToLocalChecked()->IsNullOrUndefined())
+	{
+		ctx->log_options.level = Nan::To<int>(logLevel.ToLocalChecked()).FromJust();
+	}
+
+	// Initialize environment
+	genaro_env_t *env = genaro_init_env(&bridge_options,
+		&encrypt_options,
+		&http_options,
+		&ctx->log_options,
+		true);
+
+	free(encrypt_options.priv_key);
+
+	if (!env)
+	{
+		delete ctx;
+		return Nan::ThrowError("Environment is not initialized");
+	}
+
+	// Bind the env to the loop of the isolate creating it, which is not
+	// the default loop inside of a worker thread
+	env->loop = Nan::GetCurrentEventLoop();
+
+	ctx->js_thread = uv_thread_self();
+	ctx->io_loop = NULL;
+	ctx->inflight_memory = 0;
+	ctx->max_memory = 0;
+	if (!maxMemory.ToLocalChecked()->IsNullOrUndefined())
+	{
+		ctx->max_memory = (uint64_t)Nan::To<double>(maxMemory.ToLocalChecked()).FromJust();
+	}
+	if (!encryptionInfoPool.ToLocalChecked()->IsNullOrUndefined())
+	{
+		ctx->encryption_info_pool_size = Nan::To<int>(encryptionInfoPool.ToLocalChecked()).FromJust();
+	}
+	if (!ioThread.ToLocalChecked()->IsNullOrUndefined() &&
+		Nan::To<bool>(ioThread.ToLocalChecked()).FromJust())
+	{
+		if (StartIoThread(ctx))
+		{
+			genaro_destroy_env(env);
+			delete ctx;
+			return Nan::ThrowError("Unable to start io thread");
+		}
+		env->loop = ctx->io_loop;
+	}
+
+	if (!dedupeIndex.ToLocalChecked()->IsNullOrUndefined())
+	{
+		Nan::Utf8String dedupe_index_str(dedupeIndex.ToLocalChecked());
+		ctx->dedupe_index = OpenDedupeIndex(*dedupe_index_str);
+		if (!ctx->dedupe_index)
+		{
+			StopIoThread(ctx);
+			genaro_destroy_env(env);
+			DestroyEnvContext(ctx);
+			return Nan::ThrowError("Unable to open dedupe index");
+		}
+	}
+
+	if (!logger.ToLocalChecked()->IsNullOrUndefined())
+	{
+		if (!logger.ToLocalChecked()->IsFunction())
+		{
+			StopIoThread(ctx);
+			genaro_destroy_env(env);
+			DestroyEnvContext(ctx);
+			return Nan::ThrowError("logger is expected to be a function");
+		}
+		ctx->log_sink = CreateLogSink(Nan::GetCurrentEventLoop(), logger.ToLocalChecked().As<v8::Function>());
+	}
+
+	free_env_proxy *proxy = new free_env_proxy();
+	ctx->proxy = proxy;
+	ctx->addon->contexts.push_back(ctx);
+
+	// Pass along the environment so it can be accessed by methods
+	instance->SetAlignedPointerInInternalField(0, env);
+	instance->SetAlignedPointerInInternalField(1, ctx);
+
+	Nan::Persistent<v8::Object> persistent(instance);
+
+	// Setup reference
+	proxy->persistent.Reset(persistent);
+
+	// There is no guarantee that the free callback will be called
+	persistent.SetWeak(proxy, FreeEnvironmentCallback, v8::WeakCallbackType::kParameter);
+	persistent.MarkIndependent();
+	Nan::AdjustExternalMemory(sizeof(genaro_env_t));
 
-		if (ctr && ctr[0] != '\0')
-		{
-			ctr_dup = strdup(ctr);
-		}
-	}
+	args.GetReturnValue().Set(persistent);
+}
 
-	genaro_key_ctr_as_str_t *key_ctr_as_str = NULL;
+// libgenaro makes an easy handle for every bridge request and shard
+// transfer and cleans it up after one request, which costs a TCP and TLS
+// handshake each time. When it is linked in statically, its calls to
+// curl_easy_init and curl_easy_perform are wrapped by the linker (see
+// binding.js), and every handle joins one share of connections, TLS
+// sessions and DNS entries that outlives it.
+#define CURL_POOL_MAX_CONNECTS 32
 
-	if (key_dup && ctr_dup)
-	{
-		key_ctr_as_str = (genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t));
-		key_ctr_as_str->key_as_str = key_dup;
-		key_ctr_as_str->ctr_as_str = ctr_dup;
-	}
+static std::atomic<uint64_t> curl_requests(0);
+static std::atomic<uint64_t> curl_reused(0);
+static std::atomic<uint64_t> curl_connects(0);
 
-	transfer_callbacks_t *download_callbacks = static_cast<transfer_callbacks_t *>(malloc(sizeof(transfer_callbacks_t)));
+#if GENARO_CURL_SHARE
 
-	download_callbacks->progress_callback = new Nan::Callback(options->Get(Nan::New("progressCallback").ToLocalChecked()).As<v8::Function>());
-	download_callbacks->finished_callback = new Nan::Callback(options->Get(Nan::New("finishedCallback").ToLocalChecked()).As<v8::Function>());
+static uv_once_t curl_share_once = UV_ONCE_INIT;
+static uv_mutex_t curl_share_mutexes[CURL_LOCK_DATA_LAST];
+static CURLSH *curl_share = NULL;
 
-	if (IsDownloading(file_path_dup))
-	{
-		v8::Local<v8::String> msg = Nan::New("File is already downloading").ToLocalChecked();
-		v8::Local<v8::Value> error = Nan::Error(msg);
+void LockCurlShare(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	uv_mutex_lock(&curl_share_mutexes[data]);
+}
 
-		v8::Local<v8::Value> argv[] = {
-			error,
-			Nan::Null(),
-			Nan::Null() };
+void UnlockCurlShare(CURL *handle, curl_lock_data data, void *userptr)
+{
+	uv_mutex_unlock(&curl_share_mutexes[data]);
+}
 
-		Nan::Call(*(download_callbacks->finished_callback), 3, argv);
+void InitCurlShare()
+{
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+	{
+		uv_mutex_init(&curl_share_mutexes[i]);
+	}
 
+	curl_share = curl_share_init();
+	if (!curl_share)
+	{
 		return;
 	}
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, LockCurlShare);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, UnlockCurlShare);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
 
-	Nan::MaybeLocal<v8::Value> overwriteOption = options->Get(Nan::New("overwrite").ToLocalChecked());
+extern "C" CURL *__real_curl_easy_init(void);
+extern "C" CURLcode __real_curl_easy_perform(CURL *curl);
 
-	bool overwrite = false;
-	if (!overwriteOption.IsEmpty())
+extern "C" CURL *__wrap_curl_easy_init(void)
+{
+	CURL *curl = __real_curl_easy_init();
+	if (!curl)
 	{
-		overwrite = Nan::To<bool>(overwriteOption.ToLocalChecked()).FromJust();
+		return NULL;
 	}
 
-	Nan::MaybeLocal<v8::Value> decryptOption = options->Get(Nan::New("decrypt").ToLocalChecked());
-
-	bool decrypt = true;
-	if (!decryptOption.IsEmpty())
+	uv_once(&curl_share_once, InitCurlShare);
+	if (curl_share)
 	{
-		decrypt = Nan::To<bool>(decryptOption.ToLocalChecked()).FromJust();
+		curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+		curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, (long)CURL_POOL_MAX_CONNECTS);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 	}
 
-	FILE *fd = NULL;
+	return curl;
+}
 
-	if (access(file_path_dup, F_OK) != -1)
+extern "C" CURLcode __wrap_curl_easy_perform(CURL *curl)
+{
+	CURLcode code = __real_curl_easy_perform(curl);
+
+	long connects = 0;
+	curl_requests.fetch_add(1, std::memory_order_relaxed);
+	if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK)
 	{
-		if (!overwrite)
+		if (connects > 0)
 		{
-			v8::Local<v8::String> msg = Nan::New("File already exists").ToLocalChecked();
-			v8::Local<v8::Value> error = Nan::Error(msg);
-
-			v8::Local<v8::Value> argv[] = {
-				error,
-				Nan::Null(),
-				Nan::Null() };
-
-			Nan::Call(*(download_callbacks->finished_callback), 3, argv);
-
-			return;
+			curl_connects.fetch_add(connects, std::memory_order_relaxed);
+		}
+		else if (code == CURLE_OK)
+		{
+			curl_reused.fetch_add(1, std::memory_order_relaxed);
 		}
 	}
 
-	const char *temp_file_name = str_concat_many(2, file_path_dup, ".genarotmp");
+	return code;
+}
 
-	fd = fopen(temp_file_name, "wb+");
+#endif
 
-	if (fd == NULL)
-	{
-		v8::Local<v8::String> msg = Nan::New(strerror(errno)).ToLocalChecked();
-		v8::Local<v8::Value> error = Nan::Error(msg);
+void ConnectionStats(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+	Nan::HandleScope scope;
 
-		v8::Local<v8::Value> argv[] = {
-			error,
-			Nan::Null(),
-			Nan::Null() };
+	v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+	stats->Set(Nan::New("pooled").ToLocalChecked(), Nan::New((bool)GENARO_CURL_SHARE));
+	stats->Set(Nan::New("requests").ToLocalChecked(), Nan::New((double)curl_requests.load()));
+	stats->Set(Nan::New("reused").ToLocalChecked(), Nan::New((double)curl_reused.load()));
+	stats->Set(Nan::New("connects").ToLocalChecked(), Nan::New((double)curl_connects.load()));
 
-		Nan::Call(*(download_callbacks->finished_callback), 3, argv);
+	args.GetReturnValue().Set(stats);
+}
 
-		return;
-	}
+void LogStats(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+	Nan::HandleScope scope;
 
-	genaro_download_state_t *state = genaro_bridge_resolve_file(env,
-																bucket_id_dup,
-																file_id_dup,
-																key_ctr_as_str,
-																file_path_dup,
-																temp_file_name,
-																fd,
-																decrypt,
-																(void *)download_callbacks,
-																ResolveFileProgressCallback,
-																ResolveFileFinishedCallback);
-	if (!state)
-	{
-		return Nan::ThrowError("Unable to create download state");
-	}
+	v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+	stats->Set(Nan::New("written").ToLocalChecked(), Nan::New((double)log_written.load()));
+	stats->Set(Nan::New("dropped").ToLocalChecked(), Nan::New((double)log_dropped.load()));
 
-	if (state->error_status)
-	{
-		return Nan::ThrowError("Unable to queue file download");
-	}
+	args.GetReturnValue().Set(stats);
+}
 
-	downloading_task_t task;
-#ifdef _WIN32
-	task.full_path = ConvertToWindowsPath(state->file_name);
-#else
-	task.full_path = strdup(state->file_name);
-#endif
+// content defined chunking in the way of FastCDC: a gear hash over the
+// last 64 bytes cuts where its top bits are zero. Below the average size
+// more bits have to be zero than above it, which keeps the chunk sizes
+// close to the average.
+#define CHUNK_MIN_SIZE (1024 * 1024)
+#define CHUNK_AVG_SIZE (4 * 1024 * 1024)
+#define CHUNK_MAX_SIZE (16 * 1024 * 1024)
+#define CHUNK_READ_SIZE (1024 * 1024)
 
-	downloading_task_list.push_back(task);
+static uint64_t chunk_gear[256];
+static uv_once_t chunk_gear_once = UV_ONCE_INIT;
 
-	v8::Isolate *isolate = args.GetIsolate();
-	v8::Local<v8::ObjectTemplate> state_template = v8::ObjectTemplate::New(isolate);
-	state_template->SetInternalFieldCount(1);
+void InitChunkGear()
+{
+	// splitmix64 with a fixed seed, the cut points of a file must never
+	// change between versions or nothing would be found again
+	uint64_t state = 0x6765726f6765724fULL;
+	for (int i = 0; i < 256; i++)
+	{
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		chunk_gear[i] = z ^ (z >> 31);
+	}
+}
 
-	v8::Local<v8::Object> state_local = state_template->NewInstance();
-	state_local->SetAlignedPointerInInternalField(0, state);
-	Nan::SetAccessor(state_local, Nan::New("error_status").ToLocalChecked(),
-		StateStatusErrorGetter<genaro_download_state_t>);
+typedef struct
+{
+	uint64_t offset;
+	uint64_t length;
+	std::string hash;
+} chunk_t;
 
-	args.GetReturnValue().Set(state_local);
+typedef struct
+{
+	uv_work_t req;
+	std::string file_path;
+	uint64_t min_size;
+	uint64_t avg_size;
+	uint64_t max_size;
+	std::vector<chunk_t> chunks;
+	bool failed;
+	Nan::Callback *callback;
+} chunk_file_work_t;
+
+uint64_t TopBitsMask(int bits)
+{
+	return ((1ULL << bits) - 1) << (64 - bits);
 }
 
-// decrypt the downloaded but not decrypted file
-void DecryptFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+void ChunkFileWork(uv_work_t *req)
 {
-	if (args.Length() != 3)
+	chunk_file_work_t *work = (chunk_file_work_t *)req->data;
+
+	uv_once(&chunk_gear_once, InitChunkGear);
+
+	FILE *fp = fopen(work->file_path.c_str(), "rb");
+	if (!fp)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		work->failed = true;
+		return;
 	}
-	if (args.This()->InternalFieldCount() != 1)
+	AdviseSequentialRead(fp);
+
+	int bits = 0;
+	while ((2ULL << bits) <= work->avg_size)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		bits++;
 	}
+	uint64_t mask_small = TopBitsMask(bits + 1);
+	uint64_t mask_large = TopBitsMask(bits > 1 ? bits - 1 : 1);
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	std::vector<unsigned char> buffer(CHUNK_READ_SIZE);
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	uint64_t fingerprint = 0;
+	sha256_digest sha;
+
+	size_t read_bytes;
+	while ((read_bytes = fread(&buffer[0], 1, buffer.size(), fp)) > 0)
 	{
-		return Nan::ThrowError("Environment is not initialized");
-	}
+		size_t span = 0;
+		for (size_t i = 0; i < read_bytes; i++)
+		{
+			fingerprint = (fingerprint << 1) + chunk_gear[buffer[i]];
+			length++;
 
-	Nan::Utf8String file_path_str(args[0]);
-	const char *file_path = *file_path_str;
+			if (length < work->min_size)
+			{
+				continue;
+			}
 
-	//convert to ANSI encoding on Win32
-#if defined(_WIN32)
-	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
-	file_path = u_p.get();
-#endif
+			uint64_t mask = length < work->avg_size ? mask_small : mask_large;
+			if ((fingerprint & mask) && length < work->max_size)
+			{
+				continue;
+			}
 
-	Nan::Utf8String key_str(args[1]);
-	const char *key = *key_str;
-	Nan::Utf8String ctr_str(args[2]);
-	const char *ctr = *ctr_str;
+			sha.Update(&buffer[span], i + 1 - span);
+			span = i + 1;
 
-	genaro_key_ctr_as_str_t *key_ctr_as_str = NULL;
-	key_ctr_as_str = (genaro_key_ctr_as_str_t *)malloc(sizeof(genaro_key_ctr_as_str_t));
-	key_ctr_as_str->key_as_str = key;
-	key_ctr_as_str->ctr_as_str = ctr;
+			chunk_t chunk;
+			chunk.offset = offset;
+			chunk.length = length;
+			chunk.hash = Sha256Hex(&sha);
+			work->chunks.push_back(chunk);
 
-	char *decryptedMeta = genaro_decrypt_file(env, file_path, key_ctr_as_str);
-	free((void *)key_ctr_as_str);
+			offset += length;
+			length = 0;
+			fingerprint = 0;
+			sha.Reset();
+		}
 
-	if (!decryptedMeta) {
-		return;
+		sha.Update(&buffer[span], read_bytes - span);
 	}
 
-	// return the decrypted meta
-	args.GetReturnValue().Set(Nan::New(decryptedMeta).ToLocalChecked());
-	free(decryptedMeta);
+	work->failed = ferror(fp) != 0;
+	fclose(fp);
+
+	if (length)
+	{
+		chunk_t chunk;
+		chunk.offset = offset;
+		chunk.length = length;
+		chunk.hash = Sha256Hex(&sha);
+		work->chunks.push_back(chunk);
+	}
 }
 
-// TODO: this is the same as DeleteBucketCallback; refactor
-void DeleteFileCallback(uv_work_t *work_req, int status)
+void AfterChunkFileWork(uv_work_t *req, int status)
 {
 	Nan::HandleScope scope;
 
-	json_request_t *req = (json_request_t *)work_req->data;
+	chunk_file_work_t *work = (chunk_file_work_t *)req->data;
 
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
 	v8::Local<v8::Value> error = Nan::Null();
-
-	error_and_status_check<json_request_t>(req, &error);
+	v8::Local<v8::Value> chunks = Nan::Null();
+	if (work->failed)
+	{
+		error = Nan::Error("Unable to read file");
+	}
+	else
+	{
+		v8::Local<v8::Array> chunks_array = Nan::New<v8::Array>((int)work->chunks.size());
+		for (size_t i = 0; i < work->chunks.size(); i++)
+		{
+			v8::Local<v8::Object> chunk = Nan::New<v8::Object>();
+			chunk->Set(Nan::New("offset").ToLocalChecked(), Nan::New((double)work->chunks[i].offset));
+			chunk->Set(Nan::New("length").ToLocalChecked(), Nan::New((double)work->chunks[i].length));
+			chunk->Set(Nan::New("hash").ToLocalChecked(), Nan::New(work->chunks[i].hash).ToLocalChecked());
+			chunks_array->Set((uint32_t)i, chunk);
+		}
+		chunks = chunks_array;
+	}
 
 	v8::Local<v8::Value> argv[] = {
-		error };
+		error,
+		chunks };
 
-	Nan::Call(*callback, 1, argv);
+	Nan::Call(*(work->callback), 2, argv);
 
-	free(req);
-	free(work_req);
+	delete work->callback;
+	delete work;
 }
 
-void DeleteFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+uint64_t ChunkSizeOption(v8::Local<v8::Object> options, const char *name, uint64_t fallback)
 {
-	if (args.Length() != 3 || !args[2]->IsFunction())
-	{
-		return Nan::ThrowError("Unexpected arguments");
-	}
-	if (args.This()->InternalFieldCount() != 1)
+	Nan::MaybeLocal<v8::Value> option = options->Get(Nan::New(name).ToLocalChecked());
+	if (option.IsEmpty() || option.ToLocalChecked()->IsNullOrUndefined())
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		return fallback;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	double value = Nan::To<double>(option.ToLocalChecked()).FromJust();
+	return value > 0 ? (uint64_t)value : 0;
+}
+
+// split a file into content defined chunks on the threadpool, the
+// callback gets their offset, length and sha256
+void ChunkFile(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+	Nan::HandleScope scope;
+
+	if (args.Length() != 3 || !args[1]->IsObject() || !args[2]->IsFunction())
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		return Nan::ThrowError("Unexpected arguments");
 	}
 
-	Nan::Utf8String bucket_id_str(args[0]);
-	const char *bucket_id = *bucket_id_str;
-	const char *bucket_id_dup = strdup(bucket_id);
+	v8::Local<v8::Object> options = args[1].As<v8::Object>();
 
-	Nan::Utf8String file_id_str(args[1]);
-	const char *file_id = *file_id_str;
-	const char *file_id_dup = strdup(file_id);
+	chunk_file_work_t *work = new chunk_file_work_t();
+	work->min_size = ChunkSizeOption(options, "minSize", CHUNK_MIN_SIZE);
+	work->avg_size = ChunkSizeOption(options, "avgSize", CHUNK_AVG_SIZE);
+	work->max_size = ChunkSizeOption(options, "maxSize", CHUNK_MAX_SIZE);
+
+	if (!work->min_size || work->min_size > work->avg_size || work->avg_size > work->max_size)
+	{
+		delete work;
+		return Nan::ThrowError("Expected minSize <= avgSize <= maxSize");
+	}
 
-	Nan::Callback *callback = new Nan::Callback(args[2].As<v8::Function>());
+	Nan::Utf8String file_path_str(args[0]);
+	work->file_path = *file_path_str;
+	work->req.data = work;
+	work->callback = new Nan::Callback(args[2].As<v8::Function>());
 
-	genaro_bridge_delete_file(env, bucket_id_dup, file_id_dup, (void *)callback, DeleteFileCallback);
+	uv_queue_work(Nan::GetCurrentEventLoop(), &work->req, ChunkFileWork, AfterChunkFileWork);
 }
 
-void EncryptMeta(const Nan::FunctionCallbackInfo<v8::Value> &args)
+typedef struct
 {
-	if (args.Length() != 1)
-	{
-		return Nan::ThrowError("Unexpected arguments");
-	}
-	if (args.This()->InternalFieldCount() != 1)
+	std::string path;
+	uint64_t size;
+	double mtime;
+} scanned_file_t;
+
+typedef struct
+{
+	uv_work_t req;
+	std::string root;
+	std::vector<scanned_file_t> files;
+	// subdirectories that could not be read, relative to root
+	std::vector<std::string> unreadable;
+	bool failed;
+	Nan::Callback *callback;
+} scan_directory_work_t;
+
+// collect the regular files below root/relative, paths are relative to
+// root and separated by '/'. Links are not followed.
+#ifdef _WIN32
+bool WalkDirectory(const std::string &root, const std::string &relative, std::vector<scanned_file_t> *files, std::vector<std::string> *unreadable)
+{
+	std::string pattern = (relative.empty() ? root : root + "\\" + relative) + "\\*";
+
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA(pattern.c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		// only the root failing fails the scan
+		if (relative.empty())
+		{
+			return false;
+		}
+		std::string path = relative;
+		std::replace(path.begin(), path.end(), '\\', '/');
+		unreadable->push_back(path);
+		return true;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	do
 	{
-		return Nan::ThrowError("Environment is not initialized");
-	}
+		if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, "..") ||
+			(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+		{
+			continue;
+		}
 
-	Nan::Utf8String meta_str(args[0]);
-	const char *meta = *meta_str;
+		std::string child = relative.empty() ? data.cFileName : relative + "/" + data.cFileName;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			std::string native_child = child;
+			std::replace(native_child.begin(), native_child.end(), '/', '\\');
+			WalkDirectory(root, native_child, files, unreadable);
+			continue;
+		}
 
-	char *encrypted_meta = genaro_encrypt_meta(env, meta);
+		uint64_t write_time = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
 
-	if (encrypted_meta)
-	{
-		// return the encrypted meta.
-		args.GetReturnValue().Set(Nan::New(encrypted_meta).ToLocalChecked());
-	}
-}
+		scanned_file_t file;
+		file.path = child;
+		std::replace(file.path.begin(), file.path.end(), '\\', '/');
+		file.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		// 100ns intervals since 1601, kept below the millisecond
+		file.mtime = (double)write_time / 10000.0 - 11644473600000.0;
+		files->push_back(file);
+	} while (FindNextFileA(find, &data));
 
-void EncryptMetaToFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+	FindClose(find);
+	return true;
+}
+#else
+bool WalkDirectory(const std::string &root, const std::string &relative, std::vector<scanned_file_t> *files, std::vector<std::string> *unreadable)
 {
-	if (args.Length() != 2)
-	{
-		return Nan::ThrowError("Unexpected arguments");
-	}
-	if (args.This()->InternalFieldCount() != 1)
+	DIR *dir = opendir((relative.empty() ? root : root + "/" + relative).c_str());
+	if (!dir)
 	{
-		return Nan::ThrowError("Environment not available for instance");
+		// only the root failing fails the scan
+		if (relative.empty())
+		{
+			return false;
+		}
+		unreadable->push_back(relative);
+		return true;
 	}
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	struct dirent *entry;
+	while ((entry = readdir(dir)))
 	{
-		return Nan::ThrowError("Environment is not initialized");
-	}
-
-	Nan::Utf8String meta_str(args[0]);
-	const char *meta = *meta_str;
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+		{
+			continue;
+		}
 
-	char *encrypted_meta = genaro_encrypt_meta(env, meta);
+		std::string child = relative.empty() ? entry->d_name : relative + "/" + entry->d_name;
 
-	Nan::Utf8String file_path_str(args[1]);
-	const char *file_path = *file_path_str;
+		struct stat file_stat;
+		if (lstat((root + "/" + child).c_str(), &file_stat))
+		{
+			continue;
+		}
 
-	//convert to ANSI encoding on Win32
-#if defined(_WIN32)
-	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
-	file_path = u_p.get();
+		if (S_ISDIR(file_stat.st_mode))
+		{
+			WalkDirectory(root, child, files, unreadable);
+		}
+		else if (S_ISREG(file_stat.st_mode))
+		{
+			scanned_file_t file;
+			file.path = child;
+			file.size = (uint64_t)file_stat.st_size;
+			// whole seconds would miss a rewrite within the same second
+#ifdef __APPLE__
+			file.mtime = (double)file_stat.st_mtimespec.tv_sec * 1000 + (double)file_stat.st_mtimespec.tv_nsec / 1000000;
+#else
+			file.mtime = (double)file_stat.st_mtim.tv_sec * 1000 + (double)file_stat.st_mtim.tv_nsec / 1000000;
 #endif
-
-	bool ret = false;
-	if (encrypted_meta) {
-		FILE *fd = fopen(file_path, "wb+");
-		if (fd) {
-			fwrite(encrypted_meta, strlen(encrypted_meta), sizeof(char), fd);
-			fclose(fd);
-			ret = true;
+			files->push_back(file);
 		}
 	}
 
-	args.GetReturnValue().Set(Nan::New(ret));
+	closedir(dir);
+	return true;
 }
+#endif
 
-void DecryptMeta(const Nan::FunctionCallbackInfo<v8::Value> &args)
+void ScanDirectoryWork(uv_work_t *req)
 {
-	if (args.Length() != 1)
+	scan_directory_work_t *work = (scan_directory_work_t *)req->data;
+	work->failed = !WalkDirectory(work->root, std::string(), &work->files, &work->unreadable);
+}
+
+void AfterScanDirectoryWork(uv_work_t *req, int status)
+{
+	Nan::HandleScope scope;
+
+	scan_directory_work_t *work = (scan_directory_work_t *)req->data;
+
+	v8::Local<v8::Value> error = Nan::Null();
+	v8::Local<v8::Value> files = Nan::Null();
+	v8::Local<v8::Value> unreadable = Nan::Null();
+	if (work->failed)
 	{
-		return Nan::ThrowError("Unexpected arguments");
+		error = Nan::Error("Unable to read directory");
 	}
-	if (args.This()->InternalFieldCount() != 1)
+	else
 	{
-		return Nan::ThrowError("Environment not available for instance");
-	}
+		v8::Local<v8::Array> files_array = Nan::New<v8::Array>((int)work->files.size());
+		for (size_t i = 0; i < work->files.size(); i++)
+		{
+			v8::Local<v8::Object> file = Nan::New<v8::Object>();
+			file->Set(Nan::New("path").ToLocalChecked(), Nan::New(work->files[i].path).ToLocalChecked());
+			file->Set(Nan::New("size").ToLocalChecked(), Nan::New((double)work->files[i].size));
+			file->Set(Nan::New("mtime").ToLocalChecked(), Nan::New(work->files[i].mtime));
+			files_array->Set((uint32_t)i, file);
+		}
+		files = files_array;
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
-	{
-		return Nan::ThrowError("Environment is not initialized");
+		v8::Local<v8::Array> unreadable_array = Nan::New<v8::Array>((int)work->unreadable.size());
+		for (size_t i = 0; i < work->unreadable.size(); i++)
+		{
+			unreadable_array->Set((uint32_t)i, Nan::New(work->unreadable[i]).ToLocalChecked());
+		}
+		unreadable = unreadable_array;
 	}
 
-	Nan::Utf8String encrypted_meta_str(args[0]);
-	const char *encrypted_meta = *encrypted_meta_str;
+	v8::Local<v8::Value> argv[] = {
+		error,
+		files,
+		unreadable };
 
-	char *decrypted_meta = genaro_decrypt_meta(env, encrypted_meta);
+	Nan::Call(*(work->callback), 3, argv);
 
-	if (decrypted_meta)
-	{
-		// return the decrypted meta.
-		args.GetReturnValue().Set(Nan::New(decrypted_meta).ToLocalChecked());
-	}
+	delete work->callback;
+	delete work;
 }
 
-void DecryptMetaFromFile(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// list the regular files of a tree on the threadpool
+void ScanDirectory(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
-	if (args.Length() != 1)
-	{
-		return Nan::ThrowError("Unexpected arguments");
-	}
-	if (args.This()->InternalFieldCount() != 1)
-	{
-		return Nan::ThrowError("Environment not available for instance");
-	}
+	Nan::HandleScope scope;
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	if (args.Length() != 2 || !args[1]->IsFunction())
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		return Nan::ThrowError("Unexpected arguments");
 	}
 
-	Nan::Utf8String file_path_str(args[0]);
-	const char *file_path = *file_path_str;
-
-	//convert to ANSI encoding on Win32
-#if defined(_WIN32)
-	std::unique_ptr<char[]> u_p = EncodingConvert(file_path, CP_UTF8, CP_ACP);
-	file_path = u_p.get();
-#endif
-
-	FILE *fp;
-    fp = fopen(file_path, "rb");
-    if (fp == NULL) {
-		return;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    size_t fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+	Nan::Utf8String root_str(args[0]);
 
-    char *buffer = (char *)calloc(fsize + 1, sizeof(char));
-    if (buffer == NULL) {
-		return;
-    }
+	scan_directory_work_t *work = new scan_directory_work_t();
+	work->req.data = work;
+	work->root = *root_str;
+	work->callback = new Nan::Callback(args[1].As<v8::Function>());
 
-    size_t read_blocks = 0;
-    while ((!feof(fp)) && (!ferror(fp))) {
-        read_blocks = fread(buffer + read_blocks, 1, fsize, fp);
-        if (read_blocks <= 0) {
-            break;
-        }
-    }
+	uv_queue_work(Nan::GetCurrentEventLoop(), &work->req, ScanDirectoryWork, AfterScanDirectoryWork);
+}
 
-    int error = ferror(fp);
-    fclose(fp);
+// the files of one utilHashFiles call, split into slices each hashed by
+// a job of their own
+typedef struct
+{
+	std::vector<std::string> paths;
+	std::vector<std::string> hashes;
+	int pending_jobs;
+	Nan::Callback *callback;
+} hash_files_batch_t;
 
-    if (error) {
-		free(buffer);
-		return;
-    }
+typedef struct
+{
+	uv_work_t req;
+	hash_files_batch_t *batch;
+	size_t begin;
+	size_t end;
+} hash_files_work_t;
 
-	char *decrypted_meta = genaro_decrypt_meta(env, buffer);
-	free(buffer);
+#define HASH_FILES_MAX_JOBS 4
 
-	if (decrypted_meta) {
-		args.GetReturnValue().Set(Nan::New(decrypted_meta).ToLocalChecked());
+void HashFilesWork(uv_work_t *req)
+{
+	hash_files_work_t *work = (hash_files_work_t *)req->data;
+	for (size_t i = work->begin; i < work->end; i++)
+	{
+		work->batch->hashes[i] = HashFile(work->batch->paths[i].c_str());
 	}
 }
 
-void RegisterCallback(uv_work_t *work_req, int status)
+void AfterHashFilesWork(uv_work_t *req, int status)
 {
-	Nan::HandleScope scope;
+	hash_files_work_t *work = (hash_files_work_t *)req->data;
+	hash_files_batch_t *batch = work->batch;
+	delete work;
 
-	json_request_t *req = (json_request_t *)work_req->data;
-
-	Nan::Callback *callback = (Nan::Callback *)req->handle;
+	if (--batch->pending_jobs)
+	{
+		return;
+	}
 
-	v8::Local<v8::Value> error = Nan::Null();
-	v8::Local<v8::Value> result = Nan::Null();
+	Nan::HandleScope scope;
 
-	if (error_and_status_check<json_request_t>(req, &error))
+	v8::Local<v8::Array> hashes = Nan::New<v8::Array>((int)batch->hashes.size());
+	for (size_t i = 0; i < batch->hashes.size(); i++)
 	{
-		const char *result_str = json_object_to_json_string(req->response);
-		v8::Local<v8::String> result_json_string = Nan::New(result_str).ToLocalChecked();
-		Nan::JSON NanJSON;
-		Nan::MaybeLocal<v8::Value> res = NanJSON.Parse(result_json_string);
-		if (!res.IsEmpty())
+		if (batch->hashes[i].empty())
 		{
-			result = res.ToLocalChecked();
+			hashes->Set((uint32_t)i, Nan::Null());
+		}
+		else
+		{
+			hashes->Set((uint32_t)i, Nan::New(batch->hashes[i]).ToLocalChecked());
 		}
 	}
 
 	v8::Local<v8::Value> argv[] = {
-		error,
-		result };
+		Nan::Null(),
+		hashes };
 
-	Nan::Call(*callback, 2, argv);
+	Nan::Call(*(batch->callback), 2, argv);
 
-	free(req);
-	free(work_req);
+	delete batch->callback;
+	delete batch;
 }
 
-void DestroyEnvironment(const Nan::FunctionCallbackInfo<v8::Value> &args)
+// sha256 of every file on the threadpool, null for files that could not
+// be read
+void HashFiles(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
-	if (args.This()->InternalFieldCount() != 1)
-	{
-		return Nan::ThrowError("Environment not available for instance");
-	}
+	Nan::HandleScope scope;
 
-	genaro_env_t *env = (genaro_env_t *)args.This()->GetAlignedPointerFromInternalField(0);
-	if (!env)
+	if (args.Length() != 2 || !args[0]->IsArray() || !args[1]->IsFunction())
 	{
-		return Nan::ThrowError("Environment is not initialized");
+		return Nan::ThrowError("Unexpected arguments");
 	}
 
-	if (genaro_destroy_env(env))
+	v8::Local<v8::Array> paths = args[0].As<v8::Array>();
+
+	hash_files_batch_t *batch = new hash_files_batch_t();
+	for (uint32_t i = 0; i < paths->Length(); i++)
 	{
-		Nan::ThrowError("Unable to destroy environment");
+		Nan::Utf8String path_str(paths->Get(i));
+		batch->paths.push_back(*path_str);
 	}
-	args.This()->SetAlignedPointerInInternalField(0, NULL);
-}
+	batch->hashes.resize(batch->paths.size());
+	batch->callback = new Nan::Callback(args[1].As<v8::Function>());
 
-void FreeEnvironmentCallback(const Nan::WeakCallbackInfo<free_env_proxy> &data)
-{
-	free_env_proxy *proxy = data.GetParameter();
-	v8::Local<v8::Object> obj = Nan::New<v8::Object>(proxy->persistent);
-	genaro_env_t *env = (genaro_env_t *)obj->GetAlignedPointerFromInternalField(0);
+	// at least one job, an empty list is answered on a later tick too
+	size_t jobs = std::max(std::min(batch->paths.size(), (size_t)HASH_FILES_MAX_JOBS), (size_t)1);
 
-	if (env && genaro_destroy_env(env))
+	batch->pending_jobs = (int)jobs;
+	size_t slice = (batch->paths.size() + jobs - 1) / jobs;
+	for (size_t i = 0; i < jobs; i++)
 	{
-		Nan::ThrowError("Unable to destroy environment");
+		hash_files_work_t *work = new hash_files_work_t();
+		work->req.data = work;
+		work->batch = batch;
+		work->begin = i * slice;
+		work->end = std::min(work->begin + slice, batch->paths.size());
+		uv_queue_work(Nan::GetCurrentEventLoop(), &work->req, HashFilesWork, AfterHashFilesWork);
 	}
-	delete proxy;
 }
 
-void Environment(const v8::FunctionCallbackInfo<v8::Value> &args)
+// an environment still alive when the addon instance goes away, whose
+// loop is about to be closed. Its handles are closed and the sink is
+// taken out of the ones other threads wake up.
+void CloseEnvContext(env_context_t *ctx)
 {
-	Nan::EscapableHandleScope scope;
-	if (args.Length() == 0)
-	{
-		return Nan::ThrowError("First argument is expected");
-	}
-
-	v8::Local<v8::Object> options = args[0].As<v8::Object>();
-
-	v8::Local<v8::String> bridgeUrl = options->Get(Nan::New("bridgeUrl").ToLocalChecked()).As<v8::String>();
-	v8::Local<v8::String> key_file = options->Get(Nan::New("keyFile").ToLocalChecked()).As<v8::String>();
-	v8::Local<v8::String> passphrase = options->Get(Nan::New("passphrase").ToLocalChecked()).As<v8::String>();
-	Nan::MaybeLocal<v8::Value> user_agent = options->Get(Nan::New("userAgent").ToLocalChecked());
-	Nan::MaybeLocal<v8::Value> logLevel = options->Get(Nan::New("logLevel").ToLocalChecked());
-
-	v8::Local<v8::FunctionTemplate> constructor = Nan::New<v8::FunctionTemplate>();
-	constructor->SetClassName(Nan::New("Environment").ToLocalChecked());
-	constructor->InstanceTemplate()->SetInternalFieldCount(1);
-
-	Nan::SetPrototypeMethod(constructor, "getInfo", GetInfo);
-	Nan::SetPrototypeMethod(constructor, "getBuckets", GetBuckets);
-	Nan::SetPrototypeMethod(constructor, "createBucket", CreateBucket);
-	Nan::SetPrototypeMethod(constructor, "deleteBucket", DeleteBucket);
-	Nan::SetPrototypeMethod(constructor, "renameBucket", RenameBucket);
-	Nan::SetPrototypeMethod(constructor, "listFiles", ListFiles);
-	Nan::SetPrototypeMethod(constructor, "generateEncryptionInfo", GenerateEncryptionInfo);
-	Nan::SetPrototypeMethod(constructor, "storeFile", StoreFile);
-	Nan::SetPrototypeMethod(constructor, "storeFileCancel", StoreFileCancel);
-	Nan::SetPrototypeMethod(constructor, "resolveFile", ResolveFile);
-	Nan::SetPrototypeMethod(constructor, "resolveFileCancel", ResolveFileCancel);
-	Nan::SetPrototypeMethod(constructor, "deleteFile", DeleteFile);
-	Nan::SetPrototypeMethod(constructor, "encryptMeta", EncryptMeta);
-	Nan::SetPrototypeMethod(constructor, "encryptMetaToFile", EncryptMetaToFile);
-	Nan::SetPrototypeMethod(constructor, "decryptMeta", DecryptMeta);
-	Nan::SetPrototypeMethod(constructor, "decryptMetaFromFile", DecryptMetaFromFile);
-	Nan::SetPrototypeMethod(constructor, "decryptFile", DecryptFile);
-	Nan::SetPrototypeMethod(constructor, "destroy", DestroyEnvironment);
-
-	Nan::MaybeLocal<v8::Object> maybeInstance;
-	v8::Local<v8::Object> instance;
+	Nan::HandleScope scope;
 
-	v8::Local<v8::Value> *argv = 0;
-	maybeInstance = Nan::NewInstance(constructor->GetFunction(), 0, argv);
+	ctx->addon = NULL;
 
-	if (maybeInstance.IsEmpty())
-	{
-		return Nan::ThrowError("Could not create new Genaro instance");
-	}
-	else
+	if (ctx->log_sink)
 	{
-		instance = maybeInstance.ToLocalChecked();
+		DestroyLogSink(ctx->log_sink);
+		ctx->log_sink = NULL;
 	}
 
-	// Bridge URL handling
-	Nan::Utf8String _bridgeUrl(bridgeUrl);
-	const char *url = *_bridgeUrl;
-	char proto[6];
-	char host[100];
-	int port = 0;
-	sscanf(url, "%5[^://]://%99[^:/]:%99d", proto, host, &port);
-	if (port == 0)
+	// or destroyed already and waiting for what it still does
+	genaro_env_t *env = NULL;
+	if (ctx->proxy)
 	{
-		if (strcmp(proto, "http") == 0)
-		{
-			port = 80;
-		}
-		else
+		v8::Local<v8::Object> obj = Nan::New<v8::Object>(ctx->proxy->persistent);
+		env = (genaro_env_t *)obj->GetAlignedPointerFromInternalField(0);
+		obj->SetAlignedPointerInInternalField(0, NULL);
+		obj->SetAlignedPointerInInternalField(1, NULL);
+
+		ctx->proxy->persistent.Reset();
+		delete ctx->proxy;
+		ctx->proxy = NULL;
+
+		// js can not be called anymore, queued transfers just go away
+		while (!ctx->transfer_queue.empty())
 		{
-			port = 443;
+			transfer_callbacks_t *callbacks = ctx->transfer_queue.front();
+			UnqueueTransfer(ctx, callbacks);
+			ReleaseTransfer(callbacks);
 		}
 	}
 
-	// V8 types to C types
-	Nan::Utf8String _keyFileObj(key_file);
-	const char *_key_file = *_keyFileObj;
-	Nan::Utf8String _passphraseObj(passphrase);
-	const char *_passphrase = *_passphraseObj;
-
-	// Setup option structs
-	genaro_bridge_options_t bridge_options = {};
-	bridge_options.proto = proto;
-	bridge_options.host = host;
-	bridge_options.port = port;
-
-	json_object *key_json_obj = json_tokener_parse(_key_file);
-	key_result_t *key_result = genaro_parse_key_file(key_json_obj, _passphrase);
-	if (key_result == NULL)
+	// nothing comes back from the io thread anymore, what runs on it is
+	// canceled and abandoned with it
+	if (ctx->io_loop)
 	{
-		json_object_put(key_json_obj);
-		return Nan::ThrowError("Key file and passphrase mismatch.");
+		CancelTransfers(ctx);
+		StopIoThread(ctx);
+		ctx->io_pending = 0;
+		for (transfer_callbacks_t *callbacks : ctx->transfers)
+		{
+			ReleaseTransferMemory(ctx, callbacks);
+		}
+		ctx->transfers.clear();
 	}
-	genaro_encrypt_options_t encrypt_options;
-	genaro_key_result_to_encrypt_options(key_result, &encrypt_options);
-	json_object_put(key_json_obj);
 
-	genaro_http_options_t http_options = {};
-	if (!user_agent.ToLocalChecked()->IsNullOrUndefined())
+	// threadpool jobs and transfers on the loop of the worker may still
+	// finish while it closes, the last of them destroys the env
+	if (env)
 	{
-		Nan::Utf8String str(user_agent.ToLocalChecked());
-		http_options.user_agent = strdup(*str);
+		DestroyEnvWhenIdle(env, ctx);
 	}
 	else
 	{
-		http_options.user_agent = "genaro-test";
+		DestroyEnvIfIdle(ctx);
 	}
-	http_options.low_speed_limit = GENARO_LOW_SPEED_LIMIT;
-	http_options.low_speed_time = GENARO_LOW_SPEED_TIME;
-	http_options.timeout = GENARO_HTTP_TIMEOUT;
-	http_options.cainfo_path = NULL;
+}
 
-	static genaro_log_options_t log_options = {};
-	log_options.logger = JsonLogger;
-	log_options.level = 0;
-	if (!logLevel.ToLocalChecked()->IsNullOrUndefined())
+void FreeAddonData(void *arg)
+{
+	addon_data_t *addon = (addon_data_t *)arg;
+
+	while (!addon->contexts.empty())
 	{
-		log_options.level = Nan::To<int>(logLevel.ToLocalChecked()).FromJust();
+		env_context_t *ctx = addon->contexts.front();
+		addon->contexts.pop_front();
+		CloseEnvContext(ctx);
 	}
 
-	// Initialize environment
-	genaro_env_t *env = genaro_init_env(&bridge_options,
-		&encrypt_options,
-		&http_options,
-		&log_options,
-		true);
-
-	free(encrypt_options.priv_key);
-
-	if (!env)
+	uploading_task_list_t::iterator upload_iter = addon->uploading_task_list.begin();
+	for (; upload_iter != addon->uploading_task_list.end(); ++upload_iter)
 	{
-		Nan::ThrowError("Environment is not initialized");
+		free((void *)upload_iter->bucket_id);
+		free((void *)upload_iter->file_name);
 	}
 
-	// Make sure that the loop is the default loop
-	env->loop = uv_default_loop();
-
-	free_env_proxy *proxy = new free_env_proxy();
-
-	// Pass along the environment so it can be accessed by methods
-	instance->SetAlignedPointerInInternalField(0, env);
-
-	Nan::Persistent<v8::Object> persistent(instance);
-
-	// Setup reference
-	proxy->persistent.Reset(persistent);
-
-	// There is no guarantee that the free callback will be called
-	persistent.SetWeak(proxy, FreeEnvironmentCallback, v8::WeakCallbackType::kParameter);
-	persistent.MarkIndependent();
-	Nan::AdjustExternalMemory(sizeof(genaro_env_t));
+	downloading_task_list_t::iterator download_iter = addon->downloading_task_list.begin();
+	for (; download_iter != addon->downloading_task_list.end(); ++download_iter)
+	{
+		free((void *)download_iter->full_path);
+	}
 
-	args.GetReturnValue().Set(persistent);
+	uv_mutex_destroy(&addon->mutex);
+	delete addon;
 }
 
 void init(v8::Handle<v8::Object> exports)
 {
-	NODE_SET_METHOD(exports, "Environment", Environment);
+	v8::Isolate *isolate = v8::Isolate::GetCurrent();
+
+	// one per context, so the module can be loaded by several workers
+	addon_data_t *addon = new addon_data_t();
+	uv_mutex_init(&addon->mutex);
+	node::AddEnvironmentCleanupHook(isolate, FreeAddonData, addon);
+
+	v8::Local<v8::FunctionTemplate> environment = v8::FunctionTemplate::New(isolate,
+		Environment, v8::External::New(isolate, addon));
+	Nan::Set(exports, Nan::New("Environment").ToLocalChecked(),
+		Nan::GetFunction(environment).ToLocalChecked());
+
 	NODE_SET_METHOD(exports, "utilTimestamp", Timestamp);
+	NODE_SET_METHOD(exports, "utilLogStats", LogStats);
+	NODE_SET_METHOD(exports, "utilConnectionStats", ConnectionStats);
+	NODE_SET_METHOD(exports, "utilChunkFile", ChunkFile);
+	NODE_SET_METHOD(exports, "utilScanDirectory", ScanDirectory);
+	NODE_SET_METHOD(exports, "utilHashFiles", HashFiles);
 }
 
-NODE_MODULE(genaro, init);
+NAN_MODULE_WORKER_ENABLED(genaro, init)
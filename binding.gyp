@@ -1,4 +1,8 @@
 {
+  'variables': {
+    # GENARO_SANITIZE=1 builds with ASan/LSan for the soak test
+    'sanitize%': '<!(node -e "console.log(process.env.GENARO_SANITIZE || 0)")'
+  },
   'targets': [{
     'target_name': 'libgenaro',
     'include_dirs' : [
@@ -12,7 +16,19 @@
     'sources': [
       'binding.cc',
     ],
+    'defines': [
+      '<!(node ./binding.js defines)'
+    ],
     'conditions': [
+      ['sanitize==1 and OS!="win"', {
+          'cflags_cc': [ '-fsanitize=address', '-fno-omit-frame-pointer' ],
+          'ldflags': [ '-fsanitize=address' ],
+          'xcode_settings': {
+            'OTHER_CFLAGS': [ '-fsanitize=address', '-fno-omit-frame-pointer' ],
+            'OTHER_LDFLAGS': [ '-fsanitize=address' ]
+          }
+        }
+      ],
       ['OS=="mac"', {
           'xcode_settings': {
             'MACOSX_DEPLOYMENT_TARGET': '10.13',
@@ -54,6 +54,11 @@ try {
   installed = false;
 }
 
+// a static libgenaro on linux gets its curl handles wrapped, so they
+// share connections (GENARO_CURL_SHARE in binding.cc)
+const curlShare = !installed && platform === 'linux';
+const curlWrap = ['curl_easy_init', 'curl_easy_perform'].map((s) => '-Wl,--wrap=' + s).join(' ');
+
 const cmd = process.argv[2];
 let status = 1;
 
@@ -73,7 +78,11 @@ switch(cmd) {
   case 'ldflags':
     status = 0;
     const ldflags = archives.map((a) => '-Wl,--whole-archive ' + a).join(' ') + ' -lidn2';
-    stdout.write(installed ? '' : ldflags + ' -Wl,--no-whole-archive');
+    stdout.write(installed ? '' : ldflags + ' -Wl,--no-whole-archive' + (curlShare ? ' ' + curlWrap : ''));
+    break;
+  case 'defines':
+    status = 0;
+    stdout.write('GENARO_CURL_SHARE=' + (curlShare ? 1 : 0));
     break;
   case 'ldflags_mac':
     status = 0;
@@ -1,3 +1,36 @@
 'use strict';
 
-module.exports = require('bindings')('genaro.node');
+const binding = require('bindings')('genaro.node');
+const bridges = require('./lib/bridges');
+const chunked = require('./lib/chunked');
+const follow = require('./lib/follow');
+const mirror = require('./lib/mirror');
+const multipart = require('./lib/multipart');
+const retry = require('./lib/retry');
+const sync = require('./lib/sync');
+const warmup = require('./lib/warmup');
+
+// the native Environment with the transfers that are built on top of it
+function Environment(options) {
+  // the native check never sees a call without options
+  if (options === undefined || options === null) {
+    throw new Error('First argument is expected');
+  }
+  const urls = bridges.urls(options);
+  const env = new binding.Environment(urls ? bridges.endpointOptions(options, urls, 0) : options);
+  if (urls) {
+    bridges.install(env, urls, options);
+  }
+  chunked.install(env);
+  sync.install(env);
+  mirror.install(env);
+  multipart.install(env, options);
+  follow.install(env);
+  retry.install(env, options);
+  warmup.install(env, options);
+  return env;
+}
+
+module.exports = Object.assign({}, binding, {
+  Environment: Environment
+});
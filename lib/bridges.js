@@ -0,0 +1,318 @@
+'use strict';
+
+// An Environment over several bridges. Every url of `bridgeUrls` gets a
+// native environment of its own, and the bridge requests of the
+// Environment go to the endpoint with the lowest moving average latency
+// that is not cooling down after a failure. A request that could not
+// reach its bridge, or that the bridge failed with a 5xx, takes the
+// endpoint out for a while, and requests that can safely be sent twice
+// are sent to the next endpoint. Transfers are spread over the endpoints
+// the same way but never sent twice, and a cancel goes to the
+// environment that started the transfer.
+//
+// `maxMemory` is split between the endpoints, and transfers prefer the
+// ones that still have room for them. The io thread, encryption info
+// pool and dedupe index belong to the first endpoint, whose environment
+// is the one the caller holds. The logger gets the lines of all of them.
+
+const binding = require('bindings')('genaro.node');
+
+// weight of the latest latency in the moving average
+const EWMA_WEIGHT = 0.3;
+// milliseconds an endpoint is left alone after a failure, doubled for
+// every failure in a row
+const MIN_COOLDOWN = 1000;
+const MAX_COOLDOWN = 30000;
+
+// bridge requests by name, and whether they can be repeated
+const REQUESTS = {
+  getInfo: true,
+  getBuckets: true,
+  listFiles: true,
+  renameBucket: true,
+  deleteBucket: true,
+  deleteFile: true,
+  createBucket: false
+};
+
+// the method of the native environment, which an Environment overrides
+function nativeCall(env, name, args) {
+  return Object.getPrototypeOf(env)[name].apply(env, args);
+}
+
+function Endpoint(url, env) {
+  this.url = url;
+  this.env = env;
+  this.latency = null;
+  this.inflight = 0;
+  this.requests = 0;
+  this.transfers = 0;
+  this.failures = 0;
+  this.failovers = 0;
+  // consecutive failures and when the endpoint may be tried again
+  this.failing = 0;
+  this.retryAt = 0;
+}
+
+Endpoint.prototype.succeeded = function(latency) {
+  this.failing = 0;
+  this.retryAt = 0;
+  this.latency = this.latency === null ? latency :
+    this.latency + EWMA_WEIGHT * (latency - this.latency);
+};
+
+Endpoint.prototype.failed = function() {
+  this.failures++;
+  this.failing++;
+  this.retryAt = Date.now() + Math.min(MAX_COOLDOWN, MIN_COOLDOWN * Math.pow(2, this.failing - 1));
+};
+
+// endpoints that were never asked come first, so every one gets measured
+Endpoint.prototype.score = function() {
+  return (this.latency || 0) * (1 + this.inflight);
+};
+
+// whether the bridge was not reached or failed, as opposed to answering
+// the request with an error of its own
+function bridgeFailed(err) {
+  return err.curlCode !== undefined || err.statusCode >= 500;
+}
+
+// the fastest endpoint that is not cooling down, or the one that cools
+// down first, skipping those in tried
+function pick(endpoints, tried) {
+  const now = Date.now();
+  let best = null;
+  endpoints.forEach(function(endpoint) {
+    if (tried.has(endpoint)) {
+      return;
+    }
+    if (!best) {
+      best = endpoint;
+      return;
+    }
+    const ready = endpoint.retryAt <= now;
+    const bestReady = best.retryAt <= now;
+    if (ready !== bestReady) {
+      if (ready) {
+        best = endpoint;
+      }
+    } else if (!ready) {
+      if (endpoint.retryAt < best.retryAt) {
+        best = endpoint;
+      }
+    } else if (endpoint.score() < best.score() ||
+        (endpoint.score() === best.score() && endpoint.inflight < best.inflight)) {
+      best = endpoint;
+    }
+  });
+  return best;
+}
+
+function route(endpoints, name, args) {
+  const callback = args[args.length - 1];
+  if (typeof callback !== 'function') {
+    // let the native method throw for its arguments
+    return nativeCall(endpoints[0].env, name, args);
+  }
+
+  const tried = new Set();
+
+  function send(endpoint) {
+    const started = Date.now();
+    tried.add(endpoint);
+
+    nativeCall(endpoint.env, name, args.slice(0, -1).concat(function(err) {
+      endpoint.inflight--;
+      if (err && bridgeFailed(err)) {
+        endpoint.failed();
+        const next = REQUESTS[name] && pick(endpoints, tried);
+        if (next) {
+          endpoint.failovers++;
+          try {
+            return send(next);
+          } catch (e) {
+            return callback(e);
+          }
+        }
+      } else {
+        endpoint.succeeded(Date.now() - started);
+      }
+      callback.apply(null, arguments);
+    }));
+
+    // counted once the request is queued, the native method may throw
+    endpoint.requests++;
+    endpoint.inflight++;
+  }
+
+  send(pick(endpoints, tried));
+}
+
+// whether the transfers of an endpoint wait for memory already
+function full(endpoint) {
+  const stats = nativeCall(endpoint.env, 'memoryStats', []);
+  return stats.queuedTransfers > 0 || (stats.maxMemory > 0 && stats.inflightBytes >= stats.maxMemory);
+}
+
+// storeFile or resolveFile, options are the last of args. owners maps
+// the state of every transfer to its endpoint.
+function routeTransfer(endpoints, owners, name, args) {
+  const options = args[args.length - 1];
+  if (!options || typeof options !== 'object' || typeof options.finishedCallback !== 'function') {
+    // let the native method throw for its arguments
+    return nativeCall(endpoints[0].env, name, args);
+  }
+
+  // the dedupe index is only kept by the first endpoint
+  let endpoint = endpoints[0];
+  if (name !== 'storeFile' || !options.dedupe) {
+    const skipped = new Set(endpoints.filter(full));
+    endpoint = pick(endpoints, skipped.size < endpoints.length ? skipped : new Set());
+  }
+  const finishedCallback = options.finishedCallback;
+
+  endpoint.inflight++;
+  let state;
+  try {
+    state = nativeCall(endpoint.env, name, args.slice(0, -1).concat(Object.assign({}, options, {
+      finishedCallback: function() {
+        endpoint.inflight--;
+        finishedCallback.apply(null, arguments);
+      }
+    })));
+  } catch (e) {
+    endpoint.inflight--;
+    throw e;
+  }
+  endpoint.transfers++;
+  if (state) {
+    owners.set(state, endpoint);
+  }
+  return state;
+}
+
+function cancelTransfer(env, owners, name, state) {
+  const endpoint = state && typeof state === 'object' ? owners.get(state) : undefined;
+  return nativeCall(endpoint ? endpoint.env : env, name, [state]);
+}
+
+// the stats of every endpoint added up
+function sumStats(endpoints, name) {
+  return endpoints.reduce(function(sum, endpoint) {
+    const stats = nativeCall(endpoint.env, name, []);
+    Object.keys(stats).forEach(function(key) {
+      sum[key] = (sum[key] || 0) + stats[key];
+    });
+    return sum;
+  }, {});
+}
+
+function bridgeStats(endpoints) {
+  const now = Date.now();
+  return endpoints.map(function(endpoint) {
+    return {
+      url: endpoint.url,
+      healthy: endpoint.retryAt <= now,
+      latency: endpoint.latency,
+      inflight: endpoint.inflight,
+      requests: endpoint.requests,
+      transfers: endpoint.transfers,
+      failures: endpoint.failures,
+      failovers: endpoint.failovers
+    };
+  });
+}
+
+// route the requests and transfers of env, which is the environment of
+// endpoints[0], over endpoints
+function attach(env, endpoints, options) {
+  const owners = new WeakMap();
+
+  Object.keys(REQUESTS).forEach(function(name) {
+    if (name === 'deleteFile' && options.dedupeIndex) {
+      return;
+    }
+    env[name] = function() {
+      return route(endpoints, name, Array.prototype.slice.call(arguments));
+    };
+  });
+
+  ['storeFile', 'resolveFile'].forEach(function(name) {
+    env[name] = function() {
+      return routeTransfer(endpoints, owners, name, Array.prototype.slice.call(arguments));
+    };
+    env[name + 'Cancel'] = function(state) {
+      return cancelTransfer(env, owners, name + 'Cancel', state);
+    };
+  });
+
+  env.bridgeStats = function() {
+    return bridgeStats(endpoints);
+  };
+
+  env.memoryStats = function() {
+    return sumStats(endpoints, 'memoryStats');
+  };
+
+  env.requestStats = function() {
+    return sumStats(endpoints, 'requestStats');
+  };
+
+  env.destroy = function() {
+    endpoints.slice(1).forEach(function(endpoint) {
+      endpoint.env.destroy();
+    });
+    return nativeCall(env, 'destroy', []);
+  };
+}
+
+// the urls of `bridgeUrls`, or null for a single bridge
+exports.urls = function(options) {
+  if (!Array.isArray(options.bridgeUrls) || !options.bridgeUrls.length) {
+    return null;
+  }
+  return options.bridgeUrls;
+};
+
+// the options of the native environment of urls[index]
+exports.endpointOptions = function(options, urls, index) {
+  const endpointOptions = Object.assign({}, options, {
+    bridgeUrl: urls[index]
+  });
+  delete endpointOptions.bridgeUrls;
+  if (options.maxMemory) {
+    endpointOptions.maxMemory = Math.max(1, Math.floor(options.maxMemory / urls.length));
+  }
+  if (index > 0) {
+    // the dedupe index is only kept by the first one, deleteFile has to
+    // stay with it. The other two would only cost a thread and memory
+    // per endpoint.
+    endpointOptions.dedupeIndex = undefined;
+    endpointOptions.ioThread = undefined;
+    endpointOptions.encryptionInfoPool = undefined;
+  }
+  return endpointOptions;
+};
+
+// env is the native environment of urls[0], made with endpointOptions
+exports.install = function(env, urls, options) {
+  const endpoints = [new Endpoint(urls[0], env)];
+
+  try {
+    urls.slice(1).forEach(function(url, i) {
+      endpoints.push(new Endpoint(url, new binding.Environment(exports.endpointOptions(options, urls, i + 1))));
+    });
+  } catch (e) {
+    endpoints.forEach(function(endpoint) {
+      endpoint.env.destroy();
+    });
+    throw e;
+  }
+
+  attach(env, endpoints, options);
+};
+
+exports.Endpoint = Endpoint;
+exports.pick = pick;
+exports.attach = attach;
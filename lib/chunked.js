@@ -0,0 +1,368 @@
+'use strict';
+
+// Chunked transfers of large files. A file is split at content defined
+// boundaries, every chunk is stored as a file of its own named after its
+// sha256, and only chunks the bucket does not have yet are uploaded. The
+// list of chunks is kept in a manifest encrypted with encryptMeta, which
+// is uploaded like any other file and is what resolveChunked starts from.
+
+const fs = require('fs');
+const crypto = require('crypto');
+const binding = require('bindings')('genaro.node');
+const util = require('./util');
+
+const noop = util.noop;
+const tempPath = util.tempPath;
+const runQueue = util.runQueue;
+
+const MANIFEST_VERSION = 1;
+const DEFAULT_CONCURRENCY = 4;
+
+function chunkName(hash) {
+  return hash + '.chunk';
+}
+
+// shared by both directions: native states in flight, so a cancel can
+// reach them, and a finished callback that only ever runs once
+function ChunkedState(finishedCallback) {
+  this.canceled = false;
+  this.finished = false;
+  this.uploads = new Set();
+  this.downloads = new Set();
+  this.finishedCallback = finishedCallback || noop;
+}
+
+ChunkedState.prototype.finish = function() {
+  if (this.finished) {
+    return;
+  }
+  this.finished = true;
+  this.finishedCallback.apply(null, arguments);
+};
+
+// chunks already in the bucket, with the key and ctr they were stored
+// with, which are kept encrypted in their rsaKey and rsaCtr
+function existingChunks(env, files) {
+  const existing = new Map();
+  files.forEach(function(file) {
+    if (!/^[0-9a-f]{64}\.chunk$/.test(file.filename)) {
+      return;
+    }
+    const fileKey = util.fileKey(env, file);
+    if (fileKey) {
+      existing.set(file.filename.slice(0, 64), { fileId: file.id, key: fileKey.key, ctr: fileKey.ctr });
+    }
+  });
+  return existing;
+}
+
+function uploadChunk(env, state, bucketId, filePath, chunk, callback) {
+  const chunkPath = tempPath('genaro-chunk');
+
+  util.copyRange(filePath, chunk.offset, chunk.length, chunkPath, function(err) {
+    if (err || state.canceled) {
+      fs.unlink(chunkPath, noop);
+      return callback(err || new Error('Transfer canceled'));
+    }
+
+    const info = env.generateEncryptionInfo(bucketId);
+    if (!info) {
+      fs.unlink(chunkPath, noop);
+      return callback(new Error('Unable to generate encryption info'));
+    }
+
+    // the finished callback runs before storeFile returns if it fails early
+    let upload;
+    upload = env.storeFile(bucketId, chunkPath, true, {
+      filename: chunkName(chunk.hash),
+      index: info.index,
+      key: info.key,
+      ctr: info.ctr,
+      rsaKey: env.encryptMeta(info.key),
+      rsaCtr: env.encryptMeta(info.ctr),
+      progressCallback: noop,
+      finishedCallback: function(err, fileId) {
+        state.uploads.delete(upload);
+        fs.unlink(chunkPath, noop);
+        if (err) {
+          return callback(err);
+        }
+        callback(null, { fileId: fileId, key: info.key, ctr: info.ctr });
+      }
+    });
+    if (upload) {
+      state.uploads.add(upload);
+    }
+  });
+}
+
+function storeChunked(env, bucketId, filePath, options) {
+  const state = new ChunkedState(options.finishedCallback);
+  const progressCallback = options.progressCallback || noop;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+  const sizes = {
+    minSize: options.minSize,
+    avgSize: options.avgSize,
+    maxSize: options.maxSize
+  };
+
+  binding.utilChunkFile(filePath, sizes, function(err, chunks) {
+    if (err) {
+      return state.finish(err);
+    }
+
+    env.listFiles(bucketId, function(err, files) {
+      if (err) {
+        return state.finish(err);
+      }
+      if (state.canceled) {
+        return state.finish(new Error('Transfer canceled'));
+      }
+
+      const stored = existingChunks(env, files || []);
+      const missing = new Map();
+      chunks.forEach(function(chunk) {
+        if (!stored.has(chunk.hash) && !missing.has(chunk.hash)) {
+          missing.set(chunk.hash, chunk);
+        }
+      });
+
+      const total = chunks.reduce(function(sum, chunk) {
+        return sum + chunk.length;
+      }, 0);
+      let missingBytes = 0;
+      missing.forEach(function(chunk) {
+        missingBytes += chunk.length;
+      });
+      let uploadedBytes = 0;
+
+      runQueue(Array.from(missing.values()), concurrency, function(chunk, done) {
+        uploadChunk(env, state, bucketId, filePath, chunk, function(err, result) {
+          if (err) {
+            return done(err);
+          }
+          stored.set(chunk.hash, result);
+          uploadedBytes += chunk.length;
+          progressCallback(missingBytes ? uploadedBytes / missingBytes : 1, uploadedBytes);
+          done(null);
+        });
+      }, function(err) {
+        if (err) {
+          return state.finish(state.canceled ? new Error('Transfer canceled') : err);
+        }
+
+        const manifest = {
+          version: MANIFEST_VERSION,
+          size: total,
+          chunks: chunks.map(function(chunk) {
+            const entry = stored.get(chunk.hash);
+            return {
+              offset: chunk.offset,
+              length: chunk.length,
+              hash: chunk.hash,
+              fileId: entry.fileId,
+              key: entry.key,
+              ctr: entry.ctr
+            };
+          })
+        };
+
+        const encrypted = env.encryptMeta(JSON.stringify(manifest));
+        if (!encrypted) {
+          return state.finish(new Error('Unable to encrypt manifest'));
+        }
+
+        let upload;
+        upload = env.storeFile(bucketId, encrypted, false, {
+          filename: options.filename,
+          index: options.index,
+          key: options.key,
+          ctr: options.ctr,
+          rsaKey: options.rsaKey,
+          rsaCtr: options.rsaCtr,
+          progressCallback: noop,
+          finishedCallback: function(err, fileId) {
+            state.uploads.delete(upload);
+            if (err) {
+              return state.finish(err);
+            }
+            state.finish(null, fileId, {
+              chunks: chunks.length,
+              uploadedChunks: missing.size,
+              uploadedBytes: uploadedBytes
+            });
+          }
+        });
+        if (upload) {
+          state.uploads.add(upload);
+        }
+      });
+    });
+  });
+
+  return state;
+}
+
+function readManifest(env, bucketId, manifestFileId, options, callback) {
+  util.readEncryptedJson(env, bucketId, manifestFileId, options, function(err, manifest) {
+    if (err) {
+      return callback(err);
+    }
+    if (!manifest || manifest.version !== MANIFEST_VERSION || !Array.isArray(manifest.chunks)) {
+      return callback(new Error('Invalid chunk manifest'));
+    }
+    callback(null, manifest);
+  });
+}
+
+// download one chunk and write it to every offset it occurs at
+function downloadChunk(env, state, bucketId, fd, chunk, offsets, callback) {
+  const chunkPath = tempPath('genaro-chunk');
+
+  let download;
+  download = env.resolveFile(bucketId, chunk.fileId, chunkPath, {
+    key: chunk.key,
+    ctr: chunk.ctr,
+    overwrite: true,
+    decrypt: true,
+    size: chunk.length,
+    multipart: false,
+    progressCallback: noop,
+    finishedCallback: function(err) {
+      state.downloads.delete(download);
+      if (err) {
+        fs.unlink(chunkPath, noop);
+        return callback(err);
+      }
+
+      fs.readFile(chunkPath, function(err, data) {
+        fs.unlink(chunkPath, noop);
+        if (err) {
+          return callback(err);
+        }
+
+        const hash = crypto.createHash('sha256').update(data).digest('hex');
+        if (data.length !== chunk.length || hash !== chunk.hash) {
+          return callback(new Error('Chunk ' + chunk.hash + ' does not match the manifest'));
+        }
+
+        runQueue(offsets, offsets.length, function(offset, done) {
+          fs.write(fd, data, 0, data.length, offset, function(err) {
+            done(err);
+          });
+        }, callback);
+      });
+    }
+  });
+  if (download) {
+    state.downloads.add(download);
+  }
+}
+
+function resolveChunked(env, bucketId, manifestFileId, filePath, options) {
+  const state = new ChunkedState(options.finishedCallback);
+  const progressCallback = options.progressCallback || noop;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+
+  if (!options.overwrite && fs.existsSync(filePath)) {
+    process.nextTick(function() {
+      state.finish(new Error('File already exists'));
+    });
+    return state;
+  }
+
+  readManifest(env, bucketId, manifestFileId, options, function(err, manifest) {
+    if (err) {
+      return state.finish(err);
+    }
+    if (state.canceled) {
+      return state.finish(new Error('Transfer canceled'));
+    }
+
+    // chunks repeated in the file are downloaded once
+    const unique = new Map();
+    manifest.chunks.forEach(function(chunk) {
+      const entry = unique.get(chunk.hash);
+      if (entry) {
+        entry.offsets.push(chunk.offset);
+      } else {
+        unique.set(chunk.hash, { chunk: chunk, offsets: [chunk.offset] });
+      }
+    });
+
+    const partialPath = filePath + '.genarochunked';
+    fs.open(partialPath, 'w', function(err, fd) {
+      if (err) {
+        return state.finish(err);
+      }
+
+      function fail(err) {
+        fs.close(fd, function() {
+          fs.unlink(partialPath, function() {
+            state.finish(state.canceled ? new Error('Transfer canceled') : err);
+          });
+        });
+      }
+
+      fs.ftruncate(fd, manifest.size, function(err) {
+        if (err) {
+          return fail(err);
+        }
+
+        let writtenBytes = 0;
+        runQueue(Array.from(unique.values()), concurrency, function(entry, done) {
+          downloadChunk(env, state, bucketId, fd, entry.chunk, entry.offsets, function(err) {
+            if (err) {
+              return done(err);
+            }
+            writtenBytes += entry.chunk.length * entry.offsets.length;
+            progressCallback(manifest.size ? writtenBytes / manifest.size : 1, writtenBytes);
+            done(null);
+          });
+        }, function(err) {
+          if (err) {
+            return fail(err);
+          }
+
+          fs.close(fd, function(err) {
+            if (err) {
+              fs.unlink(partialPath, noop);
+              return state.finish(err);
+            }
+            fs.rename(partialPath, filePath, function(err) {
+              if (err) {
+                fs.unlink(partialPath, noop);
+                return state.finish(err);
+              }
+              state.finish(null, manifest.size);
+            });
+          });
+        });
+      });
+    });
+  });
+
+  return state;
+}
+
+function cancelChunked(env, state) {
+  state.canceled = true;
+  state.uploads.forEach(function(upload) {
+    env.storeFileCancel(upload);
+  });
+  state.downloads.forEach(function(download) {
+    env.resolveFileCancel(download);
+  });
+}
+
+exports.install = function(env) {
+  env.storeChunked = function(bucketId, filePath, options) {
+    return storeChunked(env, bucketId, filePath, options || {});
+  };
+  env.resolveChunked = function(bucketId, manifestFileId, filePath, options) {
+    return resolveChunked(env, bucketId, manifestFileId, filePath, options || {});
+  };
+  env.chunkedCancel = function(state) {
+    cancelChunked(env, state);
+  };
+};
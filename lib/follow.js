@@ -0,0 +1,284 @@
+'use strict';
+
+// Upload of a file that is still being written, like a log or a WAL
+// segment. Whatever was appended is sealed into a segment once there is
+// segmentSize of it, or once the oldest of it waited maxLag, and uploaded
+// as a part of its own straight from the file with the segment option of
+// storeFile. Writes wake it up through fs.watch, which is inotify on
+// Linux. followClose seals the rest and stores a multipart manifest of
+// the segments under the name of the file, so resolveFile with
+// `multipart: true` reassembles it like any multipart upload.
+//
+// Appended data is not held in memory, a segment is only sealed when an
+// upload slot is free, so a slow upload makes the next segments larger
+// instead of queueing them.
+
+const fs = require('fs');
+const util = require('./util');
+const multipart = require('./multipart');
+
+const noop = util.noop;
+
+const DEFAULT_SEGMENT_SIZE = 16 * 1024 * 1024;
+// milliseconds data may wait before it is sealed in a smaller segment
+const DEFAULT_MAX_LAG = 5000;
+const DEFAULT_CONCURRENCY = 2;
+
+function FollowState(finishedCallback) {
+  this.canceled = false;
+  this.closing = false;
+  this.finished = false;
+  this.error = null;
+  this.uploads = new Set();
+  this.watcher = null;
+  this.timer = null;
+  this.poll = null;
+  this.finishedCallback = finishedCallback || noop;
+}
+
+FollowState.prototype.finish = function(err) {
+  if (this.finished) {
+    return;
+  }
+  this.finished = true;
+  this.error = err || null;
+  if (this.watcher) {
+    this.watcher.close();
+  }
+  clearTimeout(this.timer);
+  clearInterval(this.poll);
+  this.finishedCallback.apply(null, arguments);
+};
+
+Object.defineProperty(FollowState.prototype, 'error_status', {
+  get: function() {
+    return this.error;
+  }
+});
+
+function uploadSegment(env, state, bucketId, filePath, filename, part, progress, callback) {
+  util.hashRange(filePath, part.offset, part.length, function(err, hash) {
+    if (err || state.canceled) {
+      return callback(err || multipart.canceledError());
+    }
+
+    const info = env.generateEncryptionInfo(bucketId);
+    if (!info) {
+      return callback(new Error('Unable to generate encryption info'));
+    }
+
+    part.hash = hash;
+
+    // the finished callback runs before storeFile returns if it fails early
+    let upload;
+    upload = env.storeFile(bucketId, filePath, true, {
+      filename: multipart.partName(filename, part.index, hash),
+      index: info.index,
+      key: info.key,
+      ctr: info.ctr,
+      rsaKey: env.encryptMeta(info.key),
+      rsaCtr: env.encryptMeta(info.ctr),
+      ioMode: state.ioMode,
+      segment: { offset: part.offset, length: part.length },
+      progressCallback: function(partProgress) {
+        progress(partProgress * part.length);
+      },
+      finishedCallback: function(err, fileId) {
+        state.uploads.delete(upload);
+        if (err) {
+          return callback(err);
+        }
+        part.fileId = fileId;
+        part.key = info.key;
+        part.ctr = info.ctr;
+        callback(null);
+      }
+    });
+    if (upload) {
+      state.uploads.add(upload);
+    }
+  });
+}
+
+function followFile(env, bucketId, filePath, options) {
+  const state = new FollowState(options.finishedCallback);
+  const progressCallback = options.progressCallback || noop;
+  const segmentCallback = options.segmentCallback || noop;
+  const segmentSize = options.segmentSize || DEFAULT_SEGMENT_SIZE;
+  const maxLag = options.maxLag || DEFAULT_MAX_LAG;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+  const retries = options.retries === undefined ? multipart.DEFAULT_RETRIES : options.retries;
+  state.ioMode = options.ioMode;
+
+  const parts = [];
+  const inflight = new Map();
+  let sealedBytes = 0;
+  let uploadedBytes = 0;
+  let fileSize = 0;
+  // when appended data was first seen that is not sealed yet
+  let waitingSince = 0;
+  let running = 0;
+  let checking = false;
+  let recheck = false;
+  let storing = false;
+
+  function reportProgress() {
+    let bytes = uploadedBytes;
+    inflight.forEach(function(partBytes) {
+      bytes += partBytes;
+    });
+    progressCallback(fileSize ? bytes / fileSize : 1, bytes);
+  }
+
+  function fail(err) {
+    state.canceled = true;
+    state.uploads.forEach(function(upload) {
+      env.storeFileCancel(upload);
+    });
+    state.finish(err);
+  }
+
+  function seal(length) {
+    const part = {
+      index: parts.length,
+      offset: sealedBytes,
+      length: length
+    };
+    parts.push(part);
+    sealedBytes += length;
+    if (sealedBytes === fileSize) {
+      waitingSince = 0;
+    }
+    running++;
+
+    multipart.retry(state, retries, function(attempted) {
+      inflight.set(part.index, 0);
+      uploadSegment(env, state, bucketId, filePath, options.filename, part, function(bytes) {
+        inflight.set(part.index, bytes);
+        reportProgress();
+      }, attempted);
+    }, function(err) {
+      running--;
+      inflight.delete(part.index);
+      if (err) {
+        return fail(err);
+      }
+      uploadedBytes += part.length;
+      reportProgress();
+      segmentCallback(part);
+      check();
+    });
+  }
+
+  function finishManifest() {
+    storing = true;
+    multipart.storeManifest(env, state, bucketId, sealedBytes, segmentSize, parts, null, options, function(err, fileId) {
+      if (err) {
+        return state.finish(err);
+      }
+      state.finish(null, fileId, { parts: parts.length, size: sealedBytes });
+    });
+  }
+
+  // seal what is due while there are free upload slots
+  function check() {
+    if (state.finished || state.canceled || storing) {
+      return;
+    }
+    if (checking) {
+      recheck = true;
+      return;
+    }
+    checking = true;
+
+    fs.stat(filePath, function(err, stat) {
+      checking = false;
+      if (state.finished || state.canceled || storing) {
+        return;
+      }
+      if (err) {
+        return fail(err);
+      }
+      if (stat.size < sealedBytes) {
+        return fail(new Error('File was truncated while following it'));
+      }
+
+      fileSize = stat.size;
+      if (!waitingSince && fileSize > sealedBytes) {
+        waitingSince = Date.now();
+      }
+
+      while (running < concurrency && fileSize > sealedBytes) {
+        const available = fileSize - sealedBytes;
+        if (available < segmentSize && !state.closing && Date.now() - waitingSince < maxLag) {
+          break;
+        }
+        seal(Math.min(available, segmentSize));
+      }
+
+      if (state.closing && !running && fileSize === sealedBytes) {
+        return finishManifest();
+      }
+
+      // data that is not due yet is looked at again once it is, with all
+      // slots busy the next finished upload looks at it
+      clearTimeout(state.timer);
+      if (waitingSince && !state.closing && running < concurrency) {
+        state.timer = setTimeout(check, Math.max(0, waitingSince + maxLag - Date.now()));
+      }
+
+      if (recheck) {
+        recheck = false;
+        check();
+      }
+    });
+  }
+
+  state.close = function() {
+    state.closing = true;
+    if (state.watcher) {
+      state.watcher.close();
+      state.watcher = null;
+    }
+    check();
+  };
+
+  try {
+    state.watcher = fs.watch(filePath, { persistent: false }, function() {
+      check();
+    });
+    state.watcher.on('error', noop);
+  } catch (e) {
+    // without change events the lag timer still seals what was written
+    // by then, only nothing wakes it up earlier
+    state.watcher = null;
+    state.poll = setInterval(check, maxLag);
+  }
+
+  check();
+
+  return state;
+}
+
+function followCancel(env, state) {
+  if (state.finished) {
+    return;
+  }
+  state.canceled = true;
+  state.uploads.forEach(function(upload) {
+    env.storeFileCancel(upload);
+  });
+  state.finish(multipart.canceledError());
+}
+
+exports.install = function(env) {
+  env.followFile = function(bucketId, filePath, options) {
+    return followFile(env, bucketId, filePath, options || {});
+  };
+  env.followClose = function(state) {
+    state.close();
+  };
+  env.followCancel = function(state) {
+    followCancel(env, state);
+  };
+};
@@ -0,0 +1,160 @@
+'use strict';
+
+// Hedged downloads. Shards are fetched inside libgenaro, so the unit that
+// can be hedged is a download of its own, a part of a multipart file. A
+// part still running past the p95 of how long parts of its size took is
+// fetched a second time, the bridge hands out the farmers of its shards
+// again, and whichever copy finishes first is kept and the other one is
+// canceled. Hedged bytes are capped at a share of the bytes downloaded,
+// so a slow network does not double its own load.
+
+// share of the downloaded bytes that may be fetched twice
+const DEFAULT_BUDGET = 0.05;
+const DEFAULT_PERCENTILE = 0.95;
+// durations kept, and needed before anything is hedged
+const MAX_SAMPLES = 64;
+const MIN_SAMPLES = 8;
+
+function Hedger(options) {
+  this.budget = options.budget === undefined ? DEFAULT_BUDGET : options.budget;
+  this.percentile = options.percentile || DEFAULT_PERCENTILE;
+  // milliseconds per byte of the latest downloads
+  this.samples = [];
+  this.requestedBytes = 0;
+  this.hedgedBytes = 0;
+  this.stats = {
+    hedged: 0,
+    won: 0
+  };
+}
+
+Hedger.prototype.record = function(bytes, elapsed) {
+  if (this.samples.length === MAX_SAMPLES) {
+    this.samples.shift();
+  }
+  this.samples.push(elapsed / Math.max(bytes, 1));
+};
+
+// milliseconds after which a download of bytes is late, or -1 while too
+// little is known
+Hedger.prototype.deadline = function(bytes) {
+  if (this.samples.length < MIN_SAMPLES) {
+    return -1;
+  }
+  const sorted = this.samples.slice().sort(function(a, b) {
+    return a - b;
+  });
+  const rank = Math.min(sorted.length - 1, Math.ceil(this.percentile * sorted.length) - 1);
+  return sorted[rank] * Math.max(bytes, 1);
+};
+
+Hedger.prototype.takeBudget = function(bytes) {
+  if (this.hedgedBytes + bytes > this.budget * this.requestedBytes) {
+    return false;
+  }
+  this.hedgedBytes += bytes;
+  return true;
+};
+
+// fetch(progress, callback(err, result)) starts a download of bytes and
+// returns a function that cancels it. A result that lost the race goes to
+// discard. callback gets the first result, or the last error once no
+// download is left.
+Hedger.prototype.run = function(bytes, fetch, discard, progress, callback) {
+  const self = this;
+  const started = Date.now();
+  const running = [];
+  let done = false;
+  let timer = null;
+  let lastError = null;
+  // progress of the copy that got furthest
+  let furthest = 0;
+  let timed = false;
+
+  this.requestedBytes += bytes;
+
+  // how long the first download took, failed or ran until a hedge beat
+  // it, so slow parts are not left out of the deadline
+  function timePrimary() {
+    if (!timed) {
+      timed = true;
+      self.record(bytes, Date.now() - started);
+    }
+  }
+
+  function finish(err, result) {
+    done = true;
+    clearTimeout(timer);
+    timePrimary();
+    running.splice(0).forEach(function(cancel) {
+      cancel();
+    });
+    callback(err, result);
+  }
+
+  function launch(hedge) {
+    let cancel = null;
+    let ended = false;
+
+    function finished(err, result) {
+      ended = true;
+      if (!hedge) {
+        timePrimary();
+      }
+      const index = running.indexOf(cancel);
+      if (index !== -1) {
+        running.splice(index, 1);
+      }
+      if (done) {
+        return err ? undefined : discard(result);
+      }
+      if (err) {
+        lastError = err;
+        return running.length ? undefined : finish(lastError);
+      }
+      if (hedge) {
+        self.stats.won++;
+      }
+      finish(null, result);
+    }
+
+    cancel = fetch(function(fetched) {
+      if (fetched > furthest) {
+        furthest = fetched;
+        progress(fetched);
+      }
+    }, finished);
+    // a fetch that failed right away has nothing left to cancel
+    if (!ended) {
+      running.push(cancel);
+    }
+  }
+
+  launch(false);
+
+  const deadline = this.deadline(bytes);
+  if (!done && deadline >= 0 && this.budget > 0) {
+    timer = setTimeout(function() {
+      if (done || !running.length || !self.takeBudget(bytes)) {
+        return;
+      }
+      self.stats.hedged++;
+      try {
+        launch(true);
+      } catch (e) {
+        // the first download is still running
+      }
+    }, deadline);
+  }
+};
+
+Hedger.prototype.hedgeStats = function() {
+  return {
+    hedged: this.stats.hedged,
+    won: this.stats.won,
+    hedgedBytes: this.hedgedBytes,
+    budgetBytes: Math.max(0, Math.floor(this.budget * this.requestedBytes - this.hedgedBytes))
+  };
+};
+
+exports.Hedger = Hedger;
@@ -0,0 +1,283 @@
+'use strict';
+
+// Download of a whole bucket into a local directory. Every file goes
+// through resolveFile, so it is written to a .genarotmp file and renamed
+// into place like any other download. A local manifest remembers file
+// id, size and sha256 of every downloaded file, so a later run skips the
+// files that are still there unchanged.
+
+const fs = require('fs');
+const path = require('path');
+const binding = require('bindings')('genaro.node');
+const multipart = require('./multipart');
+const util = require('./util');
+
+const MANIFEST_VERSION = 1;
+const MANIFEST_NAME = '.genaro-mirror.json';
+const DEFAULT_CONCURRENCY = 4;
+// downloads between two saves of the manifest
+const CHECKPOINT_INTERVAL = 32;
+
+// file names are relative paths, nothing may end up outside of localDir
+function localPath(localDir, filename) {
+  const fullPath = path.resolve(localDir, filename);
+  const root = path.resolve(localDir) + path.sep;
+  if (!filename || path.isAbsolute(filename) || fullPath.indexOf(root) !== 0) {
+    return null;
+  }
+  return fullPath;
+}
+
+function makeDirectory(dir, callback) {
+  fs.mkdir(dir, function(err) {
+    if (!err || err.code === 'EEXIST') {
+      return callback(null);
+    }
+    if (err.code !== 'ENOENT') {
+      return callback(err);
+    }
+    makeDirectory(path.dirname(dir), function(err) {
+      if (err) {
+        return callback(err);
+      }
+      fs.mkdir(dir, function(err) {
+        callback(err && err.code !== 'EEXIST' ? err : null);
+      });
+    });
+  });
+}
+
+function MirrorState(finishedCallback) {
+  this.canceled = false;
+  this.downloads = new Set();
+  this.finishedCallback = finishedCallback || util.noop;
+}
+
+function downloadFile(env, state, bucketId, file, options, progress, callback) {
+  makeDirectory(path.dirname(file.fullPath), function(err) {
+    if (err) {
+      return callback(err);
+    }
+    if (state.canceled) {
+      return callback(new Error('Mirror canceled'));
+    }
+
+    // files stored with a key of their own keep it encrypted with them
+    let key = '';
+    let ctr = '';
+    if (file.rsaKey && file.rsaCtr) {
+      key = env.decryptMeta(file.rsaKey) || '';
+      ctr = env.decryptMeta(file.rsaCtr) || '';
+    }
+
+    // the finished callback runs before resolveFile returns if it fails early
+    let download;
+    download = env.resolveFile(bucketId, file.id, file.fullPath, {
+      key: key,
+      ctr: ctr,
+      overwrite: true,
+      decrypt: options.decrypt !== false,
+      size: file.size,
+      multipart: file.multipart,
+      progressCallback: function(fileProgress) {
+        progress(fileProgress * file.size);
+      },
+      finishedCallback: function(err, fileBytes, sha256, filePath) {
+        state.downloads.delete(download);
+        if (err) {
+          return callback(err);
+        }
+        // a file that could not be replaced is saved next to it, which the
+        // next run would not find
+        if (path.resolve(filePath) !== path.resolve(file.fullPath)) {
+          return callback(new Error('File could not be replaced, saved as ' + filePath));
+        }
+        // hashed the way the next run will hash it, the page cache is warm
+        binding.utilHashFiles([filePath], function(err, hashes) {
+          callback(err, fileBytes, hashes && hashes[0]);
+        });
+      }
+    });
+    if (download) {
+      state.downloads.add(download);
+    }
+  });
+}
+
+function mirrorBucket(env, bucketId, localDir, options) {
+  const state = new MirrorState(options.finishedCallback);
+  const progressCallback = options.progressCallback || util.noop;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+  const manifestPath = options.manifest || path.join(localDir, MANIFEST_NAME);
+  const manifest = util.loadManifest(manifestPath, MANIFEST_VERSION, bucketId);
+  const started = Date.now();
+  const stats = {
+    files: 0,
+    downloaded: 0,
+    unchanged: 0,
+    downloadedBytes: 0,
+    failed: [],
+    elapsed: 0,
+    bytesPerSecond: 0
+  };
+
+  function throughput(bytes) {
+    const elapsed = Date.now() - started;
+    return elapsed ? bytes * 1000 / elapsed : 0;
+  }
+
+  function finish(err) {
+    stats.elapsed = Date.now() - started;
+    stats.bytesPerSecond = throughput(stats.downloadedBytes);
+    try {
+      util.saveManifest(manifestPath, manifest);
+    } catch (e) {
+      err = err || e;
+    }
+    state.finishedCallback(err || null, stats);
+  }
+
+  env.listFiles(bucketId, function(err, listed) {
+    if (err) {
+      return state.finishedCallback(err, stats);
+    }
+
+    const manifestFullPath = path.resolve(manifestPath);
+    const files = [];
+    listed = listed || [];
+    // parts of multipart uploads come with the file they belong to
+    const multipartNames = new Set();
+    listed.forEach(function(file) {
+      const separator = file.filename.indexOf(multipart.PART_SEPARATOR);
+      if (separator !== -1) {
+        multipartNames.add(file.filename.slice(0, separator));
+      }
+    });
+    listed.forEach(function(file) {
+      if (file.filename.indexOf(multipart.PART_SEPARATOR) !== -1) {
+        return;
+      }
+      file.multipart = multipartNames.has(file.filename);
+      file.fullPath = localPath(localDir, file.filename);
+      if (!file.fullPath) {
+        stats.failed.push({ path: file.filename, message: 'Invalid file name' });
+      } else if (file.fullPath !== manifestFullPath && file.fullPath !== manifestFullPath + '.tmp') {
+        files.push(file);
+      }
+    });
+    stats.files = files.length;
+
+    // only a file that is still there with the size it had is worth hashing
+    const candidates = files.filter(function(file) {
+      const entry = manifest.files[file.filename];
+      if (!entry || entry.fileId !== file.id || entry.size !== file.size) {
+        return false;
+      }
+      try {
+        return fs.statSync(file.fullPath).size === file.size;
+      } catch (e) {
+        return false;
+      }
+    });
+
+    binding.utilHashFiles(candidates.map(function(file) {
+      return file.fullPath;
+    }), function(err, hashes) {
+      const unchanged = new Set();
+      candidates.forEach(function(file, i) {
+        if (hashes && hashes[i] && hashes[i] === manifest.files[file.filename].hash) {
+          unchanged.add(file);
+        }
+      });
+      stats.unchanged = unchanged.size;
+
+      const downloads = files.filter(function(file) {
+        return !unchanged.has(file);
+      });
+      const totalBytes = downloads.reduce(function(sum, file) {
+        return sum + file.size;
+      }, 0);
+      const inflight = new Map();
+      let doneBytes = 0;
+
+      function reportProgress() {
+        let bytes = doneBytes;
+        inflight.forEach(function(fileBytes) {
+          bytes += fileBytes;
+        });
+        progressCallback(totalBytes ? bytes / totalBytes : 1, bytes, totalBytes, throughput(bytes));
+      }
+
+      let sinceCheckpoint = 0;
+      let next = 0;
+      let running = 0;
+
+      function downloadsDone() {
+        if (running || (next < downloads.length && !state.canceled)) {
+          return;
+        }
+        finish(state.canceled ? new Error('Mirror canceled') : null);
+      }
+
+      function start() {
+        while (!state.canceled && running < concurrency && next < downloads.length) {
+          const file = downloads[next++];
+          running++;
+          inflight.set(file.id, 0);
+          downloadFile(env, state, bucketId, file, options, function(bytes) {
+            inflight.set(file.id, bytes);
+            reportProgress();
+          }, function(err, fileBytes, sha256) {
+            running--;
+            inflight.delete(file.id);
+            if (err) {
+              delete manifest.files[file.filename];
+              stats.failed.push({ path: file.filename, message: err.message });
+            } else {
+              manifest.files[file.filename] = {
+                fileId: file.id,
+                size: file.size,
+                hash: sha256
+              };
+              stats.downloaded++;
+              stats.downloadedBytes += fileBytes;
+              doneBytes += file.size;
+              reportProgress();
+              if (++sinceCheckpoint === CHECKPOINT_INTERVAL) {
+                sinceCheckpoint = 0;
+                try {
+                  util.saveManifest(manifestPath, manifest);
+                } catch (e) {
+                  // retried at the end
+                }
+              }
+            }
+            start();
+            downloadsDone();
+          });
+        }
+      }
+
+      start();
+      downloadsDone();
+    });
+  });
+
+  return state;
+}
+
+function mirrorCancel(env, state) {
+  state.canceled = true;
+  state.downloads.forEach(function(download) {
+    env.resolveFileCancel(download);
+  });
+}
+
+exports.install = function(env) {
+  env.mirrorBucket = function(bucketId, localDir, options) {
+    return mirrorBucket(env, bucketId, localDir, options || {});
+  };
+  env.mirrorCancel = function(state) {
+    mirrorCancel(env, state);
+  };
+};
@@ -0,0 +1,979 @@
+'use strict';
+
+// Multipart transfers of huge files. The file is split into byte ranges
+// of partSize that are uploaded as files of their own, several at once
+// and each retried on its own, so a failure costs one part instead of
+// the whole upload. A manifest of the parts, encrypted with encryptMeta,
+// is stored under the name of the file. resolveFile with `multipart:
+// true` downloads the parts of such a manifest in parallel into place,
+// hedging the parts that run late.
+//
+// Parts are named <filename>.genaropart-<index>-<sha256>, so a part an
+// earlier attempt already stored is found and not uploaded again.
+//
+// With `parity`, every group of that many parts gets a parity part, the
+// xor of them, named <filename>.genaropart-p<group>-<sha256>. A download
+// fetches a group and its parity part at once and is done with the group
+// once all but one of them arrived, the missing part is the xor of the
+// others. A slow farmer then costs the bytes of a parity part instead of
+// the time of its part.
+
+const fs = require('fs');
+const hedge = require('./hedge');
+const util = require('./util');
+
+const noop = util.noop;
+const tempPath = util.tempPath;
+const runQueue = util.runQueue;
+
+const MANIFEST_VERSION = 1;
+const PART_SEPARATOR = '.genaropart-';
+const DEFAULT_PART_SIZE = 256 * 1024 * 1024;
+const DEFAULT_CONCURRENCY = 4;
+const DEFAULT_RETRIES = 3;
+// parts per parity part of `parity: true`
+const DEFAULT_PARITY_GROUP = 4;
+// milliseconds, times the number of the attempt
+const RETRY_DELAY = 1000;
+// bytes, a download without `multipart` up to this size is checked for
+// being a manifest, which takes about 200 bytes per part
+const MANIFEST_DETECT_LIMIT = 1024 * 1024;
+
+function partName(filename, index, hash) {
+  return filename + PART_SEPARATOR + index + '-' + hash;
+}
+
+function canceledError() {
+  return new Error('File transfer canceled');
+}
+
+// native states in flight, so a cancel can reach them, and a finished
+// callback that only ever runs once
+function MultipartState(finishedCallback) {
+  this.canceled = false;
+  this.finished = false;
+  this.error = null;
+  this.uploads = new Set();
+  this.downloads = new Set();
+  // the native download of a file that turned out not to be multipart
+  this.single = null;
+  // transfers and writes into the file in flight, and who waits for them
+  this.pending = 0;
+  this.drained = [];
+  this.finishedCallback = finishedCallback || noop;
+}
+
+MultipartState.prototype.begin = function() {
+  this.pending++;
+};
+
+MultipartState.prototype.end = function() {
+  if (--this.pending === 0) {
+    this.drained.splice(0).forEach(function(callback) {
+      callback();
+    });
+  }
+};
+
+// callback once nothing is in flight, a file may only be closed then
+MultipartState.prototype.drain = function(callback) {
+  if (!this.pending) {
+    return callback();
+  }
+  this.drained.push(callback);
+};
+
+MultipartState.prototype.finish = function(err) {
+  if (this.finished) {
+    return;
+  }
+  this.finished = true;
+  this.error = err || null;
+  this.finishedCallback.apply(null, arguments);
+};
+
+// like the error_status of the native states
+Object.defineProperty(MultipartState.prototype, 'error_status', {
+  get: function() {
+    if (this.single) {
+      return this.single.error_status;
+    }
+    return this.error;
+  }
+});
+
+// whether a part that failed with err is worth another attempt. With
+// `retryBudget` the Environment retried rate limited transfers already,
+// with a backoff shared by all of its requests.
+function retriable(err) {
+  return !err.retriesExhausted;
+}
+
+// run operation until it succeeds, up to retries more times
+function retry(state, retries, operation, callback) {
+  let attempt = 0;
+
+  function run() {
+    if (attempt && state.canceled) {
+      return callback(canceledError());
+    }
+    operation(function(err) {
+      if (err && !state.canceled && attempt < retries && retriable(err)) {
+        attempt++;
+        return setTimeout(run, RETRY_DELAY * attempt);
+      }
+      if (err && state.canceled) {
+        return callback(canceledError());
+      }
+      callback.apply(null, arguments);
+    });
+  }
+
+  run();
+}
+
+// parts of filename already in the bucket by name, with the key and ctr
+// they were stored with
+function existingParts(env, files, filename) {
+  const existing = new Map();
+  const prefix = filename + PART_SEPARATOR;
+  files.forEach(function(file) {
+    if (file.filename.indexOf(prefix) !== 0) {
+      return;
+    }
+    const fileKey = util.fileKey(env, file);
+    if (fileKey) {
+      existing.set(file.filename, { fileId: file.id, key: fileKey.key, ctr: fileKey.ctr });
+    }
+  });
+  return existing;
+}
+
+// the bytes of a part in a file of its own, or the xor of the parts of a
+// parity part
+function preparePart(filePath, part, partPath, callback) {
+  if (!part.members) {
+    return util.copyRange(filePath, part.offset, part.length, partPath, callback);
+  }
+
+  fs.open(filePath, 'r', function(err, input) {
+    if (err) {
+      return callback(err);
+    }
+    fs.open(partPath, 'w', function(err, output) {
+      if (err) {
+        fs.close(input, noop);
+        return callback(err);
+      }
+      util.xorRanges(part.members.map(function(member) {
+        return { fd: input, offset: member.offset, length: member.length };
+      }), part.length, output, 0, function(err, hash) {
+        fs.close(input, noop);
+        fs.close(output, function(closeErr) {
+          callback(err || closeErr, hash);
+        });
+      });
+    });
+  });
+}
+
+function uploadPart(env, state, bucketId, filePath, filename, part, existing, progress, done) {
+  const partPath = tempPath('genaro-part');
+
+  state.begin();
+  function callback() {
+    done.apply(null, arguments);
+    state.end();
+  }
+
+  preparePart(filePath, part, partPath, function(err, hash) {
+    if (err || state.canceled) {
+      fs.unlink(partPath, noop);
+      return callback(err || canceledError());
+    }
+
+    part.hash = hash;
+    const name = partName(filename, part.index, hash);
+    const stored = existing.get(name);
+    if (stored) {
+      fs.unlink(partPath, noop);
+      return callback(null, stored, false);
+    }
+
+    const info = env.generateEncryptionInfo(bucketId);
+    if (!info) {
+      fs.unlink(partPath, noop);
+      return callback(new Error('Unable to generate encryption info'));
+    }
+
+    // the finished callback runs before storeFile returns if it fails early
+    let upload;
+    upload = env.storeFile(bucketId, partPath, true, {
+      filename: name,
+      index: info.index,
+      key: info.key,
+      ctr: info.ctr,
+      rsaKey: env.encryptMeta(info.key),
+      rsaCtr: env.encryptMeta(info.ctr),
+      ioMode: state.ioMode,
+      progressCallback: function(partProgress) {
+        progress(partProgress * part.length);
+      },
+      finishedCallback: function(err, fileId) {
+        state.uploads.delete(upload);
+        fs.unlink(partPath, noop);
+        if (err) {
+          return callback(err);
+        }
+        callback(null, { fileId: fileId, key: info.key, ctr: info.ctr }, true);
+      }
+    });
+    if (upload) {
+      state.uploads.add(upload);
+    }
+  });
+}
+
+// store the encrypted manifest of parts, and of parity parts over groups
+// of parityGroup of them if there are any, under options.filename, with
+// the encryption info in options
+function storeManifest(env, state, bucketId, size, partSize, parts, parity, options, callback) {
+  const manifest = {
+    version: MANIFEST_VERSION,
+    type: 'multipart',
+    size: size,
+    partSize: partSize,
+    parts: parts
+  };
+  if (parity && parity.parts.length) {
+    manifest.parityGroup = parity.group;
+    manifest.parity = parity.parts;
+  }
+
+  const encrypted = env.encryptMeta(JSON.stringify(manifest));
+  if (!encrypted) {
+    return callback(new Error('Unable to encrypt manifest'));
+  }
+
+  let upload;
+  upload = env.storeFile(bucketId, encrypted, false, {
+    filename: options.filename,
+    index: options.index,
+    key: options.key,
+    ctr: options.ctr,
+    rsaKey: options.rsaKey,
+    rsaCtr: options.rsaCtr,
+    progressCallback: noop,
+    finishedCallback: function(err, fileId) {
+      state.uploads.delete(upload);
+      callback(err, fileId);
+    }
+  });
+  if (upload) {
+    state.uploads.add(upload);
+  }
+}
+
+function storeMultipart(env, bucketId, filePath, options) {
+  const state = new MultipartState(options.finishedCallback);
+  const progressCallback = options.progressCallback || noop;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+  const retries = options.retries === undefined ? DEFAULT_RETRIES : options.retries;
+  const partSize = options.partSize || DEFAULT_PART_SIZE;
+  const parityGroup = options.parity === true ? DEFAULT_PARITY_GROUP : options.parity || 0;
+  state.ioMode = options.ioMode;
+
+  fs.stat(filePath, function(err, stat) {
+    if (err) {
+      return state.finish(err);
+    }
+
+    const parts = [];
+    for (let offset = 0; offset < stat.size; offset += partSize) {
+      parts.push({
+        index: parts.length,
+        offset: offset,
+        length: Math.min(partSize, stat.size - offset)
+      });
+    }
+
+    // as long as the first, which is the longest, of their group
+    const parityParts = [];
+    for (let first = 0; parityGroup > 0 && first < parts.length; first += parityGroup) {
+      parityParts.push({
+        index: 'p' + parityParts.length,
+        group: parityParts.length,
+        length: parts[first].length,
+        members: parts.slice(first, first + parityGroup)
+      });
+    }
+    const totalBytes = parityParts.reduce(function(sum, part) {
+      return sum + part.length;
+    }, stat.size);
+
+    env.listFiles(bucketId, function(err, files) {
+      if (err) {
+        return state.finish(err);
+      }
+      if (state.canceled) {
+        return state.finish(canceledError());
+      }
+
+      const existing = existingParts(env, files || [], options.filename);
+      const inflight = new Map();
+      let doneBytes = 0;
+      let uploadedParts = 0;
+      let uploadedBytes = 0;
+
+      function reportProgress() {
+        let bytes = doneBytes;
+        inflight.forEach(function(partBytes) {
+          bytes += partBytes;
+        });
+        progressCallback(totalBytes ? bytes / totalBytes : 1, bytes);
+      }
+
+      runQueue(parts.concat(parityParts), concurrency, function(part, done) {
+        retry(state, retries, function(attempted) {
+          inflight.set(part.index, 0);
+          uploadPart(env, state, bucketId, filePath, options.filename, part, existing, function(bytes) {
+            inflight.set(part.index, bytes);
+            reportProgress();
+          }, attempted);
+        }, function(err, stored, uploaded) {
+          inflight.delete(part.index);
+          if (err) {
+            return done(err);
+          }
+          part.fileId = stored.fileId;
+          part.key = stored.key;
+          part.ctr = stored.ctr;
+          doneBytes += part.length;
+          if (uploaded) {
+            uploadedParts++;
+            uploadedBytes += part.length;
+          }
+          reportProgress();
+          done(null);
+        });
+      }, function(err) {
+        if (err) {
+          // the parts still running are stopped before it is reported
+          err = state.canceled ? canceledError() : err;
+          cancelMultipart(env, state);
+          return state.drain(function() {
+            state.finish(err);
+          });
+        }
+
+        const parity = {
+          group: parityGroup,
+          parts: parityParts.map(function(part) {
+            return {
+              group: part.group,
+              length: part.length,
+              hash: part.hash,
+              fileId: part.fileId,
+              key: part.key,
+              ctr: part.ctr
+            };
+          })
+        };
+        storeManifest(env, state, bucketId, stat.size, partSize, parts, parity, options, function(err, fileId) {
+          if (err) {
+            return state.finish(err);
+          }
+          state.finish(null, fileId, {
+            parts: parts.length,
+            parityParts: parityParts.length,
+            uploadedParts: uploadedParts,
+            uploadedBytes: uploadedBytes
+          });
+        });
+      });
+    });
+  });
+
+  return state;
+}
+
+// value if it is a multipart manifest, otherwise null
+function asManifest(value) {
+  if (!value || value.version !== MANIFEST_VERSION ||
+      value.type !== 'multipart' || !Array.isArray(value.parts)) {
+    return null;
+  }
+  if (value.parity && (!Array.isArray(value.parity) || !(value.parityGroup > 0) ||
+      value.parity.length !== Math.ceil(value.parts.length / value.parityGroup))) {
+    return null;
+  }
+  return value;
+}
+
+// callback gets null for a file that does not hold a multipart manifest
+function readManifest(env, bucketId, manifestFileId, options, callback) {
+  util.readEncryptedJson(env, bucketId, manifestFileId, options, function(err, value) {
+    if (err) {
+      return callback(err);
+    }
+    callback(null, asManifest(value));
+  });
+}
+
+// the manifest a finished download without `multipart` holds, or null. A
+// decrypted download is read where it was written, otherwise the file is
+// fetched once more decrypted. Larger files are never taken for one.
+function detectManifest(env, bucketId, fileId, filePath, fileBytes, options, callback) {
+  if (!(fileBytes <= MANIFEST_DETECT_LIMIT)) {
+    return process.nextTick(callback, null);
+  }
+  if (!options.decrypt) {
+    return readManifest(env, bucketId, fileId, options, function(err, manifest) {
+      callback(err ? null : manifest);
+    });
+  }
+  fs.readFile(filePath, 'utf8', function(err, encrypted) {
+    callback(err ? null : asManifest(util.parseEncryptedJson(env, encrypted)));
+  });
+}
+
+// download one part into a temp file, return a function that cancels it
+function fetchPart(env, state, bucketId, part, options, progress, callback) {
+  const partPath = tempPath('genaro-part');
+
+  // a hedge may start after the download was stopped
+  if (state.canceled) {
+    process.nextTick(function() {
+      callback(canceledError());
+    });
+    return noop;
+  }
+
+  state.begin();
+  let download;
+  download = env.resolveFile(bucketId, part.fileId, partPath, {
+    key: part.key,
+    ctr: part.ctr,
+    overwrite: true,
+    decrypt: true,
+    multipart: false,
+    size: part.length,
+    ioMode: options.ioMode,
+    progressCallback: function(partProgress) {
+      progress(partProgress * part.length);
+    },
+    finishedCallback: function(err) {
+      state.downloads.delete(download);
+      if (err) {
+        fs.unlink(partPath, noop);
+        callback(err);
+      } else {
+        callback(null, partPath);
+      }
+      state.end();
+    }
+  });
+  if (download) {
+    state.downloads.add(download);
+  }
+
+  return function() {
+    if (state.downloads.delete(download)) {
+      env.resolveFileCancel(download);
+    }
+  };
+}
+
+// download one part, a second time if it is late, and copy the copy that
+// came first into fd at its offset
+function downloadPart(env, hedger, state, bucketId, fd, part, options, progress, callback) {
+  hedger.run(part.length, function(fetchProgress, fetched) {
+    return fetchPart(env, state, bucketId, part, options, fetchProgress, fetched);
+  }, function(partPath) {
+    fs.unlink(partPath, noop);
+  }, progress, function(err, partPath) {
+    if (err) {
+      return callback(err);
+    }
+
+    state.begin();
+    util.copyInto(partPath, fd, part.offset, function(err, hash, length) {
+      fs.unlink(partPath, noop);
+      state.end();
+      if (err) {
+        return callback(err);
+      }
+      if (length !== part.length || hash !== part.hash) {
+        return callback(new Error('Part ' + part.index + ' does not match the manifest'));
+      }
+      callback(null);
+    });
+  });
+}
+
+// download the parts of a group and their parity part at once, the group
+// is complete once all but one of them arrived. A missing part is then
+// the xor of the others and is written in place from the parity part and
+// the parts already in fd, and the download of it is canceled. callback
+// gets whether a part was reconstructed.
+function downloadGroup(env, state, bucketId, fd, members, parity, options, retries, progress, callback) {
+  const missing = new Set(members.concat(parity));
+  const failed = new Set();
+  const cancels = new Map();
+  const fetched = new Map();
+  let copying = 0;
+  let parityPath = null;
+  // all but one arrived, the rest is no longer waited for
+  let enough = false;
+  let settled = false;
+
+  function reportProgress() {
+    let bytes = 0;
+    fetched.forEach(function(partBytes) {
+      bytes += partBytes;
+    });
+    progress(bytes);
+  }
+
+  function settle(err, reconstructed) {
+    if (settled) {
+      return;
+    }
+    settled = true;
+    cancels.forEach(function(cancel) {
+      cancel();
+    });
+    if (parityPath) {
+      fs.unlink(parityPath, noop);
+    }
+    callback(err, reconstructed);
+  }
+
+  function reconstruct(part) {
+    state.begin();
+    fs.open(parityPath, 'r', function(err, parityFd) {
+      if (err) {
+        state.end();
+        return settle(err);
+      }
+      const sources = [{ fd: parityFd, offset: 0, length: parity.length }];
+      members.forEach(function(member) {
+        if (member !== part) {
+          sources.push({ fd: fd, offset: member.offset, length: member.length });
+        }
+      });
+      util.xorRanges(sources, part.length, fd, part.offset, function(err, hash) {
+        fs.close(parityFd, noop);
+        state.end();
+        if (err) {
+          return settle(err);
+        }
+        if (hash !== part.hash) {
+          return settle(new Error('Part ' + part.index + ' could not be reconstructed'));
+        }
+        fetched.set(part, part.length);
+        reportProgress();
+        settle(null, true);
+      });
+    });
+  }
+
+  // the missing part is only put together once the others are in fd
+  function check() {
+    if (settled || missing.size > 1 || copying) {
+      return;
+    }
+    const part = members.find(function(member) {
+      return missing.has(member);
+    });
+    if (!part) {
+      return settle(null, false);
+    }
+    reconstruct(part);
+  }
+
+  function arrived(part) {
+    missing.delete(part);
+    if (missing.size <= 1 && !enough) {
+      enough = true;
+      missing.forEach(function(straggler) {
+        const cancel = cancels.get(straggler);
+        cancels.delete(straggler);
+        if (cancel) {
+          cancel();
+        }
+      });
+    }
+    check();
+  }
+
+  function fetchMember(part, attempt) {
+    cancels.set(part, fetchPart(env, state, bucketId, part, options, function(bytes) {
+      // parity counts for nothing, it only stands in for a part
+      if (part !== parity) {
+        fetched.set(part, bytes);
+        reportProgress();
+      }
+    }, function(err, partPath) {
+      cancels.delete(part);
+      if (settled || enough) {
+        if (!err) {
+          fs.unlink(partPath, noop);
+        }
+        return;
+      }
+      if (err) {
+        if (state.canceled) {
+          return settle(canceledError());
+        }
+        if (attempt < retries && retriable(err)) {
+          return setTimeout(function() {
+            if (!settled && !enough) {
+              fetchMember(part, attempt + 1);
+            }
+          }, RETRY_DELAY * (attempt + 1));
+        }
+        failed.add(part);
+        // a group can only do without one part
+        if (failed.size > 1) {
+          return settle(new Error('Part ' + part.index + ' could not be downloaded or reconstructed: ' + err.message));
+        }
+        return;
+      }
+
+      if (part === parity) {
+        parityPath = partPath;
+        return arrived(part);
+      }
+
+      copying++;
+      state.begin();
+      util.copyInto(partPath, fd, part.offset, function(err, hash, length) {
+        fs.unlink(partPath, noop);
+        copying--;
+        state.end();
+        if (err) {
+          return settle(err);
+        }
+        if (length !== part.length || hash !== part.hash) {
+          return settle(new Error('Part ' + part.index + ' does not match the manifest'));
+        }
+        arrived(part);
+      });
+    }));
+  }
+
+  members.concat(parity).forEach(function(part) {
+    if (!settled) {
+      fetchMember(part, 0);
+    }
+  });
+}
+
+function resolveMultipart(env, hedger, state, bucketId, manifestFileId, filePath, options) {
+  if (!options.overwrite && fs.existsSync(filePath)) {
+    return process.nextTick(function() {
+      state.finish(new Error('File already exists'), null, null);
+    });
+  }
+
+  readManifest(env, bucketId, manifestFileId, options, function(err, manifest) {
+    if (err) {
+      return state.finish(err, null, null);
+    }
+    if (state.canceled) {
+      return state.finish(canceledError(), null, null);
+    }
+    if (!manifest) {
+      return resolveSingle(env, state, bucketId, manifestFileId, filePath, options);
+    }
+    assembleMultipart(env, hedger, state, bucketId, manifest, filePath, options);
+  });
+}
+
+// download the parts of manifest into filePath
+function assembleMultipart(env, hedger, state, bucketId, manifest, filePath, options) {
+  const progressCallback = options.progressCallback || noop;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+  const retries = options.retries === undefined ? DEFAULT_RETRIES : options.retries;
+
+  const partialPath = filePath + '.genaromultipart';
+  // read back to reconstruct parts from parity
+  fs.open(partialPath, 'w+', function(err, fd) {
+    if (err) {
+      return state.finish(err, null, null);
+    }
+
+    let failed = false;
+
+    // the parts still running are stopped, and fd is closed once none of
+    // them can write into it any more
+    function fail(err) {
+      if (failed) {
+        return;
+      }
+      failed = true;
+      err = state.canceled ? canceledError() : err;
+      cancelMultipart(env, state);
+      state.drain(function() {
+        fs.close(fd, function() {
+          fs.unlink(partialPath, function() {
+            state.finish(err, null, null);
+          });
+        });
+      });
+    }
+
+    fs.ftruncate(fd, manifest.size, function(err) {
+      if (err) {
+        return fail(err);
+      }
+
+      const inflight = new Map();
+      let doneBytes = 0;
+      let reconstructed = 0;
+
+      function reportProgress() {
+        let bytes = doneBytes;
+        inflight.forEach(function(partBytes) {
+          bytes += partBytes;
+        });
+        progressCallback(manifest.size ? bytes / manifest.size : 1, manifest.size);
+      }
+
+      function downloaded(err) {
+        if (err) {
+          return fail(err);
+        }
+
+        const finishFile = options.fsync ? fs.fsync : function(fd, callback) {
+          callback(null);
+        };
+        // hedges and stragglers that lost are canceled but may still run
+        state.drain(function() {
+          finishFile(fd, function(err) {
+            if (err) {
+              return fail(err);
+            }
+            fs.close(fd, function(err) {
+              if (err) {
+                fs.unlink(partialPath, noop);
+                return state.finish(err, null, null);
+              }
+              // replaces an existing file in one step, like resolveFile
+              fs.rename(partialPath, filePath, function(err) {
+                if (err) {
+                  fs.unlink(partialPath, noop);
+                  return state.finish(err, null, null);
+                }
+                state.finish(null, manifest.size, null, filePath, {
+                  parts: manifest.parts.length,
+                  reconstructed: reconstructed
+                });
+              });
+            });
+          });
+        });
+      }
+
+      if (manifest.parity) {
+        const group = manifest.parityGroup;
+        // a group and its parity part are fetched at once
+        return runQueue(manifest.parity, Math.max(1, Math.floor(concurrency / (group + 1))), function(parity, done) {
+          const members = manifest.parts.slice(parity.group * group, (parity.group + 1) * group);
+          const groupBytes = members.reduce(function(sum, part) {
+            return sum + part.length;
+          }, 0);
+          inflight.set(parity.group, 0);
+          downloadGroup(env, state, bucketId, fd, members, parity, options, retries, function(bytes) {
+            inflight.set(parity.group, Math.min(bytes, groupBytes));
+            reportProgress();
+          }, function(err, rebuilt) {
+            inflight.delete(parity.group);
+            if (err) {
+              return done(state.canceled ? canceledError() : err);
+            }
+            if (rebuilt) {
+              reconstructed++;
+            }
+            doneBytes += groupBytes;
+            reportProgress();
+            done(null);
+          });
+        }, downloaded);
+      }
+
+      runQueue(manifest.parts, concurrency, function(part, done) {
+        retry(state, retries, function(attempted) {
+          inflight.set(part.index, 0);
+          downloadPart(env, hedger, state, bucketId, fd, part, options, function(bytes) {
+            inflight.set(part.index, bytes);
+            reportProgress();
+          }, attempted);
+        }, function(err) {
+          inflight.delete(part.index);
+          if (err) {
+            return done(err);
+          }
+          doneBytes += part.length;
+          reportProgress();
+          done(null);
+        });
+      }, downloaded);
+    });
+  });
+}
+
+// every transfer is canceled once, their finished callbacks still come
+function cancelMultipart(env, state) {
+  state.canceled = true;
+  const uploads = Array.from(state.uploads);
+  const downloads = Array.from(state.downloads);
+  state.uploads.clear();
+  state.downloads.clear();
+  uploads.forEach(function(upload) {
+    env.storeFileCancel(upload);
+  });
+  // parts went through env.resolveFile, which may be wrapped again
+  downloads.forEach(function(download) {
+    env.resolveFileCancel(download);
+  });
+  if (state.single) {
+    nativeResolveFileCancel(env, state.single);
+  }
+}
+
+// the resolveFile and resolveFileCancel an env had before install, the
+// native ones or those routing over bridgeUrls
+const wrapped = new WeakMap();
+
+// native states of downloads that turned out to be a manifest, to the
+// MultipartState putting the file together from its parts
+const assembling = new WeakMap();
+
+function nativeResolveFile(env, args) {
+  return wrapped.get(env).resolveFile.apply(env, args);
+}
+
+function nativeResolveFileCancel(env, state) {
+  return wrapped.get(env).resolveFileCancel.call(env, state);
+}
+
+// the native download of a file that was asked for as multipart but does
+// not hold a manifest
+function resolveSingle(env, state, bucketId, fileId, filePath, options) {
+  state.single = nativeResolveFile(env, [bucketId, fileId, filePath, Object.assign({}, options, {
+    progressCallback: options.progressCallback || noop,
+    finishedCallback: function() {
+      state.finish.apply(state, arguments);
+    }
+  })]);
+}
+
+// the native download of a file without `multipart`. If it holds a
+// manifest after all, the file is put together from the parts in place of
+// it, and the native state cancels that too.
+function resolveDetecting(env, hedger, args) {
+  const bucketId = args[0];
+  const fileId = args[1];
+  const filePath = args[2];
+  const options = args[3];
+
+  const native = nativeResolveFile(env, [bucketId, fileId, filePath, Object.assign({}, options, {
+    finishedCallback: function(err, fileBytes) {
+      const finishedArgs = arguments;
+      if (err) {
+        return options.finishedCallback.apply(null, finishedArgs);
+      }
+
+      const state = new MultipartState(function(err) {
+        // what is left at filePath is the manifest, not the file
+        if (err) {
+          fs.unlink(filePath, noop);
+        }
+        options.finishedCallback.apply(null, arguments);
+      });
+      assembling.set(native, state);
+
+      detectManifest(env, bucketId, fileId, filePath, fileBytes, options, function(manifest) {
+        if (!manifest) {
+          assembling.delete(native);
+          return options.finishedCallback.apply(null, finishedArgs);
+        }
+        if (state.canceled) {
+          return state.finish(canceledError(), null, null);
+        }
+        assembleMultipart(env, hedger, state, bucketId, manifest, filePath, Object.assign({}, options, {
+          overwrite: true
+        }));
+      });
+    }
+  })]);
+
+  return native;
+}
+
+// resolveFile that reassembles multipart uploads with `multipart: true`,
+// or when a download without `multipart` turns out to be a manifest. The
+// arguments are checked here, the native download may only start once the
+// manifest was read.
+function resolveFile(env, hedger, args) {
+  const options = args[3];
+  if (args.length !== 4 || !options || typeof options !== 'object' || options.multipart !== true) {
+    if (args.length === 4 && options && typeof options === 'object' && options.multipart === undefined &&
+        typeof options.finishedCallback === 'function') {
+      return resolveDetecting(env, hedger, args);
+    }
+    return nativeResolveFile(env, args);
+  }
+
+  if (typeof args[0] !== 'string' || typeof args[1] !== 'string' || typeof args[2] !== 'string' ||
+      typeof options.finishedCallback !== 'function' ||
+      (options.progressCallback !== undefined && typeof options.progressCallback !== 'function')) {
+    throw new Error('Unexpected arguments');
+  }
+  if (options.ioMode !== undefined && options.ioMode !== 'buffered' && options.ioMode !== 'dontneed') {
+    throw new Error('Unknown ioMode');
+  }
+
+  const state = new MultipartState(options.finishedCallback);
+  resolveMultipart(env, hedger, state, args[0], args[1], args[2], options);
+  return state;
+}
+
+exports.PART_SEPARATOR = PART_SEPARATOR;
+exports.DEFAULT_RETRIES = DEFAULT_RETRIES;
+exports.partName = partName;
+exports.canceledError = canceledError;
+exports.retry = retry;
+exports.storeManifest = storeManifest;
+
+exports.install = function(env, options) {
+  const hedger = new hedge.Hedger(options.hedge === false ? { budget: 0 } : options.hedge || {});
+  wrapped.set(env, {
+    resolveFile: env.resolveFile,
+    resolveFileCancel: env.resolveFileCancel
+  });
+
+  env.storeMultipart = function(bucketId, filePath, options) {
+    return storeMultipart(env, bucketId, filePath, options || {});
+  };
+  env.resolveFile = function() {
+    return resolveFile(env, hedger, Array.prototype.slice.call(arguments));
+  };
+  env.resolveFileCancel = function(state) {
+    if (state instanceof MultipartState) {
+      return cancelMultipart(env, state);
+    }
+    if (assembling.has(state)) {
+      return cancelMultipart(env, assembling.get(state));
+    }
+    return nativeResolveFileCancel(env, state);
+  };
+  env.multipartCancel = function(state) {
+    cancelMultipart(env, state);
+  };
+  env.hedgeStats = function() {
+    return hedger.hedgeStats();
+  };
+};
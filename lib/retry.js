@@ -0,0 +1,239 @@
+'use strict';
+
+// Retries of requests the bridge turned away with 420, 429 or 503, for
+// every bridge request and transfer of an Environment. Callers do not
+// retry on their own and in step with each other: a rate limited request
+// pauses the whole Environment for an exponential backoff with jitter, so
+// concurrent requests back off together, and every retry takes a token
+// from a bucket that refills at a fixed rate. An empty bucket hands the
+// error to the caller, which bounds the retries of a busy Environment.
+// Only installed with the `retryBudget` option.
+
+const DEFAULT_RETRIES = 4;
+const DEFAULT_TOKENS = 20;
+// tokens per second
+const DEFAULT_REFILL = 2;
+// milliseconds
+const DEFAULT_BASE_DELAY = 500;
+const DEFAULT_MAX_DELAY = 30000;
+
+const REQUESTS = ['getInfo', 'getBuckets', 'listFiles', 'createBucket', 'renameBucket', 'deleteBucket', 'deleteFile'];
+
+function RetryScheduler(budget) {
+  this.retries = budget.retries === undefined ? DEFAULT_RETRIES : budget.retries;
+  this.capacity = budget.tokens === undefined ? DEFAULT_TOKENS : budget.tokens;
+  this.refill = budget.refill === undefined ? DEFAULT_REFILL : budget.refill;
+  this.baseDelay = budget.baseDelay || DEFAULT_BASE_DELAY;
+  this.maxDelay = budget.maxDelay || DEFAULT_MAX_DELAY;
+  this.tokens = this.capacity;
+  this.refilled = Date.now();
+  this.pausedUntil = 0;
+  this.stats = {
+    rateLimited: 0,
+    retried: 0,
+    exhausted: 0
+  };
+}
+
+RetryScheduler.prototype.takeToken = function() {
+  const now = Date.now();
+  this.tokens = Math.min(this.capacity, this.tokens + (now - this.refilled) * this.refill / 1000);
+  this.refilled = now;
+  if (this.tokens < 1) {
+    return false;
+  }
+  this.tokens--;
+  return true;
+};
+
+// full backoff for the attempt, of which a random half is waited
+RetryScheduler.prototype.backoff = function(attempt) {
+  const delay = Math.min(this.maxDelay, this.baseDelay * Math.pow(2, attempt));
+  return delay / 2 + Math.random() * delay / 2;
+};
+
+// run send now, or once the pause of the Environment is over
+RetryScheduler.prototype.whenReady = function(send) {
+  const wait = this.pausedUntil - Date.now();
+  if (wait <= 0) {
+    return send();
+  }
+  // spread out the requests that waited for the same pause
+  setTimeout(send, wait + Math.random() * this.baseDelay);
+};
+
+// whether err is to be retried after attempt failed attempts, and then
+// when
+RetryScheduler.prototype.retryDelay = function(err, attempt) {
+  if (!err || !err.rateLimited) {
+    return -1;
+  }
+  this.stats.rateLimited++;
+  if (attempt >= this.retries || !this.takeToken()) {
+    this.stats.exhausted++;
+    // so the caller does not retry it on top of the budget
+    err.retriesExhausted = true;
+    return -1;
+  }
+  this.stats.retried++;
+  const delay = this.backoff(attempt);
+  this.pausedUntil = Math.max(this.pausedUntil, Date.now() + delay);
+  return delay;
+};
+
+// a bridge request, its callback is the last of args
+function request(scheduler, method, env, args) {
+  const callback = args[args.length - 1];
+  if (typeof callback !== 'function') {
+    return method.apply(env, args);
+  }
+
+  let attempt = 0;
+
+  function send() {
+    method.apply(env, args.slice(0, -1).concat(function(err) {
+      const delay = scheduler.retryDelay(err, attempt);
+      if (delay < 0) {
+        return callback.apply(null, arguments);
+      }
+      attempt++;
+      setTimeout(resend, delay);
+    }));
+  }
+
+  // a request that waited can only fail through its callback
+  function resend() {
+    scheduler.whenReady(function() {
+      try {
+        send();
+      } catch (e) {
+        callback(e);
+      }
+    });
+  }
+
+  if (scheduler.pausedUntil > Date.now()) {
+    return resend();
+  }
+  send();
+}
+
+// the state of a transfer that may be started again, in place of the
+// state of the native transfer
+function RetryState() {
+  this.current = null;
+  this.canceled = false;
+  this.finished = false;
+  this.error = null;
+}
+
+Object.defineProperty(RetryState.prototype, 'error_status', {
+  get: function() {
+    if (this.current && !this.finished) {
+      return this.current.error_status;
+    }
+    return this.error;
+  }
+});
+
+// storeFile or resolveFile, options are the last of args
+function transfer(scheduler, method, env, args) {
+  const options = args[args.length - 1];
+  if (!options || typeof options !== 'object' || typeof options.finishedCallback !== 'function') {
+    return method.apply(env, args);
+  }
+
+  const state = new RetryState();
+  const finishedCallback = options.finishedCallback;
+  let attempt = 0;
+
+  function finish(err) {
+    state.finished = true;
+    state.error = err || null;
+    finishedCallback.apply(null, arguments);
+  }
+
+  function start() {
+    state.current = method.apply(env, args.slice(0, -1).concat(Object.assign({}, options, {
+      finishedCallback: function(err) {
+        const delay = state.canceled ? -1 : scheduler.retryDelay(err, attempt);
+        if (delay < 0) {
+          return finish.apply(null, arguments);
+        }
+        attempt++;
+        setTimeout(restart, delay);
+      }
+    })));
+  }
+
+  function restart() {
+    scheduler.whenReady(function() {
+      if (state.canceled) {
+        return finish(new Error('File transfer canceled'));
+      }
+      try {
+        start();
+      } catch (e) {
+        finish(e);
+      }
+    });
+  }
+
+  if (scheduler.pausedUntil > Date.now()) {
+    restart();
+    return state;
+  }
+
+  start();
+  // like the native methods, nothing to cancel if it failed right away
+  return state.finished ? state.current : state;
+}
+
+function cancel(cancelMethod, env, state) {
+  if (!(state instanceof RetryState)) {
+    return cancelMethod.call(env, state);
+  }
+  state.canceled = true;
+  if (state.current && !state.finished) {
+    cancelMethod.call(env, state.current);
+  }
+}
+
+exports.RetryScheduler = RetryScheduler;
+
+// wraps what env has now, so it goes around bridgeUrls and multipart
+exports.install = function(env, options) {
+  if (!options.retryBudget) {
+    return;
+  }
+
+  const scheduler = new RetryScheduler(options.retryBudget === true ? {} : options.retryBudget);
+
+  REQUESTS.forEach(function(name) {
+    const method = env[name];
+    env[name] = function() {
+      return request(scheduler, method, env, Array.prototype.slice.call(arguments));
+    };
+  });
+
+  ['storeFile', 'resolveFile'].forEach(function(name) {
+    const method = env[name];
+    const cancelMethod = env[name + 'Cancel'];
+    env[name] = function() {
+      return transfer(scheduler, method, env, Array.prototype.slice.call(arguments));
+    };
+    env[name + 'Cancel'] = function(state) {
+      return cancel(cancelMethod, env, state);
+    };
+  });
+
+  env.retryStats = function() {
+    return {
+      rateLimited: scheduler.stats.rateLimited,
+      retried: scheduler.stats.retried,
+      exhausted: scheduler.stats.exhausted,
+      tokens: Math.floor(scheduler.tokens),
+      pausedFor: Math.max(0, scheduler.pausedUntil - Date.now())
+    };
+  };
+};
@@ -0,0 +1,254 @@
+'use strict';
+
+// One way sync of a local directory to a bucket. Files are uploaded under
+// their path relative to the directory. A local manifest remembers size,
+// mtime, sha256 and file id of every uploaded file, so a later run only
+// hashes files whose size or mtime changed and only uploads files whose
+// content did.
+
+const path = require('path');
+const binding = require('bindings')('genaro.node');
+const util = require('./util');
+
+const MANIFEST_VERSION = 1;
+const MANIFEST_NAME = '.genaro-sync.json';
+const DEFAULT_CONCURRENCY = 4;
+// uploads between two saves of the manifest
+const CHECKPOINT_INTERVAL = 32;
+
+function SyncState(finishedCallback) {
+  this.canceled = false;
+  this.uploads = new Set();
+  this.finishedCallback = finishedCallback || util.noop;
+}
+
+function uploadFile(env, state, bucketId, file, progress, callback) {
+  const info = env.generateEncryptionInfo(bucketId);
+  if (!info) {
+    return callback(new Error('Unable to generate encryption info'));
+  }
+
+  // the finished callback runs before storeFile returns if it fails early
+  let upload;
+  upload = env.storeFile(bucketId, file.fullPath, true, {
+    filename: file.path,
+    index: info.index,
+    key: info.key,
+    ctr: info.ctr,
+    // kept with the file so it can be fetched again without this manifest
+    rsaKey: env.encryptMeta(info.key),
+    rsaCtr: env.encryptMeta(info.ctr),
+    progressCallback: function(fileProgress) {
+      progress(fileProgress * file.size);
+    },
+    finishedCallback: function(err, fileId) {
+      state.uploads.delete(upload);
+      callback(err, fileId);
+    }
+  });
+  if (upload) {
+    state.uploads.add(upload);
+  }
+}
+
+// the previous version is deleted only once the new one is stored, a
+// failed upload leaves the bucket as it was. callback gets the new file id
+// and the error of deleting the previous version, if any.
+function replaceFile(env, state, bucketId, file, previous, progress, callback) {
+  uploadFile(env, state, bucketId, file, progress, function(err, fileId) {
+    if (err || !previous || !previous.fileId || previous.fileId === fileId) {
+      return callback(err, fileId, null);
+    }
+    env.deleteFile(bucketId, previous.fileId, function(err) {
+      callback(null, fileId, err && !/not found/i.test(err.message) ? err : null);
+    });
+  });
+}
+
+function syncDirectory(env, bucketId, localDir, options) {
+  const state = new SyncState(options.finishedCallback);
+  const progressCallback = options.progressCallback || util.noop;
+  const concurrency = options.concurrency || DEFAULT_CONCURRENCY;
+  const manifestPath = options.manifest || path.join(localDir, MANIFEST_NAME);
+  const manifest = util.loadManifest(manifestPath, MANIFEST_VERSION, bucketId);
+  const stats = {
+    files: 0,
+    uploaded: 0,
+    unchanged: 0,
+    removed: 0,
+    uploadedBytes: 0,
+    failed: []
+  };
+
+  function finish(err) {
+    try {
+      util.saveManifest(manifestPath, manifest);
+    } catch (e) {
+      err = err || e;
+    }
+    state.finishedCallback(err || null, stats);
+  }
+
+  binding.utilScanDirectory(localDir, function(err, scanned, unreadable) {
+    if (err) {
+      return state.finishedCallback(err, stats);
+    }
+
+    // what is below a directory that could not be read is not gone
+    unreadable = unreadable || [];
+    unreadable.forEach(function(dirPath) {
+      stats.failed.push({ path: dirPath, message: 'Unable to read directory' });
+    });
+    function readable(filePath) {
+      return !unreadable.some(function(dirPath) {
+        return filePath.startsWith(dirPath + '/');
+      });
+    }
+
+    const manifestFullPath = path.resolve(manifestPath);
+    const files = scanned.filter(function(file) {
+      file.fullPath = path.join(localDir, file.path);
+      return path.resolve(file.fullPath) !== manifestFullPath &&
+        path.resolve(file.fullPath) !== manifestFullPath + '.tmp';
+    });
+    stats.files = files.length;
+
+    const present = new Set(files.map(function(file) {
+      return file.path;
+    }));
+    const removed = Object.keys(manifest.files).filter(function(filePath) {
+      return !present.has(filePath) && readable(filePath);
+    });
+
+    // only a changed size or mtime is worth reading the file for
+    const candidates = files.filter(function(file) {
+      const entry = manifest.files[file.path];
+      if (entry && entry.size === file.size && entry.mtime === file.mtime) {
+        stats.unchanged++;
+        return false;
+      }
+      return true;
+    });
+
+    binding.utilHashFiles(candidates.map(function(file) {
+      return file.fullPath;
+    }), function(err, hashes) {
+      const uploads = [];
+      candidates.forEach(function(file, i) {
+        const entry = manifest.files[file.path];
+        file.hash = hashes[i];
+        if (!file.hash) {
+          stats.failed.push({ path: file.path, message: 'Unable to read file' });
+        } else if (entry && entry.hash === file.hash && entry.size === file.size) {
+          // touched but not changed
+          entry.mtime = file.mtime;
+          stats.unchanged++;
+        } else {
+          uploads.push(file);
+        }
+      });
+
+      const totalBytes = uploads.reduce(function(sum, file) {
+        return sum + file.size;
+      }, 0);
+      const inflight = new Map();
+      let doneBytes = 0;
+
+      function reportProgress() {
+        let bytes = doneBytes;
+        inflight.forEach(function(fileBytes) {
+          bytes += fileBytes;
+        });
+        progressCallback(totalBytes ? bytes / totalBytes : 1, bytes, totalBytes);
+      }
+
+      let sinceCheckpoint = 0;
+
+      // a failed file is recorded and the others go on
+      function uploadNext(file, done) {
+        if (state.canceled) {
+          return setImmediate(done);
+        }
+        inflight.set(file.path, 0);
+        replaceFile(env, state, bucketId, file, manifest.files[file.path], function(bytes) {
+          inflight.set(file.path, bytes);
+          reportProgress();
+        }, function(err, fileId, deleteError) {
+          inflight.delete(file.path);
+          if (err) {
+            stats.failed.push({ path: file.path, message: err.message });
+            return done(null);
+          }
+          // the new version is in the bucket, whatever became of the old one
+          manifest.files[file.path] = {
+            size: file.size,
+            mtime: file.mtime,
+            hash: file.hash,
+            fileId: fileId
+          };
+          if (deleteError) {
+            stats.failed.push({ path: file.path, message: deleteError.message });
+          }
+          stats.uploaded++;
+          stats.uploadedBytes += file.size;
+          doneBytes += file.size;
+          reportProgress();
+          if (++sinceCheckpoint === CHECKPOINT_INTERVAL) {
+            sinceCheckpoint = 0;
+            try {
+              util.saveManifest(manifestPath, manifest);
+            } catch (e) {
+              // retried at the end
+            }
+          }
+          done(null);
+        });
+      }
+
+      // files gone from the directory stay in the bucket unless asked to
+      function removeFiles() {
+        if (state.canceled) {
+          return finish(new Error('Sync canceled'));
+        }
+        if (!options.deleteRemoved || !removed.length) {
+          return finish(null);
+        }
+
+        let pending = removed.length;
+        removed.forEach(function(filePath) {
+          env.deleteFile(bucketId, manifest.files[filePath].fileId, function(err) {
+            if (err && !/not found/i.test(err.message)) {
+              stats.failed.push({ path: filePath, message: err.message });
+            } else {
+              delete manifest.files[filePath];
+              stats.removed++;
+            }
+            if (--pending === 0) {
+              finish(null);
+            }
+          });
+        });
+      }
+
+      util.runQueue(uploads, concurrency, uploadNext, removeFiles);
+    });
+  });
+
+  return state;
+}
+
+function syncCancel(env, state) {
+  state.canceled = true;
+  state.uploads.forEach(function(upload) {
+    env.storeFileCancel(upload);
+  });
+}
+
+exports.install = function(env) {
+  env.syncDirectory = function(bucketId, localDir, options) {
+    return syncDirectory(env, bucketId, localDir, options || {});
+  };
+  env.syncCancel = function(state) {
+    syncCancel(env, state);
+  };
+};
@@ -0,0 +1,280 @@
+'use strict';
+
+// Helpers shared by the transfers built on top of storeFile and
+// resolveFile.
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const crypto = require('crypto');
+
+function noop() {}
+
+function tempPath(prefix) {
+  return path.join(process.env.GENARO_TEMP || os.tmpdir(),
+    prefix + '-' + crypto.randomBytes(8).toString('hex'));
+}
+
+// run worker over items with at most concurrency of them at once, stops
+// handing out items after the first error
+function runQueue(items, concurrency, worker, done) {
+  let next = 0;
+  let running = 0;
+  let failed = false;
+
+  if (!items.length) {
+    return done(null);
+  }
+
+  function start() {
+    while (!failed && running < concurrency && next < items.length) {
+      const item = items[next++];
+      running++;
+      worker(item, function(err) {
+        running--;
+        if (failed) {
+          return;
+        }
+        if (err) {
+          failed = true;
+          return done(err);
+        }
+        if (next === items.length && running === 0) {
+          return done(null);
+        }
+        start();
+      });
+    }
+  }
+
+  start();
+}
+
+// copy length bytes at offset of filePath into a file of their own,
+// callback gets the sha256 of them
+function copyRange(filePath, offset, length, targetPath, callback) {
+  const hash = crypto.createHash('sha256');
+  const input = fs.createReadStream(filePath, {
+    start: offset,
+    end: offset + length - 1
+  });
+  const output = fs.createWriteStream(targetPath);
+  let failed = false;
+
+  function fail(err) {
+    if (!failed) {
+      failed = true;
+      input.destroy();
+      output.destroy();
+      callback(err);
+    }
+  }
+
+  input.on('error', fail);
+  output.on('error', fail);
+  input.on('data', function(data) {
+    hash.update(data);
+  });
+  output.on('finish', function() {
+    if (!failed) {
+      callback(null, hash.digest('hex'));
+    }
+  });
+  input.pipe(output);
+}
+
+// sha256 of length bytes at offset of filePath
+function hashRange(filePath, offset, length, callback) {
+  const hash = crypto.createHash('sha256');
+  const input = fs.createReadStream(filePath, {
+    start: offset,
+    end: offset + length - 1
+  });
+  let read = 0;
+
+  input.on('error', callback);
+  input.on('data', function(data) {
+    hash.update(data);
+    read += data.length;
+  });
+  input.on('end', function() {
+    if (read !== length) {
+      return callback(new Error('File ended before the range'));
+    }
+    callback(null, hash.digest('hex'));
+  });
+}
+
+// copy all of filePath into fd at offset, callback gets the sha256 and
+// the number of bytes copied
+function copyInto(filePath, fd, offset, callback) {
+  const hash = crypto.createHash('sha256');
+  const input = fs.createReadStream(filePath);
+  const output = fs.createWriteStream(null, { fd: fd, start: offset, autoClose: false });
+  let length = 0;
+  let failed = false;
+
+  function fail(err) {
+    if (!failed) {
+      failed = true;
+      input.destroy();
+      callback(err);
+    }
+  }
+
+  input.on('error', fail);
+  output.on('error', fail);
+  input.on('data', function(data) {
+    hash.update(data);
+    length += data.length;
+  });
+  output.on('finish', function() {
+    if (!failed) {
+      callback(null, hash.digest('hex'), length);
+    }
+  });
+  input.pipe(output);
+}
+
+// bytes xorRanges works through at a time
+const XOR_BLOCK_SIZE = 1024 * 1024;
+
+// write the xor of the ranges in sources, { fd, offset, length } each, as
+// length bytes into fd at offset. Ranges shorter than length count as
+// padded with zeros. callback gets the sha256 of the bytes written.
+function xorRanges(sources, length, fd, offset, callback) {
+  const hash = crypto.createHash('sha256');
+  const block = Buffer.alloc(Math.min(length, XOR_BLOCK_SIZE));
+  const data = Buffer.alloc(block.length);
+  let position = 0;
+
+  function writeBlock(size) {
+    fs.write(fd, block, 0, size, offset + position, function(err) {
+      if (err) {
+        return callback(err);
+      }
+      hash.update(block.slice(0, size));
+      position += size;
+      nextBlock();
+    });
+  }
+
+  function readSource(index, size) {
+    if (index === sources.length) {
+      return writeBlock(size);
+    }
+    const source = sources[index];
+    const available = Math.min(size, source.length - position);
+    if (available <= 0) {
+      return readSource(index + 1, size);
+    }
+    fs.read(source.fd, data, 0, available, source.offset + position, function(err, bytesRead) {
+      if (err) {
+        return callback(err);
+      }
+      if (bytesRead !== available) {
+        return callback(new Error('File ended before the range'));
+      }
+      for (let i = 0; i < bytesRead; i++) {
+        block[i] ^= data[i];
+      }
+      readSource(index + 1, size);
+    });
+  }
+
+  function nextBlock() {
+    if (position === length) {
+      return callback(null, hash.digest('hex'));
+    }
+    block.fill(0);
+    readSource(0, Math.min(block.length, length - position));
+  }
+
+  nextBlock();
+}
+
+// the local manifest of a sync or mirror at manifestPath, or an empty
+// one if there is none for this version and bucket
+function loadManifest(manifestPath, version, bucketId) {
+  let manifest = null;
+  try {
+    manifest = JSON.parse(fs.readFileSync(manifestPath, 'utf8'));
+  } catch (e) {
+    manifest = null;
+  }
+  if (!manifest || manifest.version !== version || manifest.bucketId !== bucketId) {
+    manifest = { version: version, bucketId: bucketId, files: {} };
+  }
+  return manifest;
+}
+
+// written next to manifestPath and renamed over it, so a crash leaves
+// either the old or the new manifest
+function saveManifest(manifestPath, manifest) {
+  const tempPath = manifestPath + '.tmp';
+  fs.writeFileSync(tempPath, JSON.stringify(manifest));
+  fs.renameSync(tempPath, manifestPath);
+}
+
+// download a file that holds json encrypted with encryptMeta
+function readEncryptedJson(env, bucketId, fileId, options, callback) {
+  const filePath = tempPath('genaro-manifest');
+
+  env.resolveFile(bucketId, fileId, filePath, {
+    key: options.key,
+    ctr: options.ctr,
+    overwrite: true,
+    decrypt: true,
+    multipart: false,
+    progressCallback: noop,
+    finishedCallback: function(err) {
+      if (err) {
+        fs.unlink(filePath, noop);
+        return callback(err);
+      }
+
+      fs.readFile(filePath, 'utf8', function(err, encrypted) {
+        fs.unlink(filePath, noop);
+        if (err) {
+          return callback(err);
+        }
+
+        callback(null, parseEncryptedJson(env, encrypted));
+      });
+    }
+  });
+}
+
+// the value encryptMeta of JSON gave encrypted, or null
+function parseEncryptedJson(env, encrypted) {
+  const decrypted = env.decryptMeta(encrypted);
+  try {
+    return (decrypted && JSON.parse(decrypted)) || null;
+  } catch (e) {
+    return null;
+  }
+}
+
+// the key and ctr a file was stored with, kept encrypted in its rsaKey
+// and rsaCtr, or null
+function fileKey(env, file) {
+  if (!file.rsaKey || !file.rsaCtr) {
+    return null;
+  }
+  const key = env.decryptMeta(file.rsaKey);
+  const ctr = env.decryptMeta(file.rsaCtr);
+  return key && ctr ? { key: key, ctr: ctr } : null;
+}
+
+exports.noop = noop;
+exports.tempPath = tempPath;
+exports.runQueue = runQueue;
+exports.copyRange = copyRange;
+exports.hashRange = hashRange;
+exports.copyInto = copyInto;
+exports.xorRanges = xorRanges;
+exports.loadManifest = loadManifest;
+exports.saveManifest = saveManifest;
+exports.readEncryptedJson = readEncryptedJson;
+exports.parseEncryptedJson = parseEncryptedJson;
+exports.fileKey = fileKey;
@@ -0,0 +1,114 @@
+'use strict';
+
+// Warm up of a new Environment. A few getInfo requests per bridge go out
+// at once, so with the shared curl pool of a static build the first real
+// request finds keep-alive connections, a TLS session and the address in
+// curl's DNS cache. Without that pool every request sets up its own
+// connection and the warm up only shows the bridge can be reached. The
+// addresses of the bridge hosts are looked up alongside for information,
+// curl resolves on its own and does not see them. env.ready resolves
+// once that is done and never rejects, a failed warm up only means the
+// first request pays the setup itself.
+
+const dns = require('dns');
+const url = require('url');
+
+const DEFAULT_CONNECTIONS = 2;
+
+function lookup(host, callback) {
+  dns.lookup(host, { all: true }, function(err, addresses) {
+    callback(err, err ? [] : addresses.map(function(address) {
+      return address.address;
+    }));
+  });
+}
+
+function warmup(env, options) {
+  const urls = options.bridgeUrls && options.bridgeUrls.length ? options.bridgeUrls : [options.bridgeUrl];
+  const connections = urls.length *
+    (typeof options.warmup === 'number' ? options.warmup : DEFAULT_CONNECTIONS);
+  const started = Date.now();
+  const result = {
+    warm: false,
+    addresses: [],
+    connections: 0,
+    elapsed: 0,
+    error: null
+  };
+
+  return new Promise(function(resolve) {
+    function done(err) {
+      result.error = result.error || err || null;
+      result.elapsed = Date.now() - started;
+      resolve(result);
+    }
+
+    const hosts = urls.map(function(bridgeUrl) {
+      try {
+        return url.parse(bridgeUrl).hostname;
+      } catch (e) {
+        return null;
+      }
+    });
+    if (hosts.indexOf(null) !== -1) {
+      return done(new Error('Invalid bridgeUrl'));
+    }
+
+    // the lookups and the probes
+    let pending = hosts.length + 1;
+    function finished() {
+      if (--pending === 0) {
+        done(null);
+      }
+    }
+
+    hosts.forEach(function(host) {
+      // a host node can not resolve is no error of the warm up
+      lookup(host, function(err, addresses) {
+        result.addresses = result.addresses.concat(addresses);
+        finished();
+      });
+    });
+    probe();
+
+    // with several bridges the probes are spread over them
+    function probe() {
+      if (!connections) {
+        result.warm = true;
+        return finished();
+      }
+
+      let probes = connections;
+      function probed(err) {
+        if (err) {
+          result.error = result.error || err;
+        } else {
+          result.connections++;
+          result.warm = true;
+        }
+        if (--probes === 0) {
+          finished();
+        }
+      }
+
+      for (let i = 0; i < connections; i++) {
+        try {
+          env.getInfo(probed);
+        } catch (e) {
+          // destroyed meanwhile
+          probed(e);
+        }
+      }
+    }
+  });
+}
+
+exports.install = function(env, options) {
+  env.ready = options.warmup ? warmup(env, options) : Promise.resolve({
+    warm: false,
+    addresses: [],
+    connections: 0,
+    elapsed: 0,
+    error: null
+  });
+};
@@ -6,6 +6,7 @@ const fs = require('fs');
 const libstorj = require('..');
 const mockbridge = require('./mockbridge.js');
 const mockfarmer = require('./mockfarmer.js');
+const MockEnv = require('./mockenv.js');
 const mockbridgeData = require('./mockbridge.json');
 const shallowCopy = function (target) {
   return Object.assign({}, target);
@@ -40,6 +41,18 @@ const badKeyConfig = {
   encryptionKey: 'aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaaaa aaaaa'
 };
 
+const removeDirectory = function (dir) {
+  fs.readdirSync(dir).forEach(function (name) {
+    const entry = dir + '/' + name;
+    if (fs.lstatSync(entry).isDirectory()) {
+      removeDirectory(entry);
+    } else {
+      fs.unlinkSync(entry);
+    }
+  });
+  fs.rmdirSync(dir);
+};
+
 const statusCodeConfig = function (status) {
   const config = shallowCopy(defaultConfig);
   config.userAgent = `storj-test_status-${status}`;
@@ -257,6 +270,62 @@ describe('libstorj', function() {
         const env = new libstorj.Environment(); // option missing
       }).to.throw('First argument is expected');
     });
+
+    it('can be used from a worker thread', function(done) {
+      let worker_threads;
+      try {
+        worker_threads = require('worker_threads');
+      } catch (e) {
+        return this.skip();
+      }
+      const worker = new worker_threads.Worker(`
+        const { parentPort, workerData } = require('worker_threads');
+        const libstorj = require(${JSON.stringify(require.resolve('..'))});
+        const env = new libstorj.Environment(workerData);
+        const stats = env.memoryStats();
+        env.destroy();
+        // left for the worker to clean up when it exits
+        new libstorj.Environment(Object.assign({}, workerData, {
+          logger: function() {}
+        }));
+        parentPort.postMessage(stats.inflightBytes);
+      `, { eval: true, workerData: defaultConfig });
+      let inflightBytes = null;
+      let failed = false;
+      worker.on('message', function(bytes) {
+        inflightBytes = bytes;
+      });
+      worker.on('error', function(err) {
+        failed = true;
+        done(err);
+      });
+      // the environment is gone before the worker and its context are
+      worker.on('exit', function(code) {
+        if (failed) {
+          return;
+        }
+        expect(code).to.equal(0);
+        expect(inflightBytes).to.equal(0);
+
+        // logging wakes up the sinks, the one of the worker has to be gone
+        const lines = [];
+        const config = statusCodeConfig(404);
+        config.logger = function(entries) {
+          lines.push.apply(lines, entries);
+        };
+        const env = new libstorj.Environment(config);
+        env.resolveFile('368be0816766b28fd5f43af5', '998960317b6725a3f8080c2b', './storj-test-worker.data', {
+          progressCallback: function() {},
+          finishedCallback: function() {
+            setTimeout(function() {
+              expect(lines.length).to.be.above(0);
+              env.destroy();
+              done();
+            }, 100);
+          }
+        });
+      });
+    });
   });
 
   describe('#utilTimestamp', function() {
@@ -268,6 +337,913 @@ describe('libstorj', function() {
     });
   });
 
+  describe('#utilChunkFile', function() {
+    const chunkFilePath = './storj-test-chunk.data';
+
+    before(function() {
+      fs.writeFileSync(chunkFilePath, require('crypto').randomBytes(3 * 1024 * 1024));
+    });
+
+    after(function() {
+      fs.unlinkSync(chunkFilePath);
+    });
+
+    it('will split a file into contiguous chunks', function(done) {
+      const sizes = { minSize: 64 * 1024, avgSize: 256 * 1024, maxSize: 1024 * 1024 };
+      libstorj.utilChunkFile(chunkFilePath, sizes, function(err, chunks) {
+        expect(err).to.equal(null);
+        const data = fs.readFileSync(chunkFilePath);
+        let offset = 0;
+        chunks.forEach(function(chunk) {
+          expect(chunk.offset).to.equal(offset);
+          expect(chunk.length).to.be.at.most(sizes.maxSize);
+          const hash = require('crypto').createHash('sha256')
+            .update(data.slice(chunk.offset, chunk.offset + chunk.length)).digest('hex');
+          expect(chunk.hash).to.equal(hash);
+          offset += chunk.length;
+        });
+        expect(offset).to.equal(data.length);
+        done();
+      });
+    });
+
+    it('will throw for inconsistent sizes', function() {
+      expect(function() {
+        libstorj.utilChunkFile(chunkFilePath, { minSize: 2, avgSize: 1 }, function() {});
+      }).to.throw('minSize');
+    });
+  });
+
+  describe('#utilScanDirectory', function() {
+    it('will list the files below a directory', function(done) {
+      libstorj.utilScanDirectory(__dirname, function(err, files) {
+        expect(err).to.equal(null);
+        const mockbridgeFile = files.find(function(file) {
+          return file.path === 'mockbridge.js';
+        });
+        expect(mockbridgeFile.size).to.equal(fs.statSync(__dirname + '/mockbridge.js').size);
+        expect(mockbridgeFile.mtime).to.be.a('number');
+        done();
+      });
+    });
+
+    it('will fail for a missing directory', function(done) {
+      libstorj.utilScanDirectory(__dirname + '/missing', function(err) {
+        expect(err).to.be.an('Error');
+        done();
+      });
+    });
+
+    it('will skip and report a subdirectory it can not read', function(done) {
+      // permissions do not keep root out
+      if (process.getuid && process.getuid() === 0) {
+        return this.skip();
+      }
+      const dir = require('os').tmpdir() + '/genaro-scan-test-' + process.pid;
+      fs.mkdirSync(dir);
+      fs.mkdirSync(dir + '/locked');
+      fs.writeFileSync(dir + '/a.txt', 'a');
+      fs.writeFileSync(dir + '/locked/b.txt', 'b');
+      fs.chmodSync(dir + '/locked', 0);
+
+      libstorj.utilScanDirectory(dir, function(err, files, unreadable) {
+        fs.chmodSync(dir + '/locked', 0o755);
+        removeDirectory(dir);
+        expect(err).to.equal(null);
+        expect(files.map(function(file) {
+          return file.path;
+        })).to.deep.equal(['a.txt']);
+        expect(unreadable).to.deep.equal(['locked']);
+        done();
+      });
+    });
+  });
+
+  describe('#utilHashFiles', function() {
+    it('will give back the sha256 of every file', function(done) {
+      const paths = [__dirname + '/mockbridge.js', __dirname + '/missing'];
+      libstorj.utilHashFiles(paths, function(err, hashes) {
+        expect(err).to.equal(null);
+        const expected = require('crypto').createHash('sha256')
+          .update(fs.readFileSync(paths[0])).digest('hex');
+        expect(hashes).to.deep.equal([expected, null]);
+        done();
+      });
+    });
+
+    it('will call back after returning for no files', function(done) {
+      let returned = false;
+      libstorj.utilHashFiles([], function(err, hashes) {
+        expect(returned).to.equal(true);
+        expect(err).to.equal(null);
+        expect(hashes).to.deep.equal([]);
+        done();
+      });
+      returned = true;
+    });
+  });
+
+  describe('#utilXorRanges', function() {
+    const util = require('../lib/util');
+    const crypto = require('crypto');
+    const dataPath = require('os').tmpdir() + '/genaro-xor-test-' + process.pid + '.data';
+
+    afterEach(function() {
+      if (fs.existsSync(dataPath)) {
+        fs.unlinkSync(dataPath);
+      }
+    });
+
+    it('should write the xor of the ranges padded with zeros', function(done) {
+      const a = crypto.randomBytes(300);
+      const b = crypto.randomBytes(200);
+      fs.writeFileSync(dataPath, Buffer.concat([a, b, Buffer.alloc(300)]));
+      const fd = fs.openSync(dataPath, 'r+');
+      const sources = [
+        { fd: fd, offset: 0, length: 300 },
+        { fd: fd, offset: 300, length: 200 }
+      ];
+
+      util.xorRanges(sources, 300, fd, 500, function(err, hash) {
+        fs.closeSync(fd);
+        if (err) {
+          return done(err);
+        }
+        const expected = Buffer.from(a);
+        for (let i = 0; i < b.length; i++) {
+          expected[i] ^= b[i];
+        }
+        const written = fs.readFileSync(dataPath).slice(500);
+        expect(written.equals(expected)).to.equal(true);
+        expect(hash).to.equal(crypto.createHash('sha256').update(expected).digest('hex'));
+        done();
+      });
+    });
+
+    it('will fail for a range past the end of its file', function(done) {
+      fs.writeFileSync(dataPath, Buffer.alloc(100));
+      const fd = fs.openSync(dataPath, 'r+');
+
+      util.xorRanges([{ fd: fd, offset: 50, length: 100 }], 100, fd, 0, function(err) {
+        fs.closeSync(fd);
+        expect(err.message).to.equal('File ended before the range');
+        done();
+      });
+    });
+  });
+
+  describe('#bridgeUrls', function() {
+    const bridges = require('../lib/bridges');
+    const bucketId = '368be0816766b28fd5f43af5';
+    const targetPath = require('os').tmpdir() + '/genaro-bridges-test-' + process.pid + '.data';
+
+    // a bridge that can not be reached
+    function DownEnv() {
+      MockEnv.call(this);
+    }
+    DownEnv.prototype = Object.create(MockEnv.prototype);
+    DownEnv.prototype.listFiles = function(bucketId, callback) {
+      this.calls.listFiles++;
+      setImmediate(function() {
+        const err = new Error('Couldn\'t connect to server');
+        err.curlCode = 7;
+        callback(err);
+      });
+    };
+    DownEnv.prototype.createBucket = function(name, callback) {
+      DownEnv.prototype.listFiles.call(this, name, callback);
+    };
+
+    function endpoints(envs) {
+      return envs.map(function(env, i) {
+        return new bridges.Endpoint('http://bridge' + i, env);
+      });
+    }
+
+    afterEach(function() {
+      if (fs.existsSync(targetPath)) {
+        fs.unlinkSync(targetPath);
+      }
+    });
+
+    it('should send requests to the mock bridge over every url', function(done) {
+      const config = shallowCopy(defaultConfig);
+      config.bridgeUrls = [defaultConfig.bridgeUrl, defaultConfig.bridgeUrl];
+      const env = new libstorj.Environment(config);
+
+      env.getBuckets(function(err) {
+        if (err) {
+          return done(err);
+        }
+        const stats = env.bridgeStats();
+        expect(stats.length).to.equal(2);
+        expect(stats[0].requests + stats[1].requests).to.equal(1);
+        env.destroy();
+        done();
+      });
+    });
+
+    it('should pick the fastest bridge that is not cooling down', function() {
+      const all = endpoints([new MockEnv(), new MockEnv(), new MockEnv()]);
+      all[0].succeeded(50);
+      all[1].succeeded(10);
+      all[2].succeeded(1);
+      all[2].failed();
+      expect(bridges.pick(all, new Set())).to.equal(all[1]);
+      expect(bridges.pick(all, new Set([all[1]]))).to.equal(all[0]);
+      // all cooling down, the first to be ready again
+      expect(bridges.pick(all, new Set([all[0], all[1]]))).to.equal(all[2]);
+    });
+
+    it('should send a request the bridge did not get to the next one', function(done) {
+      const all = endpoints([new DownEnv(), new MockEnv()]);
+      const env = all[0].env;
+      all[1].env.add('a.txt', 'a');
+      bridges.attach(env, all, {});
+
+      env.listFiles(bucketId, function(err, files) {
+        if (err) {
+          return done(err);
+        }
+        expect(files.length).to.equal(1);
+        const stats = env.bridgeStats();
+        expect(stats[0].healthy).to.equal(false);
+        expect(stats[0].failovers).to.equal(1);
+        expect(stats[1].requests).to.equal(1);
+        done();
+      });
+    });
+
+    it('should not send createBucket twice', function(done) {
+      const all = endpoints([new DownEnv(), new MockEnv()]);
+      const env = all[0].env;
+      bridges.attach(env, all, {});
+
+      env.createBucket('bucket', function(err) {
+        expect(err.curlCode).to.equal(7);
+        expect(env.bridgeStats()[1].requests).to.equal(0);
+        done();
+      });
+    });
+
+    it('should cancel a transfer on the bridge that started it', function(done) {
+      const all = endpoints([new MockEnv(), new MockEnv(function() {
+        return { delay: 1000 };
+      })]);
+      const env = all[0].env;
+      all.forEach(function(endpoint) {
+        endpoint.env.add('a.txt', 'a');
+      });
+      // the first bridge cools down, the download goes to the second
+      all[0].failed();
+      bridges.attach(env, all, {});
+
+      const state = env.resolveFile(bucketId, all[1].env.find('a.txt').id, targetPath, {
+        finishedCallback: function(err) {
+          expect(err.message).to.match(/canceled/);
+          expect(all[0].env.calls.resolveFile).to.equal(0);
+          expect(all[1].env.canceled).to.equal(1);
+          expect(env.bridgeStats()[1].inflight).to.equal(0);
+          done();
+        }
+      });
+      expect(env.bridgeStats()[1].transfers).to.equal(1);
+      env.resolveFileCancel(state);
+    });
+
+    it('should spread transfers over the bridges', function(done) {
+      const all = endpoints([new MockEnv(), new MockEnv()]);
+      const env = all[0].env;
+      const fileId = all[0].env.add('a.txt', 'a');
+      all[1].env.add('a.txt', 'a');
+      bridges.attach(env, all, {});
+
+      let pending = 2;
+      [targetPath, targetPath + '.2'].forEach(function(filePath) {
+        env.resolveFile(bucketId, fileId, filePath, {
+          finishedCallback: function(err) {
+            fs.unlinkSync(filePath);
+            if (err) {
+              return done(err);
+            }
+            if (--pending === 0) {
+              expect(all[0].env.calls.resolveFile).to.equal(1);
+              expect(all[1].env.calls.resolveFile).to.equal(1);
+              done();
+            }
+          }
+        });
+      });
+    });
+
+    it('should split maxMemory and keep the rest of one env with the first bridge', function() {
+      const logger = function() {};
+      const urls = ['http://bridge0', 'http://bridge1', 'http://bridge2'];
+      const options = {
+        bridgeUrls: urls,
+        maxMemory: 300,
+        logger: logger,
+        ioThread: true,
+        encryptionInfoPool: 8,
+        dedupeIndex: '/tmp/index'
+      };
+
+      const first = bridges.endpointOptions(options, urls, 0);
+      expect(first.bridgeUrl).to.equal(urls[0]);
+      expect(first.bridgeUrls).to.equal(undefined);
+      expect(first.maxMemory).to.equal(100);
+      expect(first.ioThread).to.equal(true);
+      expect(first.encryptionInfoPool).to.equal(8);
+      expect(first.dedupeIndex).to.equal('/tmp/index');
+      expect(first.logger).to.equal(logger);
+
+      const second = bridges.endpointOptions(options, urls, 2);
+      expect(second.bridgeUrl).to.equal(urls[2]);
+      expect(second.maxMemory).to.equal(100);
+      expect(second.ioThread).to.equal(undefined);
+      expect(second.encryptionInfoPool).to.equal(undefined);
+      expect(second.dedupeIndex).to.equal(undefined);
+      expect(second.logger).to.equal(logger);
+    });
+
+    it('should send transfers to a bridge that has memory left', function(done) {
+      const all = endpoints([new MockEnv(), new MockEnv(function() {
+        return { delay: 50 };
+      })]);
+      const env = all[0].env;
+      const fileId = all[0].env.add('a.txt', 'a');
+      all[1].env.add('a.txt', 'a');
+      all.forEach(function(endpoint) {
+        endpoint.env.maxMemory = 1;
+      });
+      // the second bridge is the faster one
+      all[0].succeeded(50);
+      all[1].succeeded(1);
+      bridges.attach(env, all, {});
+
+      let pending = 2;
+      [targetPath, targetPath + '.2'].forEach(function(filePath) {
+        env.resolveFile(bucketId, fileId, filePath, {
+          finishedCallback: function(err) {
+            fs.unlinkSync(filePath);
+            if (err) {
+              return done(err);
+            }
+            if (--pending === 0) {
+              expect(all[0].env.calls.resolveFile).to.equal(1);
+              expect(all[1].env.calls.resolveFile).to.equal(1);
+              done();
+            }
+          }
+        });
+      });
+
+      // both hold their one byte now
+      expect(env.memoryStats()).to.deep.equal({ inflightBytes: 2, maxMemory: 2, queuedTransfers: 0 });
+    });
+
+    it('should add up the request stats of every bridge', function() {
+      const all = endpoints([new MockEnv(), new MockEnv()]);
+      all[0].env.coalescedReads = 2;
+      all[1].env.coalescedReads = 3;
+      bridges.attach(all[0].env, all, {});
+
+      expect(all[0].env.requestStats()).to.deep.equal({ inflightReads: 0, coalescedReads: 5 });
+    });
+  });
+
+  describe('#retryBudget', function() {
+    const retry = require('../lib/retry');
+    const bucketId = '368be0816766b28fd5f43af5';
+
+    function rateLimitedError() {
+      const err = new Error('Request rate limited');
+      err.statusCode = 429;
+      err.rateLimited = true;
+      return err;
+    }
+
+    // a bridge that turns the first `limited` listings away
+    function LimitedEnv(limited, behavior) {
+      MockEnv.call(this, behavior);
+      this.limited = limited;
+    }
+    LimitedEnv.prototype = Object.create(MockEnv.prototype);
+    LimitedEnv.prototype.listFiles = function(bucketId, callback) {
+      if (this.limited > 0) {
+        this.limited--;
+        this.calls.listFiles++;
+        return setImmediate(function() {
+          callback(rateLimitedError());
+        });
+      }
+      MockEnv.prototype.listFiles.call(this, bucketId, callback);
+    };
+
+    it('should only retry rate limited errors, up to retries times', function() {
+      const scheduler = new retry.RetryScheduler({ retries: 2, baseDelay: 100 });
+      expect(scheduler.retryDelay(null, 0)).to.equal(-1);
+      expect(scheduler.retryDelay(new Error('Bad request'), 0)).to.equal(-1);
+
+      const delay = scheduler.retryDelay(rateLimitedError(), 1);
+      // a random half of the backoff of the attempt is waited
+      expect(delay).to.be.at.least(100);
+      expect(delay).to.be.at.most(200);
+      expect(scheduler.pausedUntil).to.be.above(Date.now());
+      expect(scheduler.retryDelay(rateLimitedError(), 2)).to.equal(-1);
+      expect(scheduler.stats).to.deep.equal({ rateLimited: 2, retried: 1, exhausted: 1 });
+    });
+
+    it('should pass the error on once out of tokens', function() {
+      const scheduler = new retry.RetryScheduler({ tokens: 2, refill: 0 });
+      expect(scheduler.retryDelay(rateLimitedError(), 0)).to.be.above(0);
+      expect(scheduler.retryDelay(rateLimitedError(), 0)).to.be.above(0);
+      expect(scheduler.retryDelay(rateLimitedError(), 0)).to.equal(-1);
+      expect(scheduler.stats.exhausted).to.equal(1);
+    });
+
+    it('should retry a rate limited request after a backoff', function(done) {
+      const env = new LimitedEnv(2);
+      retry.install(env, { retryBudget: { baseDelay: 10 } });
+      env.add('a.txt', 'a');
+
+      env.listFiles(bucketId, function(err, files) {
+        if (err) {
+          return done(err);
+        }
+        expect(files.length).to.equal(1);
+        expect(env.calls.listFiles).to.equal(3);
+        expect(env.retryStats().retried).to.equal(2);
+        done();
+      });
+    });
+
+    it('should not retry with retryBudget false', function(done) {
+      const env = new LimitedEnv(1);
+      retry.install(env, { retryBudget: false });
+
+      env.listFiles(bucketId, function(err) {
+        expect(err.rateLimited).to.equal(true);
+        expect(env.calls.listFiles).to.equal(1);
+        done();
+      });
+    });
+
+    it('should not retry without retryBudget', function(done) {
+      const env = new LimitedEnv(1);
+      retry.install(env, {});
+
+      expect(env.retryStats).to.equal(undefined);
+      env.listFiles(bucketId, function(err) {
+        expect(err.rateLimited).to.equal(true);
+        expect(err.retriesExhausted).to.equal(undefined);
+        expect(env.calls.listFiles).to.equal(1);
+        done();
+      });
+    });
+
+    it('should retry a rate limited part itself without retryBudget', function(done) {
+      this.timeout(10000);
+      const env = new MockEnv();
+      const sourcePath = require('os').tmpdir() + '/genaro-retry-test-' + process.pid + '.data';
+      fs.writeFileSync(sourcePath, require('crypto').randomBytes(2048));
+      require('../lib/multipart').install(env, {});
+      retry.install(env, {});
+
+      let partAttempts = 0;
+      env.behavior = function(method, name) {
+        if (name.indexOf('.genaropart-0-') === -1) {
+          return {};
+        }
+        partAttempts++;
+        return { error: rateLimitedError() };
+      };
+
+      env.storeMultipart(bucketId, sourcePath, {
+        filename: 'retry.data',
+        partSize: 1024,
+        retries: 1,
+        finishedCallback: function(err) {
+          fs.unlinkSync(sourcePath);
+          expect(err.rateLimited).to.equal(true);
+          expect(partAttempts).to.equal(2);
+          done();
+        }
+      });
+    });
+
+    it('should retry a rate limited part only through the budget', function(done) {
+      const env = new MockEnv();
+      const sourcePath = require('os').tmpdir() + '/genaro-retry-test-' + process.pid + '.data';
+      fs.writeFileSync(sourcePath, require('crypto').randomBytes(2048));
+      require('../lib/multipart').install(env, {});
+      retry.install(env, { retryBudget: { retries: 2, baseDelay: 1 } });
+
+      let partAttempts = 0;
+      env.behavior = function(method, name) {
+        if (name.indexOf('.genaropart-0-') === -1) {
+          return {};
+        }
+        partAttempts++;
+        return { error: rateLimitedError() };
+      };
+
+      env.storeMultipart(bucketId, sourcePath, {
+        filename: 'retry.data',
+        partSize: 1024,
+        retries: 3,
+        finishedCallback: function(err) {
+          fs.unlinkSync(sourcePath);
+          expect(err.rateLimited).to.equal(true);
+          // the first attempt and two retries, not four times that
+          expect(partAttempts).to.equal(3);
+          done();
+        }
+      });
+    });
+  });
+
+  describe('#hedge', function() {
+    const Hedger = require('../lib/hedge').Hedger;
+
+    function noop() {}
+
+    // a hedger that timed eight parts, at 1 to 8 ms per byte
+    function timedHedger(options) {
+      const hedger = new Hedger(options);
+      for (let i = 1; i <= 8; i++) {
+        hedger.record(100, i * 100);
+      }
+      return hedger;
+    }
+
+    it('should not hedge before eight parts were timed', function() {
+      const hedger = new Hedger({});
+      for (let i = 1; i <= 7; i++) {
+        hedger.record(100, i * 100);
+      }
+      expect(hedger.deadline(10)).to.equal(-1);
+      hedger.record(100, 800);
+      expect(hedger.deadline(10)).to.equal(80);
+      expect(new Hedger({ percentile: 0.5 }).deadline(10)).to.equal(-1);
+      expect(timedHedger({ percentile: 0.5 }).deadline(10)).to.equal(40);
+    });
+
+    it('should hedge no more than the budget', function() {
+      const hedger = new Hedger({ budget: 0.5 });
+      expect(hedger.takeBudget(1)).to.equal(false);
+      hedger.requestedBytes = 100;
+      expect(hedger.takeBudget(40)).to.equal(true);
+      expect(hedger.takeBudget(20)).to.equal(false);
+      expect(hedger.takeBudget(10)).to.equal(true);
+      expect(hedger.hedgeStats()).to.deep.equal({ hedged: 0, won: 0, hedgedBytes: 50, budgetBytes: 0 });
+    });
+
+    it('should keep the hedge that finished first and cancel the other', function(done) {
+      const hedger = timedHedger({ budget: 1 });
+      let fetches = 0;
+      let canceled = 0;
+
+      hedger.run(2, function(progress, callback) {
+        const hedge = fetches++ > 0;
+        const timer = setTimeout(function() {
+          progress(2);
+          callback(null, hedge ? 'hedge' : 'first');
+        }, hedge ? 5 : 1000);
+        return function() {
+          canceled++;
+          clearTimeout(timer);
+          setImmediate(function() {
+            callback(new Error('File transfer canceled'));
+          });
+        };
+      }, function() {
+        done(new Error('Nothing is to be discarded'));
+      }, noop, function(err, result) {
+        expect(err).to.equal(null);
+        expect(result).to.equal('hedge');
+        expect(fetches).to.equal(2);
+        expect(canceled).to.equal(1);
+        expect(hedger.hedgeStats()).to.deep.equal({ hedged: 1, won: 1, hedgedBytes: 2, budgetBytes: 0 });
+        // the first download is timed up to where the hedge beat it
+        expect(hedger.samples.length).to.equal(9);
+        expect(hedger.samples[8]).to.be.at.least(8);
+        setTimeout(done, 10);
+      });
+    });
+
+    it('should time a first download that failed', function(done) {
+      const hedger = new Hedger({});
+
+      hedger.run(2, function(progress, callback) {
+        setTimeout(function() {
+          callback(new Error('Download failed'));
+        }, 10);
+        return noop;
+      }, noop, noop, function(err) {
+        expect(err.message).to.equal('Download failed');
+        expect(hedger.samples.length).to.equal(1);
+        expect(hedger.samples[0]).to.be.at.least(4);
+        done();
+      });
+    });
+  });
+
+  describe('#storeChunked', function() {
+    const chunked = require('../lib/chunked');
+    const bucketId = '368be0816766b28fd5f43af5';
+    const sourcePath = require('os').tmpdir() + '/genaro-chunked-test-' + process.pid + '.data';
+    const targetPath = sourcePath + '.out';
+    const sizes = { minSize: 64 * 1024, avgSize: 256 * 1024, maxSize: 1024 * 1024 };
+    let data;
+
+    before(function() {
+      // a repeated block, so some chunks occur more than once
+      const block = require('crypto').randomBytes(1024 * 1024);
+      data = Buffer.concat([require('crypto').randomBytes(1024 * 1024), block, block]);
+      fs.writeFileSync(sourcePath, data);
+    });
+
+    after(function() {
+      fs.unlinkSync(sourcePath);
+      if (fs.existsSync(targetPath)) {
+        fs.unlinkSync(targetPath);
+      }
+    });
+
+    it('should download with resolveChunked what it uploaded', function(done) {
+      const env = new MockEnv();
+      chunked.install(env);
+
+      env.storeChunked(bucketId, sourcePath, Object.assign({
+        filename: 'chunked.data',
+        finishedCallback: function(err, manifestFileId, stats) {
+          if (err) {
+            return done(err);
+          }
+          // every distinct chunk and the manifest
+          expect(env.files.size).to.equal(stats.uploadedChunks + 1);
+          expect(stats.uploadedChunks).to.be.at.most(stats.chunks);
+
+          env.resolveChunked(bucketId, manifestFileId, targetPath, {
+            overwrite: true,
+            finishedCallback: function(err, fileBytes) {
+              if (err) {
+                return done(err);
+              }
+              expect(fileBytes).to.equal(data.length);
+              expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+              done();
+            }
+          });
+        }
+      }, sizes));
+    });
+
+    it('should not upload chunks the bucket already has', function(done) {
+      const env = new MockEnv();
+      chunked.install(env);
+
+      env.storeChunked(bucketId, sourcePath, Object.assign({
+        filename: 'chunked.data',
+        finishedCallback: function(err) {
+          if (err) {
+            return done(err);
+          }
+          env.storeChunked(bucketId, sourcePath, Object.assign({
+            filename: 'chunked-again.data',
+            finishedCallback: function(err, manifestFileId, stats) {
+              if (err) {
+                return done(err);
+              }
+              expect(stats.uploadedChunks).to.equal(0);
+              expect(stats.uploadedBytes).to.equal(0);
+              done();
+            }
+          }, sizes));
+        }
+      }, sizes));
+    });
+  });
+
+  describe('#syncDirectory', function() {
+    const sync = require('../lib/sync');
+    const bucketId = '368be0816766b28fd5f43af5';
+    const localDir = require('os').tmpdir() + '/genaro-sync-test-' + process.pid;
+
+    function syncOnce(env, callback) {
+      env.syncDirectory(bucketId, localDir, {
+        finishedCallback: callback
+      });
+    }
+
+    beforeEach(function() {
+      fs.mkdirSync(localDir);
+      fs.mkdirSync(localDir + '/sub');
+      fs.writeFileSync(localDir + '/a.txt', 'first version of a');
+      fs.writeFileSync(localDir + '/sub/b.txt', 'b');
+    });
+
+    afterEach(function() {
+      removeDirectory(localDir);
+    });
+
+    it('should upload only what changed and replace the previous version', function(done) {
+      const env = new MockEnv();
+      sync.install(env);
+
+      syncOnce(env, function(err, stats) {
+        if (err) {
+          return done(err);
+        }
+        expect(stats.uploaded).to.equal(2);
+        const first = env.find('a.txt').id;
+
+        fs.writeFileSync(localDir + '/a.txt', 'second version of a');
+        syncOnce(env, function(err, stats) {
+          if (err) {
+            return done(err);
+          }
+          expect(stats.uploaded).to.equal(1);
+          expect(stats.unchanged).to.equal(1);
+          expect(stats.failed.length).to.equal(0);
+          expect(env.files.has(first)).to.equal(false);
+          expect(env.find('a.txt').data.toString()).to.equal('second version of a');
+          expect(env.files.size).to.equal(2);
+          done();
+        });
+      });
+    });
+
+    it('should keep the previous version when the upload fails', function(done) {
+      let failing = false;
+      const env = new MockEnv(function(method, name) {
+        return failing && method === 'storeFile' && name === 'a.txt' ?
+          { error: new Error('Upload failed') } : {};
+      });
+      sync.install(env);
+
+      syncOnce(env, function(err) {
+        if (err) {
+          return done(err);
+        }
+        const first = env.find('a.txt').id;
+
+        failing = true;
+        fs.writeFileSync(localDir + '/a.txt', 'second version of a');
+        syncOnce(env, function(err, stats) {
+          if (err) {
+            return done(err);
+          }
+          expect(stats.uploaded).to.equal(0);
+          expect(stats.failed.length).to.equal(1);
+          expect(env.files.has(first)).to.equal(true);
+          expect(env.calls.deleteFile).to.equal(0);
+
+          // the manifest still points at the first version, so it is retried
+          failing = false;
+          syncOnce(env, function(err, stats) {
+            if (err) {
+              return done(err);
+            }
+            expect(stats.uploaded).to.equal(1);
+            expect(env.files.has(first)).to.equal(false);
+            done();
+          });
+        });
+      });
+    });
+
+    it('should not delete what is below a directory it can not read', function(done) {
+      const binding = require('bindings')('genaro.node');
+      const scanDirectory = binding.utilScanDirectory;
+      const env = new MockEnv();
+      sync.install(env);
+
+      syncOnce(env, function(err) {
+        if (err) {
+          return done(err);
+        }
+
+        // as if sub had become unreadable since
+        binding.utilScanDirectory = function(dir, callback) {
+          scanDirectory(dir, function(err, files) {
+            callback(err, files && files.filter(function(file) {
+              return !file.path.startsWith('sub/');
+            }), ['sub']);
+          });
+        };
+        env.syncDirectory(bucketId, localDir, {
+          deleteRemoved: true,
+          finishedCallback: function(err, stats) {
+            binding.utilScanDirectory = scanDirectory;
+            if (err) {
+              return done(err);
+            }
+            expect(stats.removed).to.equal(0);
+            expect(stats.failed).to.deep.equal([
+              { path: 'sub', message: 'Unable to read directory' }
+            ]);
+            expect(env.find('sub/b.txt')).to.be.an('object');
+            done();
+          }
+        });
+      });
+    });
+  });
+
+  describe('#mirrorBucket', function() {
+    const mirror = require('../lib/mirror');
+    const bucketId = '368be0816766b28fd5f43af5';
+    const localDir = require('os').tmpdir() + '/genaro-mirror-test-' + process.pid;
+    const manifestPath = localDir + '/.genaro-mirror.json';
+
+    function mirrorOnce(env, callback) {
+      env.mirrorBucket(bucketId, localDir, {
+        finishedCallback: callback
+      });
+    }
+
+    beforeEach(function() {
+      fs.mkdirSync(localDir);
+    });
+
+    afterEach(function() {
+      removeDirectory(localDir);
+    });
+
+    it('should pass a listing error to the finished callback', function(done) {
+      const env = new libstorj.Environment(statusCodeConfig(404));
+
+      mirrorOnce(env, function(err, stats) {
+        expect(err).to.be.an('Error');
+        expect(err.message).to.match(/resource not found/i);
+        expect(stats.downloaded).to.equal(0);
+        expect(fs.existsSync(manifestPath)).to.equal(false);
+        env.destroy();
+        done();
+      });
+    });
+
+    it('should download only what changed', function(done) {
+      const env = new MockEnv();
+      mirror.install(env);
+      env.add('a.txt', 'aaa');
+      env.add('sub/b.txt', 'bb');
+
+      mirrorOnce(env, function(err, stats) {
+        if (err) {
+          return done(err);
+        }
+        expect(stats.downloaded).to.equal(2);
+        expect(fs.readFileSync(localDir + '/a.txt', 'utf8')).to.equal('aaa');
+        expect(fs.readFileSync(localDir + '/sub/b.txt', 'utf8')).to.equal('bb');
+
+        mirrorOnce(env, function(err, stats) {
+          if (err) {
+            return done(err);
+          }
+          expect(stats.unchanged).to.equal(2);
+          expect(env.calls.resolveFile).to.equal(2);
+
+          // same size, other content
+          fs.writeFileSync(localDir + '/a.txt', 'xxx');
+          mirrorOnce(env, function(err, stats) {
+            if (err) {
+              return done(err);
+            }
+            expect(stats.downloaded).to.equal(1);
+            expect(stats.unchanged).to.equal(1);
+            expect(fs.readFileSync(localDir + '/a.txt', 'utf8')).to.equal('aaa');
+            done();
+          });
+        });
+      });
+    });
+
+    it('should fail a file saved next to the one it could not replace', function(done) {
+      const env = new MockEnv(function(method, name) {
+        return name === 'a.txt' ? { saveAs: localDir + '/a (1).txt' } : {};
+      });
+      mirror.install(env);
+      env.add('a.txt', 'aaa');
+      env.add('b.txt', 'bb');
+
+      mirrorOnce(env, function(err, stats) {
+        if (err) {
+          return done(err);
+        }
+        expect(stats.downloaded).to.equal(1);
+        expect(stats.failed.length).to.equal(1);
+        expect(stats.failed[0].message).to.match(/saved as/);
+        const manifest = JSON.parse(fs.readFileSync(manifestPath, 'utf8'));
+        expect(manifest.files['a.txt']).to.equal(undefined);
+        expect(manifest.files['b.txt'].hash).to.be.a('string');
+        done();
+      });
+    });
+  });
+
   describe('#mnemonicCheck', function() {
     it('should return true for a valid mnemonic', function() {
       var mnemonicCheckResult = libstorj.mnemonicCheck('abandon abandon abandon abandon abandon abandon abandon abandon abandon abandon abandon about');
@@ -290,22 +1266,388 @@ describe('libstorj', function() {
     });
   });
 
-  describe('#mnemonicGenerate', function() {
-    describe('minimum strength', function () {
-      it('should return a new mnemonic larger than 50 characters', function () {
-        var mnemonic = libstorj.mnemonicGenerate(128);
-        expect(mnemonic).to.a('string');
-        expect(mnemonic.length).to.be.above(50)
-      });
+  describe('#mnemonicGenerate', function() {
+    describe('minimum strength', function () {
+      it('should return a new mnemonic larger than 50 characters', function () {
+        var mnemonic = libstorj.mnemonicGenerate(128);
+        expect(mnemonic).to.a('string');
+        expect(mnemonic.length).to.be.above(50)
+      });
+    });
+
+    describe('maximum strength', function () {
+      it('should return a new mnemonic larger than 100 characters', function () {
+        var mnemonic = libstorj.mnemonicGenerate(256);
+        expect(mnemonic).to.a('string');
+        expect(mnemonic.length).to.be.above(100)
+      });
+    })
+  });
+
+  describe('#memoryStats', function() {
+    it('should report no memory without transfers', function() {
+      const config = shallowCopy(defaultConfig);
+      config.maxMemory = 64 * 1024 * 1024;
+      const env = new libstorj.Environment(config);
+      const stats = env.memoryStats();
+      expect(stats.inflightBytes).to.equal(0);
+      expect(stats.maxMemory).to.equal(64 * 1024 * 1024);
+      expect(stats.queuedTransfers).to.equal(0);
+      env.destroy();
+    });
+
+    const bucketId = '368be0816766b28fd5f43af5';
+    const fileId = '998960317b6725a3f8080c2b';
+    const filePath = './storj-test-memory.data';
+
+    function queueingEnv() {
+      // the first transfer always runs, any other one has to wait
+      const config = statusCodeConfig(404);
+      config.maxMemory = 1;
+      return new libstorj.Environment(config);
+    }
+
+    it('should queue transfers above maxMemory and drain the queue', function(done) {
+      const env = queueingEnv();
+      const finished = [];
+
+      function finishedCallback(index) {
+        return function(err) {
+          expect(err).to.be.an('Error');
+          finished.push(index);
+          if (finished.length < 2) {
+            return;
+          }
+          expect(finished).to.deep.equal([0, 1]);
+          const stats = env.memoryStats();
+          expect(stats.inflightBytes).to.equal(0);
+          expect(stats.queuedTransfers).to.equal(0);
+          env.destroy();
+          done();
+        };
+      }
+
+      env.resolveFile(bucketId, fileId, filePath + '.0', {
+        progressCallback: function() {},
+        finishedCallback: finishedCallback(0)
+      });
+      env.resolveFile(bucketId, fileId, filePath + '.1', {
+        progressCallback: function() {},
+        finishedCallback: finishedCallback(1)
+      });
+
+      const stats = env.memoryStats();
+      expect(stats.inflightBytes).to.be.above(0);
+      expect(stats.queuedTransfers).to.equal(1);
+    });
+
+    it('should finish a queued transfer that is canceled', function(done) {
+      const env = queueingEnv();
+      let canceled = false;
+
+      env.resolveFile(bucketId, fileId, filePath + '.0', {
+        progressCallback: function() {},
+        finishedCallback: function() {
+          expect(canceled).to.equal(true);
+          expect(env.memoryStats().inflightBytes).to.equal(0);
+          env.destroy();
+          done();
+        }
+      });
+      const state = env.resolveFile(bucketId, fileId, filePath + '.1', {
+        progressCallback: function() {},
+        finishedCallback: function(err) {
+          expect(err.message).to.match(/canceled/i);
+          canceled = true;
+        }
+      });
+
+      env.resolveFileCancel(state);
+      expect(canceled).to.equal(true);
+      expect(env.memoryStats().queuedTransfers).to.equal(0);
+    });
+
+    it('should fail queued transfers when the env is destroyed', function(done) {
+      const env = queueingEnv();
+      let failed = false;
+
+      env.resolveFile(bucketId, fileId, filePath + '.0', {
+        progressCallback: function() {},
+        finishedCallback: function(err) {
+          expect(err).to.be.an('Error');
+          expect(failed).to.equal(true);
+          done();
+        }
+      });
+      env.resolveFile(bucketId, fileId, filePath + '.1', {
+        progressCallback: function() {},
+        finishedCallback: function(err) {
+          expect(err.message).to.equal('Environment destroyed');
+          failed = true;
+        }
+      });
+
+      env.destroy();
+    });
+  });
+
+  describe('#logger', function() {
+    const bucketId = '368be0816766b28fd5f43af5';
+    const fileId = '998960317b6725a3f8080c2b';
+    const filePath = './storj-test-logger.data';
+
+    function loggingEnv(lines) {
+      const config = statusCodeConfig(404);
+      config.logger = function(entries) {
+        entries.forEach(function(entry) {
+          lines.push(entry);
+        });
+      };
+      return new libstorj.Environment(config);
+    }
+
+    // a download that fails at the bridge, then time for the log batch
+    function failDownload(env, callback) {
+      env.resolveFile(bucketId, fileId, filePath, {
+        progressCallback: function() {},
+        finishedCallback: function(err) {
+          expect(err).to.be.an('error');
+          setTimeout(callback, 100);
+        }
+      });
+    }
+
+    afterEach(function() {
+      if (fs.existsSync(filePath)) {
+        fs.unlinkSync(filePath);
+      }
+    });
+
+    it('will throw if logger is not a function', function() {
+      const config = shallowCopy(defaultConfig);
+      config.logger = 'stdout';
+      expect(function() {
+        new libstorj.Environment(config);
+      }).to.throw('logger is expected to be a function');
+    });
+
+    it('should give every logger only the lines of its environment', function(done) {
+      const first = [];
+      const second = [];
+      const firstEnv = loggingEnv(first);
+      const secondEnv = loggingEnv(second);
+      const written = libstorj.utilLogStats().written;
+
+      failDownload(firstEnv, function() {
+        expect(first.length).to.be.above(0);
+        expect(second.length).to.equal(0);
+        first.forEach(function(entry) {
+          expect(entry.message).to.be.a('string');
+          expect(entry.level).to.be.a('number');
+          expect(entry.timestamp).to.be.a('number');
+        });
+        const firstLines = first.length;
+
+        failDownload(secondEnv, function() {
+          expect(second.length).to.be.above(0);
+          expect(first.length).to.equal(firstLines);
+
+          const stats = libstorj.utilLogStats();
+          expect(stats.written - written).to.be.at.least(first.length + second.length);
+          expect(stats.dropped).to.be.a('number');
+          firstEnv.destroy();
+          secondEnv.destroy();
+          done();
+        });
+      });
+    });
+  });
+
+  describe('#generateEncryptionInfoBatch', function() {
+    it('will throw without a callback', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      expect(function() {
+        env.generateEncryptionInfoBatch('368be0816766b28fd5f43af5', 2);
+      }).to.throw('Unexpected arguments');
+      env.destroy();
+    });
+
+    it('will give back the requested number of entries', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      env.generateEncryptionInfoBatch('368be0816766b28fd5f43af5', 3, function(err, infos) {
+        expect(err).to.equal(null);
+        expect(infos).to.have.lengthOf(3);
+        infos.forEach(function(info) {
+          expect(info).to.have.all.keys('index', 'key', 'ctr');
+        });
+        env.destroy();
+        done();
+      });
+    });
+  });
+
+  describe('#encryptionInfoPool', function() {
+    const bucketId = '368be0816766b28fd5f43af5';
+
+    function poolEnv() {
+      const config = shallowCopy(defaultConfig);
+      config.encryptionInfoPool = 4;
+      return new libstorj.Environment(config);
+    }
+
+    // the refill runs on the threadpool and is handed back to the js thread
+    function whenRefilled(env, callback) {
+      const stats = env.encryptionInfoPoolStats(bucketId);
+      if (stats.refilling) {
+        return setTimeout(whenRefilled, 1, env, callback);
+      }
+      callback(stats);
+    }
+
+    it('should refill the pool once it was drained below its size', function(done) {
+      const env = poolEnv();
+      expect(env.encryptionInfoPoolStats(bucketId).ready).to.equal(0);
+
+      // the first call for a bucket is generated right away
+      expect(env.generateEncryptionInfo(bucketId)).to.have.all.keys('index', 'key', 'ctr');
+
+      whenRefilled(env, function(stats) {
+        expect(stats.size).to.equal(4);
+        expect(stats.ready).to.equal(4);
+        expect(stats.refills).to.equal(1);
+
+        const indexes = [];
+        for (let i = 0; i < 3; i++) {
+          indexes.push(env.generateEncryptionInfo(bucketId).index);
+        }
+        expect(new Set(indexes).size).to.equal(3);
+        expect(env.encryptionInfoPoolStats(bucketId).ready).to.equal(1);
+
+        whenRefilled(env, function(stats) {
+          expect(stats.ready).to.equal(4);
+          expect(stats.refills).to.equal(2);
+          env.destroy();
+          done();
+        });
+      });
+    });
+
+    it('should not start a refill while one is running', function(done) {
+      const env = poolEnv();
+
+      for (let i = 0; i < 8; i++) {
+        expect(env.generateEncryptionInfo(bucketId)).to.have.all.keys('index', 'key', 'ctr');
+      }
+      const stats = env.encryptionInfoPoolStats(bucketId);
+      expect(stats.refilling).to.equal(true);
+      expect(stats.refills).to.equal(1);
+
+      whenRefilled(env, function(stats) {
+        expect(stats.ready).to.equal(4);
+        expect(stats.refills).to.equal(1);
+        env.destroy();
+        done();
+      });
+    });
+  });
+
+  describe('#encryptMetaToFiles', function() {
+    it('will throw without a path for every meta', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      expect(function() {
+        env.encryptMetaToFiles(['a', 'b'], ['/tmp/a'], function() {});
+      }).to.throw('Expected a path for every meta');
+      env.destroy();
+    });
+
+    it('will write metas that decryptMetaFromFiles reads back', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      const metas = ['{"name":"a"}', 'x'.repeat(5000)];
+      const paths = metas.map(function(meta, i) {
+        return require('os').tmpdir() + '/genaro-meta-test-' + process.pid + '-' + i;
+      });
+      env.encryptMetaToFiles(metas, paths, function(err, written) {
+        expect(err).to.equal(null);
+        expect(written).to.deep.equal([true, true]);
+        env.decryptMetaFromFiles(paths.concat('/nonexistent/meta'), function(err, decrypted) {
+          expect(err).to.equal(null);
+          expect(decrypted).to.deep.equal(metas.concat(null));
+          expect(env.decryptMetaFromFile(paths[1])).to.equal(metas[1]);
+          paths.forEach(function(path) {
+            fs.unlinkSync(path);
+          });
+          env.destroy();
+          done();
+        });
+      });
+    });
+  });
+
+  describe('#encryptMetaBatch', function() {
+    it('will throw without a callback', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      expect(function() {
+        env.encryptMetaBatch(['a']);
+      }).to.throw('Unexpected arguments');
+      env.destroy();
+    });
+
+    it('will encrypt strings and Buffers that decryptMetaBatch reads back', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      const metas = [];
+      for (let i = 0; i < 20; i++) {
+        metas.push('{"name":"file' + i + '"}');
+      }
+      env.encryptMetaBatch(metas.map(function(meta, i) {
+        return i % 2 ? Buffer.from(meta) : meta;
+      }), function(err, encrypted) {
+        expect(err).to.equal(null);
+        expect(encrypted).to.have.lengthOf(metas.length);
+        expect(env.decryptMeta(encrypted[3])).to.equal(metas[3]);
+        env.decryptMetaBatch(encrypted.concat('invalid'), function(err, decrypted) {
+          expect(err).to.equal(null);
+          expect(decrypted).to.deep.equal(metas.concat(null));
+          env.destroy();
+          done();
+        });
+      });
+    });
+
+    it('will call back after returning for no metas', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      let returned = false;
+      env.encryptMetaBatch([], function(err, encrypted) {
+        expect(returned).to.equal(true);
+        expect(err).to.equal(null);
+        expect(encrypted).to.deep.equal([]);
+        env.destroy();
+        done();
+      });
+      returned = true;
+    });
+  });
+
+  describe('#ready', function() {
+    it('should resolve right away without warmup', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      env.ready.then(function(result) {
+        expect(result.warm).to.equal(false);
+        env.destroy();
+        done();
+      }).catch(done);
     });
 
-    describe('maximum strength', function () {
-      it('should return a new mnemonic larger than 100 characters', function () {
-        var mnemonic = libstorj.mnemonicGenerate(256);
-        expect(mnemonic).to.a('string');
-        expect(mnemonic.length).to.be.above(100)
-      });
-    })
+    it('should resolve once the bridge was reached', function(done) {
+      const config = shallowCopy(defaultConfig);
+      config.warmup = 2;
+      const env = new libstorj.Environment(config);
+      env.ready.then(function(result) {
+        expect(result.warm).to.equal(true);
+        expect(result.connections).to.equal(2);
+        env.destroy();
+        done();
+      }).catch(done);
+    });
   });
 
   describe('#getInfo', function() {
@@ -338,6 +1680,21 @@ describe('libstorj', function() {
       });
     });
 
+    it('should get info about the bridge from an io thread', function(done) {
+      const config = shallowCopy(defaultConfig);
+      config.ioThread = true;
+      const env = new libstorj.Environment(config);
+
+      env.getInfo(function(err, result) {
+        if (err) {
+          return done(err);
+        }
+        expect(result.info.title).to.equal('Storj Bridge');
+        env.destroy();
+        done();
+      });
+    });
+
     itBehavesLikeNonAuthedCurlRequest('getInfo', []);
   });
 
@@ -380,6 +1737,29 @@ describe('libstorj', function() {
       });
     });
 
+    it('should share one request between identical calls', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      const results = [];
+
+      function finished(err, result) {
+        if (err) {
+          return done(err);
+        }
+        results.push(result);
+        if (results.length === 2) {
+          expect(results[0]).to.not.equal(results[1]);
+          expect(results[0]).to.deep.equal(results[1]);
+          expect(env.requestStats().coalescedReads).to.equal(1);
+          expect(env.requestStats().inflightReads).to.equal(0);
+          env.destroy();
+          done();
+        }
+      }
+
+      env.getBuckets(finished);
+      env.getBuckets(finished);
+    });
+
     itBehavesLikeCurlRequest('getBuckets', []);
     itBehavesLikeAuthenticatedRequest('getBuckets', [], true)
   });
@@ -539,6 +1919,114 @@ describe('libstorj', function() {
       env.storeFile(bucketId, storeFilePath, options);
     });
 
+    it('will throw for dedupe without a dedupe index', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      const options = shallowCopy(defaultOptions);
+      options.dedupe = true;
+      expect(function() {
+        env.storeFile(bucketId, storeFilePath, true, options);
+      }).to.throw('dedupeIndex');
+      env.destroy();
+    });
+
+    it('should finish a dedupe hit without uploading', function(done) {
+      const os = require('os');
+      const dataPath = os.tmpdir() + '/genaro-dedupe-test-' + process.pid + '.data';
+      const indexPath = os.tmpdir() + '/genaro-dedupe-test-' + process.pid + '.index';
+      const data = Buffer.from('dedupe test data');
+      const hash = require('crypto').createHash('sha256').update(data).digest('hex');
+      const sha256OfEncrypted = 'e'.repeat(64);
+      fs.writeFileSync(dataPath, data);
+      fs.writeFileSync(indexPath, ['+', bucketId, hash, 'a1b2c3d4e5f6a7b8c9d0e1f2', data.length, sha256OfEncrypted].join(' ') + '\n');
+
+      // the bridge can not be reached, only the index can finish it
+      const config = shallowCopy(badHostnameConfig);
+      config.dedupeIndex = indexPath;
+      const env = new libstorj.Environment(config);
+      const options = shallowCopy(defaultOptions);
+      let progressed = false;
+      options.dedupe = true;
+      options.progressCallback = function() {
+        progressed = true;
+      };
+      options.finishedCallback = function(err, fileId, fileBytes, sha256) {
+        expect(err).to.equal(null);
+        expect(fileId).to.equal('a1b2c3d4e5f6a7b8c9d0e1f2');
+        expect(fileBytes).to.equal(data.length);
+        expect(sha256).to.equal(sha256OfEncrypted);
+        expect(progressed).to.equal(false);
+        env.destroy();
+        fs.unlinkSync(dataPath);
+        fs.unlinkSync(indexPath);
+        done();
+      };
+      env.storeFile(bucketId, dataPath, true, options);
+    });
+
+    it('will throw for an unknown io mode', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      const options = shallowCopy(defaultOptions);
+      options.ioMode = 'mmap';
+      expect(function() {
+        env.storeFile(bucketId, storeFilePath, true, options);
+      }).to.throw('Unknown ioMode');
+      env.destroy();
+    });
+
+    it('will throw for the direct io mode', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      const options = shallowCopy(defaultOptions);
+      options.ioMode = 'direct';
+      expect(function() {
+        env.storeFile(bucketId, storeFilePath, true, options);
+      }).to.throw('Unknown ioMode');
+      env.destroy();
+    });
+
+    it('will throw for a segment of data that is not a file', function() {
+      const env = new libstorj.Environment(defaultConfig);
+      const options = shallowCopy(defaultOptions);
+      options.segment = { offset: 0, length: 16 };
+      expect(function() {
+        env.storeFile(bucketId, 'some data', false, options);
+      }).to.throw('segment needs');
+      env.destroy();
+    });
+
+    it('should upload a segment of an open file', function(done) {
+      this.timeout(0);
+      const env = new libstorj.Environment(defaultConfig);
+      const fd = fs.openSync(storeFilePath, 'r');
+      const options = shallowCopy(defaultOptions);
+      // all of it, so the shards are the ones the mock farmer expects
+      options.segment = { offset: 0, length: fs.fstatSync(fd).size, fd: fd };
+      options.finishedCallback = function(err, fileId) {
+        fs.closeSync(fd);
+        if (err) {
+          return done(err);
+        }
+        expect(fileId).to.be.a('string');
+        env.destroy();
+        done();
+      };
+
+      env.storeFile(bucketId, storeFilePath, true, options);
+    });
+
+    it('should fail a segment past the end of the file', function(done) {
+      const env = new libstorj.Environment(defaultConfig);
+      const options = shallowCopy(defaultOptions);
+      options.segment = { offset: fs.statSync(storeFilePath).size, length: 16 };
+      options.finishedCallback = function(err) {
+        expect(err).to.be.an('Error');
+        expect(err.message).to.match(/Unable to read file segment/);
+        env.destroy();
+        done();
+      };
+
+      env.storeFile(bucketId, storeFilePath, true, options);
+    });
+
     itBehavesLikeCurlRequestWithMultipleCallbacks('storeFile', [bucketId, storeFilePath, shallowCopy(defaultOptions)]);
   });
 
@@ -579,6 +2067,36 @@ describe('libstorj', function() {
         expect(finished).to.equal(false);
       }, 0);
     });
+
+    it('should finish a running upload when its io thread env is destroyed', function (done) {
+      this.timeout(0);
+      const config = shallowCopy(defaultConfig);
+      config.ioThread = true;
+      const env = new libstorj.Environment(config);
+
+      const bucketId = '368be0816766b28fd5f43af5';
+
+      let finished = false;
+      env.storeFile(bucketId, storeFilePath, {
+        filename: 'storj-test-upload.data',
+        index: 'd2891da46d9c3bf42ad619ceddc1b6621f83e6cb74e6b6b6bc96bdbfaefb8692',
+        progressCallback: function () {},
+        finishedCallback: function (err) {
+          expect(finished).to.equal(false);
+          finished = true;
+          // the upload may have been through before the destroy got to it
+          if (err) {
+            expect(err.message).to.equal('Environment destroyed');
+          }
+          done();
+        }
+      });
+
+      setTimeout(function () {
+        env.destroy();
+        expect(finished).to.equal(false);
+      }, 0);
+    });
   });
 
   describe('#resolveFile', function() {
@@ -624,10 +2142,464 @@ describe('libstorj', function() {
       env.resolveFile(bucketId, fileId, filePath, options);
     });
 
+    it('should leave no file behind a failed download with fsync', function(done) {
+      const env = new libstorj.Environment(statusCodeConfig(404));
+      const options = shallowCopy(defaultOptions);
+      options.fsync = true;
+      options.finishedCallback = function(err) {
+        expect(err).to.be.an('Error');
+        expect(fs.existsSync(filePath)).to.equal(false);
+        env.destroy();
+        done();
+      };
+
+      env.resolveFile(bucketId, fileId, filePath, options);
+    });
+
+    it('should sync a multipart download before renaming it with fsync', function(done) {
+      const env = new MockEnv();
+      require('../lib/multipart').install(env, {});
+      const sourcePath = require('os').tmpdir() + '/genaro-fsync-test-' + process.pid + '.data';
+      const data = require('crypto').randomBytes(3 * 1024);
+      fs.writeFileSync(sourcePath, data);
+
+      const fsync = fs.fsync;
+      let synced = 0;
+      env.storeMultipart(bucketId, sourcePath, {
+        filename: 'fsync.data',
+        partSize: 1024,
+        finishedCallback: function(err, manifestFileId) {
+          fs.unlinkSync(sourcePath);
+          if (err) {
+            return done(err);
+          }
+          fs.fsync = function(fd, callback) {
+            synced++;
+            // the parts are in place, the rename has not happened yet
+            expect(fs.existsSync(filePath)).to.equal(false);
+            fsync(fd, callback);
+          };
+          env.resolveFile(bucketId, manifestFileId, filePath, {
+            multipart: true,
+            fsync: true,
+            finishedCallback: function(err) {
+              fs.fsync = fsync;
+              if (err) {
+                return done(err);
+              }
+              expect(synced).to.equal(1);
+              expect(fs.readFileSync(filePath).equals(data)).to.equal(true);
+              fs.unlinkSync(filePath);
+              done();
+            }
+          });
+        }
+      });
+    });
+
     itBehavesLikeCurlRequestWithMultipleCallbacks('resolveFile', [bucketId, fileId, filePath, shallowCopy(defaultOptions)]);
     itBehavesLikeAuthenticatedRequestWithMultipleCallbacks('resolveFile', [bucketId, fileId, filePath, shallowCopy(defaultOptions)]);
   });
 
+  describe('#storeMultipart', function() {
+    const multipart = require('../lib/multipart');
+    const bucketId = '368be0816766b28fd5f43af5';
+    const sourcePath = require('os').tmpdir() + '/genaro-multipart-test-' + process.pid + '.data';
+    const targetPath = sourcePath + '.out';
+    const data = require('crypto').randomBytes(8 * 1024);
+
+    function partIndex(name) {
+      const separator = name.indexOf(multipart.PART_SEPARATOR);
+      return separator === -1 ? null : name.slice(separator + multipart.PART_SEPARATOR.length).split('-')[0];
+    }
+
+    function storeParts(env, callback, parity) {
+      env.storeMultipart(bucketId, sourcePath, {
+        filename: 'multipart.data',
+        partSize: 1024,
+        retries: 0,
+        parity: parity,
+        finishedCallback: callback
+      });
+    }
+
+    before(function() {
+      fs.writeFileSync(sourcePath, data);
+    });
+
+    after(function() {
+      fs.unlinkSync(sourcePath);
+    });
+
+    afterEach(function() {
+      if (fs.existsSync(targetPath)) {
+        fs.unlinkSync(targetPath);
+      }
+    });
+
+    it('should download what it uploaded with multipart', function(done) {
+      const env = new MockEnv();
+      multipart.install(env, {});
+
+      storeParts(env, function(err, manifestFileId, stats) {
+        if (err) {
+          return done(err);
+        }
+        expect(stats.uploadedParts).to.equal(8);
+        env.resolveFile(bucketId, manifestFileId, targetPath, {
+          multipart: true,
+          finishedCallback: function(err, fileBytes, sha256, filePath, stats) {
+            if (err) {
+              return done(err);
+            }
+            expect(fileBytes).to.equal(data.length);
+            expect(filePath).to.equal(targetPath);
+            expect(stats.parts).to.equal(8);
+            expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+            done();
+          }
+        });
+      });
+    });
+
+    it('should put a multipart upload together when downloaded without multipart', function(done) {
+      const env = new MockEnv();
+      multipart.install(env, {});
+
+      storeParts(env, function(err, manifestFileId) {
+        if (err) {
+          return done(err);
+        }
+        env.resolveFile(bucketId, manifestFileId, targetPath, {
+          decrypt: true,
+          finishedCallback: function(err, fileBytes, sha256, filePath, stats) {
+            if (err) {
+              return done(err);
+            }
+            expect(fileBytes).to.equal(data.length);
+            expect(stats.parts).to.equal(8);
+            expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+
+            // the same without decrypting the download
+            env.resolveFile(bucketId, manifestFileId, targetPath, {
+              overwrite: true,
+              finishedCallback: function(err, fileBytes) {
+                if (err) {
+                  return done(err);
+                }
+                expect(fileBytes).to.equal(data.length);
+                expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+                done();
+              }
+            });
+          }
+        });
+      });
+    });
+
+    it('should download the manifest itself with multipart false', function(done) {
+      const env = new MockEnv();
+      multipart.install(env, {});
+
+      storeParts(env, function(err, manifestFileId) {
+        if (err) {
+          return done(err);
+        }
+        env.resolveFile(bucketId, manifestFileId, targetPath, {
+          decrypt: true,
+          multipart: false,
+          finishedCallback: function(err, fileBytes) {
+            if (err) {
+              return done(err);
+            }
+            expect(fileBytes).to.be.below(data.length);
+            const manifest = JSON.parse(env.decryptMeta(fs.readFileSync(targetPath, 'utf8')));
+            expect(manifest.type).to.equal('multipart');
+            done();
+          }
+        });
+      });
+    });
+
+    it('should download a small file without a manifest as it is', function(done) {
+      const env = new MockEnv();
+      multipart.install(env, {});
+      const fileId = env.add('small.data', Buffer.from('not a manifest'));
+
+      env.resolveFile(bucketId, fileId, targetPath, {
+        decrypt: true,
+        finishedCallback: function(err, fileBytes) {
+          if (err) {
+            return done(err);
+          }
+          expect(fileBytes).to.equal(14);
+          expect(fs.readFileSync(targetPath, 'utf8')).to.equal('not a manifest');
+          done();
+        }
+      });
+    });
+
+    it('should stop the other parts before reporting a failed upload', function(done) {
+      const env = new MockEnv(function(method, name) {
+        const index = partIndex(name);
+        if (index === '2') {
+          return { error: new Error('Upload failed') };
+        }
+        return { delay: 20 };
+      });
+      multipart.install(env, {});
+
+      storeParts(env, function(err) {
+        expect(err.message).to.equal('Upload failed');
+        expect(env.running).to.equal(0);
+        done();
+      });
+    });
+
+    it('should close the file only once no part can write into it', function(done) {
+      let failing = false;
+      const env = new MockEnv(function(method, name) {
+        const index = partIndex(name);
+        if (failing && index === '3') {
+          return { error: new Error('Download failed') };
+        }
+        return { delay: failing && index !== null ? 20 : 0 };
+      });
+      multipart.install(env, {});
+
+      storeParts(env, function(err, manifestFileId) {
+        if (err) {
+          return done(err);
+        }
+        failing = true;
+        env.resolveFile(bucketId, manifestFileId, targetPath, {
+          multipart: true,
+          retries: 0,
+          hedge: false,
+          finishedCallback: function(err) {
+            expect(err.message).to.equal('Download failed');
+            expect(env.running).to.equal(0);
+            expect(env.canceled).to.be.above(0);
+            expect(fs.existsSync(targetPath + '.genaromultipart')).to.equal(false);
+            expect(fs.existsSync(targetPath)).to.equal(false);
+            done();
+          }
+        });
+      });
+    });
+
+    it('should rebuild a part of a group that did not arrive from parity', function(done) {
+      let failing = false;
+      const env = new MockEnv(function(method, name) {
+        if (failing && partIndex(name) === '2') {
+          return { error: new Error('Download failed') };
+        }
+        return {};
+      });
+      multipart.install(env, {});
+
+      storeParts(env, function(err, manifestFileId, stats) {
+        if (err) {
+          return done(err);
+        }
+        expect(stats.parityParts).to.equal(2);
+        failing = true;
+        env.resolveFile(bucketId, manifestFileId, targetPath, {
+          multipart: true,
+          retries: 0,
+          hedge: false,
+          finishedCallback: function(err, fileBytes, sha256, filePath, stats) {
+            if (err) {
+              return done(err);
+            }
+            expect(stats.reconstructed).to.equal(1);
+            expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+            expect(env.running).to.equal(0);
+            done();
+          }
+        });
+      }, 4);
+    });
+
+    it('should fail a group that two of its parts did not arrive for', function(done) {
+      let failing = false;
+      const env = new MockEnv(function(method, name) {
+        const index = partIndex(name);
+        if (failing && (index === '1' || index === '3')) {
+          return { error: new Error('Download failed'), delay: index === '3' ? 10 : 0 };
+        }
+        return { delay: failing && index !== null ? 20 : 0 };
+      });
+      multipart.install(env, {});
+
+      storeParts(env, function(err, manifestFileId) {
+        if (err) {
+          return done(err);
+        }
+        failing = true;
+        env.resolveFile(bucketId, manifestFileId, targetPath, {
+          multipart: true,
+          retries: 0,
+          hedge: false,
+          finishedCallback: function(err) {
+            expect(err.message).to.equal('Part 3 could not be downloaded or reconstructed: Download failed');
+            expect(env.running).to.equal(0);
+            expect(env.canceled).to.be.above(0);
+            expect(fs.existsSync(targetPath + '.genaromultipart')).to.equal(false);
+            expect(fs.existsSync(targetPath)).to.equal(false);
+            done();
+          }
+        });
+      }, 4);
+    });
+
+    it('should download a file that holds no manifest as it is', function(done) {
+      const env = new MockEnv();
+      multipart.install(env, {});
+      const fileId = env.add('plain.data', data);
+
+      env.resolveFile(bucketId, fileId, targetPath, {
+        multipart: true,
+        decrypt: true,
+        finishedCallback: function(err, fileBytes) {
+          if (err) {
+            return done(err);
+          }
+          expect(fileBytes).to.equal(data.length);
+          expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+          done();
+        }
+      });
+    });
+
+    it('should not list the bucket for a download without multipart', function(done) {
+      const env = new MockEnv();
+      multipart.install(env, {});
+      const fileId = env.add('plain.data', data);
+
+      env.resolveFile(bucketId, fileId, targetPath, {
+        decrypt: true,
+        finishedCallback: function(err) {
+          expect(err).to.equal(null);
+          expect(env.calls.listFiles).to.equal(0);
+          expect(env.calls.resolveFile).to.equal(1);
+          done();
+        }
+      });
+    });
+
+    it('will throw for unexpected arguments with multipart', function() {
+      const env = new MockEnv();
+      multipart.install(env, {});
+      expect(function() {
+        env.resolveFile(bucketId, 'fileid', targetPath, { multipart: true });
+      }).to.throw('Unexpected arguments');
+      expect(function() {
+        env.resolveFile(bucketId, 'fileid', targetPath, {
+          multipart: true,
+          ioMode: 'mmap',
+          finishedCallback: function() {}
+        });
+      }).to.throw('Unknown ioMode');
+      expect(env.calls.resolveFile).to.equal(0);
+    });
+  });
+
+  describe('#followFile', function() {
+    const follow = require('../lib/follow');
+    const multipart = require('../lib/multipart');
+    const bucketId = '368be0816766b28fd5f43af5';
+    const filePath = require('os').tmpdir() + '/genaro-follow-test-' + process.pid + '.log';
+    const targetPath = filePath + '.out';
+
+    function followEnv() {
+      const env = new MockEnv();
+      multipart.install(env, {});
+      follow.install(env);
+      return env;
+    }
+
+    beforeEach(function() {
+      fs.writeFileSync(filePath, '');
+    });
+
+    afterEach(function() {
+      [filePath, targetPath].forEach(function(path) {
+        if (fs.existsSync(path)) {
+          fs.unlinkSync(path);
+        }
+      });
+    });
+
+    it('should seal segments by size and the rest with followClose', function(done) {
+      const env = followEnv();
+      const data = require('crypto').randomBytes(2500);
+      const sealed = [];
+      let lastProgress = null;
+      fs.writeFileSync(filePath, data);
+
+      const state = env.followFile(bucketId, filePath, {
+        filename: 'follow.log',
+        segmentSize: 1024,
+        maxLag: 60000,
+        progressCallback: function(progress, bytes) {
+          lastProgress = [progress, bytes];
+        },
+        segmentCallback: function(part) {
+          sealed.push(part.length);
+          // the 452 bytes left are neither a segment nor late yet
+          if (sealed.length === 2) {
+            expect(sealed).to.deep.equal([1024, 1024]);
+            setTimeout(function() {
+              expect(sealed.length).to.equal(2);
+              env.followClose(state);
+            }, 50);
+          }
+        },
+        finishedCallback: function(err, manifestFileId, stats) {
+          if (err) {
+            return done(err);
+          }
+          expect(sealed).to.deep.equal([1024, 1024, 452]);
+          expect(stats).to.deep.equal({ parts: 3, size: 2500 });
+          expect(lastProgress).to.deep.equal([1, 2500]);
+
+          env.resolveFile(bucketId, manifestFileId, targetPath, {
+            multipart: true,
+            finishedCallback: function(err) {
+              if (err) {
+                return done(err);
+              }
+              expect(fs.readFileSync(targetPath).equals(data)).to.equal(true);
+              done();
+            }
+          });
+        }
+      });
+    });
+
+    it('should seal a smaller segment once it waited maxLag', function(done) {
+      const env = followEnv();
+      const started = Date.now();
+      fs.writeFileSync(filePath, 'a line of log\n');
+
+      const state = env.followFile(bucketId, filePath, {
+        filename: 'follow.log',
+        segmentSize: 1024 * 1024,
+        maxLag: 100,
+        segmentCallback: function(part) {
+          expect(part.length).to.equal(14);
+          expect(Date.now() - started).to.be.at.least(100);
+          env.followCancel(state);
+        },
+        finishedCallback: function(err) {
+          expect(err.message).to.match(/canceled/);
+          done();
+        }
+      });
+    });
+  });
+
   describe('#resolveFileCancel', function () {
     const filePath = './storj-test-download.data';
 
@@ -0,0 +1,213 @@
+'use strict';
+
+// An environment that keeps a bucket in memory, for the transfers that are
+// built on top of storeFile and resolveFile. Data is kept as it was
+// uploaded and only comes back as such with `decrypt`, everything
+// finishes on a later tick. `behavior(method, name, options)` may return
+// `{ delay, error, saveAs }` for a transfer of the file called name, a
+// download with saveAs is written there as if replacing filePath was
+// refused.
+
+const fs = require('fs');
+const crypto = require('crypto');
+
+function noop() {}
+
+function sha256(data) {
+  return crypto.createHash('sha256').update(data).digest('hex');
+}
+
+// what a download without `decrypt` gives back
+function scramble(data) {
+  const out = Buffer.alloc(data.length);
+  for (let i = 0; i < data.length; i++) {
+    out[i] = data[i] ^ 0xff;
+  }
+  return out;
+}
+
+function MockEnv(behavior) {
+  this.files = new Map();
+  this.nextId = 1;
+  this.behavior = behavior || function() {
+    return {};
+  };
+  this.calls = { storeFile: 0, resolveFile: 0, listFiles: 0, deleteFile: 0 };
+  this.canceled = 0;
+  // transfers that did not finish yet
+  this.running = 0;
+  // what memoryStats and requestStats report, a running transfer holds
+  // one byte
+  this.maxMemory = 0;
+  this.coalescedReads = 0;
+}
+
+MockEnv.prototype.fileId = function() {
+  const id = this.nextId++;
+  return ('000000000000000000000000' + id.toString(16)).slice(-24);
+};
+
+MockEnv.prototype.add = function(filename, data, rsaKey, rsaCtr) {
+  const id = this.fileId();
+  this.files.set(id, { id: id, filename: filename, data: Buffer.from(data), rsaKey: rsaKey, rsaCtr: rsaCtr });
+  return id;
+};
+
+MockEnv.prototype.find = function(filename) {
+  return Array.from(this.files.values()).find(function(file) {
+    return file.filename === filename;
+  });
+};
+
+MockEnv.prototype.generateEncryptionInfo = function() {
+  return {
+    index: crypto.randomBytes(32).toString('hex'),
+    key: crypto.randomBytes(32).toString('hex'),
+    ctr: crypto.randomBytes(16).toString('hex')
+  };
+};
+
+MockEnv.prototype.encryptMeta = function(meta) {
+  return 'meta:' + Buffer.from(meta).toString('base64');
+};
+
+MockEnv.prototype.decryptMeta = function(encrypted) {
+  if (typeof encrypted !== 'string' || encrypted.indexOf('meta:') !== 0) {
+    return null;
+  }
+  return Buffer.from(encrypted.slice(5), 'base64').toString();
+};
+
+MockEnv.prototype.listFiles = function(bucketId, callback) {
+  const files = this.files;
+  this.calls.listFiles++;
+  setImmediate(function() {
+    callback(null, Array.from(files.values()).map(function(file) {
+      return {
+        id: file.id,
+        filename: file.filename,
+        size: file.data.length,
+        rsaKey: file.rsaKey,
+        rsaCtr: file.rsaCtr
+      };
+    }));
+  });
+};
+
+MockEnv.prototype.deleteFile = function(bucketId, fileId, callback) {
+  const files = this.files;
+  this.calls.deleteFile++;
+  setImmediate(function() {
+    if (!files.delete(fileId)) {
+      return callback(new Error('File not found'));
+    }
+    callback(null);
+  });
+};
+
+// a transfer that finishes after the delay behavior asks for, or when it
+// is canceled
+MockEnv.prototype.transfer = function(method, name, options, run) {
+  const self = this;
+  const state = { error_status: null, timer: null, finish: null };
+  const plan = this.behavior(method, name, options) || {};
+
+  state.finish = function(err) {
+    clearTimeout(state.timer);
+    state.finish = noop;
+    self.running--;
+    state.error_status = err || null;
+    options.finishedCallback.apply(null, arguments);
+  };
+
+  function complete() {
+    if (plan.error) {
+      return state.finish(plan.error);
+    }
+    let result;
+    try {
+      result = run(plan);
+    } catch (e) {
+      return state.finish(e);
+    }
+    options.progressCallback(1, result.bytes, result.bytes);
+    state.finish.apply(null, [null].concat(result.args));
+  }
+
+  this.calls[method]++;
+  this.running++;
+  state.cancel = function() {
+    self.canceled++;
+    setImmediate(function() {
+      state.finish(new Error('File transfer canceled'));
+    });
+  };
+  state.timer = plan.delay ? setTimeout(complete, plan.delay) : setTimeout(complete, 0);
+  return state;
+};
+
+MockEnv.prototype.storeFile = function(bucketId, source, isPath, options) {
+  if (options === undefined) {
+    options = isPath;
+    isPath = true;
+  }
+  const self = this;
+  options.progressCallback = options.progressCallback || noop;
+
+  return this.transfer('storeFile', options.filename, options, function() {
+    let data;
+    if (!isPath) {
+      data = Buffer.from(source);
+    } else if (options.segment) {
+      const segment = options.segment;
+      const fd = segment.fd === undefined ? fs.openSync(source, 'r') : segment.fd;
+      data = Buffer.alloc(segment.length);
+      fs.readSync(fd, data, 0, segment.length, segment.offset);
+      if (segment.fd === undefined) {
+        fs.closeSync(fd);
+      }
+    } else {
+      data = fs.readFileSync(source);
+    }
+    const id = self.add(options.filename, data, options.rsaKey, options.rsaCtr);
+    return { bytes: data.length, args: [id, data.length, sha256(data)] };
+  });
+};
+
+MockEnv.prototype.storeFileCancel = function(state) {
+  state.cancel();
+};
+
+MockEnv.prototype.resolveFile = function(bucketId, fileId, filePath, options) {
+  const file = this.files.get(fileId);
+  options.progressCallback = options.progressCallback || noop;
+
+  return this.transfer('resolveFile', file ? file.filename : fileId, options, function(plan) {
+    if (!file) {
+      throw new Error('File not found');
+    }
+    if (!options.overwrite && fs.existsSync(filePath)) {
+      throw new Error('File already exists');
+    }
+    const data = options.decrypt ? file.data : scramble(file.data);
+    const savedPath = plan.saveAs || filePath;
+    fs.writeFileSync(savedPath, data);
+    return { bytes: data.length, args: [data.length, sha256(data), savedPath] };
+  });
+};
+
+MockEnv.prototype.resolveFileCancel = function(state) {
+  state.cancel();
+};
+
+MockEnv.prototype.memoryStats = function() {
+  return { inflightBytes: this.running, maxMemory: this.maxMemory, queuedTransfers: 0 };
+};
+
+MockEnv.prototype.requestStats = function() {
+  return { inflightReads: 0, coalescedReads: this.coalescedReads };
+};
+
+MockEnv.prototype.destroy = noop;
+
+module.exports = MockEnv;
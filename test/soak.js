@@ -0,0 +1,182 @@
+'use strict';
+
+// Runs bridge requests, meta encryption and store, resolve and cancel
+// cycles of transfers against the mock bridge and farmer. Fails if the
+// resident set keeps growing once it has warmed up, or if the env still
+// holds memory for transfers whenever all of them have finished.
+//
+//   SOAK_ITERATIONS   operations to run (default 1000000)
+//   SOAK_CONCURRENCY  operations in flight at once (default 64)
+//   SOAK_MAX_GROWTH   allowed rss growth after warmup in bytes (default 32MB)
+//   SOAK_CHECK_EVERY  operations after which all are let finish and the
+//                     memory stats checked (default 10000)
+//
+// Build with GENARO_SANITIZE=1 to run it under ASan/LSan, see README.
+
+const fs = require('fs');
+const os = require('os');
+const libgenaro = require('..');
+const mockbridge = require('./mockbridge.js');
+const mockfarmer = require('./mockfarmer.js');
+
+const iterations = parseInt(process.env.SOAK_ITERATIONS || '1000000', 10);
+const concurrency = parseInt(process.env.SOAK_CONCURRENCY || '64', 10);
+const maxGrowth = parseInt(process.env.SOAK_MAX_GROWTH || String(32 * 1024 * 1024), 10);
+const checkEvery = parseInt(process.env.SOAK_CHECK_EVERY || '10000', 10);
+const warmup = Math.min(Math.floor(iterations / 10), 50000);
+
+const bucketId = '368be0816766b28fd5f43af5';
+const fileId = '998960317b6725a3f8080c2b';
+const dataPath = os.tmpdir() + '/genaro-soak-' + process.pid + '.data';
+const downloadPath = os.tmpdir() + '/genaro-soak-' + process.pid + '.download';
+let downloads = 0;
+
+const config = {
+  bridgeUrl: 'http://localhost:3000',
+  bridgeUser: 'testuser@storj.io',
+  bridgePass: 'dce18e67025a8fd68cab186e196a9f8bcca6c9e4a7ad0be8a6f5e48f3abd1b04',
+  encryptionKey: 'abandon abandon abandon abandon abandon abandon abandon abandon abandon abandon abandon about',
+  logLevel: 0,
+  ioThread: !!process.env.SOAK_IO_THREAD
+};
+
+const operations = [
+  function(env, done) {
+    env.getBuckets(done);
+  },
+  function(env, done) {
+    env.listFiles(bucketId, done);
+  },
+  function(env, done) {
+    env.createBucket('soak', done);
+  },
+  function(env, done) {
+    env.deleteFile(bucketId, fileId, done);
+  },
+  function(env, done) {
+    const encrypted = env.encryptMeta('{"name":"soak"}');
+    if (encrypted) {
+      env.decryptMeta(encrypted);
+    }
+    setImmediate(done);
+  },
+  function(env, done) {
+    env.storeFile(bucketId, dataPath, {
+      filename: 'soak.data',
+      progressCallback: function() {},
+      finishedCallback: done
+    });
+  },
+  function(env, done) {
+    env.resolveFile(bucketId, fileId, downloadPath + '.' + (downloads++ % 64), {
+      overwrite: true,
+      progressCallback: function() {},
+      finishedCallback: done
+    });
+  },
+  function(env, done) {
+    const state = env.storeFile(bucketId, dataPath, {
+      filename: 'soak.data',
+      progressCallback: function() {},
+      finishedCallback: function() {
+        done();
+      }
+    });
+    setImmediate(function() {
+      env.storeFileCancel(state);
+    });
+  }
+];
+
+function rss() {
+  if (global.gc) {
+    global.gc();
+  }
+  return process.memoryUsage().rss;
+}
+
+function cleanup() {
+  for (let i = 0; i < 64; i++) {
+    try {
+      fs.unlinkSync(downloadPath + '.' + i);
+    } catch (err) {
+      // never written
+    }
+  }
+  fs.unlinkSync(dataPath);
+}
+
+fs.writeFileSync(dataPath, require('crypto').randomBytes(64 * 1024));
+
+const farmer = mockfarmer.listen(8092);
+const server = mockbridge.listen(3000, function() {
+  const env = new libgenaro.Environment(config);
+
+  let started = 0;
+  let finished = 0;
+  let failed = 0;
+  let baseline = warmup ? 0 : rss();
+  let leaks = 0;
+
+  // nothing runs, so nothing may be held or waiting
+  function checkIdle() {
+    const stats = env.memoryStats();
+    if (stats.inflightBytes !== 0 || stats.queuedTransfers !== 0) {
+      console.error(`soak: ${stats.inflightBytes} bytes and ${stats.queuedTransfers} ` +
+        `queued transfers left after ${finished} operations`);
+      leaks++;
+    }
+  }
+
+  function start() {
+    for (let i = 0; i < concurrency; i++) {
+      next();
+    }
+  }
+
+  function next() {
+    // every checkEvery operations the running ones are let finish first
+    if (started >= iterations || (started % checkEvery === 0 && finished < started)) {
+      return;
+    }
+    const operation = operations[started % operations.length];
+    started++;
+    operation(env, function(err) {
+      if (err) {
+        failed++;
+      }
+      finished++;
+      if (finished === warmup) {
+        baseline = rss();
+      }
+      if (finished === iterations) {
+        return report();
+      }
+      if (finished === started && started % checkEvery === 0) {
+        checkIdle();
+        return start();
+      }
+      next();
+    });
+  }
+
+  function report() {
+    const growth = rss() - baseline;
+    checkIdle();
+    env.destroy();
+    server.close();
+    farmer.close();
+    cleanup();
+
+    console.log(`soak: ${iterations} operations, ${failed} failed, ` +
+      `rss grew ${(growth / 1048576).toFixed(1)}MB after warmup`);
+
+    if (growth > maxGrowth) {
+      console.error(`soak: rss growth above ${maxGrowth} bytes`);
+      process.exit(1);
+    }
+    process.exit(leaks ? 1 : 0);
+  }
+
+  start();
+});